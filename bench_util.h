@@ -0,0 +1,255 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Pieces shared by the benchmarks: clocks, pinned threads, sweep lists and
+// result tables written as aligned text, CSV or JSON.
+//
+// A table is a run of rows with the same named columns. Values are passed
+// as strings; in JSON those that parse as numbers are written unquoted.
+// JSON output is one object per run, {"bench", "host", "time", "results"},
+// plus "summary" if the bench has one, so results from different runs and
+// machines can be kept and compared.
+
+enum bench_format { BENCH_TEXT, BENCH_CSV, BENCH_JSON };
+
+#define BENCH_TEXT_WIDTH 10
+#define BENCH_MAX_LIST 16
+
+struct bench_table {
+  FILE *out;
+  enum bench_format format;
+  const char *const *columns;
+  int num_columns;
+  uint64_t rows;
+};
+
+static inline uint64_t bench_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// CPU time used by every thread of the process so far, user and system
+static inline double bench_cpu_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// TSC ticks per second, measured once against the monotonic clock over
+// 50 ms, or 0 where there is no TSC. Converts CPU time to cycles at the
+// nominal rate.
+static inline double bench_tsc_hz() {
+#if defined(__x86_64__) || defined(__i386__)
+  static double hz;
+  if (hz == 0) {
+    uint64_t t0 = bench_now_ns();
+    uint64_t c0 = __rdtsc();
+    while (bench_now_ns() - t0 < 50000000)
+      ;
+    hz = (double)(__rdtsc() - c0) * 1e9 / (bench_now_ns() - t0);
+  }
+  return hz;
+#else
+  return 0;
+#endif
+}
+
+static inline void bench_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Parses "text", "csv" or "json"; returns -1 for anything else
+static inline int bench_parse_format(const char *name,
+                                     enum bench_format *format) {
+  if (strcmp(name, "text") == 0)
+    *format = BENCH_TEXT;
+  else if (strcmp(name, "csv") == 0)
+    *format = BENCH_CSV;
+  else if (strcmp(name, "json") == 0)
+    *format = BENCH_JSON;
+  else
+    return -1;
+  return 0;
+}
+
+// Parses a comma-separated list of up to BENCH_MAX_LIST positive numbers
+// into vals. Returns how many, or -1 if the list is malformed.
+static inline int bench_parse_list(const char *s, uint32_t *vals) {
+  int n = 0;
+  while (*s) {
+    char *end;
+    unsigned long v = strtoul(s, &end, 10);
+    if (end == s || v == 0 || v > UINT32_MAX || n == BENCH_MAX_LIST ||
+        (*end != ',' && *end != '\0'))
+      return -1;
+    vals[n++] = (uint32_t)v;
+    s = *end ? end + 1 : end;
+  }
+  return n ? n : -1;
+}
+
+// Pins the calling thread to cpu, unless cpu is -1. Returns 0 or -1.
+static inline int bench_pin_self(int cpu) {
+  if (cpu < 0)
+    return 0;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (ret != 0) {
+    errno = ret;
+    perror("pthread_setaffinity_np");
+    return -1;
+  }
+  return 0;
+}
+
+// Starts a thread, pinned to cpu unless cpu is -1
+static inline int bench_start_thread(pthread_t *tid, void *(*fn)(void *),
+                                     void *arg, int cpu) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+
+  if (cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  }
+
+  int ret = pthread_create(tid, &attr, fn, arg);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    errno = ret;
+    perror("pthread_create");
+    return -1;
+  }
+  return 0;
+}
+
+// Whether s is a number JSON can take unquoted ("nan" and "inf" are not)
+static inline bool bench_is_number(const char *s) {
+  if (!(*s >= '0' && *s <= '9') && *s != '-')
+    return false;
+  char *end;
+  strtod(s, &end);
+  return *end == '\0';
+}
+
+// Starts a table of num_columns columns; for JSON, also the run's header
+static inline void bench_table_begin(struct bench_table *t, FILE *out,
+                                     enum bench_format format,
+                                     const char *bench,
+                                     const char *const *columns,
+                                     int num_columns) {
+  t->out = out;
+  t->format = format;
+  t->columns = columns;
+  t->num_columns = num_columns;
+  t->rows = 0;
+
+  switch (format) {
+  case BENCH_TEXT:
+    for (int i = 0; i < num_columns; i++)
+      fprintf(out, "%*s", BENCH_TEXT_WIDTH + 1, columns[i]);
+    fprintf(out, "\n");
+    break;
+  case BENCH_CSV:
+    for (int i = 0; i < num_columns; i++)
+      fprintf(out, "%s%s", i ? "," : "", columns[i]);
+    fprintf(out, "\n");
+    break;
+  case BENCH_JSON: {
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    char when[32];
+    time_t now = time(NULL);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(out, "{\"bench\": \"%s\", \"host\": \"%s\", \"time\": \"%s\", "
+                 "\"results\": [",
+            bench, host, when);
+    break;
+  }
+  }
+}
+
+// Writes one row; values holds one string per column
+static inline void bench_table_row(struct bench_table *t,
+                                   const char *const *values) {
+  FILE *out = t->out;
+
+  switch (t->format) {
+  case BENCH_TEXT:
+    for (int i = 0; i < t->num_columns; i++)
+      fprintf(out, "%*s", BENCH_TEXT_WIDTH + 1, values[i]);
+    fprintf(out, "\n");
+    break;
+  case BENCH_CSV:
+    for (int i = 0; i < t->num_columns; i++)
+      fprintf(out, "%s%s", i ? "," : "", values[i]);
+    fprintf(out, "\n");
+    break;
+  case BENCH_JSON:
+    fprintf(out, "%s\n  {", t->rows ? "," : "");
+    for (int i = 0; i < t->num_columns; i++) {
+      const char *q = bench_is_number(values[i]) ? "" : "\"";
+      fprintf(out, "%s\"%s\": %s%s%s", i ? ", " : "", t->columns[i], q,
+              values[i], q);
+    }
+    fprintf(out, "}");
+    break;
+  }
+  fflush(out);
+  t->rows++;
+}
+
+static inline void bench_table_end(struct bench_table *t) {
+  if (t->format == BENCH_JSON)
+    fprintf(t->out, "\n]}\n");
+  fflush(t->out);
+}
+
+// Ends the table with named values summing up the run: a "summary" object
+// after the results in JSON, "name: value" lines after the table in text,
+// and on stderr for CSV so the output stays one table
+static inline void bench_table_end_summary(struct bench_table *t,
+                                           const char *const *names,
+                                           const char *const *values,
+                                           int n) {
+  if (t->format != BENCH_JSON) {
+    FILE *out = t->format == BENCH_TEXT ? t->out : stderr;
+    if (t->format == BENCH_TEXT)
+      fprintf(out, "\n");
+    for (int i = 0; i < n; i++)
+      fprintf(out, "%s: %s\n", names[i], values[i]);
+    bench_table_end(t);
+    return;
+  }
+
+  fprintf(t->out, "\n], \"summary\": {");
+  for (int i = 0; i < n; i++) {
+    const char *q = bench_is_number(values[i]) ? "" : "\"";
+    fprintf(t->out, "%s\"%s\": %s%s%s", i ? ", " : "", names[i], q,
+            values[i], q);
+  }
+  fprintf(t->out, "}}\n");
+  fflush(t->out);
+}
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <infiniband/verbs.h>
+#include <linux/mempolicy.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Registered packet buffer pool.
+//
+// One region, registered once with a single MR, split into num_slots
+// fixed-size slots, so receive and send buffers never need ibv_reg_mr()
+// after setup. The region is mapped from 1 GB huge pages when it is large
+// enough to use them, otherwise 2 MB ones, falling back to normal pages
+// with a transparent huge page hint; fewer pages mean fewer TLB and IOTLB
+// misses when the device and the CPU walk the buffers. It is bound to the
+// NIC's NUMA node (or the one given) before any page is touched.
+//
+// Free slots are kept on a lock-free stack, linked through next[] and
+// headed by a 64-bit word holding the top slot and a tag that changes on
+// every update (so a slot popped and pushed back between another thread's
+// read and its compare-and-swap does not fool it). buf_pool_alloc() and
+// buf_pool_free() may be called from any thread.
+//
+// buf_pool_map() is also usable on its own, for regions that are not split
+// into slots, such as striding RQ buffers or a replay arena.
+
+#define BUF_POOL_EMPTY UINT32_MAX
+#define BUF_POOL_SLOT_ALIGN 64
+#define BUF_POOL_HUGE_2M (2ul * 1024 * 1024)
+#define BUF_POOL_HUGE_1G (1024ul * 1024 * 1024)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+struct buf_pool_config {
+  uint32_t num_slots;
+  uint32_t slot_size; // rounded up to BUF_POOL_SLOT_ALIGN
+  int numa_node;      // -1 for the device's node, if it has one
+  int access;         // ibv_reg_mr() access flags
+};
+
+struct buf_pool {
+  char *region;
+  size_t region_size; // mapped, a multiple of page_size
+  size_t page_size;
+  int numa_node; // -1 if unbound
+  struct ibv_mr *mr;
+  uint32_t num_slots;
+  uint32_t slot_size;
+
+  uint32_t *next; // free stack links, BUF_POOL_EMPTY at the bottom
+  alignas(64) uint64_t head; // tag << 32 | top slot
+  uint32_t available;        // approximate, for reporting
+};
+
+// NUMA node of the device behind ctx, from sysfs, or -1 if unknown
+static inline int buf_pool_device_node(struct ibv_context *ctx) {
+  char path[IBV_SYSFS_PATH_MAX + 32];
+  snprintf(path, sizeof(path), "%s/device/numa_node",
+           ctx->device->ibdev_path);
+
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  int node = -1;
+  if (fscanf(f, "%d", &node) != 1)
+    node = -1;
+  fclose(f);
+  return node;
+}
+
+// Maps size bytes of anonymous memory from the largest pages that work,
+// bound to numa_node unless it is -1. Returns NULL on failure; otherwise
+// *mapped is what to pass to buf_pool_unmap() and *page_size the page size
+// in use.
+static inline void *buf_pool_map(size_t size, int numa_node, size_t *mapped,
+                                 size_t *page_size) {
+  static const struct {
+    size_t page;
+    int flags;
+  } tries[] = {
+      {BUF_POOL_HUGE_1G, MAP_HUGETLB | (30 << MAP_HUGE_SHIFT)},
+      {BUF_POOL_HUGE_2M, MAP_HUGETLB | (21 << MAP_HUGE_SHIFT)},
+      {4096, 0},
+  };
+
+  void *p = MAP_FAILED;
+  for (size_t i = 0; i < sizeof(tries) / sizeof(tries[0]); i++) {
+    // A 1 GB page for a small region wastes most of it
+    if (tries[i].page == BUF_POOL_HUGE_1G && size < BUF_POOL_HUGE_1G / 2)
+      continue;
+
+    *page_size = tries[i].page;
+    *mapped = (size + *page_size - 1) & ~(*page_size - 1);
+    p = mmap(NULL, *mapped, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | tries[i].flags, -1, 0);
+    if (p != MAP_FAILED)
+      break;
+  }
+  if (p == MAP_FAILED) {
+    perror("buf_pool: mmap");
+    return NULL;
+  }
+  if (*page_size == 4096)
+    madvise(p, *mapped, MADV_HUGEPAGE);
+
+  // Pages are placed on first touch, which is still to come
+  if (numa_node >= 0) {
+    unsigned long mask[4] = {0};
+    if (numa_node < (int)(sizeof(mask) * 8)) {
+      mask[numa_node / 64] = 1ul << (numa_node % 64);
+      if (syscall(SYS_mbind, p, *mapped, MPOL_BIND, mask, sizeof(mask) * 8,
+                  0) != 0)
+        perror("buf_pool: mbind");
+    }
+  }
+
+  return p;
+}
+
+static inline void buf_pool_unmap(void *p, size_t mapped) {
+  if (p)
+    munmap(p, mapped);
+}
+
+static inline char *buf_pool_addr(const struct buf_pool *pool, uint32_t slot) {
+  return pool->region + (size_t)slot * pool->slot_size;
+}
+
+static inline uint32_t buf_pool_lkey(const struct buf_pool *pool) {
+  return pool->mr->lkey;
+}
+
+// Takes a free slot, or returns BUF_POOL_EMPTY
+static inline uint32_t buf_pool_alloc(struct buf_pool *pool) {
+  uint64_t old = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+
+  for (;;) {
+    uint32_t top = (uint32_t)old;
+    if (top == BUF_POOL_EMPTY)
+      return BUF_POOL_EMPTY;
+
+    uint32_t next = __atomic_load_n(&pool->next[top], __ATOMIC_RELAXED);
+    uint64_t want = ((old >> 32) + 1) << 32 | next;
+    if (__atomic_compare_exchange_n(&pool->head, &old, want, true,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      __atomic_fetch_sub(&pool->available, 1, __ATOMIC_RELAXED);
+      return top;
+    }
+  }
+}
+
+// Returns a slot taken with buf_pool_alloc()
+static inline void buf_pool_free(struct buf_pool *pool, uint32_t slot) {
+  uint64_t old = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+
+  for (;;) {
+    __atomic_store_n(&pool->next[slot], (uint32_t)old, __ATOMIC_RELAXED);
+    uint64_t want = ((old >> 32) + 1) << 32 | slot;
+    if (__atomic_compare_exchange_n(&pool->head, &old, want, true,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      break;
+  }
+  __atomic_fetch_add(&pool->available, 1, __ATOMIC_RELAXED);
+}
+
+static inline void buf_pool_destroy(struct buf_pool *pool) {
+  if (pool->mr)
+    ibv_dereg_mr(pool->mr);
+  buf_pool_unmap(pool->region, pool->region_size);
+  free(pool->next);
+  memset(pool, 0, sizeof(*pool));
+}
+
+// Maps and registers the region and puts every slot on the free stack.
+// Returns 0 on success, -1 on failure (with nothing left allocated).
+static inline int buf_pool_init(struct buf_pool *pool, struct ibv_pd *pd,
+                                const struct buf_pool_config *cfg) {
+  memset(pool, 0, sizeof(*pool));
+  if (cfg->num_slots == 0 || cfg->num_slots == BUF_POOL_EMPTY ||
+      cfg->slot_size == 0) {
+    fprintf(stderr, "buf_pool: need at least one slot of non-zero size\n");
+    return -1;
+  }
+
+  pool->num_slots = cfg->num_slots;
+  pool->slot_size = (cfg->slot_size + BUF_POOL_SLOT_ALIGN - 1) &
+                    ~(uint32_t)(BUF_POOL_SLOT_ALIGN - 1);
+  pool->numa_node =
+      cfg->numa_node >= 0 ? cfg->numa_node : buf_pool_device_node(pd->context);
+
+  pool->next = (uint32_t *)malloc(cfg->num_slots * sizeof(uint32_t));
+  pool->region = (char *)buf_pool_map((size_t)pool->num_slots *
+                                          pool->slot_size,
+                                      pool->numa_node, &pool->region_size,
+                                      &pool->page_size);
+  if (!pool->next || !pool->region) {
+    fprintf(stderr, "buf_pool: failed to allocate %u x %u byte slots\n",
+            pool->num_slots, pool->slot_size);
+    buf_pool_destroy(pool);
+    return -1;
+  }
+
+  pool->mr = ibv_reg_mr(pd, pool->region, pool->region_size, cfg->access);
+  if (!pool->mr) {
+    perror("buf_pool: ibv_reg_mr");
+    buf_pool_destroy(pool);
+    return -1;
+  }
+
+  // Slot 0 on top, so a single user gets a contiguous run
+  for (uint32_t i = 0; i < pool->num_slots; i++)
+    pool->next[i] = i + 1 < pool->num_slots ? i + 1 : BUF_POOL_EMPTY;
+  pool->head = 0;
+  pool->available = pool->num_slots;
+  return 0;
+}
+
+// Prints where the region came from
+static inline void buf_pool_report(const struct buf_pool *pool,
+                                   const char *name) {
+  char node[16] = "any";
+  if (pool->numa_node >= 0)
+    snprintf(node, sizeof(node), "%d", pool->numa_node);
+
+  printf("%s: %u x %u byte slots in %zu KB of %s pages, NUMA node %s, "
+         "one MR\n",
+         name, pool->num_slots, pool->slot_size, pool->region_size >> 10,
+         pool->page_size == BUF_POOL_HUGE_1G   ? "1 GB"
+         : pool->page_size == BUF_POOL_HUGE_2M ? "2 MB"
+                                               : "4 KB",
+         node);
+}
+
+#endif
@@ -1,129 +1,203 @@
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <infiniband/verbs.h>
 #include <iostream>
 #include <unistd.h>
 
-int main() {
-  // 1. Open device
+#include "buf_pool.h"
+#include "oob.h"
+#include "send_engine.h"
+#include "verbs.h"
+
+#define IB_PORT 1
+#define GID_INDEX 1
+#define QKEY 0x11111111
+#define SEND_QUEUE_DEPTH 256
+#define SEND_BATCH 32
+#define SIGNAL_INTERVAL 32
+#define MAX_MSG_SIZE 4096
+#define RC_MAX_MSG_SIZE 16384 // the server's ring slots
+#define OOB_TIMEOUT_MS 10000
+
+int main(int argc, char *argv[]) {
+  // Number and size of messages to send, whether to RDMA WRITE them over
+  // RC instead of sending over UD, and where the server's side channel
+  // listens
+  uint64_t count = 1;
+  uint32_t msg_size = 16;
+  bool use_rc = false;
+  const char *server_addr = "localhost:" OOB_DEFAULT_PORT;
+  int positional = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--rc") == 0) {
+      use_rc = true;
+    } else if (strncmp(argv[i], "--server=", 9) == 0) {
+      server_addr = argv[i] + 9;
+    } else if (positional++ == 0) {
+      count = strtoull(argv[i], nullptr, 10);
+    } else {
+      msg_size = atoi(argv[i]);
+    }
+  }
+  uint32_t max_size = use_rc ? RC_MAX_MSG_SIZE : MAX_MSG_SIZE;
+  if (count == 0 || msg_size == 0 || msg_size > max_size) {
+    std::cerr << "Usage: " << argv[0] << " [count] [size <= " << MAX_MSG_SIZE
+              << ", or " << RC_MAX_MSG_SIZE << " with --rc] [--rc]"
+              << " [--server=host:port|unix:path]" << std::endl;
+    return 1;
+  }
+  srand48(time(NULL) ^ getpid());
 
-  ibv_device **dev_list = ibv_get_device_list(nullptr);
-  std::cout << (*dev_list) << std::endl;
-  ibv_context *ctx = ibv_open_device(dev_list[0]);
+  // 1. Open device
+  Device dev = Device::open();
+  if (!dev) {
+    return 1;
+  }
+  std::cout << "Device: " << dev.name() << std::endl;
 
   // 2. Protection domain
-  ibv_pd *pd = ibv_alloc_pd(ctx);
+  Pd pd = Pd::alloc(dev);
+  if (!pd) {
+    return 1;
+  }
 
   // 3. Completion queue
-  ibv_cq *cq = ibv_create_cq(ctx, 1, nullptr, nullptr, 0);
-
-  // 4. Create RC QP
-  ibv_qp_init_attr qp_attr{};
-  qp_attr.send_cq = cq;
-  qp_attr.recv_cq = cq;
-  qp_attr.qp_type = IBV_QPT_UD;
-  qp_attr.cap.max_send_wr = 1;
-  qp_attr.cap.max_recv_wr = 1;
-  qp_attr.cap.max_send_sge = 1;
-  qp_attr.cap.max_recv_sge = 1;
-
-  ibv_qp *qp = ibv_create_qp(pd, &qp_attr);
-
-  // 5. Memory
-  char buf[16] = "Hello RC";
-  ibv_mr *mr = ibv_reg_mr(pd, buf, sizeof(buf), IBV_ACCESS_LOCAL_WRITE);
-
-  // 6. Move QP to INIT
-  ibv_qp_attr attr{};
-  attr.qp_state = IBV_QPS_INIT;
-  attr.port_num = 1;
-  attr.pkey_index = 0;
-  attr.qkey = 0x11111111;
-  attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
-  ibv_modify_qp(qp, &attr,
-                IBV_QP_STATE | IBV_QP_PORT | IBV_QP_PKEY_INDEX | IBV_QP_QKEY);
-
-  // 7. Print QP number for server
-  std::cout << "Client QP number: " << qp->qp_num << std::endl;
-  std::cout << "Enter server QP number: ";
-  uint32_t server_qpn;
-  std::cin >> server_qpn;
-  ibv_gid my_gid;
-  ibv_query_gid(ctx, 1, 1, &my_gid);
-  // 8. Move QP to RTR
-  attr.qp_state = IBV_QPS_RTR;
-  attr.dest_qp_num = server_qpn;
-  attr.rq_psn = 0;
-  attr.path_mtu = IBV_MTU_256;
-
-  attr.ah_attr.is_global = 1;
-  attr.ah_attr.grh.dgid = my_gid;  // Server's GID
-  attr.ah_attr.grh.sgid_index = 1; // Client's GID index
-  attr.ah_attr.grh.hop_limit = 1;
-  attr.ah_attr.port_num = 1;
-  attr.ah_attr.sl = 0;
-
-  ibv_modify_qp(qp, &attr, IBV_QP_STATE);
-
-  // Print QP state after each transition
-  ibv_qp_attr query_attr;
-  ibv_qp_init_attr query_init_attr;
-  ibv_query_qp(qp, &query_attr, IBV_QP_STATE, &query_init_attr);
-  std::cout << "QP state: " << query_attr.qp_state << std::endl;
-  // 9. Move QP to RTS
-  attr.qp_state = IBV_QPS_RTS;
-  attr.sq_psn = 0;
-  ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
-
-  ibv_query_qp(qp, &query_attr, IBV_QP_STATE, &query_init_attr);
-  std::cout << "QP state: " << query_attr.qp_state << std::endl;
-  ibv_ah_attr ah_attr{};
-  ah_attr.is_global = 1;
-  ah_attr.dlid = 0;
-  ah_attr.sl = 0;
-  ah_attr.port_num = 1;
-  ah_attr.grh.dgid = my_gid;
-  ah_attr.grh.flow_label = 0;
-  ah_attr.grh.sgid_index = 1;
-  ah_attr.grh.hop_limit = 64;
-  ah_attr.grh.traffic_class = 0;
-
-  ibv_ah *ah = ibv_create_ah(pd, &ah_attr);
-  if (!ah) {
-    perror("ibv_create_ah failed");
+  Cq cq = Cq::create(dev, SEND_QUEUE_DEPTH);
+  if (!cq) {
+    return 1;
+  }
+
+  // 4. Memory: one huge page backed pool on the NIC's NUMA node, registered
+  // once up front, that the send engine takes its buffers from. Over RC
+  // one more slot holds the credit word the server writes back into.
+  buf_pool_config buf_cfg{};
+  buf_cfg.num_slots = SEND_QUEUE_DEPTH + (use_rc ? 1 : 0);
+  buf_cfg.slot_size = msg_size;
+  buf_cfg.numa_node = -1;
+  buf_cfg.access = IBV_ACCESS_LOCAL_WRITE;
+  if (use_rc) {
+    buf_cfg.access |= IBV_ACCESS_REMOTE_WRITE;
+  }
+
+  buf_pool bufs;
+  if (buf_pool_init(&bufs, pd, &buf_cfg)) {
+    return 1;
+  }
+  auto bufs_guard = on_scope_exit([&] { buf_pool_destroy(&bufs); });
+  buf_pool_report(&bufs, "Send buffers");
+
+  // 5. Create the QP, only signaling the WRs that ask for it. UD goes
+  // straight to RTS; RC waits in INIT until it knows the server's QP, and
+  // lets the server write credit into it.
+  Qp qp = (use_rc ? QpBuilder::rc(pd) : QpBuilder::ud(pd))
+              .cq(cq)
+              .depth(SEND_QUEUE_DEPTH, 1)
+              .sig_all(false)
+              .create();
+  if (!qp) {
+    return 1;
+  }
+  if (use_rc ? qp.init_rc(IB_PORT, IBV_ACCESS_REMOTE_WRITE)
+             : qp.ready_ud(IB_PORT, QKEY)) {
     return 1;
   }
-  // 10. Post send
-  ibv_sge sge{};
-  sge.addr = (uintptr_t)buf;
-  sge.length = sizeof(buf);
-  sge.lkey = mr->lkey;
-
-  ibv_send_wr wr{};
-  wr.sg_list = &sge;
-  wr.num_sge = 1;
-  wr.opcode = IBV_WR_SEND;
-  wr.send_flags = IBV_SEND_SIGNALED;
-  wr.next = nullptr;
-  wr.wr.ud.ah = ah;
-  wr.wr.ud.remote_qpn = server_qpn;
-  wr.wr.ud.remote_qkey = 0x11111111;
-
-  ibv_send_wr *bad_wr;
-  ibv_post_send(qp, &wr, &bad_wr);
-
-  // 11. Poll completion queue
-  ibv_wc wc;
-  while (ibv_poll_cq(cq, 1, &wc) == 0) {
-  }
-
-  std::cout << "Client sent message." << std::endl;
-  std::cout << "Completion: status=" << wc.status << " opcode=" << wc.opcode
-            << " vendor_err=" << wc.vendor_err << std::endl;
-  // 12. Cleanup
-  ibv_dereg_mr(mr);
-  ibv_destroy_qp(qp);
-  ibv_destroy_cq(cq);
-  ibv_dealloc_pd(pd);
-  ibv_close_device(ctx);
-  ibv_free_device_list(dev_list);
+  std::cout << "QP state: " << qp.state() << std::endl;
+
+  send_engine_config eng_cfg{};
+  eng_cfg.sq_depth = SEND_QUEUE_DEPTH;
+  eng_cfg.batch = SEND_BATCH;
+  eng_cfg.signal_interval = SIGNAL_INTERVAL;
+  eng_cfg.buf_size = msg_size;
+
+  send_engine eng;
+  if (send_engine_init(&eng, &bufs, qp, cq, &eng_cfg)) {
+    return 1;
+  }
+  auto eng_guard = on_scope_exit([&] { send_engine_destroy(&eng); });
+  for (uint32_t i = 0; i < SEND_QUEUE_DEPTH; i++) {
+    strncpy(send_engine_buffer(&eng, i), use_rc ? "Hello RC" : "Hello UD",
+            msg_size);
+  }
+
+  uint64_t *credit = NULL;
+  if (use_rc) {
+    uint32_t slot = buf_pool_alloc(&bufs);
+    credit = (uint64_t *)buf_pool_addr(&bufs, slot);
+    *credit = 0;
+  }
+
+  // 6. Swap endpoints with the server over its side channel
+  QpEndpoint local{}, remote{};
+  local.qpn = qp.qpn();
+  local.qkey = QKEY;
+  if (use_rc) {
+    local.psn = (uint32_t)lrand48() & 0xffffff;
+    local.rkey = bufs.mr->rkey;
+    local.addr = (uintptr_t)credit;
+    local.length = sizeof(*credit);
+  }
+  if (dev.port_address(IB_PORT, GID_INDEX, &local)) {
+    return 1;
+  }
+  if (oob_exchange(server_addr, &local, &remote, OOB_TIMEOUT_MS)) {
+    return 1;
+  }
+
+  char desc[128];
+  std::cout << "Client " << oob_endpoint_str(&local, desc, sizeof(desc))
+            << std::endl;
+  std::cout << "Server " << oob_endpoint_str(&remote, desc, sizeof(desc))
+            << std::endl;
+
+  // 7. Address the server, by its LID or GID: over UD with an address
+  // handle, over RC by connecting the QP to the one made for us and
+  // writing into the ring behind it
+  Ah ah;
+  if (use_rc) {
+    if (remote.slots == 0 || remote.rkey == 0) {
+      std::cerr << "Server offers no ring; is it running with --rc?"
+                << std::endl;
+      return 1;
+    }
+    if (qp.connect_rc(remote, local.psn, IB_PORT, GID_INDEX,
+                      dev.active_mtu(IB_PORT))) {
+      return 1;
+    }
+    send_engine_set_ring_dest(&eng, remote.addr, remote.rkey, remote.slots,
+                              remote.length / remote.slots, credit);
+  } else {
+    ah = Ah::to_endpoint(pd, IB_PORT, remote, GID_INDEX);
+    if (!ah) {
+      return 1;
+    }
+    send_engine_set_ud_dest(&eng, ah, remote.qpn, remote.qkey);
+  }
+
+  // 8. Post sends or writes in signaled-every-N batches
+
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (send_engine_post(&eng, count, msg_size) < 0) {
+    return 1;
+  }
+
+  // 9. Wait for the last completions
+  int drain_ret = send_engine_drain(&eng);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double elapsed =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  std::cout << "Client sent " << eng.completed << " messages of " << msg_size
+            << " bytes (" << eng.errors << " errors)" << std::endl;
+  std::cout << "Rate (" << (use_rc ? "RC write" : "UD send")
+            << "): " << eng.completed / elapsed << " msg/s, "
+            << eng.completed * msg_size / elapsed / 1e9 << " GB/s"
+            << std::endl;
+  if (drain_ret) {
+    std::cerr << "Send completions reported errors" << std::endl;
+  }
+  // 10. Cleanup: everything goes in reverse order as it leaves scope. A run
+  // with failed completions exits non-zero so scripts can tell.
+  return drain_ret ? 1 : 0;
 }
@@ -0,0 +1,407 @@
+#ifndef CORNER_TURN_H
+#define CORNER_TURN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Corner turn from packet order to channel-major sample blocks.
+//
+// A packet carries samples_per_packet time samples for channels_per_packet
+// consecutive channels starting at its freq_channel, time-major:
+// payload[t][c][sample_bytes]. Its samples_per_packet is whatever its
+// payload size works out to. Packets are scattered into blocks of
+// block_samples time samples for all num_channels channels of all
+// num_fpgas FPGAs, laid out [fpga][channel][time][sample_bytes], so each
+// channel's samples are contiguous for the consumer and FPGAs sending the
+// same channels get rows of their own.
+//
+// Two blocks are filled at once, the current time window and the next, so
+// packets straddling a window boundary or arriving slightly out of order
+// still land. A packet for a later window completes the current block: it
+// is handed to the complete callback and its buffer reused for the window
+// after next. Block memory is therefore only valid during the callback.
+// Packets for windows already completed are dropped and counted, unless
+// a whole time step's worth of packets in a row (one per row group) lands
+// more than CT_RESYNC_WINDOWS behind: then the senders have restarted, or
+// the sample count wrapped, and the stage starts over there, as it does
+// for a jump far ahead.
+//
+// Blocks are allocated from huge pages where possible. With 4-byte samples
+// the transpose moves 4 x 4 tiles through SSE2 registers. Rows of a single
+// channel are copied whole. Both write with non-temporal stores where the
+// destination is 16-byte aligned, since a finished block is read by the
+// consumer rather than by this stage.
+
+#define CT_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define CT_RESYNC_WINDOWS 2
+
+struct ct_config {
+  uint32_t num_channels;        // freq_channel 0 .. num_channels - 1
+  uint32_t block_samples;       // time samples per block
+  uint32_t channels_per_packet; // consecutive channels in each packet
+  uint32_t sample_bytes;        // 1, 2, 4 or 8
+  uint32_t num_fpgas;           // fpga_id 0 .. num_fpgas - 1
+  int scalar;                   // no SIMD or non-temporal stores
+};
+
+struct ct_block {
+  uint8_t *data; // [num_fpgas][num_channels][block_samples][sample_bytes]
+  uint64_t first_sample; // sample_count of time index 0
+  uint64_t samples_filled; // channel-samples written, out of
+                           // num_fpgas * num_channels * block_samples
+  uint32_t packets;
+};
+
+typedef void (*ct_complete_fn)(void *arg, const struct ct_block *blk);
+
+struct corner_turn {
+  struct ct_config cfg;
+  ct_complete_fn complete;
+  void *complete_arg;
+
+  size_t block_size;
+  size_t alloc_size;
+  int huge; // blocks came from MAP_HUGETLB
+  struct ct_block blocks[2];
+  struct ct_block *cur;  // window cur_window
+  struct ct_block *next; // window cur_window + 1
+  uint64_t cur_window;
+  int started;
+  uint32_t resync_packets; // far-behind packets in a row that resync
+  uint32_t behind_run;     // far-behind packets in a row so far
+
+  uint64_t blocks_completed;
+  uint64_t late_packets;
+  uint64_t bad_packets; // channels or FPGAs outside the block, or ragged
+                        // payloads
+  uint64_t resyncs;
+  uint64_t bytes;
+};
+
+// Huge-page backed anonymous memory, falling back to normal pages with a
+// transparent huge page hint. Returns NULL on failure.
+static inline void *ct_alloc(size_t size, int *huge) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    *huge = 1;
+    return p;
+  }
+
+  *huge = 0;
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+           -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  madvise(p, size, MADV_HUGEPAGE);
+  return p;
+}
+
+static inline void ct_destroy(struct corner_turn *ct) {
+  for (int i = 0; i < 2; i++) {
+    if (ct->blocks[i].data)
+      munmap(ct->blocks[i].data, ct->alloc_size);
+  }
+  memset(ct, 0, sizeof(*ct));
+}
+
+// Returns 0 on success, -1 on a bad configuration or allocation failure
+// (with nothing left allocated)
+static inline int ct_init(struct corner_turn *ct, const struct ct_config *cfg,
+                          ct_complete_fn complete, void *complete_arg) {
+  memset(ct, 0, sizeof(*ct));
+
+  uint32_t b = cfg->sample_bytes;
+  if (cfg->num_channels == 0 || cfg->block_samples == 0 ||
+      cfg->channels_per_packet == 0 || cfg->num_fpgas == 0 ||
+      cfg->num_channels % cfg->channels_per_packet != 0 ||
+      (b != 1 && b != 2 && b != 4 && b != 8)) {
+    fprintf(stderr, "corner_turn: need at least one FPGA, "
+                    "channels_per_packet dividing num_channels and "
+                    "sample_bytes of 1, 2, 4 or 8\n");
+    return -1;
+  }
+
+  ct->cfg = *cfg;
+  ct->complete = complete;
+  ct->complete_arg = complete_arg;
+  ct->block_size =
+      (size_t)cfg->num_fpgas * cfg->num_channels * cfg->block_samples * b;
+  ct->resync_packets =
+      cfg->num_fpgas * (cfg->num_channels / cfg->channels_per_packet);
+  ct->alloc_size = (ct->block_size + CT_HUGE_PAGE_SIZE - 1) &
+                   ~(size_t)(CT_HUGE_PAGE_SIZE - 1);
+
+  for (int i = 0; i < 2; i++) {
+    int huge;
+    ct->blocks[i].data = (uint8_t *)ct_alloc(ct->alloc_size, &huge);
+    if (!ct->blocks[i].data) {
+      fprintf(stderr, "corner_turn: failed to allocate %zu byte block\n",
+              ct->alloc_size);
+      ct_destroy(ct);
+      return -1;
+    }
+    ct->huge = huge;
+  }
+
+  ct->cur = &ct->blocks[0];
+  ct->next = &ct->blocks[1];
+  return 0;
+}
+
+// Copies n bytes to an aligned destination with non-temporal stores
+static inline void ct_stream_copy(uint8_t *dst, const uint8_t *src,
+                                  size_t n) {
+#ifdef __SSE2__
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm_stream_si128((__m128i *)(dst + i),
+                     _mm_loadu_si128((const __m128i *)(src + i)));
+  memcpy(dst + i, src + i, n - i);
+#else
+  memcpy(dst, src, n);
+#endif
+}
+
+// Transposes rows x cols elements of T, row-major with src_stride elements
+// per row, into cols x rows at dst with dst_stride elements per row
+template <typename T>
+static inline void ct_transpose_scalar(T *dst, size_t dst_stride,
+                                       const T *src, size_t src_stride,
+                                       uint32_t rows, uint32_t cols) {
+  for (uint32_t c = 0; c < cols; c++) {
+    T *d = dst + c * dst_stride;
+    for (uint32_t r = 0; r < rows; r++)
+      d[r] = src[r * src_stride + c];
+  }
+}
+
+#ifdef __SSE2__
+// ct_transpose_scalar() for 4-byte elements in 4 x 4 tiles
+static inline void ct_transpose_sse2(uint32_t *dst, size_t dst_stride,
+                                     const uint32_t *src, size_t src_stride,
+                                     uint32_t rows, uint32_t cols) {
+  uint32_t r4 = rows & ~3u, c4 = cols & ~3u;
+
+  // Column-outer, so each of the four destination rows a tile column
+  // writes is filled front to back and write-combines into whole lines
+  for (uint32_t c = 0; c < c4; c += 4) {
+    for (uint32_t r = 0; r < r4; r += 4) {
+      const uint32_t *s = src + r * src_stride + c;
+      __m128i a = _mm_loadu_si128((const __m128i *)s);
+      __m128i b = _mm_loadu_si128((const __m128i *)(s + src_stride));
+      __m128i e = _mm_loadu_si128((const __m128i *)(s + 2 * src_stride));
+      __m128i f = _mm_loadu_si128((const __m128i *)(s + 3 * src_stride));
+
+      __m128i ab_lo = _mm_unpacklo_epi32(a, b);
+      __m128i ab_hi = _mm_unpackhi_epi32(a, b);
+      __m128i ef_lo = _mm_unpacklo_epi32(e, f);
+      __m128i ef_hi = _mm_unpackhi_epi32(e, f);
+      __m128i out[4] = {_mm_unpacklo_epi64(ab_lo, ef_lo),
+                        _mm_unpackhi_epi64(ab_lo, ef_lo),
+                        _mm_unpacklo_epi64(ab_hi, ef_hi),
+                        _mm_unpackhi_epi64(ab_hi, ef_hi)};
+
+      for (int k = 0; k < 4; k++) {
+        uint32_t *d = dst + (c + k) * dst_stride + r;
+        if (((uintptr_t)d & 15) == 0)
+          _mm_stream_si128((__m128i *)d, out[k]);
+        else
+          _mm_storeu_si128((__m128i *)d, out[k]);
+      }
+    }
+  }
+
+  // Ragged edges
+  if (c4 < cols)
+    ct_transpose_scalar(dst + c4 * dst_stride, dst_stride, src + c4,
+                        src_stride, rows, cols - c4);
+  if (r4 < rows)
+    ct_transpose_scalar(dst + r4, dst_stride, src + r4 * src_stride,
+                        src_stride, rows - r4, c4);
+}
+#endif
+
+// Writes time samples [t0, t0 + n) of a packet's channel group, from row
+// (fpga_id * num_channels + freq_channel) on, starting at offset time
+// index t_off within its payload, into blk
+static inline void ct_scatter(struct corner_turn *ct, struct ct_block *blk,
+                              const uint8_t *payload, uint32_t row,
+                              uint32_t t_off, uint32_t t0, uint32_t n) {
+  const struct ct_config *cfg = &ct->cfg;
+  uint32_t cp = cfg->channels_per_packet, b = cfg->sample_bytes;
+  const uint8_t *src = payload + (size_t)t_off * cp * b;
+  uint8_t *dst = blk->data + ((size_t)row * cfg->block_samples + t0) * b;
+
+  if (cp == 1) {
+    if (!cfg->scalar && ((uintptr_t)dst & 15) == 0)
+      ct_stream_copy(dst, src, (size_t)n * b);
+    else
+      memcpy(dst, src, (size_t)n * b);
+  } else {
+    switch (b) {
+    case 1:
+      ct_transpose_scalar((uint8_t *)dst, cfg->block_samples, src, cp, n, cp);
+      break;
+    case 2:
+      ct_transpose_scalar((uint16_t *)dst, cfg->block_samples,
+                          (const uint16_t *)src, cp, n, cp);
+      break;
+    case 4:
+#ifdef __SSE2__
+      if (!cfg->scalar) {
+        ct_transpose_sse2((uint32_t *)dst, cfg->block_samples,
+                          (const uint32_t *)src, cp, n, cp);
+        break;
+      }
+#endif
+      ct_transpose_scalar((uint32_t *)dst, cfg->block_samples,
+                          (const uint32_t *)src, cp, n, cp);
+      break;
+    case 8:
+      ct_transpose_scalar((uint64_t *)dst, cfg->block_samples,
+                          (const uint64_t *)src, cp, n, cp);
+      break;
+    }
+  }
+
+  blk->samples_filled += (uint64_t)n * cp;
+}
+
+// Hands the current block to the consumer and makes the next window
+// current, reusing the old buffer for the window after it. The buffer is
+// cleared if anything was written to it: even a completely filled block
+// must not leak its samples into rows the later window gets no packet for.
+static inline void ct_advance(struct corner_turn *ct) {
+  struct ct_block *done = ct->cur;
+
+  if (done->packets > 0) {
+#ifdef __SSE2__
+    _mm_sfence(); // non-temporal stores are visible before the handoff
+#endif
+    ct->complete(ct->complete_arg, done);
+    ct->blocks_completed++;
+  }
+
+  if (done->samples_filled > 0)
+    memset(done->data, 0, ct->block_size);
+
+  ct->cur = ct->next;
+  ct->next = done;
+  ct->cur_window++;
+  ct->next->first_sample = (ct->cur_window + 1) * ct->cfg.block_samples;
+  ct->next->samples_filled = 0;
+  ct->next->packets = 0;
+}
+
+static inline void ct_start(struct corner_turn *ct, uint64_t window) {
+  ct->started = 1;
+  ct->cur_window = window;
+  ct->cur->first_sample = window * ct->cfg.block_samples;
+  ct->next->first_sample = (window + 1) * ct->cfg.block_samples;
+}
+
+// Adds one packet: payload_size bytes of samples starting at sample_count
+// for channels freq_channel onwards of FPGA fpga_id
+static inline void ct_push(struct corner_turn *ct, uint64_t sample_count,
+                           uint32_t fpga_id, uint32_t freq_channel,
+                           const uint8_t *payload, uint32_t payload_size) {
+  const struct ct_config *cfg = &ct->cfg;
+  uint32_t step = cfg->channels_per_packet * cfg->sample_bytes;
+  uint32_t samples = payload_size / step;
+
+  if (samples == 0 || samples > cfg->block_samples ||
+      payload_size % step != 0 || fpga_id >= cfg->num_fpgas ||
+      freq_channel + cfg->channels_per_packet > cfg->num_channels) {
+    ct->bad_packets++;
+    return;
+  }
+
+  uint32_t row = fpga_id * cfg->num_channels + freq_channel;
+  uint64_t window = sample_count / cfg->block_samples;
+  uint64_t last_window = (sample_count + samples - 1) / cfg->block_samples;
+
+  if (!ct->started)
+    ct_start(ct, window);
+  if (last_window < ct->cur_window) {
+    // A stray late packet is dropped; a time step of every row this far
+    // behind means the senders went back, so follow them
+    if (last_window + CT_RESYNC_WINDOWS >= ct->cur_window)
+      ct->behind_run = 0;
+    else
+      ct->behind_run++;
+    if (ct->behind_run < ct->resync_packets) {
+      ct->late_packets++;
+      return;
+    }
+    ct_advance(ct);
+    ct_advance(ct);
+    ct_start(ct, window);
+    ct->resyncs++;
+  }
+  ct->behind_run = 0;
+
+  // A jump of more than one window completes what is held and restarts
+  // there rather than emitting empty blocks in between
+  if (last_window > ct->cur_window + CT_RESYNC_WINDOWS) {
+    ct_advance(ct);
+    ct_advance(ct);
+    ct_start(ct, window);
+  }
+  while (last_window > ct->cur_window + 1)
+    ct_advance(ct);
+
+  // Split at the window boundary, if the packet straddles one. Samples
+  // before the current window were completed already.
+  uint32_t t_off = 0;
+  while (t_off < samples) {
+    uint64_t s = sample_count + t_off;
+    uint64_t w = s / cfg->block_samples;
+    uint32_t t0 = (uint32_t)(s % cfg->block_samples);
+    uint32_t n = cfg->block_samples - t0;
+    if (n > samples - t_off)
+      n = samples - t_off;
+
+    if (w >= ct->cur_window)
+      ct_scatter(ct, w == ct->cur_window ? ct->cur : ct->next, payload, row,
+                 t_off, t0, n);
+    t_off += n;
+  }
+
+  ct->cur->packets += window <= ct->cur_window;
+  ct->next->packets += last_window > ct->cur_window;
+  ct->bytes += payload_size;
+}
+
+// Completes the blocks still being filled, e.g. at the end of a stream
+static inline void ct_flush(struct corner_turn *ct) {
+  if (!ct->started)
+    return;
+  ct_advance(ct);
+  ct_advance(ct);
+  ct->started = 0;
+}
+
+// Prints the counters; may run concurrently with ct_push()
+static inline void ct_report(struct corner_turn *ct, const char *prefix) {
+  printf("%sCorner turn: Blocks=%llu, Bytes=%llu, Late=%llu, Bad=%llu, "
+         "Resyncs=%llu, %s pages\n",
+         prefix,
+         (unsigned long long)__atomic_load_n(&ct->blocks_completed,
+                                             __ATOMIC_RELAXED),
+         (unsigned long long)__atomic_load_n(&ct->bytes, __ATOMIC_RELAXED),
+         (unsigned long long)__atomic_load_n(&ct->late_packets,
+                                             __ATOMIC_RELAXED),
+         (unsigned long long)__atomic_load_n(&ct->bad_packets,
+                                             __ATOMIC_RELAXED),
+         (unsigned long long)__atomic_load_n(&ct->resyncs, __ATOMIC_RELAXED),
+         ct->huge ? "huge" : "normal");
+}
+
+#endif
@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "corner_turn.h"
+
+// Microbenchmark: corner turn of in-order packets into channel-major
+// blocks, SSE2 with non-temporal stores vs plain scalar stores, for a few
+// channel counts and packet layouts. Every payload is the same, so the
+// first block of each run can be checked element by element.
+
+#define BLOCK_SAMPLES 2048
+#define DEFAULT_BLOCKS 16
+
+struct Layout {
+  uint32_t channels;
+  uint32_t channels_per_packet;
+  uint32_t samples_per_packet;
+  uint32_t sample_bytes;
+};
+
+struct BenchState {
+  const struct Layout *layout;
+  const uint8_t *payload;
+  int check; // verify the next block
+  int errors;
+  uint64_t checksum;
+};
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_block(void *arg, const struct ct_block *blk) {
+  struct BenchState *st = (struct BenchState *)arg;
+  const struct Layout *l = st->layout;
+  size_t row = (size_t)BLOCK_SAMPLES * l->sample_bytes;
+
+  st->checksum += blk->data[0] + blk->data[(size_t)l->channels * row - 1];
+  if (!st->check)
+    return;
+  st->check = 0;
+
+  for (uint32_t ch = 0; ch < l->channels; ch++) {
+    for (uint32_t t = 0; t < BLOCK_SAMPLES; t++) {
+      const uint8_t *got = blk->data + ch * row + (size_t)t * l->sample_bytes;
+      const uint8_t *want =
+          st->payload + ((size_t)(t % l->samples_per_packet) *
+                             l->channels_per_packet +
+                         ch % l->channels_per_packet) *
+                            l->sample_bytes;
+      if (memcmp(got, want, l->sample_bytes) != 0)
+        st->errors++;
+    }
+  }
+}
+
+// Pushes every packet of window w
+static void push_window(struct corner_turn *ct, const struct Layout *l,
+                        const uint8_t *payload, uint32_t size, uint64_t w) {
+  for (uint32_t t = 0; t < BLOCK_SAMPLES; t += l->samples_per_packet) {
+    for (uint32_t ch = 0; ch < l->channels; ch += l->channels_per_packet)
+      ct_push(ct, w * BLOCK_SAMPLES + t, 0, ch, payload, size);
+  }
+}
+
+static double run(const struct Layout *l, int scalar, unsigned long blocks) {
+  uint32_t size =
+      l->channels_per_packet * l->samples_per_packet * l->sample_bytes;
+  uint8_t *payload = (uint8_t *)malloc(size);
+  for (uint32_t i = 0; i < size; i++)
+    payload[i] = (uint8_t)(i * 7 + 1);
+
+  struct ct_config cfg = {l->channels, BLOCK_SAMPLES, l->channels_per_packet,
+                          l->sample_bytes, 1, scalar};
+  struct BenchState st = {l, payload, 1, 0, 0};
+  struct corner_turn ct;
+  if (ct_init(&ct, &cfg, on_block, &st) < 0) {
+    free(payload);
+    return 0;
+  }
+
+  // The first two windows fault the buffers in; time the rest
+  push_window(&ct, l, payload, size, 0);
+  push_window(&ct, l, payload, size, 1);
+
+  double start = now_seconds();
+  for (unsigned long w = 2; w < blocks + 2; w++)
+    push_window(&ct, l, payload, size, w);
+  ct_flush(&ct);
+  double elapsed = now_seconds() - start;
+
+  double bytes = (double)ct.block_size * blocks;
+  double packets = bytes / size;
+  printf("%-6s %5u ch  %3u ch/pkt  %4u samp/pkt  %u B  %8.2f GB/s  "
+         "%7.1f ns/pkt  %s%s pages (chk %lu)\n",
+         scalar ? "scalar" : "sse2", l->channels, l->channels_per_packet,
+         l->samples_per_packet, l->sample_bytes, bytes / elapsed / 1e9,
+         elapsed * 1e9 / packets, st.errors ? "MISMATCH, " : "",
+         ct.huge ? "huge" : "normal", (unsigned long)st.checksum);
+
+  ct_destroy(&ct);
+  free(payload);
+  return bytes / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long blocks = (argc > 1) ? strtoul(argv[1], NULL, 10)
+                                    : DEFAULT_BLOCKS;
+  // 4 KB payloads: complex int16 (4 B) and complex int8 (2 B) samples
+  static const struct Layout layouts[] = {
+      {1024, 1, 1024, 4}, {1024, 16, 64, 4}, {4096, 64, 16, 4},
+      {4096, 8, 128, 4},  {4096, 8, 256, 2},
+  };
+
+  if (blocks == 0)
+    blocks = DEFAULT_BLOCKS;
+  printf("Corner turn benchmark: %lu blocks of %d samples per run\n\n",
+         blocks, BLOCK_SAMPLES);
+
+  for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+    double fast = run(&layouts[i], 0, blocks);
+    double slow = run(&layouts[i], 1, blocks);
+    if (fast > 0 && slow > 0)
+      printf("       speedup %.2fx\n\n", fast / slow);
+  }
+
+  return 0;
+}
@@ -0,0 +1,174 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "corner_turn.h"
+
+// Checks of the corner turn: blocks hold exactly the samples pushed for
+// their window, and nothing a reused buffer held before; FPGAs get rows
+// of their own; senders that restart are followed. Exits non-zero on
+// failure.
+
+#define CHANNELS 4
+#define BLOCK_SAMPLES 8
+#define FPGAS 2
+#define ROWS (FPGAS * CHANNELS)
+#define MAX_BLOCKS 16
+
+struct seen_block {
+  uint64_t first_sample;
+  uint32_t packets;
+  uint8_t data[ROWS * BLOCK_SAMPLES];
+};
+
+static struct seen_block seen[MAX_BLOCKS];
+static int num_seen;
+static int failures;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);                   \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static void record_block(void *arg, const struct ct_block *blk) {
+  const struct corner_turn *ct = (const struct corner_turn *)arg;
+  if (num_seen < MAX_BLOCKS) {
+    seen[num_seen].first_sample = blk->first_sample;
+    seen[num_seen].packets = blk->packets;
+    memcpy(seen[num_seen].data, blk->data, ct->block_size);
+  }
+  num_seen++;
+}
+
+static int setup(struct corner_turn *ct) {
+  struct ct_config cfg = {CHANNELS, BLOCK_SAMPLES, 1, 1, FPGAS, 1};
+  num_seen = 0;
+  if (ct_init(ct, &cfg, record_block, ct) < 0) {
+    printf("FAIL: ct_init\n");
+    failures++;
+    return -1;
+  }
+  return 0;
+}
+
+// Pushes a whole window of one channel of an FPGA, every sample set to
+// value
+static void push_window(struct corner_turn *ct, uint64_t window,
+                        uint32_t channel, uint8_t value, uint32_t fpga = 0) {
+  uint8_t payload[BLOCK_SAMPLES];
+  memset(payload, value, sizeof(payload));
+  ct_push(ct, window * BLOCK_SAMPLES, fpga, channel, payload,
+          sizeof(payload));
+}
+
+// Pushes a whole window of every channel of every FPGA
+static void push_all(struct corner_turn *ct, uint64_t window,
+                     uint8_t value) {
+  for (uint32_t f = 0; f < FPGAS; f++) {
+    for (uint32_t c = 0; c < CHANNELS; c++)
+      push_window(ct, window, c, value, f);
+  }
+}
+
+static int nonzero_bytes(const struct seen_block *b) {
+  int n = 0;
+  for (size_t i = 0; i < sizeof(b->data); i++)
+    n += b->data[i] != 0;
+  return n;
+}
+
+// A completely filled block's buffer comes back two windows later; rows
+// the later window gets no packet for must read as zero
+static void test_reuse_after_full_block() {
+  struct corner_turn ct;
+  if (setup(&ct) < 0)
+    return;
+
+  for (uint64_t w = 0; w < 2; w++) {
+    for (uint32_t f = 0; f < FPGAS; f++) {
+      for (uint32_t c = 0; c < CHANNELS; c++)
+        push_window(&ct, w, c, 0x10 + c, f);
+    }
+  }
+  push_window(&ct, 2, 0, 0x77);
+  push_window(&ct, 3, 0, 0x77);
+  ct_flush(&ct);
+
+  CHECK(num_seen == 4);
+  CHECK(nonzero_bytes(&seen[0]) == ROWS * BLOCK_SAMPLES);
+  CHECK(seen[2].first_sample == 2 * BLOCK_SAMPLES);
+  CHECK(nonzero_bytes(&seen[2]) == BLOCK_SAMPLES);
+  CHECK(seen[2].data[0] == 0x77 && seen[2].data[BLOCK_SAMPLES] == 0);
+  CHECK(nonzero_bytes(&seen[3]) == BLOCK_SAMPLES);
+  ct_destroy(&ct);
+}
+
+// FPGAs sending the same channel fill rows of their own; an fpga_id past
+// the configured ones is rejected rather than written over another's row
+static void test_fpga_rows() {
+  struct corner_turn ct;
+  if (setup(&ct) < 0)
+    return;
+
+  push_window(&ct, 0, 1, 0x21, 0);
+  push_window(&ct, 0, 1, 0x22, 1);
+  push_window(&ct, 0, 1, 0x23, FPGAS);
+  ct_flush(&ct);
+
+  CHECK(num_seen == 1);
+  CHECK(ct.bad_packets == 1);
+  CHECK(seen[0].packets == 2);
+  CHECK(nonzero_bytes(&seen[0]) == 2 * BLOCK_SAMPLES);
+  CHECK(seen[0].data[1 * BLOCK_SAMPLES] == 0x21);
+  CHECK(seen[0].data[(CHANNELS + 1) * BLOCK_SAMPLES] == 0x22);
+  CHECK(seen[0].data[2 * BLOCK_SAMPLES - 1] == 0x21);
+  ct_destroy(&ct);
+}
+
+// Senders restarting at sample 0 long after starting: a stray old packet
+// is late, but a time step of every row that far back restarts the stage
+// there, as a jump far ahead does
+static void test_restart_far_behind() {
+  struct corner_turn ct;
+  if (setup(&ct) < 0)
+    return;
+
+  for (uint64_t w = 0; w < 10; w++)
+    push_all(&ct, w, 0x30);
+  push_window(&ct, 0, 0, 0x31); // stray
+  CHECK(ct.late_packets == 1);
+  push_window(&ct, 9, 0, 0x32); // in window: ends the run
+  CHECK(ct.resyncs == 0);
+
+  for (uint64_t w = 0; w < 3; w++)
+    push_all(&ct, w, 0x40 + w);
+  ct_flush(&ct);
+
+  CHECK(ct.resyncs == 1);
+  CHECK(ct.late_packets == (uint64_t)ROWS);
+  CHECK(num_seen == 10 + 3);
+  CHECK(seen[9].first_sample == 9 * BLOCK_SAMPLES);
+  CHECK(seen[10].first_sample == 0);
+  CHECK(seen[10].packets == 1); // only the packet that resynced
+  CHECK(seen[11].first_sample == BLOCK_SAMPLES);
+  CHECK(seen[11].packets == ROWS);
+  CHECK(nonzero_bytes(&seen[11]) == ROWS * BLOCK_SAMPLES);
+  CHECK(seen[12].data[0] == 0x42);
+  ct_destroy(&ct);
+}
+
+int main() {
+  test_reuse_after_full_block();
+  test_fpga_rows();
+  test_restart_far_behind();
+
+  if (failures) {
+    printf("corner_turn_test: %d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("corner_turn_test: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,234 @@
+#ifndef CQ_WAIT_H
+#define CQ_WAIT_H
+
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Completion wait strategies.
+//
+// cq_wait_poll() returns the next batch of up to CQ_WAIT_BATCH completions,
+// waiting for at least one in the configured way:
+//   CQ_WAIT_BUSY      spin on ibv_poll_cq(); lowest latency, one full core
+//   CQ_WAIT_ADAPTIVE  spin for spin_limit empty polls, then sleep with
+//                     exponential backoff up to max_sleep_us
+//   CQ_WAIT_EVENT     arm the CQ with ibv_req_notify_cq() and block in
+//                     ibv_get_cq_event() on its completion channel
+// The waiter owns the CQ (and channel) it creates with cq_wait_create_cq(),
+// because the CQ can only be destroyed once every event has been acked.
+
+#define CQ_WAIT_BATCH 64
+#define CQ_WAIT_SPIN_LIMIT 1000
+#define CQ_WAIT_MAX_SLEEP_US 1000
+#define CQ_WAIT_ACK_BATCH 64
+
+enum cq_wait_mode { CQ_WAIT_BUSY, CQ_WAIT_ADAPTIVE, CQ_WAIT_EVENT };
+
+struct cq_waiter {
+  enum cq_wait_mode mode;
+  struct ibv_cq *cq;
+  struct ibv_comp_channel *channel; // CQ_WAIT_EVENT only
+
+  uint32_t spin_limit;
+  uint32_t max_sleep_us;
+  uint32_t sleep_us; // current adaptive backoff
+  uint32_t unacked_events;
+
+  // Totals, plus the values at the last cq_wait_report()
+  uint64_t polls;
+  uint64_t completions;
+  uint64_t wakeups; // returns from usleep() or ibv_get_cq_event()
+  uint64_t last_polls;
+  uint64_t last_completions;
+  uint64_t last_wakeups;
+};
+
+static inline const char *cq_wait_mode_name(enum cq_wait_mode mode) {
+  switch (mode) {
+  case CQ_WAIT_BUSY:
+    return "busy";
+  case CQ_WAIT_ADAPTIVE:
+    return "adaptive";
+  case CQ_WAIT_EVENT:
+    return "event";
+  }
+  return "unknown";
+}
+
+// Parses "busy", "adaptive" or "event". Returns 0, or -1 if name is none
+// of them.
+static inline int cq_wait_parse_mode(const char *name,
+                                     enum cq_wait_mode *mode) {
+  if (strcmp(name, "busy") == 0)
+    *mode = CQ_WAIT_BUSY;
+  else if (strcmp(name, "adaptive") == 0)
+    *mode = CQ_WAIT_ADAPTIVE;
+  else if (strcmp(name, "event") == 0)
+    *mode = CQ_WAIT_EVENT;
+  else
+    return -1;
+  return 0;
+}
+
+static inline void cq_wait_init(struct cq_waiter *w, enum cq_wait_mode mode) {
+  memset(w, 0, sizeof(*w));
+  w->mode = mode;
+  w->spin_limit = CQ_WAIT_SPIN_LIMIT;
+  w->max_sleep_us = CQ_WAIT_MAX_SLEEP_US;
+  w->sleep_us = 1;
+}
+
+// Creates a CQ of cqe entries waited on with mode, plus its completion
+// channel in event mode. Returns the CQ, or NULL on failure.
+static inline struct ibv_cq *cq_wait_create_cq(struct cq_waiter *w,
+                                               struct ibv_context *ctx,
+                                               int cqe,
+                                               enum cq_wait_mode mode) {
+  cq_wait_init(w, mode);
+
+  if (mode == CQ_WAIT_EVENT) {
+    w->channel = ibv_create_comp_channel(ctx);
+    if (!w->channel) {
+      perror("cq_wait: ibv_create_comp_channel");
+      return NULL;
+    }
+  }
+
+  w->cq = ibv_create_cq(ctx, cqe, NULL, w->channel, 0);
+  if (!w->cq) {
+    perror("cq_wait: ibv_create_cq");
+    if (w->channel)
+      ibv_destroy_comp_channel(w->channel);
+    w->channel = NULL;
+    return NULL;
+  }
+
+  return w->cq;
+}
+
+// Blocks until the CQ's channel delivers an event. The CQ must have been
+// armed with ibv_req_notify_cq(). Returns 0, or -1 on error.
+static inline int cq_wait_for_event(struct cq_waiter *w) {
+  struct ibv_cq *ev_cq;
+  void *ev_ctx;
+
+  if (ibv_get_cq_event(w->channel, &ev_cq, &ev_ctx)) {
+    perror("cq_wait: ibv_get_cq_event");
+    return -1;
+  }
+  w->wakeups++;
+
+  // Acking takes a mutex, so do it in batches
+  if (++w->unacked_events == CQ_WAIT_ACK_BATCH) {
+    ibv_ack_cq_events(w->cq, w->unacked_events);
+    w->unacked_events = 0;
+  }
+  return 0;
+}
+
+// Adaptive backoff after an empty poll: keep spinning until spin_limit
+// empty polls in a row, then sleep, doubling the sleep each time
+static inline void cq_wait_backoff(struct cq_waiter *w, uint32_t *empty_polls) {
+  if (++*empty_polls < w->spin_limit)
+    return;
+  usleep(w->sleep_us);
+  w->wakeups++;
+  if (w->sleep_us < w->max_sleep_us)
+    w->sleep_us *= 2;
+}
+
+// Records a poll of n completions on a CQ read without ibv_poll_cq() (such
+// as a striding RQ's) and backs off if it was empty. Such CQs raise no
+// events here, so event mode spins like busy mode.
+static inline void cq_wait_note_poll(struct cq_waiter *w, int n,
+                                     uint32_t *empty_polls) {
+  w->polls++;
+  if (n > 0) {
+    w->completions += n;
+    w->sleep_us = 1;
+    *empty_polls = 0;
+  } else if (w->mode == CQ_WAIT_ADAPTIVE) {
+    cq_wait_backoff(w, empty_polls);
+  }
+}
+
+// Fills wcs (room for CQ_WAIT_BATCH entries) with at least one completion.
+// Returns the number of completions, or -1 on error.
+static inline int cq_wait_poll(struct cq_waiter *w, struct ibv_wc *wcs) {
+  uint32_t empty_polls = 0;
+  bool armed = false;
+
+  for (;;) {
+    int n = ibv_poll_cq(w->cq, CQ_WAIT_BATCH, wcs);
+    w->polls++;
+
+    if (n < 0) {
+      fprintf(stderr, "cq_wait: ibv_poll_cq failed\n");
+      return -1;
+    }
+    if (n > 0) {
+      w->completions += n;
+      w->sleep_us = 1;
+      return n;
+    }
+
+    switch (w->mode) {
+    case CQ_WAIT_BUSY:
+      break;
+    case CQ_WAIT_ADAPTIVE:
+      cq_wait_backoff(w, &empty_polls);
+      break;
+    case CQ_WAIT_EVENT:
+      // Completions that land before the CQ is armed raise no event, so
+      // arm it and poll once more before blocking
+      if (!armed) {
+        if (ibv_req_notify_cq(w->cq, 0)) {
+          fprintf(stderr, "cq_wait: ibv_req_notify_cq failed\n");
+          return -1;
+        }
+        armed = true;
+      } else {
+        if (cq_wait_for_event(w))
+          return -1;
+        armed = false;
+      }
+      break;
+    }
+  }
+}
+
+// Prints wakeups per second and completions per poll since the last
+// report, elapsed_s seconds ago.
+static inline void cq_wait_report(struct cq_waiter *w, double elapsed_s) {
+  uint64_t polls = w->polls - w->last_polls;
+  uint64_t completions = w->completions - w->last_completions;
+  uint64_t wakeups = w->wakeups - w->last_wakeups;
+
+  printf("CQ wait (%s): Completions=%llu, Wakeups/s=%.1f, "
+         "Completions/poll=%.2f\n",
+         cq_wait_mode_name(w->mode), (unsigned long long)completions,
+         elapsed_s > 0 ? wakeups / elapsed_s : 0.0,
+         polls ? (double)completions / polls : 0.0);
+
+  w->last_polls = w->polls;
+  w->last_completions = w->completions;
+  w->last_wakeups = w->wakeups;
+}
+
+// Acks outstanding events and destroys the CQ and channel
+static inline void cq_wait_destroy(struct cq_waiter *w) {
+  if (w->cq) {
+    if (w->unacked_events)
+      ibv_ack_cq_events(w->cq, w->unacked_events);
+    ibv_destroy_cq(w->cq);
+  }
+  if (w->channel)
+    ibv_destroy_comp_channel(w->channel);
+  w->cq = NULL;
+  w->channel = NULL;
+  w->unacked_events = 0;
+}
+
+#endif
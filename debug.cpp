@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "verbs.h"
+
 void print_device_caps(struct ibv_context *context) {
   struct ibv_device_attr device_attr;
 
@@ -48,30 +50,18 @@ void print_port_info(struct ibv_context *context, int port_num) {
                                                            : "Unknown");
 }
 
-int test_qp_creation(struct ibv_context *context, struct ibv_pd *pd,
-                     struct ibv_cq *cq) {
-  struct ibv_qp_init_attr qp_attr = {};
-  struct ibv_qp *qp;
-
+int test_qp_creation(struct ibv_pd *pd, struct ibv_cq *cq) {
   printf("\nTesting different QP types:\n");
 
   // Test different QP types
-  enum ibv_qp_type qp_types[] = {IBV_QPT_RC, IBV_QPT_UD, IBV_QPT_RAW_PACKET};
+  QpBuilder builders[] = {QpBuilder::rc(pd), QpBuilder::ud(pd),
+                          QpBuilder::raw(pd)};
   const char *qp_names[] = {"RC", "UD", "RAW_PACKET"};
 
   for (int i = 0; i < 3; i++) {
-    qp_attr.send_cq = cq;
-    qp_attr.recv_cq = cq;
-    qp_attr.qp_type = qp_types[i];
-    qp_attr.cap.max_send_wr = 1;
-    qp_attr.cap.max_recv_wr = 1;
-    qp_attr.cap.max_send_sge = 1;
-    qp_attr.cap.max_recv_sge = 1;
-
-    qp = ibv_create_qp(pd, &qp_attr);
+    Qp qp = builders[i].cq(cq).create();
     if (qp) {
       printf("  ✓ %s QP creation: SUCCESS\n", qp_names[i]);
-      ibv_destroy_qp(qp);
     } else {
       printf("  ✗ %s QP creation: FAILED (errno: %d, %s)\n", qp_names[i], errno,
              strerror(errno));
@@ -82,72 +72,47 @@ int test_qp_creation(struct ibv_context *context, struct ibv_pd *pd,
 }
 
 int main() {
-  struct ibv_device **dev_list;
-  struct ibv_context *context;
-  struct ibv_pd *pd;
-  struct ibv_cq *cq;
-  int num_devices;
-
   printf("=== RDMA Device Debug Info ===\n\n");
 
-  // Get device list
-  dev_list = ibv_get_device_list(&num_devices);
-  if (!dev_list || num_devices == 0) {
-    fprintf(stderr, "No RDMA devices found\n");
+  // Get device list and open the first device
+  Device dev = Device::open();
+  if (dev.num_devices() == 0)
     return 1;
-  }
 
-  printf("Found %d RDMA device(s):\n", num_devices);
-  for (int i = 0; i < num_devices; i++) {
-    printf("  %d: %s (%s)\n", i, ibv_get_device_name(dev_list[i]),
-           ibv_node_type_str(dev_list[i]->node_type));
+  printf("Found %d RDMA device(s):\n", dev.num_devices());
+  for (int i = 0; i < dev.num_devices(); i++) {
+    printf("  %d: %s (%s)\n", i, ibv_get_device_name(dev.device_at(i)),
+           ibv_node_type_str(dev.device_at(i)->node_type));
   }
   printf("\n");
 
-  // Test first device
-  context = ibv_open_device(dev_list[0]);
-  if (!context) {
+  if (!dev) {
     fprintf(stderr, "Failed to open device\n");
-    ibv_free_device_list(dev_list);
     return 1;
   }
 
-  printf("Testing device: %s\n\n", ibv_get_device_name(dev_list[0]));
+  printf("Testing device: %s\n\n", dev.name());
 
   // Print device capabilities
-  print_device_caps(context);
+  print_device_caps(dev);
   printf("\n");
 
   // Print port info
-  print_port_info(context, 1);
+  print_port_info(dev, 1);
   printf("\n");
 
-  // Create basic resources for QP testing
-  pd = ibv_alloc_pd(context);
-  if (!pd) {
-    fprintf(stderr, "Failed to allocate PD\n");
-    ibv_close_device(context);
-    ibv_free_device_list(dev_list);
+  // Create basic resources for QP testing; they are released as they leave
+  // scope
+  Pd pd = Pd::alloc(dev);
+  if (!pd)
     return 1;
-  }
 
-  cq = ibv_create_cq(context, 10, NULL, NULL, 0);
-  if (!cq) {
-    fprintf(stderr, "Failed to create CQ\n");
-    ibv_dealloc_pd(pd);
-    ibv_close_device(context);
-    ibv_free_device_list(dev_list);
+  Cq cq = Cq::create(dev, 10);
+  if (!cq)
     return 1;
-  }
 
   // Test QP creation
-  test_qp_creation(context, pd, cq);
-
-  // Cleanup
-  ibv_destroy_cq(cq);
-  ibv_dealloc_pd(pd);
-  ibv_close_device(context);
-  ibv_free_device_list(dev_list);
+  test_qp_creation(pd, cq);
 
   return 0;
 }
@@ -0,0 +1,168 @@
+#ifndef LAT_HIST_H
+#define LAT_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Log-linear latency histogram, in the style of HdrHistogram.
+//
+// Values (nanoseconds, normally) below LAT_HIST_SUB are counted exactly.
+// Above that, every power of two is split into LAT_HIST_SUB equal buckets,
+// so a value is known to within 1/LAT_HIST_SUB of itself (about 3%) from
+// 32 ns up to 2^LAT_HIST_MAGS ns (18 minutes), in a fixed 9 KB array.
+// Recording is a count leading zeros, a shift and an increment, cheap
+// enough for every message of a benchmark. Larger values go into the top
+// bucket, and min, max and the sum are kept exactly.
+//
+// Histograms with the same layout add up, so per-thread histograms can be
+// merged off the hot path with lat_hist_merge(), or with
+// lat_hist_merge_shared() while their threads keep recording.
+
+#define LAT_HIST_SUB_BITS 5
+#define LAT_HIST_SUB (1u << LAT_HIST_SUB_BITS)
+#define LAT_HIST_MAGS 40
+#define LAT_HIST_BUCKETS                                                       \
+  ((LAT_HIST_MAGS - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB)
+
+struct lat_hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[LAT_HIST_BUCKETS];
+};
+
+static inline void lat_hist_reset(struct lat_hist *h) {
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+static inline uint32_t lat_hist_index(uint64_t v) {
+  if (v < LAT_HIST_SUB)
+    return (uint32_t)v;
+  if (v >> LAT_HIST_MAGS)
+    return LAT_HIST_BUCKETS - 1;
+
+  uint32_t shift = 63 - __builtin_clzll(v) - LAT_HIST_SUB_BITS;
+  return (shift + 1) * LAT_HIST_SUB + (uint32_t)(v >> shift) - LAT_HIST_SUB;
+}
+
+// Largest value that lands in bucket idx
+static inline uint64_t lat_hist_bucket_top(uint32_t idx) {
+  if (idx < LAT_HIST_SUB)
+    return idx;
+  uint32_t shift = idx / LAT_HIST_SUB - 1;
+  uint64_t base = (uint64_t)(LAT_HIST_SUB + idx % LAT_HIST_SUB) << shift;
+  return base + (1ull << shift) - 1;
+}
+
+static inline void lat_hist_record(struct lat_hist *h, uint64_t v) {
+  h->buckets[lat_hist_index(v)]++;
+  h->count++;
+  h->sum += v;
+  if (v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+}
+
+// lat_hist_record() for a histogram that another thread reads meanwhile
+// with lat_hist_merge_shared(). There must be only one writer; its stores
+// are plain but untorn, so the reader sees each field old or new.
+static inline void lat_hist_record_shared(struct lat_hist *h, uint64_t v) {
+  uint64_t *bucket = &h->buckets[lat_hist_index(v)];
+  __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+  if (v < h->min)
+    __atomic_store_n(&h->min, v, __ATOMIC_RELAXED);
+  if (v > h->max)
+    __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+static inline void lat_hist_merge(struct lat_hist *dst,
+                                  const struct lat_hist *src) {
+  for (uint32_t i = 0; i < LAT_HIST_BUCKETS; i++)
+    dst->buckets[i] += src->buckets[i];
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+// lat_hist_merge() from a histogram its writer may be updating. The result
+// is a snapshot as of some moment during the call, give or take the
+// values recorded while it ran.
+static inline void lat_hist_merge_shared(struct lat_hist *dst,
+                                         const struct lat_hist *src) {
+  for (uint32_t i = 0; i < LAT_HIST_BUCKETS; i++)
+    dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+  dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+  dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+  uint64_t min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+  if (min < dst->min)
+    dst->min = min;
+  if (max > dst->max)
+    dst->max = max;
+}
+
+// Number of recorded values up to v, counting only the buckets that end
+// at or below v: never a value above v, but values up to 1/LAT_HIST_SUB
+// below it may be left out unless v is the top of its bucket
+static inline uint64_t lat_hist_count_upto(const struct lat_hist *h,
+                                           uint64_t v) {
+  uint32_t end = lat_hist_index(v) + 1;
+  if (lat_hist_bucket_top(end - 1) > v)
+    end--;
+  uint64_t n = 0;
+  for (uint32_t i = 0; i < end; i++)
+    n += h->buckets[i];
+  return n;
+}
+
+// Value at or below which pct percent of the recorded values lie, as the
+// top of its bucket (never above the largest value), or 0 if empty
+static inline uint64_t lat_hist_percentile(const struct lat_hist *h,
+                                           double pct) {
+  if (h->count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(pct / 100.0 * h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > h->count)
+    rank = h->count;
+
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < LAT_HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t top = lat_hist_bucket_top(i);
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
+
+static inline double lat_hist_mean(const struct lat_hist *h) {
+  return h->count ? (double)h->sum / h->count : 0.0;
+}
+
+// Prints count, min, mean, the usual percentiles and max on one line
+static inline void lat_hist_print(const struct lat_hist *h,
+                                  const char *prefix) {
+  printf("%sCount=%llu, Min=%llu, Mean=%.0f, p50=%llu, p99=%llu, "
+         "p99.9=%llu, Max=%llu\n",
+         prefix, (unsigned long long)h->count,
+         (unsigned long long)(h->count ? h->min : 0), lat_hist_mean(h),
+         (unsigned long long)lat_hist_percentile(h, 50),
+         (unsigned long long)lat_hist_percentile(h, 99),
+         (unsigned long long)lat_hist_percentile(h, 99.9),
+         (unsigned long long)h->max);
+}
+
+#endif
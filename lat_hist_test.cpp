@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lat_hist.h"
+
+// Checks of the latency histogram: bucket tops, and counts up to a bound
+// that never include a value above it. Exits non-zero on failure.
+
+static int failures;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);                   \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+// Every value lands in a bucket whose top is at or above it, and the next
+// value up after a top starts the next bucket
+static void test_bucket_tops() {
+  for (uint64_t v = 0; v < 1u << 16; v++) {
+    uint32_t idx = lat_hist_index(v);
+    CHECK(lat_hist_bucket_top(idx) >= v);
+    if (lat_hist_bucket_top(idx) == v)
+      CHECK(lat_hist_index(v + 1) == idx + 1);
+  }
+}
+
+// A value just above a bound that falls inside a bucket is not counted up
+// to the bound; at bucket tops, and below LAT_HIST_SUB, counts are exact
+static void test_count_upto() {
+  struct lat_hist h;
+  lat_hist_reset(&h);
+  lat_hist_record(&h, 5);
+  lat_hist_record(&h, 1000);
+  lat_hist_record(&h, 1001);
+  lat_hist_record(&h, 1007); // 992 to 1007 share a bucket
+
+  CHECK(lat_hist_bucket_top(lat_hist_index(1000)) == 1007);
+  CHECK(lat_hist_count_upto(&h, 4) == 0);
+  CHECK(lat_hist_count_upto(&h, 5) == 1);
+  CHECK(lat_hist_count_upto(&h, 1000) == 1);
+  CHECK(lat_hist_count_upto(&h, 1006) == 1);
+  CHECK(lat_hist_count_upto(&h, 1007) == 4);
+  CHECK(lat_hist_count_upto(&h, UINT64_MAX) == 4);
+
+  for (uint64_t bound = 0; bound < 1u << 14; bound += 37) {
+    lat_hist_reset(&h);
+    for (uint64_t v = bound; v < bound + 64; v++)
+      lat_hist_record(&h, v);
+    CHECK(lat_hist_count_upto(&h, bound) <= 1);
+  }
+}
+
+int main() {
+  test_bucket_tops();
+  test_count_upto();
+
+  if (failures) {
+    printf("lat_hist_test: %d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("lat_hist_test: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,526 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <infiniband/verbs.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "buf_pool.h"
+#include "lat_hist.h"
+#include "verbs.h"
+
+// Ping-pong latency benchmark over three paths between two threads of one
+// process:
+//   ud   two UD QPs on one port, SEND/RECV, as loopback_verbs uses them
+//   rc   two connected RC QPs, RDMA WRITE with immediate into the peer's
+//        buffer, as rdma_client --rc sends
+//   udp  two kernel UDP sockets on 127.0.0.1
+// For each message size from 8 bytes up to the path MTU, doubling, the
+// pinger sends, waits for the ponger's echo of the same size and records
+// the round trip in a log-linear histogram. Warm-up round trips run first
+// and are not recorded, so caches, TLBs, CQs and (on soft-RoCE) the kernel
+// threads behind the device are in steady state. Both sides busy-poll,
+// yielding now and then, or after every empty poll when there is only one
+// CPU to share. One-way latency is about half the round trip.
+//
+// Runs on any verbs device, including soft-RoCE (rxe) loopback; without
+// one only the UDP path runs. Results are round trip times in ns, one row
+// per path and size, as text, CSV or JSON.
+
+#define IB_PORT 1
+#define GID_INDEX 1
+#define QKEY 0x11111111
+#define GRH_SIZE 40
+#define MIN_SIZE 8
+#define UDP_MAX_SIZE 1472 // fits a 1500 byte Ethernet MTU
+#define PP_QUEUE_DEPTH 16
+#define PP_SIGNAL_INTERVAL 8
+#define PP_MAX_INLINE 64
+#define PP_POLL_BATCH 4
+#define PP_SPIN_POLLS 100000 // empty polls before yielding the CPU
+#define DEFAULT_ITERS 20000
+#define DEFAULT_WARMUP 2000
+
+static volatile int failed; // set by either side to stop the other
+static uint32_t spin_polls; // 0 on one CPU, where the peer needs it
+
+// Called after each empty poll
+static inline void pp_idle(uint32_t *empty) {
+  if (++*empty > spin_polls) {
+    sched_yield();
+    *empty = 0;
+  } else {
+    bench_cpu_relax();
+  }
+}
+
+// A path is two ends, [0] pinging and [1] ponging, and how to use them
+struct pp_path {
+  const char *name;
+  uint32_t max_size;
+  void *ends[2];
+  int (*send)(void *end, uint32_t size);
+  int (*wait)(void *end); // until a message arrives
+};
+
+struct bench_opts {
+  uint64_t iters;
+  uint64_t warmup;
+  uint32_t max_size; // 0 for each path's MTU
+  int cpus[2];       // pinger, ponger; -1 for unpinned
+  struct bench_table table;
+};
+
+// UDP: connected sockets, so each send and receive is one plain syscall
+
+struct udp_end {
+  int fd;
+  char buf[UDP_MAX_SIZE];
+};
+
+static int udp_send(void *arg, uint32_t size) {
+  struct udp_end *e = (struct udp_end *)arg;
+  if (send(e->fd, e->buf, size, 0) != (ssize_t)size) {
+    perror("send");
+    return -1;
+  }
+  return 0;
+}
+
+static int udp_wait(void *arg) {
+  struct udp_end *e = (struct udp_end *)arg;
+  uint32_t empty = 0;
+  while (!failed) {
+    if (recv(e->fd, e->buf, sizeof(e->buf), MSG_DONTWAIT) >= 0)
+      return 0;
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      perror("recv");
+      return -1;
+    }
+    pp_idle(&empty);
+  }
+  return -1;
+}
+
+// Binds two sockets to ephemeral loopback ports and connects them to each
+// other. Returns 0, or -1 with nothing left open.
+static int udp_open_pair(struct udp_end ends[2]) {
+  struct sockaddr_in addrs[2];
+  ends[0].fd = ends[1].fd = -1;
+
+  for (int i = 0; i < 2; i++) {
+    socklen_t len = sizeof(addrs[i]);
+    memset(&addrs[i], 0, sizeof(addrs[i]));
+    addrs[i].sin_family = AF_INET;
+    addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    ends[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ends[i].fd < 0 ||
+        bind(ends[i].fd, (struct sockaddr *)&addrs[i], sizeof(addrs[i])) ||
+        getsockname(ends[i].fd, (struct sockaddr *)&addrs[i], &len)) {
+      perror("udp socket");
+      goto fail;
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    if (connect(ends[i].fd, (struct sockaddr *)&addrs[1 - i],
+                sizeof(addrs[1 - i]))) {
+      perror("connect");
+      goto fail;
+    }
+    memset(ends[i].buf, 0, sizeof(ends[i].buf));
+  }
+  return 0;
+
+fail:
+  for (int i = 0; i < 2; i++) {
+    if (ends[i].fd >= 0)
+      close(ends[i].fd);
+  }
+  return -1;
+}
+
+// Verbs: one QP and CQ per end. Sends are signaled every
+// PP_SIGNAL_INTERVAL and inline when small; each receive completion
+// reposts one receive, so PP_QUEUE_DEPTH stay posted.
+
+struct verbs_end {
+  Cq cq;
+  Qp qp;
+  ibv_send_wr wr;
+  ibv_sge sge;
+  ibv_recv_wr rwr;
+  ibv_sge rsge;
+  uint32_t unsignaled;
+  uint32_t outstanding; // send WRs not yet retired
+};
+
+// Polls once; returns the number of messages received, or -1 on error
+static int verbs_poll(struct verbs_end *e) {
+  ibv_wc wcs[PP_POLL_BATCH];
+  int n = e->cq.poll(PP_POLL_BATCH, wcs);
+  if (n < 0) {
+    fprintf(stderr, "ibv_poll_cq failed\n");
+    return -1;
+  }
+
+  int received = 0;
+  for (int i = 0; i < n; i++) {
+    if (wcs[i].status != IBV_WC_SUCCESS) {
+      fprintf(stderr, "Completion error: %s\n",
+              ibv_wc_status_str(wcs[i].status));
+      return -1;
+    }
+    if (wcs[i].opcode & IBV_WC_RECV) {
+      if (e->qp.post_recv(&e->rwr)) {
+        perror("ibv_post_recv");
+        return -1;
+      }
+      received++;
+    } else {
+      e->outstanding -= (uint32_t)wcs[i].wr_id;
+    }
+  }
+  return received;
+}
+
+static int verbs_send(void *arg, uint32_t size) {
+  struct verbs_end *e = (struct verbs_end *)arg;
+  while (e->outstanding == PP_QUEUE_DEPTH) {
+    if (verbs_poll(e) != 0)
+      return -1; // a message cannot arrive before we send
+  }
+
+  e->sge.length = size;
+  e->wr.send_flags = size <= PP_MAX_INLINE ? IBV_SEND_INLINE : 0;
+  e->wr.wr_id = 0;
+  if (++e->unsignaled == PP_SIGNAL_INTERVAL) {
+    e->wr.send_flags |= IBV_SEND_SIGNALED;
+    e->wr.wr_id = e->unsignaled;
+    e->unsignaled = 0;
+  }
+  if (e->qp.post_send(&e->wr)) {
+    perror("ibv_post_send");
+    return -1;
+  }
+  e->outstanding++;
+  return 0;
+}
+
+static int verbs_wait(void *arg) {
+  struct verbs_end *e = (struct verbs_end *)arg;
+  uint32_t empty = 0;
+  while (!failed) {
+    int n = verbs_poll(e);
+    if (n < 0)
+      return -1;
+    if (n > 0)
+      return 0;
+    pp_idle(&empty);
+  }
+  return -1;
+}
+
+// Creates both ends of a UD or RC path, sending from and receiving into
+// slots of bufs, and connects them to each other. Returns 0 or -1.
+static int verbs_open_pair(const Device &dev, ibv_pd *pd, bool rc,
+                           struct buf_pool *bufs, Ah *ah,
+                           struct verbs_end ends[2]) {
+  QpEndpoint eps[2];
+  char *recv_bufs[2];
+
+  for (int i = 0; i < 2; i++) {
+    struct verbs_end *e = &ends[i];
+    e->cq = Cq::create(dev, 2 * PP_QUEUE_DEPTH);
+    if (!e->cq)
+      return -1;
+    e->qp = (rc ? QpBuilder::rc(pd) : QpBuilder::ud(pd))
+                .cq(e->cq)
+                .depth(PP_QUEUE_DEPTH, PP_QUEUE_DEPTH)
+                .max_inline(PP_MAX_INLINE)
+                .sig_all(false)
+                .create();
+    if (!e->qp)
+      return -1;
+    if (rc ? e->qp.init_rc(IB_PORT, IBV_ACCESS_REMOTE_WRITE)
+           : e->qp.ready_ud(IB_PORT, QKEY))
+      return -1;
+
+    memset(&eps[i], 0, sizeof(eps[i]));
+    eps[i].qpn = e->qp.qpn();
+    eps[i].psn = (uint32_t)lrand48() & 0xffffff;
+    if (dev.port_address(IB_PORT, GID_INDEX, &eps[i]))
+      return -1;
+
+    // Slots 2i and 2i+1 are this end's send and receive buffers
+    char *send_buf = buf_pool_addr(bufs, buf_pool_alloc(bufs));
+    recv_bufs[i] = buf_pool_addr(bufs, buf_pool_alloc(bufs));
+
+    memset(&e->sge, 0, sizeof(e->sge));
+    e->sge.addr = (uintptr_t)send_buf;
+    e->sge.lkey = buf_pool_lkey(bufs);
+    memset(&e->wr, 0, sizeof(e->wr));
+    e->wr.sg_list = &e->sge;
+    e->wr.num_sge = 1;
+
+    // UD lands the GRH first; RC writes carry their own address and need
+    // no receive buffer
+    memset(&e->rsge, 0, sizeof(e->rsge));
+    e->rsge.addr = (uintptr_t)recv_bufs[i];
+    e->rsge.length = bufs->slot_size;
+    e->rsge.lkey = buf_pool_lkey(bufs);
+    memset(&e->rwr, 0, sizeof(e->rwr));
+    e->rwr.sg_list = rc ? NULL : &e->rsge;
+    e->rwr.num_sge = rc ? 0 : 1;
+    for (int j = 0; j < PP_QUEUE_DEPTH; j++) {
+      if (e->qp.post_recv(&e->rwr)) {
+        perror("ibv_post_recv");
+        return -1;
+      }
+    }
+    e->unsignaled = 0;
+    e->outstanding = 0;
+  }
+
+  if (!rc) {
+    *ah = Ah::to_endpoint(pd, IB_PORT, eps[0], GID_INDEX);
+    if (!*ah)
+      return -1;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    struct verbs_end *e = &ends[i];
+    const QpEndpoint &peer = eps[1 - i];
+    if (rc) {
+      if (e->qp.connect_rc(peer, eps[i].psn, IB_PORT, GID_INDEX,
+                           dev.active_mtu(IB_PORT)))
+        return -1;
+      e->wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+      e->wr.wr.rdma.remote_addr = (uintptr_t)recv_bufs[1 - i];
+      e->wr.wr.rdma.rkey = bufs->mr->rkey;
+    } else {
+      e->wr.opcode = IBV_WR_SEND;
+      e->wr.wr.ud.ah = *ah;
+      e->wr.wr.ud.remote_qpn = peer.qpn;
+      e->wr.wr.ud.remote_qkey = QKEY;
+    }
+  }
+  return 0;
+}
+
+struct pong_args {
+  struct pp_path *path;
+  uint64_t count;
+  uint32_t size;
+};
+
+static void *pong_main(void *arg) {
+  struct pong_args *a = (struct pong_args *)arg;
+  void *end = a->path->ends[1];
+
+  for (uint64_t i = 0; i < a->count; i++) {
+    if (a->path->wait(end) || a->path->send(end, a->size)) {
+      failed = 1;
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Runs warm-up and measured round trips of one size. Returns 0 or -1.
+static int run_size(struct pp_path *path, uint32_t size,
+                    const struct bench_opts *opts, struct lat_hist *h) {
+  struct pong_args args = {path, opts->warmup + opts->iters, size};
+  pthread_t pong;
+  if (bench_start_thread(&pong, pong_main, &args, opts->cpus[1]))
+    return -1;
+
+  void *end = path->ends[0];
+  lat_hist_reset(h);
+  for (uint64_t i = 0; i < args.count && !failed; i++) {
+    uint64_t start = bench_now_ns();
+    if (path->send(end, size) || path->wait(end)) {
+      failed = 1;
+      break;
+    }
+    if (i >= opts->warmup)
+      lat_hist_record(h, bench_now_ns() - start);
+  }
+
+  pthread_join(pong, NULL);
+  return failed ? -1 : 0;
+}
+
+// Runs every size from MIN_SIZE up to the path's largest, doubling, and
+// writes a row for each
+static int run_path(struct pp_path *path, struct bench_opts *opts) {
+  static const char *const pcts[] = {"50", "90", "99", "99.9"};
+  struct lat_hist h;
+  uint32_t max = path->max_size;
+  if (opts->max_size && opts->max_size < max)
+    max = opts->max_size;
+
+  for (uint32_t size = MIN_SIZE;; size *= 2) {
+    if (size > max)
+      size = max;
+    if (run_size(path, size, opts, &h)) {
+      fprintf(stderr, "%s: failed at %u bytes\n", path->name, size);
+      return -1;
+    }
+
+    char vals[10][32];
+    snprintf(vals[0], sizeof(vals[0]), "%s", path->name);
+    snprintf(vals[1], sizeof(vals[1]), "%u", size);
+    snprintf(vals[2], sizeof(vals[2]), "%llu", (unsigned long long)h.count);
+    snprintf(vals[3], sizeof(vals[3]), "%llu", (unsigned long long)h.min);
+    snprintf(vals[4], sizeof(vals[4]), "%.0f", lat_hist_mean(&h));
+    for (int i = 0; i < 4; i++)
+      snprintf(vals[5 + i], sizeof(vals[5 + i]), "%llu",
+               (unsigned long long)lat_hist_percentile(&h, atof(pcts[i])));
+    snprintf(vals[9], sizeof(vals[9]), "%llu", (unsigned long long)h.max);
+
+    const char *row[10];
+    for (int i = 0; i < 10; i++)
+      row[i] = vals[i];
+    bench_table_row(&opts->table, row);
+
+    if (size == max)
+      return 0;
+  }
+}
+
+static int run_udp(struct bench_opts *opts) {
+  static struct udp_end ends[2];
+  if (udp_open_pair(ends))
+    return -1;
+
+  struct pp_path path = {"udp", UDP_MAX_SIZE, {&ends[0], &ends[1]},
+                         udp_send, udp_wait};
+  int ret = run_path(&path, opts);
+  close(ends[0].fd);
+  close(ends[1].fd);
+  return ret;
+}
+
+static int run_verbs(const Device &dev, bool rc, struct bench_opts *opts) {
+  Pd pd = Pd::alloc(dev);
+  if (!pd)
+    return -1;
+
+  // UD messages are at most one MTU; RC is held to the same for comparison
+  uint32_t mtu = 128u << dev.active_mtu(IB_PORT);
+  buf_pool_config buf_cfg{};
+  buf_cfg.num_slots = 4;
+  buf_cfg.slot_size = GRH_SIZE + mtu;
+  buf_cfg.numa_node = -1;
+  buf_cfg.access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+
+  buf_pool bufs;
+  if (buf_pool_init(&bufs, pd, &buf_cfg))
+    return -1;
+  auto bufs_guard = on_scope_exit([&] { buf_pool_destroy(&bufs); });
+
+  Ah ah;
+  struct verbs_end ends[2];
+  if (verbs_open_pair(dev, pd, rc, &bufs, &ah, ends))
+    return -1;
+
+  struct pp_path path = {rc ? "rc" : "ud", mtu, {&ends[0], &ends[1]},
+                         verbs_send, verbs_wait};
+  return run_path(&path, opts);
+}
+
+// Whether name is one of the comma-separated paths
+static bool has_path(const char *paths, const char *name) {
+  size_t len = strlen(name);
+  for (const char *p = paths; p; p = strchr(p, ',')) {
+    if (*p == ',')
+      p++;
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+      return true;
+  }
+  return false;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--paths=ud,rc,udp] [--iters=N] [--warmup=N] "
+          "[--max-size=BYTES] [--cpus=PING,PONG] [--format=text|csv|json]\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  static const char *const columns[] = {
+      "path",   "size",   "count",  "min_ns",   "mean_ns",
+      "p50_ns", "p90_ns", "p99_ns", "p99.9_ns", "max_ns"};
+  const char *paths = "ud,rc,udp";
+  enum bench_format format = BENCH_TEXT;
+  struct bench_opts opts;
+  opts.iters = DEFAULT_ITERS;
+  opts.warmup = DEFAULT_WARMUP;
+  opts.max_size = 0;
+  opts.cpus[0] = opts.cpus[1] = -1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--paths=", 8) == 0) {
+      paths = argv[i] + 8;
+    } else if (strncmp(argv[i], "--iters=", 8) == 0) {
+      opts.iters = strtoull(argv[i] + 8, NULL, 10);
+    } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+      opts.warmup = strtoull(argv[i] + 9, NULL, 10);
+    } else if (strncmp(argv[i], "--max-size=", 11) == 0) {
+      opts.max_size = strtoul(argv[i] + 11, NULL, 10);
+    } else if (strncmp(argv[i], "--cpus=", 7) == 0) {
+      if (sscanf(argv[i] + 7, "%d,%d", &opts.cpus[0], &opts.cpus[1]) != 2) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--format=", 9) == 0) {
+      if (bench_parse_format(argv[i] + 9, &format)) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (opts.iters == 0 || (opts.max_size && opts.max_size < MIN_SIZE)) {
+    usage(argv[0]);
+    return 1;
+  }
+  srand48(time(NULL) ^ getpid());
+  spin_polls = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? PP_SPIN_POLLS : 0;
+  if (bench_pin_self(opts.cpus[0]))
+    return 1;
+
+  bool want_ud = has_path(paths, "ud");
+  bool want_rc = has_path(paths, "rc");
+  bool want_udp = has_path(paths, "udp");
+
+  Device dev;
+  if (want_ud || want_rc) {
+    dev = Device::open();
+    if (!dev) {
+      fprintf(stderr, "Skipping the verbs paths\n");
+      want_ud = want_rc = false;
+    }
+  }
+
+  bench_table_begin(&opts.table, stdout, format, "latency", columns, 10);
+  int ret = 0;
+  if (want_ud && run_verbs(dev, false, &opts))
+    ret = 1;
+  if (!failed && want_rc && run_verbs(dev, true, &opts))
+    ret = 1;
+  if (!failed && want_udp && run_udp(&opts))
+    ret = 1;
+  bench_table_end(&opts.table);
+  return ret;
+}
@@ -1,179 +1,147 @@
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <infiniband/verbs.h>
 #include <iostream>
 
-int main() {
+#include "buf_pool.h"
+#include "recv_pool.h"
+#include "send_engine.h"
+#include "verbs.h"
+
+#define IB_PORT 1
+#define GID_INDEX 1
+#define QKEY 0x11111111
+#define GRH_SIZE 40
+#define RECV_SLOTS 512
+#define RECV_SLOT_SIZE (GRH_SIZE + 4096)
+#define RECV_REFILL_BATCH 32
+#define SEND_MSG_SIZE 2048
+#define POLL_BATCH 32
+#define SEND_QUEUE_DEPTH 256
+#define SEND_BATCH 32
+#define SIGNAL_INTERVAL 32
+#define DRAIN_QUIET_MS 100
+
+// Reaps up to POLL_BATCH receive completions, counting the successful ones
+// in *received and handing every buffer back to the pool. Returns the
+// number reaped, or -1 if polling failed.
+static int reap_recvs(Cq &cq, recv_pool *pool, uint64_t *received) {
+  ibv_wc wcs[POLL_BATCH];
+  int n = cq.poll(POLL_BATCH, wcs);
+  if (n < 0) {
+    std::cerr << "ibv_poll_cq failed\n";
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (wcs[i].status == IBV_WC_SUCCESS) {
+      (*received)++;
+    }
+    recv_pool_release(pool, wcs[i].wr_id);
+  }
+  return n;
+}
+
+int main(int argc, char *argv[]) {
+  // Optional send engine run after the single message test
+  uint64_t stream_count = (argc > 1) ? strtoull(argv[1], nullptr, 10) : 0;
+  uint32_t stream_size = (argc > 2) ? atoi(argv[2]) : 1024;
+
   // 1. Open device
   std::cout << "Opening device\n";
-  ibv_device **dev_list = ibv_get_device_list(nullptr);
-  if (!dev_list) {
-    perror("ibv_get_device_list");
+  Device dev = Device::open();
+  if (!dev) {
     return 1;
   }
   std::cout << "Available devices:\n";
-  for (int i = 0; dev_list[i]; ++i) {
-    std::cout << "  [" << i << "] " << ibv_get_device_name(dev_list[i]) << "\n";
-  }
-  ibv_context *ctx = ibv_open_device(dev_list[0]);
-  if (!ctx) {
-    perror("ibv_open_device");
-    return 1;
+  for (int i = 0; i < dev.num_devices(); ++i) {
+    std::cout << "  [" << i << "] " << ibv_get_device_name(dev.device_at(i))
+              << "\n";
   }
-  std::cout << "Opened device: " << ibv_get_device_name(dev_list[0]) << "\n";
+  std::cout << "Opened device: " << dev.name() << "\n";
 
   // 2. Allocate protection domain
   std::cout << "Allocating protection domain\n";
-  ibv_pd *pd = ibv_alloc_pd(ctx);
+  Pd pd = Pd::alloc(dev);
   if (!pd) {
-    perror("ibv_alloc_pd");
-    return 1;
-  }
-
-  // 3. Create completion queue
-  ibv_cq *send_cq = ibv_create_cq(ctx, 1, nullptr, nullptr, 0);
-  if (!send_cq) {
-    perror("ibv_create_cq send");
-    return 1;
-  }
-  ibv_cq *recv_cq = ibv_create_cq(ctx, 1, nullptr, nullptr, 0);
-  if (!recv_cq) {
-    perror("ibv_create_cq recv");
     return 1;
   }
 
-  // 4. Create QP
-  std::cout << "Create QP...\n";
-  ibv_qp_init_attr qp_attr{};
-  qp_attr.send_cq = send_cq;
-  qp_attr.recv_cq = send_cq;
-  qp_attr.qp_type = IBV_QPT_UD;
-  qp_attr.cap.max_send_wr = 1;
-  qp_attr.cap.max_recv_wr = 1;
-  qp_attr.cap.max_send_sge = 1;
-  qp_attr.cap.max_recv_sge = 1;
-
-  ibv_qp *qp1 = ibv_create_qp(pd, &qp_attr);
-  if (!qp1) {
-    perror("ibv_create_qp qp1");
-    return 1;
-  }
-  qp_attr.send_cq = recv_cq;
-  qp_attr.recv_cq = recv_cq;
-  ibv_qp *qp2 = ibv_create_qp(pd, &qp_attr);
-  if (!qp2) {
-    perror("ibv_create_qp qp2");
+  // 3. Create completion queues
+  Cq send_cq = Cq::create(dev, SEND_QUEUE_DEPTH);
+  Cq recv_cq = Cq::create(dev, RECV_SLOTS);
+  if (!send_cq || !recv_cq) {
     return 1;
   }
 
-  // 5. Allocate memory
+  // 4. Allocate memory: one pool, registered once, for the receive slots,
+  // the test message and the send engine's buffers
   std::cout << "Allocate memory...\n";
-  char send_buf[2048] = "Hello verbs";
-  char recv_buf[2048] = {};
+  buf_pool_config buf_cfg{};
+  buf_cfg.num_slots = RECV_SLOTS + 1 + SEND_QUEUE_DEPTH;
+  buf_cfg.slot_size = RECV_SLOT_SIZE;
+  buf_cfg.numa_node = -1;
+  buf_cfg.access = IBV_ACCESS_LOCAL_WRITE;
 
   std::cout << "Register w/ protection domain...\n";
-  ibv_mr *send_mr =
-      ibv_reg_mr(pd, send_buf, sizeof(send_buf), IBV_ACCESS_LOCAL_WRITE);
-  if (!send_mr) {
-    perror("ibv_reg_mr send");
-    return 1;
-  }
-  ibv_mr *recv_mr =
-      ibv_reg_mr(pd, recv_buf, sizeof(recv_buf),
-                 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
-  if (!recv_mr) {
-    perror("ibv_reg_mr recv");
+  buf_pool bufs;
+  if (buf_pool_init(&bufs, pd, &buf_cfg)) {
     return 1;
   }
+  auto bufs_guard = on_scope_exit([&] { buf_pool_destroy(&bufs); });
+  buf_pool_report(&bufs, "Buffers");
 
-  std::cout << "Move to init...\n";
-  ibv_qp_attr attr{};
-  attr.qp_state = IBV_QPS_INIT;
-  attr.port_num = 1;
-  attr.qkey = 0x11111111;
-  attr.pkey_index = 0;
-  if (ibv_modify_qp(qp1, &attr,
-                    IBV_QP_STATE | IBV_QP_PORT | IBV_QP_QKEY |
-                        IBV_QP_PKEY_INDEX)) {
-    perror("ibv_modify_qp qp1 INIT");
-    return 1;
-  }
-  if (ibv_modify_qp(qp2, &attr,
-                    IBV_QP_STATE | IBV_QP_PORT | IBV_QP_QKEY |
-                        IBV_QP_PKEY_INDEX)) {
-    perror("ibv_modify_qp qp2 INIT");
-    return 1;
-  }
+  uint32_t send_slot = buf_pool_alloc(&bufs);
+  char *send_buf = buf_pool_addr(&bufs, send_slot);
+  strcpy(send_buf, "Hello verbs");
 
-  std::cout << "Move to RTR\n";
-  memset(&attr, 0, sizeof(attr));
-  attr.qp_state = IBV_QPS_RTR;
-  if (ibv_modify_qp(qp1, &attr, IBV_QP_STATE)) {
-    perror("ibv_modify_qp qp1 RTR");
-    return 1;
-  }
-  if (ibv_modify_qp(qp2, &attr, IBV_QP_STATE)) {
-    perror("ibv_modify_qp qp2 RTR");
+  // 5. Create two UD QPs, qp1 sending on send_cq and qp2 receiving on
+  // recv_cq, and bring both up to RTS
+  std::cout << "Create QP...\n";
+  QpBuilder qp_builder = QpBuilder::ud(pd)
+                             .depth(SEND_QUEUE_DEPTH, RECV_SLOTS)
+                             .sig_all(false);
+  Qp qp1 = qp_builder.cq(send_cq).create();
+  Qp qp2 = qp_builder.cq(recv_cq).create();
+  if (!qp1 || !qp2) {
     return 1;
   }
 
   std::cout << "Move to RTS\n";
-  attr.qp_state = IBV_QPS_RTS;
-  attr.sq_psn = 0;
-  if (ibv_modify_qp(qp1, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
-    perror("ibv_modify_qp qp1 RTS");
-    return 1;
-  }
-  if (ibv_modify_qp(qp2, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
-    perror("ibv_modify_qp qp2 RTS");
+  if (qp1.ready_ud(IB_PORT, QKEY) || qp2.ready_ud(IB_PORT, QKEY)) {
     return 1;
   }
 
   std::cout << "Create receive\n";
-  ibv_sge sge_recv{};
-  sge_recv.addr = (uintptr_t)recv_buf;
-  sge_recv.length = sizeof(recv_buf);
-  sge_recv.lkey = recv_mr->lkey;
-
-  ibv_recv_wr recv_wr{};
-  recv_wr.sg_list = &sge_recv;
-  recv_wr.num_sge = 1;
-  recv_wr.next = nullptr;
-  ibv_recv_wr *bad_recv;
-  if (ibv_post_recv(qp2, &recv_wr, &bad_recv)) {
-    perror("ibv_post_recv");
+  recv_pool_config pool_cfg{};
+  pool_cfg.num_slots = RECV_SLOTS;
+  pool_cfg.slot_size = RECV_SLOT_SIZE;
+  pool_cfg.refill_batch = RECV_REFILL_BATCH;
+
+  recv_pool pool;
+  if (recv_pool_init(&pool, &bufs, qp2, nullptr, &pool_cfg)) {
     return 1;
   }
+  auto pool_guard = on_scope_exit([&] { recv_pool_destroy(&pool); });
 
   std::cout << "Create AH...\n";
   union ibv_gid gid;
-  if (ibv_query_gid(ctx, 1, 1, &gid)) {
+  if (ibv_query_gid(dev, IB_PORT, GID_INDEX, &gid)) {
     perror("ibv_query_gid");
     return 1;
   }
 
-  ibv_ah_attr ah_attr{};
-  ah_attr.is_global = 1;
-  ah_attr.dlid = 0;
-  ah_attr.sl = 0;
-  ah_attr.port_num = 1;
-  ah_attr.grh.dgid = gid;
-  ah_attr.grh.flow_label = 0;
-  ah_attr.grh.sgid_index = 1;
-  ah_attr.grh.hop_limit = 64;
-  ah_attr.grh.traffic_class = 0;
-
-  ibv_ah *ah = ibv_create_ah(pd, &ah_attr);
+  Ah ah = Ah::to_gid(pd, IB_PORT, gid, GID_INDEX);
   if (!ah) {
-    perror("ibv_create_ah failed");
     return 1;
   }
 
   std::cout << "Create send\n";
   ibv_sge sge_send{};
   sge_send.addr = (uintptr_t)send_buf;
-  sge_send.length = sizeof(send_buf);
-  sge_send.lkey = send_mr->lkey;
+  sge_send.length = SEND_MSG_SIZE;
+  sge_send.lkey = buf_pool_lkey(&bufs);
 
   std::cout << "Create send WR\n";
   ibv_send_wr send_wr{};
@@ -182,13 +150,12 @@ int main() {
   send_wr.opcode = IBV_WR_SEND;
   send_wr.send_flags = IBV_SEND_SIGNALED;
   send_wr.wr.ud.ah = ah;
-  send_wr.wr.ud.remote_qpn = qp2->qp_num;
-  send_wr.wr.ud.remote_qkey = 0x11111111;
+  send_wr.wr.ud.remote_qpn = qp2.qpn();
+  send_wr.wr.ud.remote_qkey = QKEY;
   send_wr.next = nullptr;
 
-  ibv_send_wr *bad_send;
   std::cout << "posting send...\n";
-  if (ibv_post_send(qp1, &send_wr, &bad_send)) {
+  if (qp1.post_send(&send_wr)) {
     perror("ibv_post_send");
     return 1;
   }
@@ -197,11 +164,15 @@ int main() {
   ibv_wc wc;
   int num_completions = 0;
   while (num_completions == 0) {
-    num_completions = ibv_poll_cq(recv_cq, 1, &wc);
+    num_completions = recv_cq.poll(1, &wc);
+  }
+  if (num_completions < 0) {
+    std::cerr << "ibv_poll_cq failed\n";
+    return 1;
   }
 
   std::cout << "Finished...\n";
-  std::cout << "Received message: " << recv_buf << std::endl;
+  char *recv_buf = recv_pool_buf(&pool, wc.wr_id);
 
   if (num_completions > 0) {
     if (wc.status == IBV_WC_SUCCESS) {
@@ -228,17 +199,81 @@ int main() {
   } else {
     std::cout << "Timeout waiting for completion" << std::endl;
   }
+  recv_pool_release(&pool, wc.wr_id);
+
+  // Stream messages from qp1 to qp2 through the batched send engine, in
+  // batch-sized chunks so qp2's receive buffers are reposted as they are
+  // consumed. UD drops anything that arrives with no buffer posted.
+  if (stream_count > 0) {
+    std::cout << "\nStreaming " << stream_count << " messages of "
+              << stream_size << " bytes...\n";
+
+    send_engine_config eng_cfg{};
+    eng_cfg.sq_depth = SEND_QUEUE_DEPTH;
+    eng_cfg.batch = SEND_BATCH;
+    eng_cfg.signal_interval = SIGNAL_INTERVAL;
+    eng_cfg.buf_size = stream_size;
+
+    send_engine eng;
+    if (send_engine_init(&eng, &bufs, qp1, send_cq, &eng_cfg)) {
+      return 1;
+    }
+    auto eng_guard = on_scope_exit([&] { send_engine_destroy(&eng); });
+    send_engine_set_ud_dest(&eng, ah, qp2.qpn(), QKEY);
+
+    uint64_t received = 0, reaped = 0;
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t sent = 0; sent < stream_count; sent += SEND_BATCH) {
+      uint64_t chunk = std::min<uint64_t>(SEND_BATCH, stream_count - sent);
+      if (send_engine_post(&eng, chunk, stream_size) < 0) {
+        break;
+      }
+
+      int n = reap_recvs(recv_cq, &pool, &received);
+      if (n < 0) {
+        return 1;
+      }
+      reaped += n;
+      recv_pool_replenish(&pool, false);
+    }
+    if (send_engine_drain(&eng) < 0) {
+      std::cout << "Send engine failed after " << eng.completed
+                << " messages (" << eng.errors << " errors)\n";
+    }
+
+    // Collect whatever is still in flight to qp2: a completion for every
+    // message sent, unless none arrives for DRAIN_QUIET_MS, as UD drops
+    // messages that found no buffer posted without a completion
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    while (reaped < eng.completed) {
+      int n = reap_recvs(recv_cq, &pool, &received);
+      if (n < 0) {
+        return 1;
+      }
+      timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (n > 0) {
+        reaped += n;
+        end = now;
+      } else if ((now.tv_sec - end.tv_sec) * 1000 +
+                     (now.tv_nsec - end.tv_nsec) / 1000000 >=
+                 DRAIN_QUIET_MS) {
+        break;
+      }
+    }
 
-  // Cleanup
-  ibv_dereg_mr(send_mr);
-  ibv_dereg_mr(recv_mr);
-  ibv_destroy_qp(qp1);
-  ibv_destroy_qp(qp2);
-  ibv_destroy_cq(send_cq);
-  ibv_destroy_cq(recv_cq);
-  ibv_dealloc_pd(pd);
-  ibv_close_device(ctx);
-  ibv_free_device_list(dev_list);
+    double elapsed =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    std::cout << "Sent " << eng.completed << " messages in " << elapsed
+              << " s: " << eng.completed / elapsed << " msg/s, "
+              << eng.completed * stream_size / elapsed / 1e9 << " GB/s\n";
+    std::cout << "Received " << received << " ("
+              << (eng.completed - received) << " dropped for lack of a "
+              << "posted buffer)\n";
+  }
 
+  // Cleanup: everything else goes in reverse order as it leaves scope
+  buf_pool_free(&bufs, send_slot);
   return 0;
 }
@@ -0,0 +1,364 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lat_hist.h"
+
+// Hot-path metrics, exported in the Prometheus text format.
+//
+// Every thread on the data path owns a metrics_thread: its counters and a
+// latency histogram per pipeline stage, on cache lines no other thread
+// writes. The owner updates them with plain stores (relaxed atomics, never
+// a locked instruction) and nothing is summed on the hot path. Blocks are
+// registered once, off the hot path, with the queue they work for.
+//
+// The endpoint runs on its own thread and, on each scrape, adds up the
+// registered blocks while their owners keep writing: counters per queue,
+// histograms per stage over all queues. A scrape may catch one counter a
+// packet or two ahead of another, never a torn value. It answers any HTTP
+// request on "unix:/path", "host:port" or ":port" with the whole
+// exposition, which is enough for Prometheus and for
+// curl --unix-socket /path http://localhost/metrics.
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+#define METRICS_MAX_THREADS 256
+#define METRICS_MAX_QUEUES 64
+#define METRICS_POLL_MS 100       // how often the endpoint checks for stop
+#define METRICS_REQUEST_MS 1000   // how long a client may take to ask
+#define METRICS_MAX_REQUEST 4096
+
+enum metric_stage {
+  METRIC_RECV,       // kernel receive timestamp to in the ring
+  METRIC_PARSE,      // header checks: once per batch, time / packets
+  METRIC_QUEUE_WAIT, // in the ring to processing starting
+  METRIC_PROCESS,    // processing one packet
+  METRIC_NUM_STAGES
+};
+
+enum metric_counter {
+  METRIC_RECEIVED,
+  METRIC_RECEIVED_BYTES,
+  METRIC_DROPPED,
+  METRIC_RECV_CALLS,
+  METRIC_BAD_FRAMES,
+  METRIC_PROCESSED,
+  METRIC_NUM_COUNTERS
+};
+
+static const char *const metric_stage_names[METRIC_NUM_STAGES] = {
+    "recv", "parse", "queue_wait", "process"};
+
+static const char *const metric_counter_names[METRIC_NUM_COUNTERS][2] = {
+    {"received_packets_total", "Datagrams received into the ring"},
+    {"received_bytes_total", "Bytes of the datagrams received"},
+    {"dropped_packets_total", "Datagrams discarded because the ring was full"},
+    {"recv_calls_total", "Receive calls that returned datagrams"},
+    {"bad_frames_total", "Datagrams the parser rejected"},
+    {"processed_packets_total", "Packets processed"}};
+
+// Histogram bucket bounds exported, in seconds
+static const double metric_bounds[] = {1e-6,   2.5e-6, 5e-6,   1e-5,  2.5e-5,
+                                       5e-5,   1e-4,   2.5e-4, 5e-4,  1e-3,
+                                       2.5e-3, 5e-3,   1e-2,   2.5e-2, 5e-2,
+                                       0.1,    0.25,   0.5,    1.0};
+
+struct metrics_thread {
+  alignas(CACHE_LINE_SIZE) uint64_t counters[METRIC_NUM_COUNTERS];
+  struct lat_hist stages[METRIC_NUM_STAGES];
+};
+
+struct metrics_entry {
+  const struct metrics_thread *m;
+  int queue;
+};
+
+// Appends gauges or anything else to a scrape
+typedef void (*metrics_extra_fn)(void *arg, FILE *out, const char *prefix);
+
+struct metrics_registry {
+  const char *prefix; // of every metric name
+  pthread_mutex_t lock;
+  struct metrics_entry entries[METRICS_MAX_THREADS];
+  int num_entries;
+  metrics_extra_fn extra;
+  void *extra_arg;
+
+  int listen_fd;
+  pthread_t thread;
+  int running;
+  int stop;
+};
+
+static inline void metrics_thread_reset(struct metrics_thread *m) {
+  memset(m->counters, 0, sizeof(m->counters));
+  for (int i = 0; i < METRIC_NUM_STAGES; i++)
+    lat_hist_reset(&m->stages[i]);
+}
+
+// Owner only
+static inline void metrics_add(struct metrics_thread *m,
+                               enum metric_counter c, uint64_t n) {
+  __atomic_store_n(&m->counters[c], m->counters[c] + n, __ATOMIC_RELAXED);
+}
+
+// Owner only
+static inline void metrics_record(struct metrics_thread *m,
+                                  enum metric_stage s, uint64_t ns) {
+  lat_hist_record_shared(&m->stages[s], ns);
+}
+
+// Any thread
+static inline uint64_t metrics_get(const struct metrics_thread *m,
+                                   enum metric_counter c) {
+  return __atomic_load_n(&m->counters[c], __ATOMIC_RELAXED);
+}
+
+static inline void metrics_init(struct metrics_registry *reg,
+                                const char *prefix) {
+  memset(reg, 0, sizeof(*reg));
+  reg->prefix = prefix;
+  reg->listen_fd = -1;
+  pthread_mutex_init(&reg->lock, NULL);
+}
+
+// Adds m, working for queue, to what is exported. Returns 0, or -1 when
+// the registry is full.
+static inline int metrics_register(struct metrics_registry *reg,
+                                   const struct metrics_thread *m,
+                                   int queue) {
+  int ret = -1;
+  pthread_mutex_lock(&reg->lock);
+  if (reg->num_entries < METRICS_MAX_THREADS && queue >= 0 &&
+      queue < METRICS_MAX_QUEUES) {
+    reg->entries[reg->num_entries].m = m;
+    reg->entries[reg->num_entries].queue = queue;
+    reg->num_entries++;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&reg->lock);
+  if (ret < 0)
+    fprintf(stderr, "metrics: cannot register a thread of queue %d\n",
+            queue);
+  return ret;
+}
+
+// Writes the exposition: counters by queue, then stage histograms
+static inline void metrics_write(struct metrics_registry *reg, FILE *out) {
+  const char *prefix = reg->prefix;
+
+  pthread_mutex_lock(&reg->lock);
+  int num_queues = 0;
+  for (int i = 0; i < reg->num_entries; i++) {
+    if (reg->entries[i].queue >= num_queues)
+      num_queues = reg->entries[i].queue + 1;
+  }
+
+  for (int c = 0; c < METRIC_NUM_COUNTERS; c++) {
+    uint64_t sums[METRICS_MAX_QUEUES] = {0};
+    for (int i = 0; i < reg->num_entries; i++)
+      sums[reg->entries[i].queue] +=
+          metrics_get(reg->entries[i].m, (enum metric_counter)c);
+
+    fprintf(out, "# HELP %s_%s %s\n# TYPE %s_%s counter\n", prefix,
+            metric_counter_names[c][0], metric_counter_names[c][1], prefix,
+            metric_counter_names[c][0]);
+    for (int q = 0; q < num_queues; q++)
+      fprintf(out, "%s_%s{queue=\"%d\"} %llu\n", prefix,
+              metric_counter_names[c][0], q, (unsigned long long)sums[q]);
+  }
+
+  // 9 KB each, so merged one stage at a time
+  struct lat_hist *h = (struct lat_hist *)malloc(sizeof(*h));
+  fprintf(out, "# HELP %s_stage_seconds Time spent per packet in each "
+               "stage\n# TYPE %s_stage_seconds histogram\n",
+          prefix, prefix);
+  for (int s = 0; h && s < METRIC_NUM_STAGES; s++) {
+    lat_hist_reset(h);
+    for (int i = 0; i < reg->num_entries; i++)
+      lat_hist_merge_shared(h, &reg->entries[i].m->stages[s]);
+
+    const char *stage = metric_stage_names[s];
+    for (size_t b = 0; b < sizeof(metric_bounds) / sizeof(metric_bounds[0]);
+         b++)
+      fprintf(out, "%s_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+              prefix, stage, metric_bounds[b],
+              (unsigned long long)lat_hist_count_upto(
+                  h, (uint64_t)(metric_bounds[b] * 1e9 + 0.5)));
+    fprintf(out, "%s_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+            prefix, stage, (unsigned long long)h->count);
+    fprintf(out, "%s_stage_seconds_sum{stage=\"%s\"} %.9f\n", prefix, stage,
+            h->sum / 1e9);
+    fprintf(out, "%s_stage_seconds_count{stage=\"%s\"} %llu\n", prefix,
+            stage, (unsigned long long)h->count);
+  }
+  free(h);
+  pthread_mutex_unlock(&reg->lock);
+
+  if (reg->extra)
+    reg->extra(reg->extra_arg, out, prefix);
+}
+
+// Listens on "unix:/path", "host:port" or ":port" (any address). Returns
+// the socket, or -1.
+static inline int metrics_listen(const char *addr) {
+  struct sockaddr_storage ss;
+  socklen_t len;
+  memset(&ss, 0, sizeof(ss));
+
+  if (strncmp(addr, "unix:", 5) == 0) {
+    struct sockaddr_un *un = (struct sockaddr_un *)&ss;
+    if (strlen(addr + 5) >= sizeof(un->sun_path)) {
+      fprintf(stderr, "metrics: socket path too long: %s\n", addr + 5);
+      return -1;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, addr + 5);
+    len = sizeof(*un);
+    unlink(un->sun_path);
+  } else {
+    const char *colon = strrchr(addr, ':');
+    char host[256];
+    size_t n = colon ? (size_t)(colon - addr) : 0;
+    if (!colon || !colon[1] || n >= sizeof(host)) {
+      fprintf(stderr, "metrics: bad address: %s\n", addr);
+      return -1;
+    }
+    memcpy(host, addr, n);
+    host[n] = '\0';
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *res;
+    int ret = getaddrinfo(n ? host : NULL, colon + 1, &hints, &res);
+    if (ret) {
+      fprintf(stderr, "metrics: %s: %s\n", addr, gai_strerror(ret));
+      return -1;
+    }
+    memcpy(&ss, res->ai_addr, res->ai_addrlen);
+    len = res->ai_addrlen;
+    freeaddrinfo(res);
+  }
+
+  int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("metrics: socket");
+    return -1;
+  }
+  int one = 1;
+  if (ss.ss_family != AF_UNIX)
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *)&ss, len) || listen(fd, 16)) {
+    fprintf(stderr, "metrics: cannot listen on %s: %s\n", addr,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Reads the request up to its blank line, then sends the exposition
+static inline void metrics_serve(struct metrics_registry *reg, int fd) {
+  char req[METRICS_MAX_REQUEST];
+  size_t got = 0;
+  while (got < sizeof(req) - 1) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, METRICS_REQUEST_MS) <= 0)
+      return;
+    ssize_t n = recv(fd, req + got, sizeof(req) - 1 - got, 0);
+    if (n <= 0)
+      return;
+    got += n;
+    req[got] = '\0';
+    if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+      break;
+  }
+
+  char *body = NULL;
+  size_t body_len = 0;
+  FILE *out = open_memstream(&body, &body_len);
+  if (!out)
+    return;
+  metrics_write(reg, out);
+  fclose(out);
+
+  char head[160];
+  int head_len = snprintf(head, sizeof(head),
+                          "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\n\r\n",
+                          body_len);
+  if (send(fd, head, head_len, MSG_NOSIGNAL) == head_len) {
+    for (size_t sent = 0; sent < body_len;) {
+      ssize_t n = send(fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+      if (n <= 0)
+        break;
+      sent += n;
+    }
+  }
+  free(body);
+}
+
+static inline void *metrics_thread_main(void *arg) {
+  struct metrics_registry *reg = (struct metrics_registry *)arg;
+
+  while (!__atomic_load_n(&reg->stop, __ATOMIC_RELAXED)) {
+    struct pollfd pfd = {reg->listen_fd, POLLIN, 0};
+    if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+      continue;
+    int fd = accept4(reg->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+      continue;
+    metrics_serve(reg, fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+// Serves the registry on addr from a new thread until metrics_stop().
+// Returns 0, or -1 on error.
+static inline int metrics_start(struct metrics_registry *reg,
+                                const char *addr) {
+  reg->listen_fd = metrics_listen(addr);
+  if (reg->listen_fd < 0)
+    return -1;
+
+  reg->stop = 0;
+  int ret = pthread_create(&reg->thread, NULL, metrics_thread_main, reg);
+  if (ret != 0) {
+    errno = ret;
+    perror("metrics: pthread_create");
+    close(reg->listen_fd);
+    reg->listen_fd = -1;
+    return -1;
+  }
+  reg->running = 1;
+  return 0;
+}
+
+static inline void metrics_stop(struct metrics_registry *reg) {
+  if (!reg->running)
+    return;
+  __atomic_store_n(&reg->stop, 1, __ATOMIC_RELAXED);
+  pthread_join(reg->thread, NULL);
+  close(reg->listen_fd);
+  reg->listen_fd = -1;
+  reg->running = 0;
+}
+
+#endif
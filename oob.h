@@ -0,0 +1,423 @@
+#ifndef OOB_H
+#define OOB_H
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "verbs.h"
+
+// Out-of-band connection setup.
+//
+// Before two QPs can talk, each side needs the other's QPN, LID/GID, PSN
+// and Q_Key, and the rkey, address and layout of any buffer it may write
+// into. These are swapped as one fixed-size message each way over a TCP or
+// Unix socket side channel: the client connects and sends its QpEndpoint,
+// the server answers with its own. Addresses are "host:port", ":port" (any
+// local address, for listening), "[v6addr]:port" or "unix:/path".
+//
+// oob_server runs the server side on its own thread and serves many
+// clients at once: it polls every pending connection, so a slow client
+// does not hold up the others, and calls back once per client with that
+// client's endpoint for the reply. oob_connect() retries until the server
+// is listening, so both ends can be started in any order by a script.
+
+#define OOB_DEFAULT_PORT "18515"
+#define OOB_MAGIC 0x4f4f4231 // "OOB1"
+#define OOB_MAX_PENDING 64   // connections being read at once
+#define OOB_POLL_MS 100      // how often the server checks for stop
+
+// QpEndpoint on the wire, every field big-endian
+#pragma pack(push, 1)
+struct oob_wire {
+  uint32_t magic;
+  uint32_t qpn;
+  uint32_t psn;
+  uint32_t qkey;
+  uint32_t rkey;
+  uint64_t addr;
+  uint32_t length;
+  uint32_t slots;
+  uint16_t lid;
+  uint8_t gid[16];
+};
+#pragma pack(pop)
+
+static inline void oob_pack(const QpEndpoint *ep, struct oob_wire *w) {
+  w->magic = htonl(OOB_MAGIC);
+  w->qpn = htonl(ep->qpn);
+  w->psn = htonl(ep->psn);
+  w->qkey = htonl(ep->qkey);
+  w->rkey = htonl(ep->rkey);
+  w->addr = htobe64(ep->addr);
+  w->length = htonl(ep->length);
+  w->slots = htonl(ep->slots);
+  w->lid = htons(ep->lid);
+  memcpy(w->gid, ep->gid.raw, sizeof(w->gid));
+}
+
+// Returns 0, or -1 if w is not an endpoint message
+static inline int oob_unpack(const struct oob_wire *w, QpEndpoint *ep) {
+  if (ntohl(w->magic) != OOB_MAGIC) {
+    fprintf(stderr, "oob: bad message from peer\n");
+    return -1;
+  }
+  ep->qpn = ntohl(w->qpn);
+  ep->psn = ntohl(w->psn);
+  ep->qkey = ntohl(w->qkey);
+  ep->rkey = ntohl(w->rkey);
+  ep->addr = be64toh(w->addr);
+  ep->length = ntohl(w->length);
+  ep->slots = ntohl(w->slots);
+  ep->lid = ntohs(w->lid);
+  memcpy(ep->gid.raw, w->gid, sizeof(w->gid));
+  return 0;
+}
+
+// One-line description of ep, for logs
+static inline const char *oob_endpoint_str(const QpEndpoint *ep, char *buf,
+                                           size_t size) {
+  char gid[INET6_ADDRSTRLEN];
+  inet_ntop(AF_INET6, ep->gid.raw, gid, sizeof(gid));
+  snprintf(buf, size, "QPN 0x%06x PSN 0x%06x LID %u GID %s", ep->qpn,
+           ep->psn, ep->lid, gid);
+  return buf;
+}
+
+#define OOB_MAX_ADDRS 4
+
+struct oob_addr {
+  int family;
+  socklen_t len;
+  struct sockaddr_storage sa;
+};
+
+// Resolves addr into up to OOB_MAX_ADDRS socket addresses, IPv6 first.
+// passive is for listening, where an empty host means any address; for
+// connecting it means this host. Returns the number found, or -1.
+static inline int oob_resolve(const char *addr, int passive,
+                              struct oob_addr *out) {
+  memset(out, 0, sizeof(*out) * OOB_MAX_ADDRS);
+
+  if (strncmp(addr, "unix:", 5) == 0) {
+    struct sockaddr_un *un = (struct sockaddr_un *)&out[0].sa;
+    if (strlen(addr + 5) >= sizeof(un->sun_path)) {
+      fprintf(stderr, "oob: socket path too long: %s\n", addr + 5);
+      return -1;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, addr + 5);
+    out[0].family = AF_UNIX;
+    out[0].len = sizeof(*un);
+    return 1;
+  }
+
+  // host:port, [host]:port, :port or just host
+  char host[256];
+  const char *port = OOB_DEFAULT_PORT;
+  const char *colon;
+  if (addr[0] == '[') {
+    const char *end = strchr(addr, ']');
+    if (!end || (size_t)(end - addr - 1) >= sizeof(host)) {
+      fprintf(stderr, "oob: bad address: %s\n", addr);
+      return -1;
+    }
+    memcpy(host, addr + 1, end - addr - 1);
+    host[end - addr - 1] = '\0';
+    colon = end[1] == ':' ? end + 1 : NULL;
+  } else {
+    colon = strrchr(addr, ':');
+    size_t n = colon ? (size_t)(colon - addr) : strlen(addr);
+    if (n >= sizeof(host)) {
+      fprintf(stderr, "oob: bad address: %s\n", addr);
+      return -1;
+    }
+    memcpy(host, addr, n);
+    host[n] = '\0';
+  }
+  if (colon && colon[1])
+    port = colon + 1;
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+  struct addrinfo *res;
+  int ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+  if (ret) {
+    fprintf(stderr, "oob: %s: %s\n", addr, gai_strerror(ret));
+    return -1;
+  }
+
+  int n = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (struct addrinfo *ai = res; ai && n < OOB_MAX_ADDRS; ai = ai->ai_next) {
+      if ((ai->ai_family == AF_INET6) != (pass == 0))
+        continue;
+      out[n].family = ai->ai_family;
+      out[n].len = ai->ai_addrlen;
+      memcpy(&out[n].sa, ai->ai_addr, ai->ai_addrlen);
+      n++;
+    }
+  }
+  freeaddrinfo(res);
+  return n;
+}
+
+// Reads or writes exactly len bytes, waiting at most timeout_ms for each
+// chunk. Returns 0, or -1 on error, timeout or EOF.
+static inline int oob_io(int fd, void *buf, size_t len, int writing,
+                         int timeout_ms) {
+  char *p = (char *)buf;
+  while (len > 0) {
+    struct pollfd pfd = {fd, (short)(writing ? POLLOUT : POLLIN), 0};
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      fprintf(stderr, "oob: %s\n", ret == 0 ? "peer timed out" : "poll");
+      return -1;
+    }
+
+    ssize_t n = writing ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (n <= 0) {
+      fprintf(stderr, "oob: %s\n", n == 0 ? "peer closed the connection"
+                                          : strerror(errno));
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Listens on addr; on both IPv6 and IPv4 when the host is left out.
+// Returns the socket, or -1.
+static inline int oob_listen(const char *addr) {
+  struct oob_addr addrs[OOB_MAX_ADDRS];
+  if (oob_resolve(addr, 1, addrs) <= 0)
+    return -1;
+  struct oob_addr *a = &addrs[0];
+
+  int fd = socket(a->family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("oob: socket");
+    return -1;
+  }
+  int one = 1, zero = 0;
+  if (a->family == AF_UNIX) {
+    unlink(((struct sockaddr_un *)&a->sa)->sun_path);
+  } else {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (a->family == AF_INET6)
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+  }
+
+  if (bind(fd, (struct sockaddr *)&a->sa, a->len) ||
+      listen(fd, SOMAXCONN)) {
+    fprintf(stderr, "oob: cannot listen on %s: %s\n", addr, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Connects to addr, trying each address it resolves to, until the server
+// is listening or timeout_ms has passed. Returns the socket, or -1.
+static inline int oob_connect(const char *addr, int timeout_ms) {
+  struct oob_addr addrs[OOB_MAX_ADDRS];
+  int num_addrs = oob_resolve(addr, 0, addrs);
+  if (num_addrs <= 0)
+    return -1;
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (;;) {
+    int err = 0;
+    for (int i = 0; i < num_addrs; i++) {
+      int fd = socket(addrs[i].family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0) {
+        err = errno;
+        continue;
+      }
+      if (connect(fd, (struct sockaddr *)&addrs[i].sa, addrs[i].len) == 0)
+        return fd;
+      err = errno;
+      close(fd);
+    }
+
+    // Not listening yet is worth waiting for; anything else is not
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
+                      (now.tv_nsec - start.tv_nsec) / 1000000;
+    if ((err != ECONNREFUSED && err != ENOENT) || elapsed_ms >= timeout_ms) {
+      fprintf(stderr, "oob: cannot connect to %s: %s\n", addr,
+              strerror(err));
+      return -1;
+    }
+    usleep(OOB_POLL_MS * 1000);
+  }
+}
+
+// Client side: connects to addr, sends local and receives the server's
+// endpoint into remote. Returns 0, or -1 on error.
+static inline int oob_exchange(const char *addr, const QpEndpoint *local,
+                               QpEndpoint *remote, int timeout_ms) {
+  int fd = oob_connect(addr, timeout_ms);
+  if (fd < 0)
+    return -1;
+
+  struct oob_wire w;
+  oob_pack(local, &w);
+  int ret = oob_io(fd, &w, sizeof(w), 1, timeout_ms);
+  if (ret == 0)
+    ret = oob_io(fd, &w, sizeof(w), 0, timeout_ms);
+  if (ret == 0)
+    ret = oob_unpack(&w, remote);
+  close(fd);
+  return ret;
+}
+
+// Called on the server thread once per client with its endpoint. Fills
+// in reply and returns 0, or returns -1 to turn the client away (its
+// connection is closed without a reply).
+typedef int (*oob_client_fn)(void *arg, const QpEndpoint *remote,
+                             QpEndpoint *reply);
+
+struct oob_conn {
+  int fd;
+  size_t got; // bytes of msg read so far
+  struct oob_wire msg;
+};
+
+struct oob_server {
+  int listen_fd;
+  oob_client_fn fn;
+  void *arg;
+  pthread_t thread;
+  int running;
+  int stop;
+
+  struct oob_conn conns[OOB_MAX_PENDING];
+  int num_conns;
+  uint64_t clients; // answered
+  uint64_t rejected;
+};
+
+static inline void oob_server_drop(struct oob_server *srv, int i) {
+  close(srv->conns[i].fd);
+  srv->conns[i] = srv->conns[--srv->num_conns];
+}
+
+// Reads what has arrived on conns[i] and answers once the whole message is
+// in. Returns 1 if the connection is finished (and dropped), 0 if not.
+static inline int oob_server_read(struct oob_server *srv, int i) {
+  struct oob_conn *c = &srv->conns[i];
+  ssize_t n = recv(c->fd, (char *)&c->msg + c->got, sizeof(c->msg) - c->got,
+                   MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+  if (n <= 0) {
+    srv->rejected++;
+    oob_server_drop(srv, i);
+    return 1;
+  }
+  c->got += n;
+  if (c->got < sizeof(c->msg))
+    return 0;
+
+  QpEndpoint remote, reply = {};
+  if (oob_unpack(&c->msg, &remote) || srv->fn(srv->arg, &remote, &reply)) {
+    srv->rejected++;
+  } else {
+    // The reply is far smaller than a socket buffer, so this cannot block
+    oob_pack(&reply, &c->msg);
+    if (oob_io(c->fd, &c->msg, sizeof(c->msg), 1, OOB_POLL_MS) == 0)
+      __atomic_fetch_add(&srv->clients, 1, __ATOMIC_RELAXED);
+    else
+      srv->rejected++;
+  }
+  oob_server_drop(srv, i);
+  return 1;
+}
+
+static inline void *oob_server_thread(void *arg) {
+  struct oob_server *srv = (struct oob_server *)arg;
+  struct pollfd pfds[OOB_MAX_PENDING + 1];
+
+  while (!__atomic_load_n(&srv->stop, __ATOMIC_RELAXED)) {
+    // Leave new connections in the backlog while every slot is busy
+    int n = 0, listening = srv->num_conns < OOB_MAX_PENDING;
+    for (int i = 0; i < srv->num_conns; i++)
+      pfds[n++] = {srv->conns[i].fd, POLLIN, 0};
+    if (listening)
+      pfds[n++] = {srv->listen_fd, POLLIN, 0};
+
+    int ready = poll(pfds, n, OOB_POLL_MS);
+    if (ready <= 0)
+      continue;
+
+    // Connections first, back to front, as dropping one moves the last
+    for (int i = srv->num_conns - 1; i >= 0; i--) {
+      if (pfds[i].revents)
+        oob_server_read(srv, i);
+    }
+
+    if (listening && (pfds[n - 1].revents & POLLIN)) {
+      int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        struct oob_conn *c = &srv->conns[srv->num_conns++];
+        c->fd = fd;
+        c->got = 0;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Listens on addr and answers clients with fn on a new thread until
+// oob_server_stop(). Returns 0, or -1 on error.
+static inline int oob_server_start(struct oob_server *srv, const char *addr,
+                                   oob_client_fn fn, void *arg) {
+  memset(srv, 0, sizeof(*srv));
+  srv->fn = fn;
+  srv->arg = arg;
+  srv->listen_fd = oob_listen(addr);
+  if (srv->listen_fd < 0)
+    return -1;
+
+  if (pthread_create(&srv->thread, NULL, oob_server_thread, srv)) {
+    perror("oob: pthread_create");
+    close(srv->listen_fd);
+    return -1;
+  }
+  srv->running = 1;
+  return 0;
+}
+
+static inline void oob_server_stop(struct oob_server *srv) {
+  if (!srv->running)
+    return;
+  __atomic_store_n(&srv->stop, 1, __ATOMIC_RELAXED);
+  pthread_join(srv->thread, NULL);
+  while (srv->num_conns > 0)
+    oob_server_drop(srv, 0);
+  close(srv->listen_fd);
+  srv->running = 0;
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Send pacing for replay.
+//
+// pacer_next() returns the CLOCK_MONOTONIC time (ns) each frame is due,
+// and must be called once per frame in send order:
+//   PACE_MAX   every frame is due immediately
+//   PACE_PCAP  frames keep the gaps between their capture timestamps,
+//              divided by rate (the speed factor)
+//   PACE_PPS   frames are spaced 1/rate seconds apart
+//   PACE_BPS   frames are spaced by their size on the wire at rate bit/s
+// Deadlines advance from the previous deadline rather than from when the
+// frame actually went out, so a late frame does not slow the ones after it.
+//
+// pacer_wait() sleeps with clock_nanosleep() until shortly before a
+// deadline and spins the rest. On x86 the spin reads the TSC, calibrated
+// against CLOCK_MONOTONIC in pacer_init(), instead of calling
+// clock_gettime() in a loop. It also records how late each deadline was
+// met, for pacer_report().
+
+// Preamble, start of frame delimiter, FCS and inter-frame gap: the bytes
+// an Ethernet frame occupies on the wire beyond what a capture records
+#define ETH_WIRE_OVERHEAD 24
+
+// Sleeps shorter than this are spun instead; clock_nanosleep() overshoots
+// by tens of microseconds
+#define PACER_SPIN_NS 50000
+
+enum pace_mode { PACE_MAX, PACE_PCAP, PACE_PPS, PACE_BPS };
+
+struct pacer {
+  enum pace_mode mode;
+  double rate; // speed factor, packets/s or bits/s, depending on mode
+  uint64_t next_ns;
+  uint64_t last_ts_ns; // capture timestamp of the previous frame
+  int started;
+
+  double tsc_per_ns; // 0 if spinning on clock_gettime()
+
+  // Lateness of each wait, measured when the spin ends
+  uint64_t waits;
+  double late_sum_ns;
+  double late_sq_sum_ns;
+  uint64_t late_max_ns;
+};
+
+static inline uint64_t pacer_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t pacer_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Measures TSC ticks per ns over about 10 ms. Returns 0 where there is no
+// TSC to use.
+static inline double pacer_calibrate_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t ns0 = pacer_now_ns(), tsc0 = pacer_tsc();
+  struct timespec ts = {0, 10000000};
+  nanosleep(&ts, NULL);
+  uint64_t ns1 = pacer_now_ns(), tsc1 = pacer_tsc();
+  return ns1 > ns0 ? (double)(tsc1 - tsc0) / (ns1 - ns0) : 0;
+#else
+  return 0;
+#endif
+}
+
+static inline void pacer_init(struct pacer *p, enum pace_mode mode,
+                              double rate) {
+  p->mode = mode;
+  p->rate = rate;
+  p->next_ns = 0;
+  p->last_ts_ns = 0;
+  p->started = 0;
+  p->tsc_per_ns = mode == PACE_MAX ? 0 : pacer_calibrate_tsc();
+  p->waits = 0;
+  p->late_sum_ns = 0;
+  p->late_sq_sum_ns = 0;
+  p->late_max_ns = 0;
+}
+
+// Deadline of the next frame, captured at ts_ns and len bytes long
+static inline uint64_t pacer_next(struct pacer *p, uint64_t ts_ns,
+                                  uint32_t len) {
+  if (p->mode == PACE_MAX)
+    return 0;
+
+  if (!p->started) {
+    p->started = 1;
+    p->next_ns = pacer_now_ns();
+    p->last_ts_ns = ts_ns;
+    return p->next_ns;
+  }
+
+  switch (p->mode) {
+  case PACE_PCAP:
+    // Out-of-order stamps, and the wrap back to the start of a looped
+    // capture, go out without a gap
+    if (ts_ns > p->last_ts_ns)
+      p->next_ns += (uint64_t)((ts_ns - p->last_ts_ns) / p->rate);
+    p->last_ts_ns = ts_ns;
+    break;
+  case PACE_PPS:
+    p->next_ns += (uint64_t)(1e9 / p->rate);
+    break;
+  case PACE_BPS:
+    p->next_ns += (uint64_t)((len + ETH_WIRE_OVERHEAD) * 8 * 1e9 / p->rate);
+    break;
+  case PACE_MAX:
+    break;
+  }
+  return p->next_ns;
+}
+
+static inline void pacer_wait(struct pacer *p, uint64_t deadline_ns) {
+  if (p->mode == PACE_MAX)
+    return;
+
+  uint64_t now = pacer_now_ns();
+  if (deadline_ns > now) {
+    if (deadline_ns - now > PACER_SPIN_NS) {
+      uint64_t wake = deadline_ns - PACER_SPIN_NS;
+      struct timespec ts;
+      ts.tv_sec = wake / 1000000000ull;
+      ts.tv_nsec = wake % 1000000000ull;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+             EINTR)
+        ;
+      now = pacer_now_ns();
+    }
+
+    if (p->tsc_per_ns > 0 && deadline_ns > now) {
+      uint64_t end = pacer_tsc() + (uint64_t)((deadline_ns - now) *
+                                              p->tsc_per_ns);
+      while (pacer_tsc() < end)
+        ;
+    } else {
+      while (pacer_now_ns() < deadline_ns)
+        ;
+    }
+    now = pacer_now_ns();
+  }
+
+  uint64_t late = now > deadline_ns ? now - deadline_ns : 0;
+  p->waits++;
+  p->late_sum_ns += late;
+  p->late_sq_sum_ns += (double)late * late;
+  if (late > p->late_max_ns)
+    p->late_max_ns = late;
+}
+
+// Prints the mean, standard deviation and worst lateness of the waits
+static inline void pacer_report(const struct pacer *p) {
+  if (p->waits == 0)
+    return;
+  double mean = p->late_sum_ns / p->waits;
+  double var = p->late_sq_sum_ns / p->waits - mean * mean;
+  printf("Timing jitter: mean %.2f us late, stddev %.2f us, max %.2f us "
+         "over %llu waits%s\n",
+         mean / 1e3, var > 0 ? sqrt(var) / 1e3 : 0.0, p->late_max_ns / 1e3,
+         (unsigned long long)p->waits, p->tsc_per_ns > 0 ? " (TSC spin)" : "");
+}
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef PACKET_PARSER_H
+#define PACKET_PARSER_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Batch parser for the FPGA packet format: Ethernet, IPv4 without options,
+// UDP, then the custom header (sample_count, fpga_id, freq_channel and 8
+// bytes of padding) and the payload, all at fixed offsets.
+//
+// pkt_parse_batch() checks up to PKT_MAX_BATCH frames and writes the custom
+// header fields of the good ones into a structure of arrays, so later
+// stages can walk one field across the batch. Each frame gets a status,
+// and bad frames are counted by status in a pkt_stats rather than printed.
+//
+// A frame is good if it is IPv4 (ethertype, version 4, no options), UDP,
+// not a fragment, and its IP and UDP lengths agree with each other and fit
+// in the frame. Those byte checks are one masked 16-byte compare with
+// SSE2. With PKT_VERIFY_CHECKSUM the IPv4 header checksum is checked too,
+// summed in SSE2 registers. Fields of the custom header are taken as they
+// are on the wire, in host byte order, as the FPGAs send them.
+
+#define PKT_ETH_TYPE_OFFSET 12
+#define PKT_IP_OFFSET 14
+#define PKT_UDP_OFFSET 34
+#define PKT_CUSTOM_OFFSET 42
+#define PKT_PAYLOAD_OFFSET 58
+#define PKT_CUSTOM_SIZE 16 // PKT_PAYLOAD_OFFSET - PKT_CUSTOM_OFFSET
+// Where udp_client -t writes each packet's send time, a CLOCK_MONOTONIC
+// nanosecond count in host byte order, over the first payload bytes
+#define PKT_SEND_STAMP_OFFSET PKT_PAYLOAD_OFFSET
+#define PKT_MAX_BATCH 64
+
+// pkt_parse_batch() flags
+#define PKT_VERIFY_CHECKSUM 1
+#define PKT_SCALAR 2 // plain C checks even with SSE2, for comparison
+
+enum pkt_status {
+  PKT_OK,
+  PKT_ERR_SHORT,     // shorter than the headers
+  PKT_ERR_ETHERTYPE, // not IPv4
+  PKT_ERR_IP_HEADER, // not version 4, or has options
+  PKT_ERR_FRAGMENT,
+  PKT_ERR_PROTOCOL, // not UDP
+  PKT_ERR_LENGTH,   // IP or UDP length does not match the frame
+  PKT_ERR_CHECKSUM, // IPv4 header checksum
+  PKT_NUM_STATUS
+};
+
+static const char *const pkt_status_names[PKT_NUM_STATUS] = {
+    "Valid",    "Short",    "Ethertype", "IP header",
+    "Fragment", "Protocol", "Length",    "Checksum"};
+
+struct pkt_batch {
+  uint32_t count; // frames parsed
+  uint32_t valid; // of which PKT_OK
+  uint8_t status[PKT_MAX_BATCH]; // enum pkt_status
+  uint64_t sample_count[PKT_MAX_BATCH];
+  uint32_t fpga_id[PKT_MAX_BATCH];
+  uint16_t freq_channel[PKT_MAX_BATCH];
+  uint32_t payload_size[PKT_MAX_BATCH]; // from the UDP length
+  const uint8_t *payload[PKT_MAX_BATCH];
+};
+
+struct pkt_stats {
+  uint64_t frames;
+  uint64_t counts[PKT_NUM_STATUS]; // counts[PKT_OK] is the good frames
+};
+
+static inline uint16_t pkt_load_be16(const uint8_t *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohs(v);
+}
+
+// Which check a frame failed, the slow way; only called for frames the fast
+// check rejected
+static inline enum pkt_status pkt_classify(const uint8_t *f) {
+  if (pkt_load_be16(f + PKT_ETH_TYPE_OFFSET) != 0x0800)
+    return PKT_ERR_ETHERTYPE;
+  if (f[PKT_IP_OFFSET] != 0x45)
+    return PKT_ERR_IP_HEADER;
+  if (pkt_load_be16(f + PKT_IP_OFFSET + 6) & 0x3fff)
+    return PKT_ERR_FRAGMENT;
+  return PKT_ERR_PROTOCOL;
+}
+
+// Ethertype, version, IHL, fragment and protocol checks, in plain C
+static inline int pkt_headers_ok_scalar(const uint8_t *f) {
+  return pkt_load_be16(f + PKT_ETH_TYPE_OFFSET) == 0x0800 &&
+         f[PKT_IP_OFFSET] == 0x45 &&
+         (pkt_load_be16(f + PKT_IP_OFFSET + 6) & 0x3fff) == 0 &&
+         f[PKT_IP_OFFSET + 9] == IPPROTO_UDP;
+}
+
+// Folded ones' complement sum of the 20-byte IPv4 header; 0xffff if the
+// checksum is right
+static inline uint32_t pkt_ip_sum_scalar(const uint8_t *f) {
+  uint32_t sum = 0;
+  for (int i = 0; i < 20; i += 2)
+    sum += pkt_load_be16(f + PKT_IP_OFFSET + i);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (sum & 0xffff) + (sum >> 16);
+}
+
+#ifdef __SSE2__
+// pkt_headers_ok_scalar() as one compare of bytes 12-27 under a mask:
+// ethertype, version/IHL, flags/fragment offset (bar DF) and protocol
+static inline int pkt_headers_ok_sse2(const uint8_t *f) {
+  const __m128i mask = _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0, 0x3f, -1, 0,
+                                     -1, 0, 0, 0, 0);
+  const __m128i want = _mm_setr_epi8(0x08, 0x00, 0x45, 0, 0, 0, 0, 0, 0, 0,
+                                     0, IPPROTO_UDP, 0, 0, 0, 0);
+  __m128i v = _mm_loadu_si128((const __m128i *)(f + PKT_ETH_TYPE_OFFSET));
+  __m128i eq = _mm_cmpeq_epi8(_mm_and_si128(v, mask), want);
+  return _mm_movemask_epi8(eq) == 0xffff;
+}
+
+// pkt_ip_sum_scalar() with the ten words widened and added in SSE2
+// registers. The sum is taken in wire byte order, which leaves an all-ones
+// result all ones.
+static inline uint32_t pkt_ip_sum_sse2(const uint8_t *f) {
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t tail;
+  memcpy(&tail, f + PKT_IP_OFFSET + 16, sizeof(tail));
+
+  __m128i head = _mm_loadu_si128((const __m128i *)(f + PKT_IP_OFFSET));
+  __m128i rest = _mm_cvtsi32_si128((int)tail);
+  __m128i sum = _mm_add_epi32(_mm_unpacklo_epi16(head, zero),
+                              _mm_unpackhi_epi16(head, zero));
+  sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(rest, zero));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+  uint32_t s = (uint32_t)_mm_cvtsi128_si32(sum);
+  s = (s & 0xffff) + (s >> 16);
+  return (s & 0xffff) + (s >> 16);
+}
+#endif
+
+// Status of one frame, and its payload size (from the UDP length) if good
+static inline enum pkt_status pkt_check(const uint8_t *f, uint32_t len,
+                                        int flags, uint32_t *payload_size) {
+  if (len < PKT_PAYLOAD_OFFSET)
+    return PKT_ERR_SHORT;
+
+#ifdef __SSE2__
+  int ok = (flags & PKT_SCALAR) ? pkt_headers_ok_scalar(f)
+                                : pkt_headers_ok_sse2(f);
+#else
+  int ok = pkt_headers_ok_scalar(f);
+#endif
+  if (!ok)
+    return pkt_classify(f);
+
+  // Ethernet may pad short frames, so the frame can be longer than the IP
+  // packet but not shorter
+  uint32_t ip_len = pkt_load_be16(f + PKT_IP_OFFSET + 2);
+  uint32_t udp_len = pkt_load_be16(f + PKT_UDP_OFFSET + 4);
+  if (udp_len < 8 + PKT_CUSTOM_SIZE || ip_len != 20 + udp_len ||
+      PKT_IP_OFFSET + ip_len > len)
+    return PKT_ERR_LENGTH;
+
+  if (flags & PKT_VERIFY_CHECKSUM) {
+#ifdef __SSE2__
+    uint32_t sum = (flags & PKT_SCALAR) ? pkt_ip_sum_scalar(f)
+                                        : pkt_ip_sum_sse2(f);
+#else
+    uint32_t sum = pkt_ip_sum_scalar(f);
+#endif
+    if (sum != 0xffff)
+      return PKT_ERR_CHECKSUM;
+  }
+
+  *payload_size = udp_len - 8 - PKT_CUSTOM_SIZE;
+  return PKT_OK;
+}
+
+// Parses frames[0 .. n-1] (n at most PKT_MAX_BATCH) into b and adds them to
+// stats. Returns the number of good frames.
+static inline uint32_t pkt_parse_batch(const uint8_t *const *frames,
+                                       const uint32_t *lens, uint32_t n,
+                                       int flags, struct pkt_batch *b,
+                                       struct pkt_stats *stats) {
+  uint32_t valid = 0;
+
+  for (uint32_t i = 0; i < n; i++) {
+    const uint8_t *f = frames[i];
+    uint32_t payload_size = 0;
+    enum pkt_status st = pkt_check(f, lens[i], flags, &payload_size);
+
+    b->status[i] = st;
+    if (st != PKT_OK) {
+      stats->counts[st]++;
+      continue;
+    }
+
+    const uint8_t *custom = f + PKT_CUSTOM_OFFSET;
+    memcpy(&b->sample_count[i], custom, sizeof(uint64_t));
+    memcpy(&b->fpga_id[i], custom + 8, sizeof(uint32_t));
+    memcpy(&b->freq_channel[i], custom + 12, sizeof(uint16_t));
+    b->payload_size[i] = payload_size;
+    b->payload[i] = f + PKT_PAYLOAD_OFFSET;
+    valid++;
+  }
+
+  // Good frames are counted once per batch rather than per frame
+  b->count = n;
+  b->valid = valid;
+  stats->counts[PKT_OK] += valid;
+  stats->frames += n;
+  return valid;
+}
+
+// Prints the counts by status; may run concurrently with pkt_parse_batch()
+static inline void pkt_stats_report(struct pkt_stats *st, const char *prefix) {
+  printf("%sParser: Frames=%llu", prefix,
+         (unsigned long long)__atomic_load_n(&st->frames, __ATOMIC_RELAXED));
+  for (int i = 0; i < PKT_NUM_STATUS; i++) {
+    uint64_t n = __atomic_load_n(&st->counts[i], __ATOMIC_RELAXED);
+    if (i == PKT_OK || n)
+      printf(", %s=%llu", pkt_status_names[i], (unsigned long long)n);
+  }
+  printf("\n");
+}
+
+#endif
@@ -0,0 +1,270 @@
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "packet_parser.h"
+
+// Checks of pkt_parse_batch(): one frame per pkt_status, the custom header
+// fields and payload size of good frames, and the same statuses, fields
+// and stats from the PKT_SCALAR and SSE2 checks, on the cases and on
+// randomly corrupted headers. Exits non-zero on failure.
+
+#define PAYLOAD_SIZE 64
+#define FRAME_SIZE (PKT_PAYLOAD_OFFSET + PAYLOAD_SIZE)
+#define FRAME_ROOM (FRAME_SIZE + 16) // for padded frames
+#define RANDOM_BATCHES 2000
+
+static int failures;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);                   \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static void store_be16(uint8_t *p, uint16_t v) {
+  v = htons(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+// Writes a correct IPv4 header checksum
+static void fix_checksum(uint8_t *f) {
+  store_be16(f + PKT_IP_OFFSET + 10, 0);
+  uint32_t sum = pkt_ip_sum_scalar(f);
+  store_be16(f + PKT_IP_OFFSET + 10, (uint16_t)~sum);
+}
+
+// A good frame with PAYLOAD_SIZE bytes of payload
+static void build_frame(uint8_t *f, uint64_t sample_count, uint32_t fpga_id,
+                        uint16_t freq_channel) {
+  memset(f, 0, FRAME_ROOM);
+  store_be16(f + PKT_ETH_TYPE_OFFSET, 0x0800);
+
+  uint8_t *ip = f + PKT_IP_OFFSET;
+  ip[0] = 0x45;
+  store_be16(ip + 2, 20 + 8 + PKT_CUSTOM_SIZE + PAYLOAD_SIZE);
+  store_be16(ip + 6, 0x4000); // DF, which is allowed
+  ip[8] = 64;
+  ip[9] = IPPROTO_UDP;
+  memcpy(ip + 12, "\x0a\x00\x00\x01\x0a\x00\x00\x02", 8);
+
+  uint8_t *udp = f + PKT_UDP_OFFSET;
+  store_be16(udp, 5000);
+  store_be16(udp + 2, 12345);
+  store_be16(udp + 4, 8 + PKT_CUSTOM_SIZE + PAYLOAD_SIZE);
+
+  uint8_t *custom = f + PKT_CUSTOM_OFFSET;
+  memcpy(custom, &sample_count, sizeof(sample_count));
+  memcpy(custom + 8, &fpga_id, sizeof(fpga_id));
+  memcpy(custom + 12, &freq_channel, sizeof(freq_channel));
+  for (int i = 0; i < PAYLOAD_SIZE; i++)
+    f[PKT_PAYLOAD_OFFSET + i] = (uint8_t)i;
+
+  fix_checksum(f);
+}
+
+struct parse_case {
+  const char *name;
+  enum pkt_status want;         // without PKT_VERIFY_CHECKSUM
+  enum pkt_status want_checked; // with it
+};
+
+enum {
+  CASE_GOOD,
+  CASE_PADDED,
+  CASE_SHORT,
+  CASE_ETHERTYPE,
+  CASE_IP_VERSION,
+  CASE_IP_OPTIONS,
+  CASE_FRAGMENT_MF,
+  CASE_FRAGMENT_OFFSET,
+  CASE_PROTOCOL,
+  CASE_IP_LENGTH,
+  CASE_UDP_LENGTH,
+  CASE_TRUNCATED,
+  CASE_CHECKSUM,
+  NUM_CASES
+};
+
+static const struct parse_case cases[NUM_CASES] = {
+    {"good", PKT_OK, PKT_OK},
+    {"ethernet padding", PKT_OK, PKT_OK},
+    {"shorter than the headers", PKT_ERR_SHORT, PKT_ERR_SHORT},
+    {"IPv6 ethertype", PKT_ERR_ETHERTYPE, PKT_ERR_ETHERTYPE},
+    {"IP version 6", PKT_ERR_IP_HEADER, PKT_ERR_IP_HEADER},
+    {"IP options (IHL 6)", PKT_ERR_IP_HEADER, PKT_ERR_IP_HEADER},
+    {"more fragments", PKT_ERR_FRAGMENT, PKT_ERR_FRAGMENT},
+    {"fragment offset", PKT_ERR_FRAGMENT, PKT_ERR_FRAGMENT},
+    {"TCP", PKT_ERR_PROTOCOL, PKT_ERR_PROTOCOL},
+    {"IP length too long", PKT_ERR_LENGTH, PKT_ERR_LENGTH},
+    {"UDP length too short", PKT_ERR_LENGTH, PKT_ERR_LENGTH},
+    {"truncated frame", PKT_ERR_LENGTH, PKT_ERR_LENGTH},
+    {"bad checksum", PKT_OK, PKT_ERR_CHECKSUM},
+};
+
+// Frame i of the case batch, with its length
+static uint32_t build_case(uint8_t *f, int c) {
+  uint32_t len = FRAME_SIZE;
+  uint8_t *ip = f + PKT_IP_OFFSET;
+
+  build_frame(f, 1000 + c, c % 4, c);
+  switch (c) {
+  case CASE_PADDED:
+    len = FRAME_SIZE + 16;
+    break;
+  case CASE_SHORT:
+    len = PKT_PAYLOAD_OFFSET - 1;
+    break;
+  case CASE_ETHERTYPE:
+    store_be16(f + PKT_ETH_TYPE_OFFSET, 0x86dd);
+    break;
+  case CASE_IP_VERSION:
+    ip[0] = 0x65;
+    break;
+  case CASE_IP_OPTIONS:
+    ip[0] = 0x46;
+    break;
+  case CASE_FRAGMENT_MF:
+    store_be16(ip + 6, 0x2000);
+    break;
+  case CASE_FRAGMENT_OFFSET:
+    store_be16(ip + 6, 0x0010);
+    break;
+  case CASE_PROTOCOL:
+    ip[9] = IPPROTO_TCP;
+    break;
+  case CASE_IP_LENGTH:
+    store_be16(ip + 2, pkt_load_be16(ip + 2) + 4);
+    break;
+  case CASE_UDP_LENGTH:
+    store_be16(f + PKT_UDP_OFFSET + 4, 8 + PKT_CUSTOM_SIZE - 1);
+    store_be16(ip + 2, 20 + 8 + PKT_CUSTOM_SIZE - 1);
+    break;
+  case CASE_TRUNCATED:
+    len = FRAME_SIZE - 1;
+    break;
+  }
+
+  // Every case but the checksum one fails (or passes) for its own reason
+  fix_checksum(f);
+  if (c == CASE_CHECKSUM)
+    ip[10] ^= 0x01;
+  return len;
+}
+
+static int same_batch(const struct pkt_batch *a, const struct pkt_batch *b) {
+  if (a->count != b->count || a->valid != b->valid)
+    return 0;
+  for (uint32_t i = 0; i < a->count; i++) {
+    if (a->status[i] != b->status[i])
+      return 0;
+    if (a->status[i] == PKT_OK &&
+        (a->sample_count[i] != b->sample_count[i] ||
+         a->fpga_id[i] != b->fpga_id[i] ||
+         a->freq_channel[i] != b->freq_channel[i] ||
+         a->payload_size[i] != b->payload_size[i] ||
+         a->payload[i] != b->payload[i]))
+      return 0;
+  }
+  return 1;
+}
+
+// Parses the batch with and without PKT_SCALAR; checks they agree and
+// returns the SSE2 (or, without SSE2, the default) result in *out
+static void parse_both(const uint8_t *const *frames, const uint32_t *lens,
+                       uint32_t n, int flags, struct pkt_batch *out) {
+  struct pkt_batch scalar;
+  struct pkt_stats stats = {}, scalar_stats = {};
+
+  pkt_parse_batch(frames, lens, n, flags, out, &stats);
+  pkt_parse_batch(frames, lens, n, flags | PKT_SCALAR, &scalar,
+                  &scalar_stats);
+  CHECK(same_batch(out, &scalar));
+  CHECK(memcmp(&stats, &scalar_stats, sizeof(stats)) == 0);
+  CHECK(stats.frames == n);
+  CHECK(stats.counts[PKT_OK] == out->valid);
+}
+
+static void test_cases(int flags) {
+  static uint8_t bufs[NUM_CASES][FRAME_ROOM];
+  const uint8_t *frames[NUM_CASES];
+  uint32_t lens[NUM_CASES];
+  struct pkt_batch b;
+
+  for (int c = 0; c < NUM_CASES; c++) {
+    lens[c] = build_case(bufs[c], c);
+    frames[c] = bufs[c];
+  }
+  parse_both(frames, lens, NUM_CASES, flags, &b);
+
+  for (int c = 0; c < NUM_CASES; c++) {
+    enum pkt_status want = (flags & PKT_VERIFY_CHECKSUM)
+                               ? cases[c].want_checked
+                               : cases[c].want;
+    if (b.status[c] != want) {
+      printf("FAIL %s%s: got %s, expected %s\n", cases[c].name,
+             (flags & PKT_VERIFY_CHECKSUM) ? " (checksum on)" : "",
+             pkt_status_names[b.status[c]], pkt_status_names[want]);
+      failures++;
+      continue;
+    }
+    if (want != PKT_OK)
+      continue;
+    CHECK(b.sample_count[c] == 1000u + c);
+    CHECK(b.fpga_id[c] == (uint32_t)c % 4);
+    CHECK(b.freq_channel[c] == c);
+    CHECK(b.payload_size[c] == PAYLOAD_SIZE);
+    CHECK(b.payload[c] == bufs[c] + PKT_PAYLOAD_OFFSET);
+    CHECK(b.payload[c][PAYLOAD_SIZE - 1] == PAYLOAD_SIZE - 1);
+  }
+}
+
+// Good frames with random bytes of the checked header fields overwritten
+// (ethertype through the UDP length) and random lengths: the scalar and
+// SSE2 checks must agree on all of them
+static void test_random(int flags) {
+  static uint8_t bufs[PKT_MAX_BATCH][FRAME_ROOM];
+  const uint8_t *frames[PKT_MAX_BATCH];
+  uint32_t lens[PKT_MAX_BATCH];
+  uint64_t seed = 0x243f6a8885a308d3ull;
+  struct pkt_batch b;
+
+  for (int batch = 0; batch < RANDOM_BATCHES; batch++) {
+    for (int i = 0; i < PKT_MAX_BATCH; i++) {
+      build_frame(bufs[i], batch * PKT_MAX_BATCH + i, i, batch);
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      int corruptions = (seed >> 60) % 3;
+      for (int k = 0; k < corruptions; k++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        int off = PKT_ETH_TYPE_OFFSET +
+                  (seed >> 33) % (PKT_UDP_OFFSET + 6 - PKT_ETH_TYPE_OFFSET);
+        bufs[i][off] = (uint8_t)(seed >> 17);
+      }
+      lens[i] = (seed >> 40) % 8 == 0 ? (uint32_t)((seed >> 20) % FRAME_ROOM)
+                                      : FRAME_SIZE;
+      frames[i] = bufs[i];
+    }
+    parse_both(frames, lens, PKT_MAX_BATCH, flags, &b);
+  }
+}
+
+int main() {
+  test_cases(0);
+  test_cases(PKT_VERIFY_CHECKSUM);
+  test_random(0);
+  test_random(PKT_VERIFY_CHECKSUM);
+
+#ifndef __SSE2__
+  printf("parser_test: built without SSE2, PKT_SCALAR compared with "
+         "itself\n");
+#endif
+  if (failures) {
+    printf("parser_test: %d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("parser_test: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,348 @@
+#ifndef PCAP_FILE_H
+#define PCAP_FILE_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Capture file loader for replay.
+//
+// Maps a pcap or pcapng file read-only and indexes every frame once up
+// front (offset, captured length, timestamp in ns), so replay walks a flat
+// array instead of parsing record headers or copying through libpcap on
+// the send path. Classic pcap may be in either byte order with microsecond
+// or nanosecond timestamps. pcapng may hold several sections and
+// interfaces, each with its own timestamp resolution; frames come from
+// enhanced and simple packet blocks, and the link type is that of the
+// first interface.
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+#define PCAPNG_BLOCK_SHB 0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB 1
+#define PCAPNG_BLOCK_SPB 3
+#define PCAPNG_BLOCK_EPB 6
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_MAX_INTERFACES 64
+
+#pragma pack(push, 1)
+struct pcap_file_header_raw {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct pcap_record_header_raw {
+  uint32_t ts_sec;
+  uint32_t ts_frac; // usec or nsec, depending on the magic
+  uint32_t caplen;
+  uint32_t len;
+};
+#pragma pack(pop)
+
+struct pcap_frame {
+  uint64_t offset; // of the frame data in the file
+  uint64_t ts_ns;
+  uint32_t len; // captured bytes
+};
+
+struct pcap_file {
+  int fd;
+  const uint8_t *map;
+  size_t map_size;
+  uint32_t linktype;
+
+  struct pcap_frame *frames;
+  uint32_t num_frames;
+  uint32_t truncated; // frames captured shorter than they were on the wire
+  uint64_t total_bytes;
+};
+
+static inline const uint8_t *pcap_frame_data(const struct pcap_file *pf,
+                                             uint32_t idx) {
+  return pf->map + pf->frames[idx].offset;
+}
+
+static inline uint32_t pcap_swap32(uint32_t v, int swapped) {
+  return swapped ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t pcap_swap16(uint16_t v, int swapped) {
+  return swapped ? __builtin_bswap16(v) : v;
+}
+
+static inline uint32_t pcap_read32(const uint8_t *p, int swapped) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return pcap_swap32(v, swapped);
+}
+
+// Indexes the records of a classic pcap file into frames, or only counts
+// them if frames is NULL. Returns the number of frames; *end is set to the
+// offset just past the last complete record.
+static inline uint32_t pcap_file_walk_classic(struct pcap_file *pf,
+                                              int swapped, int nsec,
+                                              struct pcap_frame *frames,
+                                              size_t *end) {
+  size_t pos = sizeof(struct pcap_file_header_raw);
+  uint32_t count = 0;
+
+  while (pos + sizeof(struct pcap_record_header_raw) <= pf->map_size) {
+    const struct pcap_record_header_raw *rec =
+        (const struct pcap_record_header_raw *)(pf->map + pos);
+    uint32_t caplen = pcap_swap32(rec->caplen, swapped);
+    if (pos + sizeof(*rec) + caplen > pf->map_size)
+      break;
+
+    if (frames) {
+      struct pcap_frame *f = &frames[count];
+      uint64_t frac = pcap_swap32(rec->ts_frac, swapped);
+      f->offset = pos + sizeof(*rec);
+      f->len = caplen;
+      f->ts_ns = (uint64_t)pcap_swap32(rec->ts_sec, swapped) * 1000000000ull +
+                 (nsec ? frac : frac * 1000);
+      if (caplen < pcap_swap32(rec->len, swapped))
+        pf->truncated++;
+      pf->total_bytes += caplen;
+    }
+
+    pos += sizeof(*rec) + caplen;
+    count++;
+  }
+
+  *end = pos;
+  return count;
+}
+
+// Converts a timestamp in units of 10^-v (or 2^-v if the top bit of
+// if_tsresol is set) seconds to ns
+static inline uint64_t pcapng_ts_to_ns(uint64_t ts, uint8_t tsresol) {
+  uint8_t v = tsresol & 0x7f;
+  if (tsresol & 0x80)
+    return (uint64_t)((unsigned __int128)ts * 1000000000ull >> v);
+
+  uint64_t scale = 1;
+  if (v <= 9) {
+    for (uint8_t i = v; i < 9; i++)
+      scale *= 10;
+    return ts * scale;
+  }
+  for (uint8_t i = 9; i < v && i < 28; i++)
+    scale *= 10;
+  return ts / scale;
+}
+
+// pcapng version of pcap_file_walk_classic()
+static inline uint32_t pcap_file_walk_pcapng(struct pcap_file *pf,
+                                             struct pcap_frame *frames,
+                                             size_t *end) {
+  uint8_t tsresol[PCAPNG_MAX_INTERFACES];
+  uint32_t num_ifaces = 0;
+  int swapped = 0;
+  size_t pos = 0;
+  uint32_t count = 0;
+
+  // Every block starts with its type and total length and ends with the
+  // length again; the bodies below are read relative to pos
+  while (pos + 12 <= pf->map_size) {
+    const uint8_t *blk = pf->map + pos;
+    uint32_t type = pcap_read32(blk, 0);
+
+    if (type == PCAPNG_BLOCK_SHB) {
+      // Each section sets its own byte order and interface list
+      uint32_t magic = pcap_read32(blk + 8, 0);
+      if (magic == PCAPNG_BYTE_ORDER_MAGIC)
+        swapped = 0;
+      else if (magic == __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC))
+        swapped = 1;
+      else
+        break;
+      num_ifaces = 0;
+    } else {
+      type = pcap_swap32(type, swapped);
+    }
+
+    uint32_t blk_len = pcap_read32(blk + 4, swapped);
+    if (blk_len < 12 || blk_len % 4 || pos + blk_len > pf->map_size)
+      break;
+
+    if (type == PCAPNG_BLOCK_IDB && blk_len >= 20) {
+      uint8_t resol = 6;
+      uint16_t linktype;
+      memcpy(&linktype, blk + 8, sizeof(linktype));
+      if (num_ifaces == 0 && count == 0)
+        pf->linktype = pcap_swap16(linktype, swapped);
+
+      size_t opt = 16;
+      while (opt + 4 <= blk_len - 4) {
+        uint16_t code, len;
+        memcpy(&code, blk + opt, sizeof(code));
+        memcpy(&len, blk + opt + 2, sizeof(len));
+        code = pcap_swap16(code, swapped);
+        len = pcap_swap16(len, swapped);
+        if (code == PCAPNG_OPT_END)
+          break;
+        if (code == PCAPNG_OPT_IF_TSRESOL && len >= 1)
+          resol = blk[opt + 4];
+        opt += 4 + ((len + 3) & ~3u);
+      }
+
+      if (num_ifaces < PCAPNG_MAX_INTERFACES)
+        tsresol[num_ifaces] = resol;
+      num_ifaces++;
+    } else if (type == PCAPNG_BLOCK_EPB && blk_len >= 32) {
+      uint32_t iface = pcap_read32(blk + 8, swapped);
+      uint32_t caplen = pcap_read32(blk + 20, swapped);
+      if (28 + (size_t)caplen + 4 > blk_len)
+        break;
+
+      if (frames) {
+        struct pcap_frame *f = &frames[count];
+        uint64_t ts = (uint64_t)pcap_read32(blk + 12, swapped) << 32 |
+                      pcap_read32(blk + 16, swapped);
+        f->offset = pos + 28;
+        f->len = caplen;
+        f->ts_ns = pcapng_ts_to_ns(
+            ts, iface < num_ifaces && iface < PCAPNG_MAX_INTERFACES
+                    ? tsresol[iface]
+                    : 6);
+        if (caplen < pcap_read32(blk + 24, swapped))
+          pf->truncated++;
+        pf->total_bytes += caplen;
+      }
+      count++;
+    } else if (type == PCAPNG_BLOCK_SPB && blk_len >= 16) {
+      // No timestamp, and the captured length is whatever fits
+      uint32_t len = pcap_read32(blk + 8, swapped);
+      uint32_t caplen = blk_len - 16 < len ? blk_len - 16 : len;
+
+      if (frames) {
+        struct pcap_frame *f = &frames[count];
+        f->offset = pos + 12;
+        f->len = caplen;
+        f->ts_ns = count ? frames[count - 1].ts_ns : 0;
+        if (caplen < len)
+          pf->truncated++;
+        pf->total_bytes += caplen;
+      }
+      count++;
+    }
+
+    pos += blk_len;
+  }
+
+  *end = pos;
+  return count;
+}
+
+static inline void pcap_file_close(struct pcap_file *pf) {
+  if (pf->map)
+    munmap((void *)pf->map, pf->map_size);
+  if (pf->fd > 0)
+    close(pf->fd);
+  free(pf->frames);
+  memset(pf, 0, sizeof(*pf));
+}
+
+// Maps path and builds the frame index. Returns 0 on success, -1 on
+// failure (with nothing left open).
+static inline int pcap_file_open(struct pcap_file *pf, const char *path) {
+  memset(pf, 0, sizeof(*pf));
+
+  pf->fd = open(path, O_RDONLY);
+  if (pf->fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(pf->fd, &st) < 0) {
+    perror("pcap_file: fstat");
+    pcap_file_close(pf);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(struct pcap_file_header_raw)) {
+    fprintf(stderr, "pcap_file: %s is too short for a pcap file\n", path);
+    pcap_file_close(pf);
+    return -1;
+  }
+
+  pf->map_size = st.st_size;
+  void *map = mmap(NULL, pf->map_size, PROT_READ, MAP_PRIVATE, pf->fd, 0);
+  if (map == MAP_FAILED) {
+    perror("pcap_file: mmap");
+    pf->map = NULL;
+    pcap_file_close(pf);
+    return -1;
+  }
+  pf->map = (const uint8_t *)map;
+  madvise(map, pf->map_size, MADV_SEQUENTIAL);
+
+  const struct pcap_file_header_raw *hdr =
+      (const struct pcap_file_header_raw *)pf->map;
+  int pcapng = 0, swapped = 0, nsec = 0;
+  switch (hdr->magic) {
+  case PCAPNG_BLOCK_SHB:
+    pcapng = 1;
+    break;
+  case PCAP_MAGIC_USEC:
+    break;
+  case PCAP_MAGIC_NSEC:
+    nsec = 1;
+    break;
+  default:
+    if (hdr->magic == __builtin_bswap32(PCAP_MAGIC_USEC)) {
+      swapped = 1;
+    } else if (hdr->magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+      swapped = 1;
+      nsec = 1;
+    } else {
+      fprintf(stderr, "pcap_file: %s is not a pcap or pcapng file\n", path);
+      pcap_file_close(pf);
+      return -1;
+    }
+  }
+  if (!pcapng)
+    pf->linktype = pcap_swap32(hdr->linktype, swapped);
+
+  // Count first so the index is one exact allocation
+  size_t end;
+  uint32_t count = pcapng ? pcap_file_walk_pcapng(pf, NULL, &end)
+                          : pcap_file_walk_classic(pf, swapped, nsec, NULL,
+                                                   &end);
+  if (end != pf->map_size)
+    fprintf(stderr, "pcap_file: ignoring %zu trailing bytes in %s\n",
+            pf->map_size - end, path);
+
+  pf->frames = (struct pcap_frame *)malloc((count ? count : 1) *
+                                           sizeof(struct pcap_frame));
+  if (!pf->frames) {
+    fprintf(stderr, "pcap_file: failed to allocate index of %u frames\n",
+            count);
+    pcap_file_close(pf);
+    return -1;
+  }
+
+  if (pcapng)
+    pcap_file_walk_pcapng(pf, pf->frames, &end);
+  else
+    pcap_file_walk_classic(pf, swapped, nsec, pf->frames, &end);
+  pf->num_frames = count;
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,677 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "packet_parser.h"
+#include "pcap_file.h"
+
+// End-to-end pipeline benchmark: udp_client replaying into udp_server over
+// loopback, both run as they are, one step per offered packet rate.
+//
+// Each step starts a fresh server (-P, -L and -R, plus --server-args), has
+// the client send at the step's rate (-r, -t, -l 0) for --duration seconds,
+// stops it with SIGINT and, after --drain seconds for the server to catch
+// up, stops the server with SIGTERM and reads its results file.
+// A step is loss-free if no more than --loss percent of what the client
+// sent went unprocessed, whether the kernel dropped it, the full ring did,
+// or it was still queued at the end.
+//
+// The rate doubles from --rate until a step loses packets (or reaches
+// --max-rate), then --refine bisection steps narrow down the highest
+// loss-free rate. Each step reports the latency from the client's send
+// stamp to the end of processing and how full the server's rings were,
+// sampled every 10 ms; --occupancy writes those samples out as a time
+// series. The stream is synthesized from --pcap's frames (--fpgas x
+// --channels streams), or from a built-in --size byte frame without one.
+// With --replay the capture is sent as captured instead, once per step
+// whatever --duration says: another pass would repeat its sample_counts,
+// which the server drops as duplicates.
+//
+// A run fails, exiting 2, if the maximum loss-free rate is below --min-pps,
+// its p99 latency above --max-p99-us, or either is more than --tolerance
+// percent worse than in --baseline, a JSON result of an earlier run.
+
+#define SERVER_PORT 12345 // udp_server's PORT
+#define DEFAULT_RATE 10000
+#define DEFAULT_MAX_RATE 10000000
+#define DEFAULT_DURATION 2.0
+#define DEFAULT_DRAIN 1.0
+#define DEFAULT_REFINE 3
+#define DEFAULT_FPGAS 4
+#define DEFAULT_CHANNELS 16
+#define DEFAULT_FRAME_SIZE 1024
+#define MAX_FRAME_SIZE 4096 // udp_server's BUFFER_SIZE
+#define DEFAULT_TOLERANCE 10.0
+#define SENDER_SHORTFALL 0.9 // achieved/offered below this: sender-bound
+#define START_TIMEOUT_MS 5000
+#define MAX_SERVER_ARGS 32
+
+struct pipeline_config {
+  const char *server;
+  const char *client;
+  const char *pcap;
+  bool replay; // send the capture as it is instead of synthesizing
+  uint32_t fpgas;
+  uint32_t channels;
+  int process_us;
+  double duration;
+  double drain;
+  double loss_pct; // tolerated
+  char *server_args[MAX_SERVER_ARGS];
+  int num_server_args;
+  FILE *occupancy; // time series, or NULL
+};
+
+enum step_outcome { STEP_OK, STEP_LOSS, STEP_SENDER };
+static const char *const outcome_names[] = {"ok", "loss", "sender"};
+
+struct step_result {
+  double rate; // offered
+  uint64_t sent;
+  double sent_pps;
+  uint64_t received;
+  uint64_t dropped; // by the server's full rings
+  uint64_t processed;
+  uint64_t latency_count;
+  uint64_t p50_ns, p90_ns, p99_ns, p999_ns, max_ns;
+  uint64_t ring_size;
+  uint64_t occupancy_max;
+  double occupancy_mean;
+  enum step_outcome outcome;
+};
+
+static void sleep_seconds(double s) {
+  struct timespec ts;
+  ts.tv_sec = (time_t)s;
+  ts.tv_nsec = (long)((s - ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+// Writes a one-frame capture of a size-byte FPGA packet, from 10.0.0.1 to
+// 10.0.0.2 and from and to locally administered MACs. Returns 0 or -1.
+static int write_template_pcap(const char *path, uint32_t size) {
+  static const uint8_t macs[12] = {0x02, 0, 0, 0, 0, 0x02,
+                                   0x02, 0, 0, 0, 0, 0x01};
+  uint8_t f[MAX_FRAME_SIZE];
+  memset(f, 0, size);
+  memcpy(f, macs, sizeof(macs));
+  f[PKT_ETH_TYPE_OFFSET] = 0x08;
+
+  uint8_t *ip = f + PKT_IP_OFFSET;
+  uint16_t ip_len = htons(size - PKT_IP_OFFSET);
+  uint16_t udp_len = htons(size - PKT_UDP_OFFSET);
+  uint16_t port = htons(SERVER_PORT);
+  ip[0] = 0x45;
+  memcpy(ip + 2, &ip_len, 2);
+  ip[6] = 0x40; // DF
+  ip[8] = 64;
+  ip[9] = IPPROTO_UDP;
+  ip[12] = 10, ip[15] = 1, ip[16] = 10, ip[19] = 2;
+  uint16_t csum = htons((uint16_t)~pkt_ip_sum_scalar(f));
+  memcpy(ip + 10, &csum, 2);
+  memcpy(f + PKT_UDP_OFFSET, &port, 2);
+  memcpy(f + PKT_UDP_OFFSET + 2, &port, 2);
+  memcpy(f + PKT_UDP_OFFSET + 4, &udp_len, 2);
+
+  struct pcap_file_header_raw fh = {PCAP_MAGIC_USEC, 2, 4, 0, 0, 65535,
+                                    PCAP_LINKTYPE_ETHERNET};
+  struct pcap_record_header_raw rh = {0, 0, size, size};
+  FILE *out = fopen(path, "wb");
+  if (!out) {
+    perror(path);
+    return -1;
+  }
+  fwrite(&fh, sizeof(fh), 1, out);
+  fwrite(&rh, sizeof(rh), 1, out);
+  fwrite(f, size, 1, out);
+  if (fclose(out) != 0) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Starts argv[0] with stdout on out_fd; returns its pid, or -1
+static pid_t spawn(char *const *argv, int out_fd) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(out_fd, STDOUT_FILENO);
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  return pid;
+}
+
+// Whether something holds the server's port: binding it without
+// SO_REUSEADDR fails once udp_server has bound it with
+static bool port_taken() {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return false;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(SERVER_PORT);
+  bool taken = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+               errno == EADDRINUSE;
+  close(fd);
+  return taken;
+}
+
+// Waits for the server to bind its port. Returns 0, or -1 if it exited or
+// took longer than START_TIMEOUT_MS.
+static int wait_for_server(pid_t pid) {
+  for (int ms = 0; ms < START_TIMEOUT_MS; ms += 10) {
+    if (port_taken())
+      return 0;
+    int status;
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+      fprintf(stderr, "Server exited on start-up\n");
+      return -1;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "Server did not bind port %d within %d ms\n", SERVER_PORT,
+          START_TIMEOUT_MS);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  return -1;
+}
+
+// Reads the name=value lines udp_server -R wrote. Returns 0 or -1.
+static int read_server_results(const char *path,
+                               const struct pipeline_config *cfg,
+                               struct step_result *res) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+
+  char *line = NULL;
+  size_t cap = 0;
+  uint64_t tick_ms = 0;
+  while (getline(&line, &cap, f) > 0) {
+    char *eq = strchr(line, '=');
+    if (!eq)
+      continue;
+    *eq = '\0';
+    const char *name = line, *value = eq + 1;
+    uint64_t v = strtoull(value, NULL, 10);
+
+    if (strcmp(name, "received") == 0)
+      res->received = v;
+    else if (strcmp(name, "dropped") == 0)
+      res->dropped = v;
+    else if (strcmp(name, "processed") == 0)
+      res->processed = v;
+    else if (strcmp(name, "latency_count") == 0)
+      res->latency_count = v;
+    else if (strcmp(name, "latency_p50_ns") == 0)
+      res->p50_ns = v;
+    else if (strcmp(name, "latency_p90_ns") == 0)
+      res->p90_ns = v;
+    else if (strcmp(name, "latency_p99_ns") == 0)
+      res->p99_ns = v;
+    else if (strcmp(name, "latency_p99.9_ns") == 0)
+      res->p999_ns = v;
+    else if (strcmp(name, "latency_max_ns") == 0)
+      res->max_ns = v;
+    else if (strcmp(name, "ring_size") == 0)
+      res->ring_size = v;
+    else if (strcmp(name, "occupancy_max") == 0)
+      res->occupancy_max = v;
+    else if (strcmp(name, "occupancy_tick_ms") == 0)
+      tick_ms = v;
+    else if (strcmp(name, "occupancy") == 0) {
+      uint64_t sum = 0, n = 0;
+      for (const char *p = value; *p >= '0' && *p <= '9';) {
+        char *end;
+        uint64_t sample = strtoull(p, &end, 10);
+        if (cfg->occupancy)
+          fprintf(cfg->occupancy, "%.0f,%llu,%llu\n", res->rate,
+                  (unsigned long long)(n * tick_ms),
+                  (unsigned long long)sample);
+        sum += sample;
+        n++;
+        p = *end == ',' ? end + 1 : end;
+      }
+      res->occupancy_mean = n ? (double)sum / n : 0;
+    }
+  }
+  free(line);
+  fclose(f);
+  return 0;
+}
+
+// Runs one step at res->rate and fills in the rest of res. Returns 0, or
+// -1 if either side failed.
+static int run_step(const struct pipeline_config *cfg, const char *pcap,
+                    const char *results_path, struct step_result *res) {
+  char rate[32], process[32];
+  snprintf(rate, sizeof(rate), "%.0f", res->rate);
+  snprintf(process, sizeof(process), "%d", cfg->process_us);
+
+  char *server_argv[MAX_SERVER_ARGS + 8];
+  int n = 0;
+  server_argv[n++] = (char *)cfg->server;
+  server_argv[n++] = (char *)"-P";
+  server_argv[n++] = process;
+  server_argv[n++] = (char *)"-L";
+  server_argv[n++] = (char *)"-R";
+  server_argv[n++] = (char *)results_path;
+  for (int i = 0; i < cfg->num_server_args; i++)
+    server_argv[n++] = cfg->server_args[i];
+  server_argv[n] = NULL;
+
+  char fpgas[16], channels[16];
+  snprintf(fpgas, sizeof(fpgas), "%u", cfg->fpgas);
+  snprintf(channels, sizeof(channels), "%u", cfg->channels);
+  char *client_argv[16];
+  n = 0;
+  client_argv[n++] = (char *)cfg->client;
+  client_argv[n++] = (char *)"-r";
+  client_argv[n++] = rate;
+  client_argv[n++] = (char *)"-l";
+  client_argv[n++] = (char *)(cfg->replay ? "1" : "0");
+  client_argv[n++] = (char *)"-t";
+  if (!cfg->replay) {
+    client_argv[n++] = (char *)"-F";
+    client_argv[n++] = fpgas;
+    client_argv[n++] = (char *)"-C";
+    client_argv[n++] = channels;
+  }
+  client_argv[n++] = (char *)pcap;
+  client_argv[n] = NULL;
+
+  // The server's per-packet output is of no use here
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd < 0) {
+    perror("/dev/null");
+    return -1;
+  }
+  unlink(results_path);
+  pid_t server = spawn(server_argv, null_fd);
+  close(null_fd);
+  if (server < 0 || wait_for_server(server) < 0)
+    return -1;
+
+  int pipe_fds[2];
+  if (pipe(pipe_fds) < 0) {
+    perror("pipe");
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    return -1;
+  }
+  pid_t client = spawn(client_argv, pipe_fds[1]);
+  close(pipe_fds[1]);
+  if (client < 0) {
+    close(pipe_fds[0]);
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    return -1;
+  }
+
+  if (!cfg->replay) {
+    sleep_seconds(cfg->duration);
+    kill(client, SIGINT);
+  }
+
+  // The client prints its summary on the way out
+  FILE *out = fdopen(pipe_fds[0], "r");
+  char line[256];
+  double elapsed = 0;
+  unsigned long long sent = 0;
+  while (out && fgets(line, sizeof(line), out)) {
+    sscanf(line, "Frames sent: %llu", &sent);
+    sscanf(line, "Elapsed: %lf s", &elapsed);
+  }
+  if (out)
+    fclose(out);
+  int client_status = 0;
+  waitpid(client, &client_status, 0);
+
+  sleep_seconds(cfg->drain);
+  kill(server, SIGTERM);
+  int server_status = 0;
+  waitpid(server, &server_status, 0);
+
+  if (!WIFEXITED(client_status) || WEXITSTATUS(client_status) != 0) {
+    fprintf(stderr, "Client failed at %s pps\n", rate);
+    return -1;
+  }
+  if (!WIFEXITED(server_status) || WEXITSTATUS(server_status) != 0) {
+    fprintf(stderr, "Server failed at %s pps\n", rate);
+    return -1;
+  }
+
+  res->sent = sent;
+  res->sent_pps = elapsed > 0 ? sent / elapsed : 0;
+  if (read_server_results(results_path, cfg, res) < 0)
+    return -1;
+
+  uint64_t lost = res->sent > res->processed ? res->sent - res->processed : 0;
+  if (res->sent_pps < res->rate * SENDER_SHORTFALL)
+    res->outcome = STEP_SENDER;
+  else if (lost > res->sent * cfg->loss_pct / 100)
+    res->outcome = STEP_LOSS;
+  else
+    res->outcome = STEP_OK;
+  return 0;
+}
+
+static void report(struct bench_table *table, const struct step_result *res) {
+  char vals[14][32];
+  uint64_t lost = res->sent > res->processed ? res->sent - res->processed : 0;
+  snprintf(vals[0], sizeof(vals[0]), "%.0f", res->rate);
+  snprintf(vals[1], sizeof(vals[1]), "%.0f", res->sent_pps);
+  snprintf(vals[2], sizeof(vals[2]), "%llu", (unsigned long long)res->sent);
+  snprintf(vals[3], sizeof(vals[3]), "%llu",
+           (unsigned long long)res->processed);
+  snprintf(vals[4], sizeof(vals[4]), "%llu", (unsigned long long)res->dropped);
+  snprintf(vals[5], sizeof(vals[5]), "%.3f",
+           res->sent ? 100.0 * lost / res->sent : 0.0);
+  snprintf(vals[6], sizeof(vals[6]), "%llu", (unsigned long long)res->p50_ns);
+  snprintf(vals[7], sizeof(vals[7]), "%llu", (unsigned long long)res->p90_ns);
+  snprintf(vals[8], sizeof(vals[8]), "%llu", (unsigned long long)res->p99_ns);
+  snprintf(vals[9], sizeof(vals[9]), "%llu", (unsigned long long)res->p999_ns);
+  snprintf(vals[10], sizeof(vals[10]), "%llu",
+           (unsigned long long)res->max_ns);
+  snprintf(vals[11], sizeof(vals[11]), "%.1f", res->occupancy_mean);
+  snprintf(vals[12], sizeof(vals[12]), "%llu",
+           (unsigned long long)res->occupancy_max);
+  snprintf(vals[13], sizeof(vals[13]), "%s", outcome_names[res->outcome]);
+
+  const char *row[14];
+  for (int i = 0; i < 14; i++)
+    row[i] = vals[i];
+  bench_table_row(table, row);
+}
+
+// Value of "name" in the summary of a JSON result, or -1 if it has none
+static double baseline_value(const char *json, const char *name) {
+  const char *summary = strstr(json, "\"summary\"");
+  if (!summary)
+    return -1;
+  char key[64];
+  snprintf(key, sizeof(key), "\"%s\":", name);
+  const char *p = strstr(summary, key);
+  return p ? strtod(p + strlen(key), NULL) : -1;
+}
+
+static char *read_file(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  size_t cap = 4096, len = 0;
+  char *buf = (char *)malloc(cap);
+  size_t n;
+  while (buf && (n = fread(buf + len, 1, cap - len - 1, f)) > 0) {
+    len += n;
+    if (len + 1 == cap) {
+      char *bigger = (char *)realloc(buf, cap *= 2);
+      if (!bigger)
+        free(buf);
+      buf = bigger;
+    }
+  }
+  fclose(f);
+  if (buf)
+    buf[len] = '\0';
+  return buf;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--server=PATH] [--client=PATH] [--pcap=FILE] "
+          "[--replay] [--fpgas=N] [--channels=N] [--size=B] [--rate=PPS] "
+          "[--max-rate=PPS] [--refine=N] [--duration=S] [--drain=S] "
+          "[--loss=PCT] [--process-us=N] [--server-args=\"ARGS\"] "
+          "[--occupancy=FILE] [--min-pps=PPS] [--max-p99-us=N] "
+          "[--baseline=FILE] [--tolerance=PCT] [--format=text|csv|json]\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  static const char *const columns[] = {
+      "rate_pps", "sent_pps", "sent",     "processed", "dropped",
+      "loss_pct", "p50_ns",   "p90_ns",   "p99_ns",    "p99.9_ns",
+      "max_ns",   "occ_mean", "occ_max",  "result"};
+  struct pipeline_config cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.server = "./udp_server";
+  cfg.client = "./udp_client";
+  cfg.fpgas = DEFAULT_FPGAS;
+  cfg.channels = DEFAULT_CHANNELS;
+  cfg.duration = DEFAULT_DURATION;
+  cfg.drain = DEFAULT_DRAIN;
+  enum bench_format format = BENCH_TEXT;
+  double rate = DEFAULT_RATE, max_rate = DEFAULT_MAX_RATE;
+  int refine = DEFAULT_REFINE;
+  uint32_t frame_size = DEFAULT_FRAME_SIZE;
+  const char *occupancy_path = NULL, *baseline_path = NULL;
+  double min_pps = 0, max_p99_us = 0, tolerance = DEFAULT_TOLERANCE;
+  char *server_args = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    int bad = 0;
+    if (strncmp(a, "--server=", 9) == 0)
+      cfg.server = a + 9;
+    else if (strncmp(a, "--client=", 9) == 0)
+      cfg.client = a + 9;
+    else if (strncmp(a, "--pcap=", 7) == 0)
+      cfg.pcap = a + 7;
+    else if (strcmp(a, "--replay") == 0)
+      cfg.replay = true;
+    else if (strncmp(a, "--fpgas=", 8) == 0)
+      bad = (cfg.fpgas = strtoul(a + 8, NULL, 10)) == 0;
+    else if (strncmp(a, "--channels=", 11) == 0)
+      bad = (cfg.channels = strtoul(a + 11, NULL, 10)) == 0;
+    else if (strncmp(a, "--size=", 7) == 0) {
+      frame_size = strtoul(a + 7, NULL, 10);
+      bad = frame_size < PKT_SEND_STAMP_OFFSET + sizeof(uint64_t) ||
+            frame_size > MAX_FRAME_SIZE;
+    } else if (strncmp(a, "--rate=", 7) == 0)
+      bad = (rate = atof(a + 7)) < 1;
+    else if (strncmp(a, "--max-rate=", 11) == 0)
+      bad = (max_rate = atof(a + 11)) < 1;
+    else if (strncmp(a, "--refine=", 9) == 0)
+      bad = (refine = atoi(a + 9)) < 0;
+    else if (strncmp(a, "--duration=", 11) == 0)
+      bad = (cfg.duration = atof(a + 11)) <= 0;
+    else if (strncmp(a, "--drain=", 8) == 0)
+      bad = (cfg.drain = atof(a + 8)) < 0;
+    else if (strncmp(a, "--loss=", 7) == 0)
+      bad = (cfg.loss_pct = atof(a + 7)) < 0;
+    else if (strncmp(a, "--process-us=", 13) == 0)
+      bad = (cfg.process_us = atoi(a + 13)) < 0;
+    else if (strncmp(a, "--server-args=", 14) == 0)
+      server_args = strdup(a + 14);
+    else if (strncmp(a, "--occupancy=", 12) == 0)
+      occupancy_path = a + 12;
+    else if (strncmp(a, "--min-pps=", 10) == 0)
+      min_pps = atof(a + 10);
+    else if (strncmp(a, "--max-p99-us=", 13) == 0)
+      max_p99_us = atof(a + 13);
+    else if (strncmp(a, "--baseline=", 11) == 0)
+      baseline_path = a + 11;
+    else if (strncmp(a, "--tolerance=", 12) == 0)
+      bad = (tolerance = atof(a + 12)) < 0;
+    else if (strncmp(a, "--format=", 9) == 0)
+      bad = bench_parse_format(a + 9, &format);
+    else
+      bad = 1;
+    if (bad || (cfg.replay && !cfg.pcap)) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  for (char *tok = server_args ? strtok(server_args, " ") : NULL; tok;
+       tok = strtok(NULL, " ")) {
+    if (cfg.num_server_args == MAX_SERVER_ARGS) {
+      fprintf(stderr, "At most %d server arguments\n", MAX_SERVER_ARGS);
+      return 1;
+    }
+    cfg.server_args[cfg.num_server_args++] = tok;
+  }
+
+  char *baseline = NULL;
+  if (baseline_path && !(baseline = read_file(baseline_path)))
+    return 1;
+
+  if (port_taken()) {
+    fprintf(stderr, "UDP port %d is in use; stop the server holding it\n",
+            SERVER_PORT);
+    return 1;
+  }
+
+  char results_path[] = "/tmp/pipeline_bench_results.XXXXXX";
+  char pcap_path[] = "/tmp/pipeline_bench_frame.XXXXXX";
+  int fd = mkstemp(results_path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  const char *pcap = cfg.pcap;
+  if (!pcap) {
+    fd = mkstemp(pcap_path);
+    if (fd < 0 || (close(fd), write_template_pcap(pcap_path, frame_size))) {
+      unlink(results_path);
+      return 1;
+    }
+    pcap = pcap_path;
+  }
+
+  if (occupancy_path) {
+    cfg.occupancy = fopen(occupancy_path, "w");
+    if (!cfg.occupancy)
+      perror(occupancy_path);
+    else
+      fprintf(cfg.occupancy, "rate_pps,t_ms,occupancy\n");
+  }
+
+  struct bench_table table;
+  bench_table_begin(&table, stdout, format, "pipeline", columns, 14);
+
+  // Double until a step fails, then bisect between the best loss-free rate
+  // and the lowest failing one
+  struct step_result best;
+  memset(&best, 0, sizeof(best));
+  double failing = 0;
+  int ret = 0, bisections = 0;
+  while (ret == 0) {
+    if (failing == 0 && rate > max_rate)
+      break;
+    if (failing > 0) {
+      if (bisections++ == refine)
+        break;
+      rate = (best.rate + failing) / 2;
+      if (failing - rate < 1)
+        break;
+    }
+
+    struct step_result res;
+    memset(&res, 0, sizeof(res));
+    res.rate = rate;
+    if (run_step(&cfg, pcap, results_path, &res) < 0) {
+      ret = 1;
+      break;
+    }
+    report(&table, &res);
+
+    if (res.outcome == STEP_OK) {
+      best = res;
+      if (failing == 0)
+        rate *= 2;
+    } else {
+      if (res.outcome == STEP_SENDER)
+        fprintf(stderr, "The client reached only %.0f of %.0f pps; the "
+                        "result is bound by the sender\n",
+                res.sent_pps, res.rate);
+      failing = rate;
+    }
+  }
+
+  // Thresholds
+  bool regressed = false;
+  if (ret == 0 && best.rate < min_pps) {
+    fprintf(stderr, "Regression: max loss-free rate %.0f pps is below "
+                    "%.0f\n",
+            best.rate, min_pps);
+    regressed = true;
+  }
+  if (ret == 0 && max_p99_us > 0 && best.p99_ns > max_p99_us * 1e3) {
+    fprintf(stderr, "Regression: p99 latency %.1f us is above %.1f us\n",
+            best.p99_ns / 1e3, max_p99_us);
+    regressed = true;
+  }
+  if (ret == 0 && baseline) {
+    double base_pps = baseline_value(baseline, "max_lossfree_pps");
+    double base_p99 = baseline_value(baseline, "p99_ns");
+    if (base_pps < 0 || base_p99 < 0) {
+      fprintf(stderr, "%s has no summary to compare against\n",
+              baseline_path);
+      ret = 1;
+    } else {
+      if (best.rate < base_pps * (1 - tolerance / 100)) {
+        fprintf(stderr, "Regression: max loss-free rate %.0f pps, baseline "
+                        "%.0f\n",
+                best.rate, base_pps);
+        regressed = true;
+      }
+      if (best.p99_ns > base_p99 * (1 + tolerance / 100)) {
+        fprintf(stderr, "Regression: p99 latency %llu ns, baseline %.0f\n",
+                (unsigned long long)best.p99_ns, base_p99);
+        regressed = true;
+      }
+    }
+  }
+
+  static const char *const names[] = {"max_lossfree_pps", "p50_ns",
+                                      "p99_ns",           "p99.9_ns",
+                                      "occ_max",          "verdict"};
+  char vals[6][32];
+  snprintf(vals[0], sizeof(vals[0]), "%.0f", best.rate);
+  snprintf(vals[1], sizeof(vals[1]), "%llu", (unsigned long long)best.p50_ns);
+  snprintf(vals[2], sizeof(vals[2]), "%llu", (unsigned long long)best.p99_ns);
+  snprintf(vals[3], sizeof(vals[3]), "%llu", (unsigned long long)best.p999_ns);
+  snprintf(vals[4], sizeof(vals[4]), "%llu",
+           (unsigned long long)best.occupancy_max);
+  snprintf(vals[5], sizeof(vals[5]), "%s",
+           ret ? "error" : regressed ? "regressed" : "pass");
+  const char *summary[6];
+  for (int i = 0; i < 6; i++)
+    summary[i] = vals[i];
+  bench_table_end_summary(&table, names, summary, 6);
+
+  if (cfg.occupancy)
+    fclose(cfg.occupancy);
+  unlink(results_path);
+  if (!cfg.pcap)
+    unlink(pcap_path);
+  free(baseline);
+  free(server_args);
+  return ret ? 1 : regressed ? 2 : 0;
+}
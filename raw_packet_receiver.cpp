@@ -6,210 +6,654 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cq_wait.h"
+#include "packet_parser.h"
+#include "buf_pool.h"
+#include "recv_pool.h"
+#include "striding_rq.h"
+#include "trace.h"
+#include "verbs.h"
+
 #define BUFFER_SIZE 4096
 #define UDP_PORT 12345
+#define RECV_SLOTS 512
+#define RECV_REFILL_BATCH 32
+#define STATS_INTERVAL_S 5
+#define MAX_FLOWS 16
+
+// Striding RQ layout: 2 KB strides (an 8 KB frame takes four), 512 per
+// 1 MB WQE, 16 WQEs posted
+#define MPRQ_LOG_STRIDE_SIZE 11
+#define MPRQ_LOG_NUM_STRIDES 9
+#define MPRQ_NUM_WQES 16
+
+// 1 (-D 1) prints every packet received, which costs most of the
+// throughput
+#define DEBUG_PACKETS 1
+
+// Which packets the receiver wants. Installed as flow steering rules, or
+// applied in software when the device rejects them.
+struct flow_filter {
+  uint8_t dst_mac[6];
+  int has_dst_mac;
+  uint32_t dst_ip;   // network order, 0 = any
+  uint16_t dst_port; // host order
+  uint32_t src_ips[MAX_FLOWS]; // network order, one flow each
+  int num_src_ips;             // 0 = a single flow for any source
+};
+
+// One receive flow: its own raw packet QP, receive buffers and rule. In
+// striding mode every flow's rule points at the striding RQ's QP instead
+// and the pool is unused.
+struct rx_flow {
+  struct ibv_qp *qp;
+  Qp owned_qp; // qp, unless it is the striding RQ's
+  struct ibv_flow *flow; // NULL when filtering in software
+  struct recv_pool pool;
+  uint32_t src_ip; // network order, 0 = any source
+  unsigned long long packets;
+};
 
 struct rdma_context {
-  struct ibv_device **dev_list;
-  struct ibv_context *context;
-  struct ibv_pd *pd;
+  Device dev;
+  Pd pd;
   struct ibv_cq *cq;
-  struct ibv_qp *qp;
-  struct ibv_mr *mr;
-  char *buffer;
+  struct cq_waiter waiter;
+  struct buf_pool bufs; // every flow's receive slots, one MR
+  struct rx_flow flows[MAX_FLOWS];
+  int num_flows;
+
+  // Software filter fallback: everything lands on flows[0].qp through a
+  // broad rule and is classified here
+  int sw_filter;
+  struct ibv_flow *catch_all;
+  unsigned long long filtered; // rejected by the software filter
+
+  // Multi-packet receive: one striding RQ shared by all flows, which are
+  // told apart in software
+  int striding;
+  struct striding_rq mprq;
+
+  struct pkt_stats parse_stats; // headers of packets that reached a flow
+
+  int debug_level;
+  struct trace_ring *trace; // with -t, else NULL
+  uint64_t batch_ns;        // when the current batch was parsed, for trace
 };
 
-int init_rdma_context(struct rdma_context *ctx, int gid_idx) {
-  int num_devices;
+// Flow rule for Ethernet / IPv4 / UDP, specs laid out back to back as
+// ibv_create_flow() expects
+#pragma pack(push, 1)
+struct udp_flow_rule {
+  struct ibv_flow_attr attr;
+  struct ibv_flow_spec_eth eth;
+  struct ibv_flow_spec_ipv4 ipv4;
+  struct ibv_flow_spec_tcp_udp udp;
+};
 
-  // Get device list
-  ctx->dev_list = ibv_get_device_list(&num_devices);
-  if (!ctx->dev_list || num_devices == 0) {
-    fprintf(stderr, "No RDMA devices found\n");
-    return -1;
+struct eth_flow_rule {
+  struct ibv_flow_attr attr;
+  struct ibv_flow_spec_eth eth;
+};
+#pragma pack(pop)
+
+// Raw packet queue pair on the shared CQ, in RTS
+Qp create_raw_qp(struct rdma_context *ctx) {
+  Qp qp = QpBuilder::raw(ctx->pd)
+              .cq(ctx->cq)
+              .depth(10, RECV_SLOTS)
+              .create();
+  if (qp && qp.ready_raw(1))
+    qp.reset();
+  return qp;
+}
+
+// Steers UDP packets to filter->dst_port (and dst MAC / IP when set) from
+// src_ip (0 = any source) to qp. Returns NULL if the device rejects it.
+struct ibv_flow *install_udp_rule(struct ibv_qp *qp,
+                                  const struct flow_filter *filter,
+                                  uint32_t src_ip) {
+  struct udp_flow_rule rule = {};
+
+  rule.attr.type = IBV_FLOW_ATTR_NORMAL;
+  rule.attr.size = sizeof(rule);
+  rule.attr.num_of_specs = 3;
+  rule.attr.port = 1;
+
+  rule.eth.type = IBV_FLOW_SPEC_ETH;
+  rule.eth.size = sizeof(rule.eth);
+  rule.eth.val.ether_type = htons(ETHERTYPE_IP);
+  rule.eth.mask.ether_type = 0xffff;
+  if (filter->has_dst_mac) {
+    memcpy(rule.eth.val.dst_mac, filter->dst_mac, 6);
+    memset(rule.eth.mask.dst_mac, 0xff, 6);
   }
 
-  // Open device
-  ctx->context = ibv_open_device(ctx->dev_list[0]);
-  if (!ctx->context) {
-    fprintf(stderr, "Failed to open device\n");
-    return -1;
+  rule.ipv4.type = IBV_FLOW_SPEC_IPV4;
+  rule.ipv4.size = sizeof(rule.ipv4);
+  if (filter->dst_ip) {
+    rule.ipv4.val.dst_ip = filter->dst_ip;
+    rule.ipv4.mask.dst_ip = 0xffffffff;
+  }
+  if (src_ip) {
+    rule.ipv4.val.src_ip = src_ip;
+    rule.ipv4.mask.src_ip = 0xffffffff;
+  }
+
+  rule.udp.type = IBV_FLOW_SPEC_UDP;
+  rule.udp.size = sizeof(rule.udp);
+  rule.udp.val.dst_port = htons(filter->dst_port);
+  rule.udp.mask.dst_port = 0xffff;
+
+  return ibv_create_flow(qp, &rule.attr);
+}
+
+// Broadest rule the device accepts for the software filter: everything to
+// our MAC if one was given, otherwise all otherwise-unsteered traffic.
+struct ibv_flow *install_catch_all_rule(struct ibv_qp *qp,
+                                        const struct flow_filter *filter) {
+  struct eth_flow_rule rule = {};
+  struct ibv_flow *flow;
+
+  rule.attr.size = sizeof(rule.attr);
+  rule.attr.port = 1;
+
+  if (filter->has_dst_mac) {
+    rule.attr.type = IBV_FLOW_ATTR_NORMAL;
+    rule.attr.size = sizeof(rule);
+    rule.attr.num_of_specs = 1;
+    rule.eth.type = IBV_FLOW_SPEC_ETH;
+    rule.eth.size = sizeof(rule.eth);
+    memcpy(rule.eth.val.dst_mac, filter->dst_mac, 6);
+    memset(rule.eth.mask.dst_mac, 0xff, 6);
+
+    flow = ibv_create_flow(qp, &rule.attr);
+    if (flow)
+      return flow;
+
+    rule.attr.size = sizeof(rule.attr);
+    rule.attr.num_of_specs = 0;
+  }
+
+  rule.attr.type = IBV_FLOW_ATTR_ALL_DEFAULT;
+  return ibv_create_flow(qp, &rule.attr);
+}
+
+// Tries to filter in hardware with one rule per flow. If any rule is
+// rejected, removes them all and falls back to a catch-all rule on the
+// first flow plus software filtering.
+void install_flow_rules(struct rdma_context *ctx,
+                        const struct flow_filter *filter) {
+  int i;
+
+  for (i = 0; i < ctx->num_flows; i++) {
+    struct rx_flow *f = &ctx->flows[i];
+    f->flow = install_udp_rule(f->qp, filter, f->src_ip);
+    if (!f->flow)
+      break;
+  }
+
+  if (i == ctx->num_flows) {
+    printf("Flow steering: %d hardware rule(s) installed\n", ctx->num_flows);
+    return;
+  }
+
+  perror("ibv_create_flow");
+  printf("Flow steering rule rejected, falling back to software "
+         "filtering\n");
+  for (int j = 0; j < i; j++) {
+    ibv_destroy_flow(ctx->flows[j].flow);
+    ctx->flows[j].flow = NULL;
   }
 
+  ctx->sw_filter = 1;
+  ctx->catch_all = install_catch_all_rule(ctx->flows[0].qp, filter);
+  if (!ctx->catch_all) {
+    perror("ibv_create_flow catch-all");
+    printf("Warning: no steering rule accepted; only traffic the device "
+           "delivers unsteered will arrive\n");
+  }
+}
+
+int init_rdma_context(struct rdma_context *ctx, int gid_idx,
+                      enum cq_wait_mode wait_mode,
+                      const struct flow_filter *filter) {
+  // Open the first device
+  ctx->dev = Device::open();
+  if (!ctx->dev)
+    return -1;
+
   // Allocate protection domain
-  ctx->pd = ibv_alloc_pd(ctx->context);
-  if (!ctx->pd) {
-    fprintf(stderr, "Failed to allocate PD\n");
+  ctx->pd = Pd::alloc(ctx->dev);
+  if (!ctx->pd)
     return -1;
+
+  // One flow per FPGA source IP, or a single flow for any source. They
+  // all share one CQ.
+  ctx->num_flows = filter->num_src_ips > 0 ? filter->num_src_ips : 1;
+  for (int i = 0; i < ctx->num_flows; i++)
+    ctx->flows[i].src_ip = filter->num_src_ips > 0 ? filter->src_ips[i] : 0;
+
+  if (ctx->striding) {
+    struct striding_rq_config mprq_cfg = {};
+    mprq_cfg.log_stride_size = MPRQ_LOG_STRIDE_SIZE;
+    mprq_cfg.log_num_strides = MPRQ_LOG_NUM_STRIDES;
+    mprq_cfg.num_wqes = MPRQ_NUM_WQES;
+
+    if (!striding_rq_supported(ctx->dev, &mprq_cfg)) {
+      printf("Striding RQ not supported by this device, using one buffer "
+             "per packet\n");
+      ctx->striding = 0;
+    } else if (striding_rq_init(&ctx->mprq, ctx->dev, ctx->pd,
+                                &mprq_cfg)) {
+      printf("Striding RQ setup failed, using one buffer per packet\n");
+      ctx->striding = 0;
+    } else {
+      // The waiter only keeps statistics and backs off; the striding RQ
+      // owns its CQ
+      if (wait_mode == CQ_WAIT_EVENT) {
+        printf("Striding RQ cannot wait for events, using adaptive "
+               "polling\n");
+        wait_mode = CQ_WAIT_ADAPTIVE;
+      }
+      cq_wait_init(&ctx->waiter, wait_mode);
+      for (int i = 0; i < ctx->num_flows; i++)
+        ctx->flows[i].qp = ctx->mprq.qp;
+
+      install_flow_rules(ctx, filter);
+      return 0;
+    }
   }
 
   // Create completion queue
-  ctx->cq = ibv_create_cq(ctx->context, 10, NULL, NULL, 0);
+  ctx->cq = cq_wait_create_cq(&ctx->waiter, ctx->dev,
+                              RECV_SLOTS * ctx->num_flows, wait_mode);
   if (!ctx->cq) {
     fprintf(stderr, "Failed to create CQ\n");
     return -1;
   }
 
-  // Allocate buffer
-  ctx->buffer = (char *)malloc(BUFFER_SIZE);
-  if (!ctx->buffer) {
-    fprintf(stderr, "Failed to allocate buffer\n");
+  // Register the receive buffers of every flow once, on the NIC's NUMA
+  // node, and keep all of them posted
+  struct buf_pool_config buf_cfg = {};
+  buf_cfg.num_slots = RECV_SLOTS * ctx->num_flows;
+  buf_cfg.slot_size = BUFFER_SIZE;
+  buf_cfg.numa_node = -1;
+  buf_cfg.access = IBV_ACCESS_LOCAL_WRITE;
+  if (buf_pool_init(&ctx->bufs, ctx->pd, &buf_cfg)) {
+    fprintf(stderr, "Failed to allocate receive buffers\n");
     return -1;
   }
-
-  // Register memory region
-  ctx->mr = ibv_reg_mr(ctx->pd, ctx->buffer, BUFFER_SIZE,
-                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
-  if (!ctx->mr) {
-    fprintf(stderr, "Failed to register MR\n");
-    return -1;
+  buf_pool_report(&ctx->bufs, "Receive buffers");
+
+  struct recv_pool_config pool_cfg = {};
+  pool_cfg.num_slots = RECV_SLOTS;
+  pool_cfg.slot_size = BUFFER_SIZE;
+  pool_cfg.refill_batch = RECV_REFILL_BATCH;
+
+  for (int i = 0; i < ctx->num_flows; i++) {
+    struct rx_flow *f = &ctx->flows[i];
+    f->owned_qp = create_raw_qp(ctx);
+    if (!f->owned_qp)
+      return -1;
+    f->qp = f->owned_qp;
+
+    if (recv_pool_init(&f->pool, &ctx->bufs, f->qp, NULL, &pool_cfg)) {
+      fprintf(stderr, "Failed to post receive buffers\n");
+      return -1;
+    }
   }
 
-  // Create raw packet queue pair
-  struct ibv_qp_init_attr qp_attr = {};
-  qp_attr.send_cq = ctx->cq;
-  qp_attr.recv_cq = ctx->cq;
-  qp_attr.qp_type = IBV_QPT_RAW_PACKET;
-  qp_attr.cap.max_send_wr = 10;
-  qp_attr.cap.max_recv_wr = 10;
-  qp_attr.cap.max_send_sge = 1;
-  qp_attr.cap.max_recv_sge = 1;
+  install_flow_rules(ctx, filter);
+  return 0;
+}
 
-  ctx->qp = ibv_create_qp(ctx->pd, &qp_attr);
-  if (!ctx->qp) {
-    fprintf(stderr, "Failed to create QP\n");
-    return -1;
+void cleanup_rdma_context(struct rdma_context *ctx) {
+  if (ctx->catch_all)
+    ibv_destroy_flow(ctx->catch_all);
+  for (int i = 0; i < ctx->num_flows; i++) {
+    struct rx_flow *f = &ctx->flows[i];
+    if (f->flow)
+      ibv_destroy_flow(f->flow);
+    f->owned_qp.reset();
+    recv_pool_destroy(&f->pool);
   }
+  buf_pool_destroy(&ctx->bufs);
+  if (ctx->striding)
+    striding_rq_destroy(&ctx->mprq);
+  cq_wait_destroy(&ctx->waiter);
+  ctx->pd.reset();
+  ctx->dev.reset();
+}
 
-  // Transition QP to INIT state
-  struct ibv_qp_attr attr = {};
-  attr.qp_state = IBV_QPS_INIT;
-  attr.port_num = 1;
-
-  if (ibv_modify_qp(ctx->qp, &attr, IBV_QP_STATE | IBV_QP_PORT)) {
-    fprintf(stderr, "Failed to modify QP to INIT\n");
-    return -1;
+// Flow whose QP a completion came from
+struct rx_flow *flow_for_qp(struct rdma_context *ctx, uint32_t qp_num) {
+  for (int i = 0; i < ctx->num_flows; i++) {
+    if (ctx->flows[i].qp->qp_num == qp_num)
+      return &ctx->flows[i];
   }
+  return NULL;
+}
 
-  // Transition QP to RTR state
-  memset(&attr, 0, sizeof(attr));
-  attr.qp_state = IBV_QPS_RTR;
-
-  if (ibv_modify_qp(ctx->qp, &attr, IBV_QP_STATE)) {
-    fprintf(stderr, "Failed to modify QP to RTR\n");
-    return -1;
+// Software version of the steering rules. Returns the flow the packet
+// belongs to, or NULL if it does not match.
+struct rx_flow *match_flow(struct rdma_context *ctx,
+                           const struct flow_filter *filter,
+                           const char *buffer, uint32_t len) {
+  if (len < sizeof(struct ether_header) + sizeof(struct iphdr))
+    return NULL;
+
+  const struct ether_header *eth = (const struct ether_header *)buffer;
+  if (ntohs(eth->ether_type) != ETHERTYPE_IP)
+    return NULL;
+  if (filter->has_dst_mac && memcmp(eth->ether_dhost, filter->dst_mac, 6))
+    return NULL;
+
+  const struct iphdr *ip =
+      (const struct iphdr *)(buffer + sizeof(struct ether_header));
+  uint32_t ip_len = ip->ihl * 4;
+  if (ip->protocol != IPPROTO_UDP ||
+      len < sizeof(struct ether_header) + ip_len + sizeof(struct udphdr))
+    return NULL;
+  if (filter->dst_ip && ip->daddr != filter->dst_ip)
+    return NULL;
+
+  const struct udphdr *udp =
+      (const struct udphdr *)(buffer + sizeof(struct ether_header) + ip_len);
+  if (ntohs(udp->dest) != filter->dst_port)
+    return NULL;
+
+  if (filter->num_src_ips == 0)
+    return &ctx->flows[0];
+  for (int i = 0; i < ctx->num_flows; i++) {
+    if (ctx->flows[i].src_ip == ip->saddr)
+      return &ctx->flows[i];
   }
+  return NULL;
+}
 
-  // Transition QP to RTS state
-  memset(&attr, 0, sizeof(attr));
-  attr.qp_state = IBV_QPS_RTS;
+// Counts and traces one received packet, the i-th of a batch parsed into
+// parsed, and prints it at DEBUG_PACKETS. owner is the flow whose QP it
+// arrived on, or NULL if several flows share the QP.
+void handle_packet(struct rdma_context *ctx, const struct flow_filter *filter,
+                   struct rx_flow *owner, const char *buffer, uint32_t len,
+                   const struct pkt_batch *parsed, int i) {
+  // Hardware rules already guarantee a match when each flow has its own QP
+  struct rx_flow *f = (ctx->sw_filter || !owner)
+                          ? match_flow(ctx, filter, buffer, len)
+                          : owner;
+  int ok = parsed->status[i] == PKT_OK; // custom header fields are valid
+  if (!f) {
+    ctx->filtered++;
+    trace_emit(ctx->trace, ctx->batch_ns, TRACE_EV_DROP, TRACE_DROP_FILTERED,
+               ok ? parsed->fpga_id[i] : 0, ok ? parsed->freq_channel[i] : 0,
+               ok ? parsed->sample_count[i] : 0, 1, 0);
+    return;
+  }
 
-  if (ibv_modify_qp(ctx->qp, &attr, IBV_QP_STATE)) {
-    fprintf(stderr, "Failed to modify QP to RTS\n");
-    return -1;
+  f->packets++;
+  if (!ok) {
+    // counted by status in ctx->parse_stats
+    trace_emit(ctx->trace, ctx->batch_ns, TRACE_EV_DROP,
+               TRACE_DROP_BAD_FRAME, 0, 0, 0, 1, parsed->status[i]);
+    return;
   }
 
-  return 0;
+  trace_emit(ctx->trace, ctx->batch_ns, TRACE_EV_RX, TRACE_DROP_NONE,
+             parsed->fpga_id[i], parsed->freq_channel[i],
+             parsed->sample_count[i], 1, 0);
+  if (ctx->debug_level >= DEBUG_PACKETS)
+    printf("Received packet: sample_count=%llu, fpga_id=%u, "
+           "freq_channel=%u, payload=%u bytes\n",
+           (unsigned long long)parsed->sample_count[i], parsed->fpga_id[i],
+           parsed->freq_channel[i], parsed->payload_size[i]);
 }
 
-int post_recv(struct rdma_context *ctx) {
-  struct ibv_sge sge = {};
-  sge.addr = (uintptr_t)ctx->buffer;
-  sge.length = BUFFER_SIZE;
-  sge.lkey = ctx->mr->lkey;
-
-  struct ibv_recv_wr wr = {};
-  wr.wr_id = 1;
-  wr.sg_list = &sge;
-  wr.num_sge = 1;
+void print_flow_stats(struct rdma_context *ctx) {
+  for (int i = 0; i < ctx->num_flows; i++) {
+    struct rx_flow *f = &ctx->flows[i];
+    char src[INET_ADDRSTRLEN] = "any";
+    if (f->src_ip)
+      inet_ntop(AF_INET, &f->src_ip, src, sizeof(src));
+    printf("  Flow %d (src %s, %s): Packets=%llu\n", i, src,
+           f->flow ? "hardware" : "software", f->packets);
+  }
+  if (ctx->sw_filter || ctx->striding)
+    printf("  Rejected by software filter: %llu\n", ctx->filtered);
+  pkt_stats_report(&ctx->parse_stats, "  ");
+  if (ctx->striding)
+    printf("  Striding RQ: Packets=%llu, Fillers=%llu, Errors=%llu, "
+           "WQE reposts=%llu\n",
+           (unsigned long long)ctx->mprq.packets,
+           (unsigned long long)ctx->mprq.fillers,
+           (unsigned long long)ctx->mprq.errors,
+           (unsigned long long)ctx->mprq.reposts);
+}
 
-  struct ibv_recv_wr *bad_wr;
-  return ibv_post_recv(ctx->qp, &wr, &bad_wr);
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void cleanup_rdma_context(struct rdma_context *ctx) {
-  if (ctx->qp)
-    ibv_destroy_qp(ctx->qp);
-  if (ctx->mr)
-    ibv_dereg_mr(ctx->mr);
-  if (ctx->buffer)
-    free(ctx->buffer);
-  if (ctx->cq)
-    ibv_destroy_cq(ctx->cq);
-  if (ctx->pd)
-    ibv_dealloc_pd(ctx->pd);
-  if (ctx->context)
-    ibv_close_device(ctx->context);
-  if (ctx->dev_list)
-    ibv_free_device_list(ctx->dev_list);
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-S] [-m dst_mac] [-d dst_ip] [-p dst_port] "
+          "[-s src_ip]...\n"
+          "          [-t trace_file] [-D level] [gid_idx] "
+          "[busy|adaptive|event]\n"
+          "  -S  receive many packets per WQE with a striding RQ "
+          "(mlx5 only)\n"
+          "  -m  only accept frames to this MAC (aa:bb:cc:dd:ee:ff)\n"
+          "  -d  only accept packets to this IPv4 address\n"
+          "  -p  UDP destination port (default %d)\n"
+          "  -s  FPGA source IP; each one gets its own QP and rule "
+          "(up to %d)\n"
+          "  -t  record every packet received and dropped in a binary "
+          "trace file,\n"
+          "      written in the background (see trace_decode)\n"
+          "  -D  debug level: 1 prints every packet received, at a large "
+          "cost in\n"
+          "      throughput (default 0)\n",
+          prog, UDP_PORT, MAX_FLOWS);
 }
 
 int main(int argc, char *argv[]) {
   struct rdma_context ctx = {};
-  int gid_idx = (argc > 1) ? atoi(argv[1]) : 0;
-
-  printf("RDMA Raw Packet Server starting (GID index: %d)...\n", gid_idx);
+  struct flow_filter filter = {};
+  enum cq_wait_mode wait_mode = CQ_WAIT_ADAPTIVE;
+  struct trace_log trace;
+  const char *trace_path = NULL;
+  int opt;
+
+  filter.dst_port = UDP_PORT;
+
+  while ((opt = getopt(argc, argv, "Sm:d:p:s:t:D:h")) != -1) {
+    switch (opt) {
+    case 'S':
+      ctx.striding = 1;
+      break;
+    case 'm':
+      if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &filter.dst_mac[0],
+                 &filter.dst_mac[1], &filter.dst_mac[2], &filter.dst_mac[3],
+                 &filter.dst_mac[4], &filter.dst_mac[5]) != 6) {
+        usage(argv[0]);
+        return 1;
+      }
+      filter.has_dst_mac = 1;
+      break;
+    case 'd':
+      if (inet_pton(AF_INET, optarg, &filter.dst_ip) != 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'p':
+      filter.dst_port = atoi(optarg);
+      break;
+    case 's':
+      if (filter.num_src_ips == MAX_FLOWS ||
+          inet_pton(AF_INET, optarg, &filter.src_ips[filter.num_src_ips]) !=
+              1) {
+        usage(argv[0]);
+        return 1;
+      }
+      filter.num_src_ips++;
+      break;
+    case 't':
+      trace_path = optarg;
+      break;
+    case 'D':
+      ctx.debug_level = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
 
-  if (init_rdma_context(&ctx, gid_idx) < 0) {
-    fprintf(stderr, "Failed to initialize RDMA context\n");
+  int gid_idx = (optind < argc) ? atoi(argv[optind]) : 0;
+  if (optind + 1 < argc &&
+      cq_wait_parse_mode(argv[optind + 1], &wait_mode) < 0) {
+    usage(argv[0]);
     return 1;
   }
 
-  // Post receive work request
-  if (post_recv(&ctx) < 0) {
-    fprintf(stderr, "Failed to post receive\n");
+  printf("RDMA Raw Packet Server starting (GID index: %d, wait mode: %s)...\n",
+         gid_idx, cq_wait_mode_name(wait_mode));
+
+  if (init_rdma_context(&ctx, gid_idx, wait_mode, &filter) < 0) {
+    fprintf(stderr, "Failed to initialize RDMA context\n");
     cleanup_rdma_context(&ctx);
     return 1;
   }
 
-  printf("Server listening for packets...\n");
+  if (trace_path) {
+    if (trace_open(&trace, trace_path) < 0) {
+      cleanup_rdma_context(&ctx);
+      return 1;
+    }
+    ctx.trace = trace_ring_create(&trace);
+    printf("Tracing packets to %s\n", trace_path);
+  }
+
+  if (ctx.striding)
+    printf("Server listening for UDP port %d on %d flow(s), striding RQ of "
+           "%d x %d strides of %d bytes...\n",
+           filter.dst_port, ctx.num_flows, MPRQ_NUM_WQES,
+           1 << MPRQ_LOG_NUM_STRIDES, 1 << MPRQ_LOG_STRIDE_SIZE);
+  else
+    printf("Server listening for UDP port %d on %d flow(s), %d receive "
+           "buffers posted each...\n",
+           filter.dst_port, ctx.num_flows, RECV_SLOTS);
+
+  double last_report = now_seconds();
+  uint32_t empty_polls = 0;
 
-  // Poll for completion
+  // Wait for completions
   while (1) {
-    struct ibv_wc wc;
-    int ret = ibv_poll_cq(ctx.cq, 1, &wc);
+    if (ctx.striding) {
+      // Packets are handled in place in the strides; the WQEs they filled
+      // are reposted by the next poll
+      struct striding_rq_pkt pkts[STRIDING_RQ_MAX_BATCH];
+      int n = striding_rq_poll(&ctx.mprq, pkts, STRIDING_RQ_MAX_BATCH);
+      if (n < 0) {
+        fprintf(stderr, "Striding RQ poll failed\n");
+        break;
+      }
+      cq_wait_note_poll(&ctx.waiter, n, &empty_polls);
+
+      const uint8_t *frames[STRIDING_RQ_MAX_BATCH];
+      uint32_t lens[STRIDING_RQ_MAX_BATCH];
+      struct pkt_batch parsed;
+      for (int i = 0; i < n; i++) {
+        frames[i] = (const uint8_t *)pkts[i].data;
+        lens[i] = pkts[i].len;
+      }
+      pkt_parse_batch(frames, lens, n, 0, &parsed, &ctx.parse_stats);
+      if (ctx.trace)
+        ctx.batch_ns = trace_now_ns();
+
+      for (int i = 0; i < n; i++)
+        handle_packet(&ctx, &filter, NULL, pkts[i].data, pkts[i].len,
+                      &parsed, i);
+
+      double now = now_seconds();
+      if (now - last_report >= STATS_INTERVAL_S) {
+        cq_wait_report(&ctx.waiter, now - last_report);
+        print_flow_stats(&ctx);
+        last_report = now;
+      }
+      continue;
+    }
+
+    struct ibv_wc wcs[CQ_WAIT_BATCH];
+    int ret = cq_wait_poll(&ctx.waiter, wcs);
+
+    if (ret < 0) {
+      fprintf(stderr, "Poll CQ failed\n");
+      break;
+    }
+
+    // Successful completions are parsed as one batch; their buffers are
+    // released once handled, failed ones straight away
+    const uint8_t *frames[CQ_WAIT_BATCH];
+    uint32_t lens[CQ_WAIT_BATCH];
+    struct ibv_wc *good[CQ_WAIT_BATCH];
+    struct rx_flow *owners[CQ_WAIT_BATCH];
+    struct pkt_batch parsed;
+    int num_good = 0;
+
+    for (int i = 0; i < ret; i++) {
+      struct ibv_wc &wc = wcs[i];
+      struct rx_flow *owner = flow_for_qp(&ctx, wc.qp_num);
+      if (!owner)
+        continue;
 
-    if (ret > 0) {
       if (wc.status == IBV_WC_SUCCESS) {
-        printf("Received packet of %d bytes\n", wc.byte_len);
-
-        // Parse Ethernet header
-        struct ether_header *eth = (struct ether_header *)ctx.buffer;
-        if (ntohs(eth->ether_type) == ETHERTYPE_IP) {
-          struct iphdr *ip =
-              (struct iphdr *)(ctx.buffer + sizeof(struct ether_header));
-          if (ip->protocol == IPPROTO_UDP) {
-            struct udphdr *udp =
-                (struct udphdr *)(ctx.buffer + sizeof(struct ether_header) +
-                                  sizeof(struct iphdr));
-            char *payload = ctx.buffer + sizeof(struct ether_header) +
-                            sizeof(struct iphdr) + sizeof(struct udphdr);
-            int payload_len = wc.byte_len - sizeof(struct ether_header) -
-                              sizeof(struct iphdr) - sizeof(struct udphdr);
-
-            printf("UDP packet from port %d to port %d\n", ntohs(udp->source),
-                   ntohs(udp->dest));
-            printf("Payload (%d bytes): %.*s\n", payload_len, payload_len,
-                   payload);
-          }
-        }
-
-        // Post another receive
-        post_recv(&ctx);
+        frames[num_good] =
+            (const uint8_t *)recv_pool_buf(&owner->pool, wc.wr_id);
+        lens[num_good] = wc.byte_len;
+        good[num_good] = &wc;
+        owners[num_good++] = owner;
       } else {
         fprintf(stderr, "Completion with error: %s\n",
                 ibv_wc_status_str(wc.status));
+        recv_pool_release(&owner->pool, wc.wr_id);
       }
-    } else if (ret < 0) {
-      fprintf(stderr, "Poll CQ failed\n");
-      break;
     }
 
-    usleep(1000); // Small delay to prevent busy waiting
+    pkt_parse_batch(frames, lens, num_good, 0, &parsed, &ctx.parse_stats);
+    if (ctx.trace)
+      ctx.batch_ns = trace_now_ns();
+    for (int i = 0; i < num_good; i++) {
+      handle_packet(&ctx, &filter, owners[i], (const char *)frames[i],
+                    lens[i], &parsed, i);
+      recv_pool_release(&owners[i]->pool, good[i]->wr_id);
+    }
+
+    // Repost consumed buffers in one batch per sweep
+    int failed = 0;
+    for (int i = 0; i < ctx.num_flows; i++) {
+      if (recv_pool_replenish(&ctx.flows[i].pool, false) < 0)
+        failed = 1;
+    }
+    if (failed)
+      break;
+
+    double now = now_seconds();
+    if (now - last_report >= STATS_INTERVAL_S) {
+      cq_wait_report(&ctx.waiter, now - last_report);
+      print_flow_stats(&ctx);
+      last_report = now;
+    }
   }
 
+  if (trace_path)
+    trace_close(&trace);
   cleanup_rdma_context(&ctx);
   return 0;
 }
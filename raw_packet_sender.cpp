@@ -1,45 +1,350 @@
-#include <arpa/inet.h>
+#include <infiniband/verbs.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
 #include <unistd.h>
 
-#define UDP_PORT 12345
+#include "pacer.h"
+#include "pcap_file.h"
+#include "buf_pool.h"
+#include "send_engine.h"
+
+#define SEND_QUEUE_DEPTH 512
+#define SEND_BATCH 32
+#define SIGNAL_INTERVAL 64
+#define MAX_FRAME_SIZE 9216
+#define FRAME_ALIGN 64
+
+// Replays the frames of a pcap file unchanged through a raw packet QP. The
+// frames are copied once into a registered arena, each starting on its own
+// cache line, and sent straight from there by the send engine: chained
+// batches with one doorbell each and a completion every SIGNAL_INTERVAL
+// frames.
+
+struct rdma_context {
+  struct ibv_device **dev_list;
+  struct ibv_context *context;
+  struct ibv_pd *pd;
+  struct ibv_cq *cq;
+  struct ibv_qp *qp;
+
+  char *arena;
+  size_t arena_mapped; // huge page backed, on the NIC's NUMA node
+  struct ibv_mr *mr;
+  struct ibv_sge *frames; // one per sendable frame, pointing into arena
+  uint64_t *timestamps;   // capture time of each entry in frames
+  uint32_t num_frames;
+
+  struct send_engine engine;
+};
+
+struct ibv_qp *create_raw_qp(struct rdma_context *ctx) {
+  // Create raw packet queue pair
+  struct ibv_qp_init_attr qp_attr = {};
+  qp_attr.send_cq = ctx->cq;
+  qp_attr.recv_cq = ctx->cq;
+  qp_attr.qp_type = IBV_QPT_RAW_PACKET;
+  qp_attr.sq_sig_all = 0;
+  qp_attr.cap.max_send_wr = SEND_QUEUE_DEPTH;
+  qp_attr.cap.max_recv_wr = 1;
+  qp_attr.cap.max_send_sge = 1;
+  qp_attr.cap.max_recv_sge = 1;
+
+  struct ibv_qp *qp = ibv_create_qp(ctx->pd, &qp_attr);
+  if (!qp) {
+    fprintf(stderr, "Failed to create QP\n");
+    return NULL;
+  }
+
+  // Transition QP to INIT state
+  struct ibv_qp_attr attr = {};
+  attr.qp_state = IBV_QPS_INIT;
+  attr.port_num = 1;
+
+  if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PORT)) {
+    fprintf(stderr, "Failed to modify QP to INIT\n");
+    ibv_destroy_qp(qp);
+    return NULL;
+  }
+
+  // Transition QP to RTR state
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_RTR;
+
+  if (ibv_modify_qp(qp, &attr, IBV_QP_STATE)) {
+    fprintf(stderr, "Failed to modify QP to RTR\n");
+    ibv_destroy_qp(qp);
+    return NULL;
+  }
+
+  // Transition QP to RTS state
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_RTS;
+
+  if (ibv_modify_qp(qp, &attr, IBV_QP_STATE)) {
+    fprintf(stderr, "Failed to modify QP to RTS\n");
+    ibv_destroy_qp(qp);
+    return NULL;
+  }
+
+  return qp;
+}
+
+// Copies every frame of pf that fits in MAX_FRAME_SIZE into one registered
+// arena and builds the SGE list the send loop posts from
+int load_frames(struct rdma_context *ctx, const struct pcap_file *pf) {
+  size_t arena_size = 0;
+  for (uint32_t i = 0; i < pf->num_frames; i++) {
+    uint32_t len = pf->frames[i].len;
+    if (len <= MAX_FRAME_SIZE)
+      arena_size += (len + FRAME_ALIGN - 1) & ~(FRAME_ALIGN - 1);
+  }
+  if (arena_size == 0) {
+    fprintf(stderr, "No frames of at most %d bytes to send\n",
+            MAX_FRAME_SIZE);
+    return -1;
+  }
+
+  size_t page_size;
+  ctx->arena = (char *)buf_pool_map(arena_size,
+                                    buf_pool_device_node(ctx->context),
+                                    &ctx->arena_mapped, &page_size);
+  ctx->frames =
+      (struct ibv_sge *)malloc(pf->num_frames * sizeof(struct ibv_sge));
+  ctx->timestamps = (uint64_t *)malloc(pf->num_frames * sizeof(uint64_t));
+  if (!ctx->arena || !ctx->frames || !ctx->timestamps) {
+    fprintf(stderr, "Failed to allocate %zu byte frame arena\n", arena_size);
+    return -1;
+  }
+
+  ctx->mr = ibv_reg_mr(ctx->pd, ctx->arena, arena_size,
+                       IBV_ACCESS_LOCAL_WRITE);
+  if (!ctx->mr) {
+    perror("ibv_reg_mr");
+    return -1;
+  }
+
+  size_t offset = 0;
+  uint32_t skipped = 0;
+  for (uint32_t i = 0; i < pf->num_frames; i++) {
+    uint32_t len = pf->frames[i].len;
+    if (len > MAX_FRAME_SIZE) {
+      skipped++;
+      continue;
+    }
+
+    memcpy(ctx->arena + offset, pcap_frame_data(pf, i), len);
+    struct ibv_sge *sge = &ctx->frames[ctx->num_frames];
+    sge->addr = (uintptr_t)(ctx->arena + offset);
+    sge->length = len;
+    sge->lkey = ctx->mr->lkey;
+    ctx->timestamps[ctx->num_frames] = pf->frames[i].ts_ns;
+    ctx->num_frames++;
+    offset += (len + FRAME_ALIGN - 1) & ~(FRAME_ALIGN - 1);
+  }
+
+  if (skipped)
+    printf("Skipped %u frame(s) larger than %d bytes\n", skipped,
+           MAX_FRAME_SIZE);
+  return 0;
+}
+
+int init_rdma_context(struct rdma_context *ctx, uint32_t batch) {
+  int num_devices;
+
+  // Get device list
+  ctx->dev_list = ibv_get_device_list(&num_devices);
+  if (!ctx->dev_list || num_devices == 0) {
+    fprintf(stderr, "No RDMA devices found\n");
+    return -1;
+  }
+
+  // Open device
+  ctx->context = ibv_open_device(ctx->dev_list[0]);
+  if (!ctx->context) {
+    fprintf(stderr, "Failed to open device\n");
+    return -1;
+  }
+
+  // Allocate protection domain
+  ctx->pd = ibv_alloc_pd(ctx->context);
+  if (!ctx->pd) {
+    fprintf(stderr, "Failed to allocate PD\n");
+    return -1;
+  }
+
+  // Create completion queue, deep enough for a flushed send queue
+  ctx->cq = ibv_create_cq(ctx->context, SEND_QUEUE_DEPTH, NULL, NULL, 0);
+  if (!ctx->cq) {
+    fprintf(stderr, "Failed to create CQ\n");
+    return -1;
+  }
+
+  ctx->qp = create_raw_qp(ctx);
+  if (!ctx->qp)
+    return -1;
+
+  // Frames are sent from the arena, so the engine needs no buffer pool
+  struct send_engine_config cfg = {};
+  cfg.sq_depth = SEND_QUEUE_DEPTH;
+  cfg.batch = batch;
+  cfg.signal_interval = SIGNAL_INTERVAL;
+  cfg.buf_size = 0;
+  return send_engine_init(&ctx->engine, NULL, ctx->qp, ctx->cq, &cfg);
+}
+
+void cleanup_rdma_context(struct rdma_context *ctx) {
+  if (ctx->qp)
+    ibv_destroy_qp(ctx->qp);
+  send_engine_destroy(&ctx->engine);
+  if (ctx->mr)
+    ibv_dereg_mr(ctx->mr);
+  buf_pool_unmap(ctx->arena, ctx->arena_mapped);
+  free(ctx->frames);
+  free(ctx->timestamps);
+  if (ctx->cq)
+    ibv_destroy_cq(ctx->cq);
+  if (ctx->pd)
+    ibv_dealloc_pd(ctx->pd);
+  if (ctx->context)
+    ibv_close_device(ctx->context);
+  if (ctx->dev_list)
+    ibv_free_device_list(ctx->dev_list);
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-t | -x speed | -r pps | -g gbps] [-l loops] "
+          "[-b batch] <pcap_file>\n"
+          "  -t  keep the capture's inter-frame gaps\n"
+          "  -x  keep the capture's gaps, sped up by this factor\n"
+          "  -r  send at a fixed packet rate\n"
+          "  -g  send at a fixed bit rate, counting Ethernet framing\n"
+          "      (default: as fast as possible)\n"
+          "  -l  replay the capture this many times (default 1)\n"
+          "  -b  frames posted per doorbell (default %d, max %d)\n",
+          prog, SEND_BATCH, SEND_ENGINE_MAX_BATCH);
+}
 
 int main(int argc, char *argv[]) {
-  int sockfd;
-  struct sockaddr_in server_addr;
-  const char *message = "Hello from UDP client!";
-  const char *server_ip = (argc > 1) ? argv[1] : "127.0.0.1";
+  struct rdma_context ctx = {};
+  struct pcap_file pf;
+  enum pace_mode mode = PACE_MAX;
+  double rate = 0;
+  unsigned long loops = 1;
+  uint32_t batch = SEND_BATCH;
+  int opt;
 
-  printf("UDP Client sending to %s:%d\n", server_ip, UDP_PORT);
+  while ((opt = getopt(argc, argv, "tx:r:g:l:b:h")) != -1) {
+    switch (opt) {
+    case 't':
+      mode = PACE_PCAP;
+      rate = 1.0;
+      break;
+    case 'x':
+      mode = PACE_PCAP;
+      rate = atof(optarg);
+      break;
+    case 'r':
+      mode = PACE_PPS;
+      rate = atof(optarg);
+      break;
+    case 'g':
+      mode = PACE_BPS;
+      rate = atof(optarg) * 1e9;
+      break;
+    case 'l':
+      loops = strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      batch = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
 
-  // Create UDP socket
-  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-  if (sockfd < 0) {
-    perror("socket");
+  if (optind >= argc || loops == 0 ||
+      (mode != PACE_MAX && rate <= 0)) {
+    usage(argv[0]);
     return 1;
   }
 
-  // Setup server address
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(UDP_PORT);
-  server_addr.sin_addr.s_addr = inet_addr(server_ip);
-
-  // Send message
-  ssize_t sent = sendto(sockfd, message, strlen(message), 0,
-                        (struct sockaddr *)&server_addr, sizeof(server_addr));
+  if (pcap_file_open(&pf, argv[optind]) < 0)
+    return 1;
+  if (pf.linktype != PCAP_LINKTYPE_ETHERNET) {
+    fprintf(stderr, "%s: link type %u is not Ethernet\n", argv[optind],
+            pf.linktype);
+    pcap_file_close(&pf);
+    return 1;
+  }
+  printf("Loaded %u frames (%llu bytes) from %s\n", pf.num_frames,
+         (unsigned long long)pf.total_bytes, argv[optind]);
 
-  if (sent < 0) {
-    perror("sendto");
-    close(sockfd);
+  if (init_rdma_context(&ctx, batch) < 0 || load_frames(&ctx, &pf) < 0) {
+    fprintf(stderr, "Failed to initialize RDMA context\n");
+    cleanup_rdma_context(&ctx);
+    pcap_file_close(&pf);
     return 1;
   }
+  pcap_file_close(&pf);
 
-  printf("Sent UDP packet: '%s' (%zd bytes)\n", message, sent);
+  struct pacer pacer;
+  pacer_init(&pacer, mode, rate);
 
-  close(sockfd);
-  return 0;
+  uint64_t total = (uint64_t)ctx.num_frames * loops;
+  uint64_t sent = 0, bytes = 0;
+  uint32_t idx = 0;
+  int failed = 0;
+
+  uint64_t start = pacer_now_ns();
+  uint64_t due = pacer_next(&pacer, ctx.timestamps[0], ctx.frames[0].length);
+
+  while (sent < total) {
+    pacer_wait(&pacer, due);
+    uint64_t now = pacer_now_ns();
+
+    // Everything already due goes out under one doorbell. Frames are
+    // contiguous in the SGE list until the capture wraps around.
+    uint32_t first = idx, n = 0;
+    do {
+      bytes += ctx.frames[idx].length;
+      n++;
+      if (++idx == ctx.num_frames)
+        idx = 0;
+      if (sent + n < total)
+        due = pacer_next(&pacer, ctx.timestamps[idx],
+                         ctx.frames[idx].length);
+    } while (n < batch && sent + n < total && idx != 0 && due <= now);
+
+    if (send_engine_post_bufs(&ctx.engine, &ctx.frames[first], n,
+                              sent + n == total) < 0) {
+      failed = 1;
+      break;
+    }
+    sent += n;
+  }
+
+  if (send_engine_drain(&ctx.engine) < 0)
+    failed = 1;
+  double elapsed = (pacer_now_ns() - start) / 1e9;
+
+  printf("\n=== Summary ===\n");
+  printf("Frames sent: %llu (%lu loop(s) of %u)\n", (unsigned long long)sent,
+         loops, ctx.num_frames);
+  printf("Send errors: %llu\n", (unsigned long long)ctx.engine.errors);
+  printf("Elapsed: %.3f s, %.3f Mpps, %.3f Gbit/s on the wire\n", elapsed,
+         elapsed > 0 ? sent / elapsed / 1e6 : 0.0,
+         elapsed > 0 ? (bytes + sent * ETH_WIRE_OVERHEAD) * 8 / elapsed / 1e9
+                     : 0.0);
+  if (mode == PACE_PPS)
+    printf("Target: %.3f Mpps\n", rate / 1e6);
+  else if (mode == PACE_BPS)
+    printf("Target: %.3f Gbit/s\n", rate / 1e9);
+  pacer_report(&pacer);
+
+  cleanup_rdma_context(&ctx);
+  return failed ? 1 : 0;
 }
@@ -0,0 +1,291 @@
+#ifndef RC_RING_H
+#define RC_RING_H
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buf_pool.h"
+#include "verbs.h"
+
+// Receiving side of the RC write path.
+//
+// Each sender gets its own RC QP and its own ring of fixed-size slots, one
+// slot of a buf_pool registered for remote write, and RDMA WRITEs its
+// messages straight into consecutive slots (see send_engine_set_ring_dest()
+// for the sending side). Only the last write of each chain carries
+// immediate data, the index of the slot it wrote; it consumes one of the
+// buffer-less receives posted on the QP and raises the only completion the
+// receiver sees. RC delivers in order, so every slot up to that one holds a
+// message by then.
+//
+// Flow control is by credit: after each sweep rc_ring_flush() RDMA WRITEs
+// the number of slots consumed so far, inline, into a word the sender
+// registered and offered in its QpEndpoint, and the sender never runs more
+// than a ring ahead of it. The data path has no per-message receive WR and
+// no copy; the receiver reads messages where they land.
+//
+// Peers are added by rc_ring_accept() on the side channel's thread while
+// the owner polls the CQ on its own; a peer is published only once its QP
+// is connected.
+
+#define RC_RING_MAX_PEERS 16
+#define RC_RING_CREDIT_DEPTH 8 // credit writes in flight per peer
+#define RC_RING_POST_BATCH 64
+
+struct rc_ring_config {
+  uint32_t slots;     // per peer
+  uint32_t slot_size; // largest message
+  uint8_t port;
+  uint8_t gid_index;
+};
+
+struct rc_ring_peer {
+  Qp qp;
+  uint32_t qpn;
+  uint32_t pool_slot; // buf_pool slot holding the ring
+  char *ring;
+
+  uint32_t next_slot;      // first slot not yet handed out
+  uint32_t notify_used;    // receives consumed, to be reposted
+  uint64_t consumed;       // slots handed out so far
+  uint64_t credited;       // consumed, as last written back
+  uint32_t credit_pending; // credit writes not yet completed
+  uint64_t credit_addr;    // the sender's credit word
+  uint32_t credit_rkey;
+};
+
+struct rc_ring_receiver {
+  struct ibv_pd *pd;
+  struct ibv_cq *cq;
+  struct rc_ring_config cfg;
+  QpEndpoint local; // LID and GID for replies
+  ibv_mtu mtu;
+  struct buf_pool rings;
+
+  struct rc_ring_peer peers[RC_RING_MAX_PEERS];
+  uint32_t num_peers; // published with release ordering
+  uint64_t rejected;
+};
+
+// Called with each message's peer index, address and length. Messages of
+// one chain all get the length of its last one, which is what the
+// completion reports; send_engine_post() sends one length per call.
+typedef void (*rc_ring_msg_fn)(void *arg, uint32_t peer, const char *msg,
+                               uint32_t length);
+
+// Posts n receives without buffers, for WRITE_WITH_IMM notifications.
+// Returns 0, or -1 on error.
+static inline int rc_ring_post_notify(struct rc_ring_peer *peer, uint32_t n) {
+  struct ibv_recv_wr wrs[RC_RING_POST_BATCH];
+
+  while (n > 0) {
+    uint32_t batch = n < RC_RING_POST_BATCH ? n : RC_RING_POST_BATCH;
+    for (uint32_t i = 0; i < batch; i++) {
+      memset(&wrs[i], 0, sizeof(wrs[i]));
+      wrs[i].next = (i + 1 < batch) ? &wrs[i + 1] : NULL;
+    }
+    if (peer->qp.post_recv(&wrs[0])) {
+      perror("rc_ring: ibv_post_recv");
+      return -1;
+    }
+    n -= batch;
+  }
+  return 0;
+}
+
+// Maps and registers RC_RING_MAX_PEERS rings. Returns 0 on success, -1 on
+// failure (with nothing left allocated).
+static inline int rc_ring_init(struct rc_ring_receiver *rx, const Device &dev,
+                               struct ibv_pd *pd, struct ibv_cq *cq,
+                               const struct rc_ring_config *cfg) {
+  rx->pd = pd;
+  rx->cq = cq;
+  rx->cfg = *cfg;
+  rx->num_peers = 0;
+  rx->rejected = 0;
+  memset(&rx->local, 0, sizeof(rx->local));
+  if (dev.port_address(cfg->port, cfg->gid_index, &rx->local))
+    return -1;
+  rx->mtu = dev.active_mtu(cfg->port);
+
+  // Slots are padded to BUF_POOL_SLOT_ALIGN, which senders must know
+  rx->cfg.slot_size = (cfg->slot_size + BUF_POOL_SLOT_ALIGN - 1) &
+                      ~(uint32_t)(BUF_POOL_SLOT_ALIGN - 1);
+
+  struct buf_pool_config pool_cfg;
+  pool_cfg.num_slots = RC_RING_MAX_PEERS;
+  pool_cfg.slot_size = rx->cfg.slots * rx->cfg.slot_size;
+  pool_cfg.numa_node = -1;
+  pool_cfg.access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+  return buf_pool_init(&rx->rings, pd, &pool_cfg);
+}
+
+// Sets up a ring and a connected RC QP for the sender described by remote
+// and fills in reply. Has the oob_client_fn signature, with the receiver
+// as arg. Returns 0, or -1 to turn the sender away.
+static inline int rc_ring_accept(void *arg, const QpEndpoint *remote,
+                                 QpEndpoint *reply) {
+  struct rc_ring_receiver *rx = (struct rc_ring_receiver *)arg;
+  uint32_t idx = rx->num_peers;
+
+  if (remote->rkey == 0 || remote->length < sizeof(uint64_t)) {
+    fprintf(stderr, "rc_ring: peer offers no credit word, not in RC mode?\n");
+    rx->rejected++;
+    return -1;
+  }
+  if (idx == RC_RING_MAX_PEERS) {
+    fprintf(stderr, "rc_ring: already serving %d peers\n", RC_RING_MAX_PEERS);
+    rx->rejected++;
+    return -1;
+  }
+
+  struct rc_ring_peer *peer = &rx->peers[idx];
+  peer->pool_slot = buf_pool_alloc(&rx->rings);
+  if (peer->pool_slot == BUF_POOL_EMPTY) {
+    fprintf(stderr, "rc_ring: no ring left to give the peer\n");
+    rx->rejected++;
+    return -1;
+  }
+  peer->ring = buf_pool_addr(&rx->rings, peer->pool_slot);
+
+  // The receive queue holds a notification for every chain the ring can
+  // have in flight; sends are only credit writes
+  uint32_t psn = (uint32_t)lrand48() & 0xffffff;
+  peer->qp = QpBuilder::rc(rx->pd)
+                 .cq(rx->cq)
+                 .depth(RC_RING_CREDIT_DEPTH, rx->cfg.slots)
+                 .max_inline(sizeof(uint64_t))
+                 .create();
+  if (!peer->qp || peer->qp.init_rc(rx->cfg.port, IBV_ACCESS_REMOTE_WRITE) ||
+      rc_ring_post_notify(peer, rx->cfg.slots) ||
+      peer->qp.connect_rc(*remote, psn, rx->cfg.port, rx->cfg.gid_index,
+                          rx->mtu)) {
+    peer->qp.reset();
+    buf_pool_free(&rx->rings, peer->pool_slot);
+    return -1;
+  }
+
+  peer->qpn = peer->qp.qpn();
+  peer->next_slot = 0;
+  peer->notify_used = 0;
+  peer->consumed = 0;
+  peer->credited = 0;
+  peer->credit_pending = 0;
+  peer->credit_addr = remote->addr;
+  peer->credit_rkey = remote->rkey;
+
+  *reply = rx->local;
+  reply->qpn = peer->qpn;
+  reply->psn = psn;
+  reply->rkey = rx->rings.mr->rkey;
+  reply->addr = (uintptr_t)peer->ring;
+  reply->length = rx->cfg.slots * rx->cfg.slot_size;
+  reply->slots = rx->cfg.slots;
+
+  __atomic_store_n(&rx->num_peers, idx + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Index of the peer whose QP is qpn, or RC_RING_MAX_PEERS
+static inline uint32_t rc_ring_find(struct rc_ring_receiver *rx,
+                                    uint32_t qpn) {
+  uint32_t n = __atomic_load_n(&rx->num_peers, __ATOMIC_ACQUIRE);
+  for (uint32_t i = 0; i < n; i++) {
+    if (rx->peers[i].qpn == qpn)
+      return i;
+  }
+  return RC_RING_MAX_PEERS;
+}
+
+// Handles one successful completion from the CQ: a notification hands the
+// new messages to fn, a credit write is retired. Returns the number of
+// messages handed out.
+static inline uint32_t rc_ring_complete(struct rc_ring_receiver *rx,
+                                        const struct ibv_wc *wc,
+                                        rc_ring_msg_fn fn, void *arg) {
+  uint32_t idx = rc_ring_find(rx, wc->qp_num);
+  if (idx == RC_RING_MAX_PEERS)
+    return 0;
+  struct rc_ring_peer *peer = &rx->peers[idx];
+
+  if (wc->opcode == IBV_WC_RDMA_WRITE) {
+    peer->credit_pending--;
+    return 0;
+  }
+  if (wc->opcode != IBV_WC_RECV_RDMA_WITH_IMM)
+    return 0;
+
+  uint32_t slots = rx->cfg.slots;
+  uint32_t last = ntohl(wc->imm_data) % slots;
+  uint32_t n = (last + slots - peer->next_slot) % slots + 1;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t slot = (peer->next_slot + i) % slots;
+    fn(arg, idx, peer->ring + (size_t)slot * rx->cfg.slot_size,
+       wc->byte_len);
+  }
+
+  peer->next_slot = (last + 1) % slots;
+  peer->consumed += n;
+  peer->notify_used++;
+  return n;
+}
+
+// Reposts used notification receives and writes each peer's consumed count
+// back to it, once per sweep. A peer with RC_RING_CREDIT_DEPTH writes still
+// pending is skipped until the next call. Returns 0, or -1 on error.
+static inline int rc_ring_flush(struct rc_ring_receiver *rx) {
+  uint32_t n = __atomic_load_n(&rx->num_peers, __ATOMIC_ACQUIRE);
+
+  for (uint32_t i = 0; i < n; i++) {
+    struct rc_ring_peer *peer = &rx->peers[i];
+
+    // Receives first: the sender may start a new chain once it sees credit
+    if (peer->notify_used) {
+      if (rc_ring_post_notify(peer, peer->notify_used))
+        return -1;
+      peer->notify_used = 0;
+    }
+
+    if (peer->consumed == peer->credited ||
+        peer->credit_pending == RC_RING_CREDIT_DEPTH)
+      continue;
+
+    // Inline data is copied at post time, so a local will do
+    uint64_t credit = htobe64(peer->consumed);
+    struct ibv_sge sge;
+    sge.addr = (uintptr_t)&credit;
+    sge.length = sizeof(credit);
+    sge.lkey = 0;
+
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_INLINE | IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = peer->credit_addr;
+    wr.wr.rdma.rkey = peer->credit_rkey;
+    if (peer->qp.post_send(&wr)) {
+      perror("rc_ring: ibv_post_send");
+      return -1;
+    }
+    peer->credited = peer->consumed;
+    peer->credit_pending++;
+  }
+  return 0;
+}
+
+// Destroys every peer's QP and the rings; the side channel must be stopped
+static inline void rc_ring_destroy(struct rc_ring_receiver *rx) {
+  for (uint32_t i = 0; i < rx->num_peers; i++)
+    rx->peers[i].qp.reset();
+  rx->num_peers = 0;
+  buf_pool_destroy(&rx->rings);
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef RECV_POOL_H
+#define RECV_POOL_H
+
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buf_pool.h"
+
+// Receive buffer manager.
+//
+// Takes num_slots slots from a registered buf_pool and keeps them posted to
+// a QP's receive queue, or to an SRQ shared by several QPs. Several receive
+// pools, and send engines, can share one buf_pool and so one MR. Each
+// receive WR's wr_id is its buf_pool slot index, so a completion maps
+// straight back to its buffer with recv_pool_buf(). Consumed slots are
+// handed back with recv_pool_release() and reposted together by
+// recv_pool_replenish(), normally once per ibv_poll_cq() sweep, as chains
+// of up to RECV_POOL_POST_BATCH WRs per ibv_post_recv() call.
+
+#define RECV_POOL_POST_BATCH 64
+
+struct recv_pool_config {
+  uint32_t num_slots;    // buffers kept posted
+  uint32_t slot_size;    // bytes per buffer, including any GRH headroom; at
+                         // most the buf_pool's slot size
+  uint32_t refill_batch; // repost once at least this many slots are free
+};
+
+struct recv_pool {
+  struct ibv_qp *qp;   // receive queue the slots are posted to, or
+  struct ibv_srq *srq; // the SRQ they are posted to instead
+  struct buf_pool *bufs;
+  struct recv_pool_config cfg;
+
+  uint32_t *slots;      // buf_pool slots owned, returned on destroy
+  uint32_t *free_slots; // slots waiting to be reposted
+  uint32_t num_free;
+  uint32_t posted; // slots currently owned by the device
+
+  struct ibv_recv_wr wrs[RECV_POOL_POST_BATCH];
+  struct ibv_sge sges[RECV_POOL_POST_BATCH];
+};
+
+static inline char *recv_pool_buf(struct recv_pool *pool, uint64_t wr_id) {
+  return buf_pool_addr(pool->bufs, (uint32_t)wr_id);
+}
+
+// Hands a slot from a receive completion back to the pool. It is not
+// reposted until the next recv_pool_replenish().
+static inline void recv_pool_release(struct recv_pool *pool, uint64_t wr_id) {
+  pool->free_slots[pool->num_free++] = (uint32_t)wr_id;
+  pool->posted--;
+}
+
+// Reposts free slots if at least refill_batch of them (or any, if force is
+// set) have accumulated. Returns the number reposted, or -1 on error.
+static inline int recv_pool_replenish(struct recv_pool *pool, bool force) {
+  if (pool->num_free == 0 ||
+      (!force && pool->num_free < pool->cfg.refill_batch))
+    return 0;
+
+  int reposted = 0;
+  while (pool->num_free > 0) {
+    uint32_t n = pool->num_free < RECV_POOL_POST_BATCH ? pool->num_free
+                                                       : RECV_POOL_POST_BATCH;
+
+    for (uint32_t i = 0; i < n; i++) {
+      uint32_t slot = pool->free_slots[pool->num_free - n + i];
+      pool->sges[i].addr = (uintptr_t)recv_pool_buf(pool, slot);
+      pool->wrs[i].wr_id = slot;
+      pool->wrs[i].next = (i + 1 < n) ? &pool->wrs[i + 1] : NULL;
+    }
+
+    struct ibv_recv_wr *bad_wr;
+    int ret = pool->srq ? ibv_post_srq_recv(pool->srq, pool->wrs, &bad_wr)
+                        : ibv_post_recv(pool->qp, pool->wrs, &bad_wr);
+    if (ret) {
+      fprintf(stderr, "recv_pool: failed to post %u receives: %s\n", n,
+              strerror(ret));
+      return -1;
+    }
+
+    pool->num_free -= n;
+    pool->posted += n;
+    reposted += n;
+  }
+
+  return reposted;
+}
+
+// Returns the pool's slots to its buf_pool. Destroy the QPs or SRQ the
+// slots were posted to first, so the device no longer owns any of them.
+static inline void recv_pool_destroy(struct recv_pool *pool) {
+  if (pool->slots) {
+    for (uint32_t i = 0; i < pool->cfg.num_slots; i++) {
+      if (pool->slots[i] != BUF_POOL_EMPTY)
+        buf_pool_free(pool->bufs, pool->slots[i]);
+    }
+  }
+  free(pool->slots);
+  free(pool->free_slots);
+  pool->slots = NULL;
+  pool->free_slots = NULL;
+}
+
+// Takes num_slots slots from bufs and posts every one to qp, or to srq if
+// it is non-NULL. bufs must be registered with IBV_ACCESS_LOCAL_WRITE.
+// Returns 0 on success, -1 on failure (with nothing left allocated).
+static inline int recv_pool_init(struct recv_pool *pool, struct buf_pool *bufs,
+                                 struct ibv_qp *qp, struct ibv_srq *srq,
+                                 const struct recv_pool_config *cfg) {
+  memset(pool, 0, sizeof(*pool));
+  pool->qp = qp;
+  pool->srq = srq;
+  pool->bufs = bufs;
+  pool->cfg = *cfg;
+
+  if (cfg->slot_size > bufs->slot_size) {
+    fprintf(stderr, "recv_pool: %u byte slots do not fit %u byte buffers\n",
+            cfg->slot_size, bufs->slot_size);
+    return -1;
+  }
+
+  pool->slots = (uint32_t *)malloc(cfg->num_slots * sizeof(uint32_t));
+  pool->free_slots = (uint32_t *)malloc(cfg->num_slots * sizeof(uint32_t));
+  if (!pool->slots || !pool->free_slots) {
+    fprintf(stderr, "recv_pool: out of memory\n");
+    recv_pool_destroy(pool);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < cfg->num_slots; i++)
+    pool->slots[i] = BUF_POOL_EMPTY;
+
+  // Stacked in reverse, so the first slots taken are posted first
+  for (uint32_t i = 0; i < cfg->num_slots; i++) {
+    uint32_t slot = buf_pool_alloc(bufs);
+    if (slot == BUF_POOL_EMPTY) {
+      fprintf(stderr, "recv_pool: buffer pool has only %u of %u slots free\n",
+              i, cfg->num_slots);
+      recv_pool_destroy(pool);
+      return -1;
+    }
+    pool->slots[i] = slot;
+    pool->free_slots[cfg->num_slots - 1 - i] = slot;
+  }
+  pool->num_free = cfg->num_slots;
+
+  for (uint32_t i = 0; i < RECV_POOL_POST_BATCH; i++) {
+    pool->sges[i].length = cfg->slot_size;
+    pool->sges[i].lkey = buf_pool_lkey(bufs);
+    pool->wrs[i].sg_list = &pool->sges[i];
+    pool->wrs[i].num_sge = 1;
+  }
+
+  // Every slot starts out free and is posted by the first replenish
+  if (recv_pool_replenish(pool, true) < 0) {
+    recv_pool_destroy(pool);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Creates an SRQ deep enough for a pool of num_slots buffers
+static inline struct ibv_srq *recv_pool_create_srq(struct ibv_pd *pd,
+                                                   uint32_t num_slots) {
+  struct ibv_srq_init_attr srq_attr = {};
+  srq_attr.attr.max_wr = num_slots;
+  srq_attr.attr.max_sge = 1;
+
+  struct ibv_srq *srq = ibv_create_srq(pd, &srq_attr);
+  if (!srq)
+    perror("recv_pool: ibv_create_srq");
+  return srq;
+}
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Per-stream reorder and gap detection.
+//
+// Packets are keyed by (fpga_id, freq_channel) and put back in sample_count
+// order, where consecutive packets of a stream are step samples apart. The
+// next expected packet is emitted straight away, with no copy, followed by
+// any later ones already waiting. A packet up to REORDER_WINDOW - 1 steps
+// ahead is copied into a shared buffer pool and held. A packet further
+// ahead, a full pool, or reorder_flush_all() (when input goes idle) gives
+// up on the missing packets: they are counted as lost and whatever was
+// waiting is emitted in order. A packet behind the expected one is
+// dropped, counted as late if it had been given up on and as a duplicate
+// otherwise, as is a second copy of a held packet.
+//
+// A stream whose sample_count goes backwards for good (the sender
+// restarted, the count wrapped, a capture is replayed in a loop) is
+// resynced rather than dropped until the counts catch up: at once when a
+// packet is more than REORDER_WINDOW steps behind, or when
+// REORDER_RESYNC_RUN would-be duplicates in a row follow on from each
+// other, one step apart, as a restarted sequence does and stray copies do
+// not. Its held packets are emitted and it starts over at the new packet.
+//
+// Streams live in a flat open-addressing table with linear probing. The
+// table, the window slots and the pool are allocated once at init, so
+// nothing is allocated per packet. Each stage is driven by one thread;
+// reorder_report() may run on another and reads its counters racily.
+
+#define REORDER_WINDOW 64 // one bit per slot in reorder_stream.pending
+#define REORDER_TABLE_SIZE 8192 // power of two
+#define REORDER_MAX_STREAMS (REORDER_TABLE_SIZE / 4 * 3)
+#define REORDER_EMPTY_KEY UINT64_MAX
+#define REORDER_REPORT_STREAMS 16
+#define REORDER_RESYNC_RUN 4
+
+struct reorder_pkt {
+  uint64_t sample_count;
+  uint32_t fpga_id;
+  uint16_t freq_channel;
+  const uint8_t *payload;
+  uint32_t payload_size;
+  struct timespec timestamp;
+  uint64_t ring_ns; // passed through untouched, like timestamp
+};
+
+typedef void (*reorder_emit_fn)(void *arg, const struct reorder_pkt *pkt);
+
+struct reorder_stream {
+  uint64_t key; // fpga_id << 16 | freq_channel, or REORDER_EMPTY_KEY
+  uint64_t next_sample;
+  uint64_t pending;      // window slots holding a packet
+  uint64_t lost_history; // bit i: the packet i + 1 steps back was lost
+
+  uint64_t delivered;
+  uint64_t reordered; // delivered after waiting in the window
+  uint64_t lost;
+  uint64_t gaps; // runs of lost packets
+  uint64_t duplicates;
+  uint64_t late;
+  uint64_t resyncs;
+  uint64_t run_next; // sample that would extend the run of duplicates
+  uint32_t run;      // in-order duplicates since the last packet taken
+};
+
+struct reorder_stage {
+  uint64_t step;
+  uint32_t max_payload;
+  reorder_emit_fn emit;
+  void *emit_arg;
+
+  struct reorder_stream *streams; // REORDER_TABLE_SIZE entries
+  uint32_t *window;               // REORDER_WINDOW pool slots per stream
+  uint32_t num_streams;
+
+  // Held packets
+  uint8_t *pool;
+  struct reorder_pkt *pool_pkts;
+  uint32_t *free_slots;
+  uint32_t pool_size;
+  uint32_t num_free;
+
+  uint64_t untracked; // emitted unordered because the table was full
+};
+
+static inline uint64_t reorder_key(uint32_t fpga_id, uint16_t freq_channel) {
+  return (uint64_t)fpga_id << 16 | freq_channel;
+}
+
+// Allocates the stream table and a pool of pool_size held packets of up to
+// max_payload bytes. Returns 0 on success, -1 on failure (with nothing
+// left allocated).
+static inline int reorder_init(struct reorder_stage *r, uint64_t step,
+                               uint32_t max_payload, uint32_t pool_size,
+                               reorder_emit_fn emit, void *emit_arg) {
+  memset(r, 0, sizeof(*r));
+  r->step = step ? step : 1;
+  r->max_payload = max_payload;
+  r->emit = emit;
+  r->emit_arg = emit_arg;
+  r->pool_size = pool_size;
+
+  r->streams = (struct reorder_stream *)malloc(REORDER_TABLE_SIZE *
+                                               sizeof(struct reorder_stream));
+  r->window = (uint32_t *)malloc((size_t)REORDER_TABLE_SIZE * REORDER_WINDOW *
+                                 sizeof(uint32_t));
+  r->pool = (uint8_t *)malloc((size_t)pool_size * max_payload);
+  r->pool_pkts =
+      (struct reorder_pkt *)malloc(pool_size * sizeof(struct reorder_pkt));
+  r->free_slots = (uint32_t *)malloc(pool_size * sizeof(uint32_t));
+  if (!r->streams || !r->window || !r->pool || !r->pool_pkts ||
+      !r->free_slots) {
+    fprintf(stderr, "reorder: failed to allocate stream table and pool\n");
+    free(r->streams);
+    free(r->window);
+    free(r->pool);
+    free(r->pool_pkts);
+    free(r->free_slots);
+    memset(r, 0, sizeof(*r));
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < REORDER_TABLE_SIZE; i++)
+    r->streams[i].key = REORDER_EMPTY_KEY;
+  for (uint32_t i = 0; i < pool_size; i++)
+    r->free_slots[i] = i;
+  r->num_free = pool_size;
+  return 0;
+}
+
+static inline void reorder_destroy(struct reorder_stage *r) {
+  free(r->streams);
+  free(r->window);
+  free(r->pool);
+  free(r->pool_pkts);
+  free(r->free_slots);
+  memset(r, 0, sizeof(*r));
+}
+
+// Stream for key, created with next_sample as its first expected packet if
+// it is new. Returns NULL if the table is full.
+static inline struct reorder_stream *
+reorder_find(struct reorder_stage *r, uint64_t key, uint64_t next_sample) {
+  uint32_t mask = REORDER_TABLE_SIZE - 1;
+  uint32_t i = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+
+  for (;;) {
+    struct reorder_stream *st = &r->streams[i];
+    if (st->key == key)
+      return st;
+    if (st->key == REORDER_EMPTY_KEY)
+      break;
+    i = (i + 1) & mask;
+  }
+
+  if (r->num_streams == REORDER_MAX_STREAMS)
+    return NULL;
+
+  struct reorder_stream fresh = {};
+  fresh.key = REORDER_EMPTY_KEY;
+  fresh.next_sample = next_sample;
+
+  struct reorder_stream *st = &r->streams[i];
+  *st = fresh;
+  r->num_streams++;
+  // Publish the key last, so a concurrent reorder_report() never sees a
+  // half-initialized stream
+  __atomic_store_n(&st->key, key, __ATOMIC_RELEASE);
+  return st;
+}
+
+static inline uint32_t reorder_slot(const struct reorder_stage *r,
+                                    uint64_t sample) {
+  return (uint32_t)(sample / r->step) & (REORDER_WINDOW - 1);
+}
+
+static inline uint32_t *reorder_window(struct reorder_stage *r,
+                                       const struct reorder_stream *st) {
+  return r->window + (size_t)(st - r->streams) * REORDER_WINDOW;
+}
+
+// Moves st past its next expected packet: emits it if it is held,
+// otherwise counts it lost
+static inline void reorder_advance(struct reorder_stage *r,
+                                   struct reorder_stream *st) {
+  uint32_t slot = reorder_slot(r, st->next_sample);
+  uint64_t bit = 1ull << slot;
+  int lost = !(st->pending & bit);
+
+  if (!lost) {
+    uint32_t idx = reorder_window(r, st)[slot];
+    r->emit(r->emit_arg, &r->pool_pkts[idx]);
+    r->free_slots[r->num_free++] = idx;
+    st->pending &= ~bit;
+    st->delivered++;
+    st->reordered++;
+  } else {
+    if (!(st->lost_history & 1))
+      st->gaps++;
+    st->lost++;
+  }
+
+  st->lost_history = st->lost_history << 1 | lost;
+  st->next_sample += r->step;
+}
+
+// Emits held packets that are now next in line
+static inline void reorder_drain(struct reorder_stage *r,
+                                 struct reorder_stream *st) {
+  while (st->pending &&
+         (st->pending & (1ull << reorder_slot(r, st->next_sample))))
+    reorder_advance(r, st);
+}
+
+// Gives up on everything missing before sample: emits the held packets in
+// order and counts the holes between them as lost
+static inline void reorder_skip_to(struct reorder_stage *r,
+                                   struct reorder_stream *st,
+                                   uint64_t sample) {
+  while (st->pending && st->next_sample < sample)
+    reorder_advance(r, st);
+
+  // Nothing held any more, so the rest of the gap can be counted at once
+  if (st->next_sample < sample) {
+    uint64_t missing = (sample - st->next_sample) / r->step;
+    if (!(st->lost_history & 1))
+      st->gaps++;
+    st->lost += missing;
+    st->lost_history =
+        missing >= 64 ? ~0ull : (st->lost_history << missing) |
+                                    ((1ull << missing) - 1);
+    st->next_sample += missing * r->step;
+  }
+}
+
+// Starts st over at sample: the packets it holds are emitted in order,
+// without counting the holes between them as lost, and its history is
+// forgotten
+static inline void reorder_resync(struct reorder_stage *r,
+                                  struct reorder_stream *st,
+                                  uint64_t sample) {
+  for (uint64_t s = st->next_sample; st->pending; s += r->step) {
+    uint32_t slot = reorder_slot(r, s);
+    uint64_t bit = 1ull << slot;
+    if (!(st->pending & bit))
+      continue;
+
+    uint32_t idx = reorder_window(r, st)[slot];
+    r->emit(r->emit_arg, &r->pool_pkts[idx]);
+    r->free_slots[r->num_free++] = idx;
+    st->pending &= ~bit;
+    st->delivered++;
+    st->reordered++;
+  }
+
+  st->next_sample = sample;
+  st->lost_history = 0;
+  st->run = 0;
+  st->resyncs++;
+}
+
+static inline void reorder_push(struct reorder_stage *r,
+                                const struct reorder_pkt *pkt) {
+  struct reorder_stream *st =
+      reorder_find(r, reorder_key(pkt->fpga_id, pkt->freq_channel),
+                   pkt->sample_count);
+  if (!st) {
+    r->untracked++;
+    r->emit(r->emit_arg, pkt);
+    return;
+  }
+
+  if (pkt->sample_count < st->next_sample) {
+    uint64_t back = (st->next_sample - pkt->sample_count) / r->step;
+    if (back >= 1 && back <= 64 && (st->lost_history >> (back - 1)) & 1) {
+      st->late++;
+      st->lost_history &= ~(1ull << (back - 1));
+      return;
+    }
+    st->run = st->run && pkt->sample_count == st->run_next ? st->run + 1 : 1;
+    st->run_next = pkt->sample_count + r->step;
+    if (back <= REORDER_WINDOW && st->run < REORDER_RESYNC_RUN) {
+      st->duplicates++;
+      return;
+    }
+    reorder_resync(r, st, pkt->sample_count);
+  }
+  st->run = 0;
+
+  uint64_t ahead = (pkt->sample_count - st->next_sample) / r->step;
+  uint32_t slot = reorder_slot(r, pkt->sample_count);
+
+  // A second copy of a held packet, whether or not this one could be held
+  if (ahead > 0 && ahead < REORDER_WINDOW && (st->pending & (1ull << slot))) {
+    st->duplicates++;
+    return;
+  }
+
+  if (ahead > 0 && ahead < REORDER_WINDOW && r->num_free > 0 &&
+      pkt->payload_size <= r->max_payload) {
+    uint32_t idx = r->free_slots[--r->num_free];
+    struct reorder_pkt *held = &r->pool_pkts[idx];
+    uint8_t *buf = r->pool + (size_t)idx * r->max_payload;
+    memcpy(buf, pkt->payload, pkt->payload_size);
+    *held = *pkt;
+    held->payload = buf;
+
+    reorder_window(r, st)[slot] = idx;
+    st->pending |= 1ull << slot;
+    return;
+  }
+
+  // Too far ahead to hold (or nowhere to hold it): stop waiting for the
+  // packets before it
+  if (ahead > 0)
+    reorder_skip_to(r, st, pkt->sample_count);
+
+  r->emit(r->emit_arg, pkt);
+  st->delivered++;
+  st->lost_history <<= 1;
+  st->next_sample = pkt->sample_count + r->step;
+  reorder_drain(r, st);
+}
+
+// Gives up on every hole that has packets waiting behind it, e.g. because
+// input has gone quiet and the missing packets are not coming
+static inline void reorder_flush_all(struct reorder_stage *r) {
+  if (r->num_free == r->pool_size)
+    return;
+
+  for (uint32_t i = 0; i < REORDER_TABLE_SIZE; i++) {
+    struct reorder_stream *st = &r->streams[i];
+    while (st->key != REORDER_EMPTY_KEY && st->pending)
+      reorder_advance(r, st);
+  }
+}
+
+// Prints totals over all streams, then the streams with loss, duplicates
+// or late packets (up to REORDER_REPORT_STREAMS of them)
+static inline void reorder_report(struct reorder_stage *r,
+                                  const char *prefix) {
+  uint64_t delivered = 0, reordered = 0, lost = 0, gaps = 0;
+  uint64_t duplicates = 0, late = 0, resyncs = 0;
+  uint32_t streams = 0, shown = 0, unshown = 0;
+
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    for (uint32_t i = 0; i < REORDER_TABLE_SIZE; i++) {
+      struct reorder_stream *st = &r->streams[i];
+      uint64_t key = __atomic_load_n(&st->key, __ATOMIC_ACQUIRE);
+      if (key == REORDER_EMPTY_KEY)
+        continue;
+
+      uint64_t s_lost = __atomic_load_n(&st->lost, __ATOMIC_RELAXED);
+      uint64_t s_dup = __atomic_load_n(&st->duplicates, __ATOMIC_RELAXED);
+      uint64_t s_late = __atomic_load_n(&st->late, __ATOMIC_RELAXED);
+
+      if (pass == 0) {
+        streams++;
+        delivered += __atomic_load_n(&st->delivered, __ATOMIC_RELAXED);
+        reordered += __atomic_load_n(&st->reordered, __ATOMIC_RELAXED);
+        gaps += __atomic_load_n(&st->gaps, __ATOMIC_RELAXED);
+        resyncs += __atomic_load_n(&st->resyncs, __ATOMIC_RELAXED);
+        lost += s_lost;
+        duplicates += s_dup;
+        late += s_late;
+        continue;
+      }
+
+      if (!s_lost && !s_dup && !s_late)
+        continue;
+      if (shown == REORDER_REPORT_STREAMS) {
+        unshown++;
+        continue;
+      }
+      shown++;
+      printf("%s  fpga %u channel %u: Lost=%llu (%llu gaps), "
+             "Duplicates=%llu, Late=%llu, Next sample=%llu\n",
+             prefix, (unsigned)(key >> 16), (unsigned)(key & 0xffff),
+             (unsigned long long)s_lost,
+             (unsigned long long)__atomic_load_n(&st->gaps, __ATOMIC_RELAXED),
+             (unsigned long long)s_dup, (unsigned long long)s_late,
+             (unsigned long long)__atomic_load_n(&st->next_sample,
+                                                 __ATOMIC_RELAXED));
+    }
+
+    if (pass == 0)
+      printf("%sReorder: Streams=%u, Delivered=%llu (%llu reordered), "
+             "Lost=%llu in %llu gaps, Duplicates=%llu, Late=%llu, "
+             "Resyncs=%llu, Untracked=%llu\n",
+             prefix, streams, (unsigned long long)delivered,
+             (unsigned long long)reordered, (unsigned long long)lost,
+             (unsigned long long)gaps, (unsigned long long)duplicates,
+             (unsigned long long)late, (unsigned long long)resyncs,
+             (unsigned long long)__atomic_load_n(&r->untracked,
+                                                 __ATOMIC_RELAXED));
+  }
+
+  if (unshown)
+    printf("%s  ... and %u more stream(s) with loss\n", prefix, unshown);
+}
+
+#endif
@@ -0,0 +1,227 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "reorder.h"
+
+// Checks of the reorder stage: in-order and reordered delivery, gaps given
+// up on, late and duplicate packets, duplicates of a held packet that
+// arrive when the pool cannot hold another, and streams that restart.
+// Exits non-zero on failure.
+
+#define MAX_EMITTED 512
+#define PAYLOAD_SIZE 16
+
+static uint64_t emitted[MAX_EMITTED];
+static uint8_t emitted_tag[MAX_EMITTED];
+static int num_emitted;
+static int failures;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);                   \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static void record_emit(void *arg, const struct reorder_pkt *pkt) {
+  (void)arg;
+  if (num_emitted < MAX_EMITTED) {
+    emitted[num_emitted] = pkt->sample_count;
+    emitted_tag[num_emitted] = pkt->payload_size ? pkt->payload[0] : 0;
+  }
+  num_emitted++;
+}
+
+// Pushes sample of stream (0, 0) with a payload whose first byte is tag
+static void push(struct reorder_stage *r, uint64_t sample, uint8_t tag,
+                 uint32_t payload_size = PAYLOAD_SIZE) {
+  static uint8_t payload[2 * PAYLOAD_SIZE];
+  memset(payload, tag, sizeof(payload));
+
+  struct reorder_pkt pkt = {};
+  pkt.sample_count = sample;
+  pkt.payload = payload;
+  pkt.payload_size = payload_size;
+  reorder_push(r, &pkt);
+}
+
+static int emitted_is(const uint64_t *expected, int n) {
+  if (num_emitted != n)
+    return 0;
+  for (int i = 0; i < n; i++) {
+    if (emitted[i] != expected[i])
+      return 0;
+  }
+  return 1;
+}
+
+static struct reorder_stream *stream0(struct reorder_stage *r) {
+  return reorder_find(r, reorder_key(0, 0), 0);
+}
+
+static void setup(struct reorder_stage *r, uint32_t pool_size) {
+  num_emitted = 0;
+  if (reorder_init(r, 1, PAYLOAD_SIZE, pool_size, record_emit, NULL) < 0) {
+    printf("FAIL: reorder_init\n");
+    failures++;
+  }
+}
+
+static void test_in_order() {
+  struct reorder_stage r;
+  setup(&r, 4);
+  for (uint64_t s = 0; s < 5; s++)
+    push(&r, s, 0);
+
+  const uint64_t expected[] = {0, 1, 2, 3, 4};
+  CHECK(emitted_is(expected, 5));
+  CHECK(stream0(&r)->delivered == 5);
+  CHECK(stream0(&r)->reordered == 0);
+  reorder_destroy(&r);
+}
+
+static void test_reordered() {
+  struct reorder_stage r;
+  setup(&r, 4);
+  push(&r, 0, 0);
+  push(&r, 3, 3);
+  push(&r, 2, 2);
+  push(&r, 1, 1);
+
+  const uint64_t expected[] = {0, 1, 2, 3};
+  CHECK(emitted_is(expected, 4));
+  CHECK(emitted_tag[2] == 2 && emitted_tag[3] == 3);
+  CHECK(stream0(&r)->reordered == 2);
+  CHECK(r.num_free == r.pool_size);
+  reorder_destroy(&r);
+}
+
+static void test_gap_and_late() {
+  struct reorder_stage r;
+  setup(&r, 4);
+  push(&r, 0, 0);
+  push(&r, 3, 3);
+  reorder_flush_all(&r); // gives up on 1 and 2
+
+  const uint64_t expected[] = {0, 3};
+  CHECK(emitted_is(expected, 2));
+  CHECK(stream0(&r)->lost == 2);
+  CHECK(stream0(&r)->gaps == 1);
+
+  push(&r, 1, 1); // given up on: late
+  push(&r, 3, 3); // already delivered: duplicate
+  CHECK(num_emitted == 2);
+  CHECK(stream0(&r)->late == 1);
+  CHECK(stream0(&r)->duplicates == 1);
+
+  push(&r, 4 + REORDER_WINDOW, 0); // too far ahead to hold
+  CHECK(num_emitted == 3);
+  CHECK(stream0(&r)->lost == 2 + REORDER_WINDOW);
+  CHECK(stream0(&r)->gaps == 2);
+  reorder_destroy(&r);
+}
+
+// A duplicate of a held packet that cannot be held itself (pool empty, or
+// payload too large) must still be dropped, not emitted in place of the
+// held copy, which would leak the copy's pool slot into a later window
+static void test_duplicate_of_held_pool_full() {
+  struct reorder_stage r;
+  setup(&r, 1);
+  push(&r, 0, 0);
+  push(&r, 2, 2); // held; the pool is now empty
+  CHECK(r.num_free == 0);
+
+  push(&r, 2, 9);                    // pool full
+  push(&r, 2, 9, 2 * PAYLOAD_SIZE); // too large to hold
+  CHECK(num_emitted == 1);
+  CHECK(stream0(&r)->duplicates == 2);
+
+  push(&r, 1, 1);
+  const uint64_t expected[] = {0, 1, 2};
+  CHECK(emitted_is(expected, 3));
+  CHECK(emitted_tag[2] == 2); // the held copy
+  CHECK(stream0(&r)->pending == 0);
+  CHECK(r.num_free == r.pool_size);
+
+  // One window on, the slot the copy used takes a new packet normally
+  for (uint64_t s = 3; s <= 2 + REORDER_WINDOW; s++)
+    push(&r, s, (uint8_t)s);
+  CHECK(num_emitted == 3 + REORDER_WINDOW);
+  CHECK(emitted[num_emitted - 1] == 2 + REORDER_WINDOW);
+  CHECK(emitted_tag[num_emitted - 1] == (uint8_t)(2 + REORDER_WINDOW));
+  CHECK(stream0(&r)->duplicates == 2);
+  reorder_destroy(&r);
+}
+
+// A sender restarting at sample 0 long after starting: the stream resyncs
+// on the first packet, emitting what it held, without counting loss
+static void test_restart_far_behind() {
+  struct reorder_stage r;
+  setup(&r, 4);
+  for (uint64_t s = 0; s < 100; s++)
+    push(&r, s, 0);
+  push(&r, 101, 101); // held, waiting for 100
+
+  for (uint64_t s = 0; s < 10; s++)
+    push(&r, s, 1);
+
+  CHECK(num_emitted == 100 + 1 + 10);
+  CHECK(emitted[100] == 101 && emitted_tag[100] == 101);
+  for (int i = 0; i < 10; i++)
+    CHECK(emitted[101 + i] == (uint64_t)i && emitted_tag[101 + i] == 1);
+  CHECK(stream0(&r)->resyncs == 1);
+  CHECK(stream0(&r)->duplicates == 0);
+  CHECK(stream0(&r)->lost == 0);
+  CHECK(stream0(&r)->pending == 0);
+  CHECK(r.num_free == r.pool_size);
+  CHECK(stream0(&r)->next_sample == 10);
+  reorder_destroy(&r);
+}
+
+// A restart less than a window back looks like duplicates at first; a run
+// of REORDER_RESYNC_RUN of them, in order, resyncs the stream
+static void test_restart_within_window() {
+  struct reorder_stage r;
+  setup(&r, 4);
+  for (uint64_t s = 0; s < 32; s++)
+    push(&r, s, 0);
+  for (uint64_t s = 0; s < 32; s++)
+    push(&r, s, 1);
+
+  const int dropped = REORDER_RESYNC_RUN - 1;
+  CHECK(num_emitted == 32 + 32 - dropped);
+  CHECK(emitted[32] == (uint64_t)dropped && emitted_tag[32] == 1);
+  CHECK(stream0(&r)->duplicates == (uint64_t)dropped);
+  CHECK(stream0(&r)->resyncs == 1);
+
+  // Duplicates interleaved with new packets, or out of order, never add
+  // up to a resync
+  for (uint64_t s = 32; s < 40; s++) {
+    push(&r, s, 2);
+    push(&r, s, 2);
+  }
+  for (int i = 0; i < 2 * REORDER_RESYNC_RUN; i++)
+    push(&r, 30 + i % 2, 2);
+  CHECK(stream0(&r)->resyncs == 1);
+  CHECK(stream0(&r)->duplicates == (uint64_t)dropped + 8 +
+                                       2 * REORDER_RESYNC_RUN);
+  reorder_destroy(&r);
+}
+
+int main() {
+  test_in_order();
+  test_reordered();
+  test_gap_and_late();
+  test_duplicate_of_held_pool_full();
+  test_restart_far_behind();
+  test_restart_within_window();
+
+  if (failures) {
+    printf("reorder_test: %d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("reorder_test: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,166 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "spsc_ring.h"
+
+// Microbenchmark: lock-free SpscRing vs the mutex-guarded ring that
+// udp_receiver.cpp used before, moving fixed-size payloads from a producer
+// thread to a consumer thread.
+
+#define RING_SIZE 1024
+#define DEFAULT_MESSAGES 2000000
+
+template <size_t S> struct BenchEntry {
+  uint32_t length;
+  uint8_t data[S];
+};
+
+// Same scheme as the original udp_receiver ring: one mutex, modulo indices
+// and one wasted slot to tell full from empty.
+template <typename T, size_t N> struct MutexRing {
+  T slots[N];
+  int write_index = 0;
+  int read_index = 0;
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+  T *claim() {
+    pthread_mutex_lock(&mutex);
+    if ((write_index + 1) % (int)N == read_index) {
+      pthread_mutex_unlock(&mutex);
+      return NULL;
+    }
+    return &slots[write_index];
+  }
+
+  void publish() {
+    write_index = (write_index + 1) % N;
+    pthread_mutex_unlock(&mutex);
+  }
+
+  T *front() {
+    pthread_mutex_lock(&mutex);
+    if (read_index == write_index) {
+      pthread_mutex_unlock(&mutex);
+      return NULL;
+    }
+    return &slots[read_index];
+  }
+
+  void release() {
+    read_index = (read_index + 1) % N;
+    pthread_mutex_unlock(&mutex);
+  }
+};
+
+template <typename Ring> struct BenchArgs {
+  Ring *ring;
+  unsigned long messages;
+  size_t payload;
+  uint64_t checksum;
+};
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  sched_yield();
+#endif
+}
+
+template <typename Ring> void *producer(void *arg) {
+  BenchArgs<Ring> *args = (BenchArgs<Ring> *)arg;
+  unsigned long spins = 0;
+
+  for (unsigned long i = 0; i < args->messages; i++) {
+    auto *entry = args->ring->claim();
+    while (entry == NULL) {
+      // Yield now and then so the benchmark still completes on one core
+      if (++spins % 64 == 0)
+        sched_yield();
+      else
+        cpu_relax();
+      entry = args->ring->claim();
+    }
+    memset(entry->data, (int)i, args->payload);
+    entry->length = args->payload;
+    args->ring->publish();
+  }
+  return NULL;
+}
+
+template <typename Ring> void *consumer(void *arg) {
+  BenchArgs<Ring> *args = (BenchArgs<Ring> *)arg;
+  unsigned long spins = 0;
+  uint64_t sum = 0;
+
+  for (unsigned long i = 0; i < args->messages; i++) {
+    auto *entry = args->ring->front();
+    while (entry == NULL) {
+      if (++spins % 64 == 0)
+        sched_yield();
+      else
+        cpu_relax();
+      entry = args->ring->front();
+    }
+    sum += entry->data[0] + entry->data[entry->length - 1];
+    args->ring->release();
+  }
+  args->checksum = sum;
+  return NULL;
+}
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <typename Ring>
+double run(const char *name, size_t payload, unsigned long messages) {
+  // Rings with 4 KB slots are several MB, so keep them off the stack
+  Ring *ring = new Ring();
+  BenchArgs<Ring> args = {ring, messages, payload, 0};
+  pthread_t prod, cons;
+
+  double start = now_seconds();
+  pthread_create(&cons, NULL, consumer<Ring>, &args);
+  pthread_create(&prod, NULL, producer<Ring>, &args);
+  pthread_join(prod, NULL);
+  pthread_join(cons, NULL);
+  double elapsed = now_seconds() - start;
+
+  double mops = messages / elapsed / 1e6;
+  printf("%-6s %6zu B  %8.2f Mmsg/s  %8.1f ns/msg  %8.3f GB/s  (chk %lu)\n",
+         name, payload, mops, elapsed * 1e9 / messages,
+         messages * payload / elapsed / 1e9, (unsigned long)args.checksum);
+
+  delete ring;
+  return mops;
+}
+
+template <size_t S> void compare(unsigned long messages) {
+  typedef BenchEntry<S> Entry;
+  double spsc = run<SpscRing<Entry, RING_SIZE>>("spsc", S, messages);
+  double mutex = run<MutexRing<Entry, RING_SIZE>>("mutex", S, messages);
+  printf("       speedup %.2fx\n\n", spsc / mutex);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long messages = (argc > 1) ? strtoul(argv[1], NULL, 10)
+                                      : DEFAULT_MESSAGES;
+
+  printf("Ring benchmark: %lu messages per run, %d slots\n\n", messages,
+         RING_SIZE);
+
+  compare<1>(messages);
+  compare<8>(messages);
+  compare<64>(messages);
+  compare<4096>(messages / 4);
+
+  return 0;
+}
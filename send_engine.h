@@ -0,0 +1,372 @@
+#ifndef SEND_ENGINE_H
+#define SEND_ENGINE_H
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buf_pool.h"
+
+// Batched send engine, for UD sends or RC writes into a remote ring.
+//
+// Keeps up to sq_depth send WRs in flight on one QP. WRs are chained
+// through wr.next and posted batch at a time (one doorbell per batch), and
+// only every signal_interval-th WR asks for a completion. A signaled WR's
+// wr_id holds how many WRs it retires, so one CQE accounts for the whole
+// run of unsignaled WRs posted before it. Payloads come from sq_depth slots
+// taken from a registered buf_pool at init, reused round-robin; a buffer
+// is never reused while the WR that sends it can still be outstanding.
+// Alternatively send_engine_post_bufs() sends straight out of memory the
+// caller registered, such as frames preloaded for replay, and the pool can
+// be left out by setting buf_size to 0.
+//
+// On an RC QP, send_engine_set_ring_dest() turns the SENDs into RDMA
+// WRITEs into consecutive slots of a ring in the receiver's memory. The
+// last WR of every chain is a WRITE_WITH_IMM carrying the index of the
+// slot it wrote, which is all the receiver is told: RC delivers in order,
+// so every slot before it has landed too. The receiver writes back how
+// many slots it has consumed, and the engine never runs more than a ring
+// ahead of that count.
+//
+// The QP must be created with cap.max_send_wr >= sq_depth and sq_sig_all
+// = 0, and its send CQ sized for sq_depth entries (a failed QP flushes
+// every WR with a completion, signaled or not).
+
+#define SEND_ENGINE_MAX_BATCH 64
+#define SEND_ENGINE_POLL_BATCH 16
+
+struct send_engine_config {
+  uint32_t sq_depth;        // max WRs outstanding on the send queue
+  uint32_t batch;           // WRs chained per ibv_post_send()
+  uint32_t signal_interval; // request a completion every N WRs
+  uint32_t buf_size;        // bytes per buffer, 0 for none
+};
+
+struct send_engine {
+  struct ibv_qp *qp;
+  struct ibv_cq *cq;
+  struct buf_pool *bufs;
+  uint32_t *slots; // sq_depth buf_pool slots
+  struct send_engine_config cfg;
+
+  // UD destination
+  struct ibv_ah *ah;
+  uint32_t remote_qpn;
+  uint32_t remote_qkey;
+
+  // RC ring destination, if ring_slots is not 0
+  uint64_t ring_addr;
+  uint32_t ring_slots;
+  uint32_t ring_slot_size;
+  uint64_t ring_written; // messages written into the ring so far
+  const volatile uint64_t *ring_consumed; // big-endian, written by the peer
+
+  uint32_t next_buf;   // next pool buffer to send from
+  uint32_t unsignaled; // WRs posted since the last signaled one
+  uint32_t outstanding;
+
+  uint64_t posted;
+  uint64_t completed;
+  uint64_t errors;
+
+  struct ibv_send_wr wrs[SEND_ENGINE_MAX_BATCH];
+  struct ibv_sge sges[SEND_ENGINE_MAX_BATCH];
+};
+
+static inline char *send_engine_buffer(struct send_engine *eng, uint32_t idx) {
+  return buf_pool_addr(eng->bufs, eng->slots[idx]);
+}
+
+static inline void send_engine_destroy(struct send_engine *eng) {
+  if (eng->slots) {
+    for (uint32_t i = 0; i < eng->cfg.sq_depth; i++) {
+      if (eng->slots[i] != BUF_POOL_EMPTY)
+        buf_pool_free(eng->bufs, eng->slots[i]);
+    }
+  }
+  free(eng->slots);
+  eng->slots = NULL;
+}
+
+// Takes sq_depth buffers from bufs, unless buf_size is 0 (when bufs may be
+// NULL). Returns 0 on success, -1 on failure (with nothing left allocated).
+static inline int send_engine_init(struct send_engine *eng,
+                                   struct buf_pool *bufs,
+                                   struct ibv_qp *qp, struct ibv_cq *cq,
+                                   const struct send_engine_config *cfg) {
+  memset(eng, 0, sizeof(*eng));
+
+  // Up to signal_interval - 1 unsignaled WRs cannot be reaped until the
+  // next signaled one is posted, so a full batch must still fit beside them
+  if (cfg->batch == 0 || cfg->batch > SEND_ENGINE_MAX_BATCH ||
+      cfg->signal_interval == 0 ||
+      cfg->batch + cfg->signal_interval - 1 > cfg->sq_depth) {
+    fprintf(stderr, "send_engine: need 0 < batch <= %d, signal_interval > 0 "
+                    "and batch + signal_interval - 1 <= sq_depth\n",
+            SEND_ENGINE_MAX_BATCH);
+    return -1;
+  }
+
+  eng->qp = qp;
+  eng->cq = cq;
+  eng->cfg = *cfg;
+
+  for (uint32_t i = 0; i < SEND_ENGINE_MAX_BATCH; i++) {
+    eng->wrs[i].sg_list = &eng->sges[i];
+    eng->wrs[i].num_sge = 1;
+    eng->wrs[i].opcode = IBV_WR_SEND;
+  }
+
+  if (cfg->buf_size == 0)
+    return 0;
+
+  if (cfg->buf_size > bufs->slot_size) {
+    fprintf(stderr, "send_engine: %u byte messages do not fit %u byte "
+                    "buffers\n",
+            cfg->buf_size, bufs->slot_size);
+    return -1;
+  }
+
+  eng->bufs = bufs;
+  eng->slots = (uint32_t *)malloc(cfg->sq_depth * sizeof(uint32_t));
+  if (!eng->slots) {
+    fprintf(stderr, "send_engine: out of memory\n");
+    return -1;
+  }
+  for (uint32_t i = 0; i < cfg->sq_depth; i++)
+    eng->slots[i] = BUF_POOL_EMPTY;
+  for (uint32_t i = 0; i < cfg->sq_depth; i++) {
+    eng->slots[i] = buf_pool_alloc(bufs);
+    if (eng->slots[i] == BUF_POOL_EMPTY) {
+      fprintf(stderr, "send_engine: buffer pool has only %u of %u slots "
+                      "free\n",
+              i, cfg->sq_depth);
+      send_engine_destroy(eng);
+      return -1;
+    }
+    memset(send_engine_buffer(eng, i), 0, cfg->buf_size);
+  }
+
+  // Everything but the address, length and flags is the same for every
+  // WR, so fill it once here
+  for (uint32_t i = 0; i < SEND_ENGINE_MAX_BATCH; i++)
+    eng->sges[i].lkey = buf_pool_lkey(bufs);
+
+  return 0;
+}
+
+static inline void send_engine_set_ud_dest(struct send_engine *eng,
+                                           struct ibv_ah *ah,
+                                           uint32_t remote_qpn,
+                                           uint32_t remote_qkey) {
+  eng->ah = ah;
+  eng->remote_qpn = remote_qpn;
+  eng->remote_qkey = remote_qkey;
+  for (uint32_t i = 0; i < SEND_ENGINE_MAX_BATCH; i++) {
+    eng->wrs[i].wr.ud.ah = ah;
+    eng->wrs[i].wr.ud.remote_qpn = remote_qpn;
+    eng->wrs[i].wr.ud.remote_qkey = remote_qkey;
+  }
+}
+
+// Sends the following messages as RDMA WRITEs into a ring of slots of
+// slot_size bytes each at addr/rkey on the peer, starting at slot 0.
+// credit is a registered word the peer RDMA WRITEs its count of consumed
+// slots into, as a big-endian 64-bit value starting from 0.
+static inline void send_engine_set_ring_dest(struct send_engine *eng,
+                                             uint64_t addr, uint32_t rkey,
+                                             uint32_t slots, uint32_t slot_size,
+                                             const volatile uint64_t *credit) {
+  eng->ring_addr = addr;
+  eng->ring_slots = slots;
+  eng->ring_slot_size = slot_size;
+  eng->ring_written = 0;
+  eng->ring_consumed = credit;
+  for (uint32_t i = 0; i < SEND_ENGINE_MAX_BATCH; i++) {
+    eng->wrs[i].opcode = IBV_WR_RDMA_WRITE;
+    eng->wrs[i].wr.rdma.rkey = rkey;
+  }
+}
+
+// Polls the send CQ once for up to SEND_ENGINE_POLL_BATCH completions.
+// Returns the number of WRs retired, or -1 if polling failed.
+static inline int send_engine_reap(struct send_engine *eng) {
+  struct ibv_wc wcs[SEND_ENGINE_POLL_BATCH];
+  int n = ibv_poll_cq(eng->cq, SEND_ENGINE_POLL_BATCH, wcs);
+  if (n < 0) {
+    fprintf(stderr, "send_engine: ibv_poll_cq failed\n");
+    return -1;
+  }
+
+  uint32_t retired = 0;
+  for (int i = 0; i < n; i++) {
+    if (wcs[i].status != IBV_WC_SUCCESS) {
+      fprintf(stderr, "send_engine: completion error: %s\n",
+              ibv_wc_status_str(wcs[i].status));
+      eng->errors++;
+    }
+    retired += (uint32_t)wcs[i].wr_id;
+  }
+
+  eng->outstanding -= retired;
+  eng->completed += retired;
+  return retired;
+}
+
+// Waits until n more WRs fit on the send queue and, with a ring
+// destination, n more messages fit in the ring. Returns 0, or -1 on error.
+static inline int send_engine_wait_room(struct send_engine *eng, uint32_t n) {
+  for (;;) {
+    bool room = eng->outstanding + n <= eng->cfg.sq_depth;
+    if (room && eng->ring_slots) {
+      uint64_t consumed = be64toh(*eng->ring_consumed);
+      room = eng->ring_written + n - consumed <= eng->ring_slots;
+    }
+    if (room)
+      return 0;
+    if (send_engine_reap(eng) < 0)
+      return -1;
+  }
+}
+
+// Points the n WRs at the next n ring slots, with the slot index of the
+// last one as immediate data
+static inline void send_engine_ring_target(struct send_engine *eng,
+                                           uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    struct ibv_send_wr *wr = &eng->wrs[i];
+    uint32_t slot = (uint32_t)(eng->ring_written++ % eng->ring_slots);
+
+    wr->wr.rdma.remote_addr =
+        eng->ring_addr + (uint64_t)slot * eng->ring_slot_size;
+    if (i + 1 == n) {
+      wr->opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+      wr->imm_data = htonl(slot);
+    } else {
+      wr->opcode = IBV_WR_RDMA_WRITE;
+    }
+  }
+}
+
+// Posts the n WRs whose sges are already filled in as one chain, signaling
+// every signal_interval-th and, if last is set, the final one. The caller
+// has made room for them with send_engine_wait_room(). Returns 0, or -1 on
+// error.
+static inline int send_engine_post_chain(struct send_engine *eng, uint32_t n,
+                                         bool last) {
+  if (eng->ring_slots)
+    send_engine_ring_target(eng, n);
+
+  for (uint32_t i = 0; i < n; i++) {
+    struct ibv_send_wr *wr = &eng->wrs[i];
+
+    eng->unsignaled++;
+    if (eng->unsignaled == eng->cfg.signal_interval || (last && i + 1 == n)) {
+      wr->send_flags = IBV_SEND_SIGNALED;
+      wr->wr_id = eng->unsignaled;
+      eng->unsignaled = 0;
+    } else {
+      wr->send_flags = 0;
+      wr->wr_id = 0;
+    }
+    wr->next = (i + 1 < n) ? &eng->wrs[i + 1] : NULL;
+  }
+
+  struct ibv_send_wr *bad_wr;
+  if (ibv_post_send(eng->qp, &eng->wrs[0], &bad_wr)) {
+    perror("send_engine: ibv_post_send");
+    return -1;
+  }
+
+  eng->outstanding += n;
+  eng->posted += n;
+  return 0;
+}
+
+// Sends count messages of length bytes from the buffer pool, whose
+// contents the caller may have filled through send_engine_buffer(). The
+// last WR of the call is always signaled so send_engine_drain() can wait
+// for it. Returns the number of messages posted, or -1 on error.
+static inline long send_engine_post(struct send_engine *eng, uint64_t count,
+                                    uint32_t length) {
+  struct send_engine_config *cfg = &eng->cfg;
+  uint64_t done = 0;
+
+  if (length > cfg->buf_size) {
+    fprintf(stderr, "send_engine: message of %u bytes exceeds %u byte "
+                    "buffers\n",
+            length, cfg->buf_size);
+    return -1;
+  }
+  if (eng->ring_slots && length > eng->ring_slot_size) {
+    fprintf(stderr, "send_engine: message of %u bytes exceeds %u byte ring "
+                    "slots\n",
+            length, eng->ring_slot_size);
+    return -1;
+  }
+
+  while (done < count) {
+    uint32_t n = cfg->batch;
+    if (count - done < n)
+      n = (uint32_t)(count - done);
+
+    if (send_engine_wait_room(eng, n))
+      return -1;
+
+    for (uint32_t i = 0; i < n; i++) {
+      eng->sges[i].addr = (uintptr_t)send_engine_buffer(eng, eng->next_buf);
+      eng->sges[i].length = length;
+      if (++eng->next_buf == cfg->sq_depth)
+        eng->next_buf = 0;
+    }
+
+    if (send_engine_post_chain(eng, n, done + n == count))
+      return -1;
+    done += n;
+  }
+
+  return (long)done;
+}
+
+// Sends count buffers described by bufs (address, length and lkey of
+// memory the caller registered) as they are. The caller must keep them
+// unchanged until the WRs complete, e.g. until send_engine_drain(). Calls
+// may be small, so only every signal_interval-th WR is signaled, plus the
+// last one if last is set; set it on the final call before draining.
+// Returns the number of messages posted, or -1 on error.
+static inline long send_engine_post_bufs(struct send_engine *eng,
+                                         const struct ibv_sge *bufs,
+                                         uint32_t count, bool last) {
+  uint32_t done = 0;
+
+  while (done < count) {
+    uint32_t n = eng->cfg.batch;
+    if (count - done < n)
+      n = count - done;
+
+    if (send_engine_wait_room(eng, n))
+      return -1;
+
+    memcpy(eng->sges, bufs + done, n * sizeof(*bufs));
+    if (send_engine_post_chain(eng, n, last && done + n == count))
+      return -1;
+    done += n;
+  }
+
+  return (long)done;
+}
+
+// Waits until every posted WR has completed. Returns 0, or -1 on error.
+static inline int send_engine_drain(struct send_engine *eng) {
+  while (eng->outstanding > 0) {
+    if (send_engine_reap(eng) < 0)
+      return -1;
+  }
+  return eng->errors ? -1 : 0;
+}
+
+#endif
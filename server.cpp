@@ -1,124 +1,305 @@
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <infiniband/verbs.h>
 #include <iostream>
 #include <unistd.h>
 
-int main() {
+#include "buf_pool.h"
+#include "cq_wait.h"
+#include "oob.h"
+#include "rc_ring.h"
+#include "recv_pool.h"
+#include "verbs.h"
+
+#define IB_PORT 1
+#define GID_INDEX 1
+#define QKEY 0x11111111
+#define GRH_SIZE 40
+#define MAX_MSG_SIZE 4096
+#define RECV_SLOTS 512
+#define RECV_REFILL_BATCH 32
+#define RC_RING_SLOTS 256
+#define RC_SLOT_SIZE 16384
+
+static void print_client(const QpEndpoint *remote) {
+  char desc[128];
+  printf("Client connected: %s\n",
+         oob_endpoint_str(remote, desc, sizeof(desc)));
+}
+
+// Answers each client that connects to the side channel with this
+// server's endpoint. UD needs no per-client state: clients address the one
+// QP by its QPN and Q_Key.
+static int answer_client(void *arg, const QpEndpoint *remote,
+                         QpEndpoint *reply) {
+  print_client(remote);
+  *reply = *(const QpEndpoint *)arg;
+  return 0;
+}
+
+// RC: each client gets its own QP and ring
+static int accept_rc_client(void *arg, const QpEndpoint *remote,
+                            QpEndpoint *reply) {
+  print_client(remote);
+  return rc_ring_accept(arg, remote, reply);
+}
+
+// Prints the first message written into any ring
+static void print_first(void *arg, uint32_t peer, const char *msg,
+                        uint32_t length) {
+  bool *printed = (bool *)arg;
+  if (*printed) {
+    return;
+  }
+  *printed = true;
+  std::cout << "Server received: " << std::string(msg, strnlen(msg, length))
+            << " (client " << peer << ")" << std::endl;
+}
+
+// RC mode: clients RDMA WRITE into per-client rings and only the last
+// write of each batch raises a completion. Returns the exit status.
+static int serve_rc(const Device &dev, ibv_pd *pd, cq_waiter *waiter,
+                    uint64_t count, const char *listen_addr) {
+  // 4. Memory and QPs: a ring per client, handed out as clients connect
+  rc_ring_config ring_cfg{};
+  ring_cfg.slots = RC_RING_SLOTS;
+  ring_cfg.slot_size = RC_SLOT_SIZE;
+  ring_cfg.port = IB_PORT;
+  ring_cfg.gid_index = GID_INDEX;
+
+  rc_ring_receiver rx;
+  if (rc_ring_init(&rx, dev, pd, waiter->cq, &ring_cfg)) {
+    return 1;
+  }
+  auto rx_guard = on_scope_exit([&] { rc_ring_destroy(&rx); });
+  buf_pool_report(&rx.rings, "Receive rings");
+
+  // 5. Connect every client that turns up on the side channel
+  oob_server oob;
+  if (oob_server_start(&oob, listen_addr, accept_rc_client, &rx)) {
+    return 1;
+  }
+  auto oob_guard = on_scope_exit([&] { oob_server_stop(&oob); });
+
+  std::cout << "Server RC rings of " << RC_RING_SLOTS << " x "
+            << rx.cfg.slot_size << " bytes, waiting for clients on "
+            << listen_addr << std::endl;
+
+  // 6. Hand out messages as notifications arrive, then repost the
+  // notification receives and return credit once per sweep
+  uint64_t received = 0;
+  uint64_t errors = 0;
+  bool printed = false;
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (received + errors < count) {
+    ibv_wc wcs[CQ_WAIT_BATCH];
+    int n = cq_wait_poll(waiter, wcs);
+    if (n < 0) {
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      ibv_wc &wc = wcs[i];
+      if (wc.status != IBV_WC_SUCCESS) {
+        std::cout << "Completion: status=" << wc.status
+                  << " qp=" << wc.qp_num
+                  << " vendor_err=" << wc.vendor_err << std::endl;
+        errors++;
+      } else {
+        received += rc_ring_complete(&rx, &wc, print_first, &printed);
+      }
+    }
+
+    if (rc_ring_flush(&rx) < 0) {
+      break;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  std::cout << "Server received " << received << " messages (" << errors
+            << " errors) over RC after "
+            << __atomic_load_n(&oob.clients, __ATOMIC_RELAXED)
+            << " client(s) connected" << std::endl;
+  cq_wait_report(waiter, (end.tv_sec - start.tv_sec) +
+                             (end.tv_nsec - start.tv_nsec) / 1e9);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  // Number of messages to wait for, whether to post through an SRQ or
+  // take RC writes instead of UD sends, how to wait for completions and
+  // where to listen for clients
+  uint64_t count = 1;
+  bool use_srq = false;
+  bool use_rc = false;
+  cq_wait_mode wait_mode = CQ_WAIT_ADAPTIVE;
+  const char *listen_addr = ":" OOB_DEFAULT_PORT;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--srq") == 0) {
+      use_srq = true;
+    } else if (strcmp(argv[i], "--rc") == 0) {
+      use_rc = true;
+    } else if (strncmp(argv[i], "--listen=", 9) == 0) {
+      listen_addr = argv[i] + 9;
+    } else if (strncmp(argv[i], "--wait=", 7) == 0) {
+      if (cq_wait_parse_mode(argv[i] + 7, &wait_mode) < 0) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [count] [--srq|--rc] [--wait=busy|adaptive|event]"
+                  << " [--listen=host:port|unix:path]" << std::endl;
+        return 1;
+      }
+    } else {
+      count = strtoull(argv[i], nullptr, 10);
+    }
+  }
+
+  srand48(time(NULL) ^ getpid());
+
   // 1. Open device
-  ibv_device **dev_list = ibv_get_device_list(nullptr);
-  ibv_context *ctx = ibv_open_device(dev_list[0]);
+  Device dev = Device::open();
+  if (!dev) {
+    return 1;
+  }
 
   // 2. Protection domain
-  ibv_pd *pd = ibv_alloc_pd(ctx);
-
-  // 3. Completion queue
-  ibv_cq *cq = ibv_create_cq(ctx, 1, nullptr, nullptr, 0);
-
-  // 4. Create RC QP
-  ibv_qp_init_attr qp_attr{};
-  qp_attr.send_cq = cq;
-  qp_attr.recv_cq = cq;
-  qp_attr.qp_type = IBV_QPT_UD;
-  qp_attr.cap.max_send_wr = 1;
-  qp_attr.cap.max_recv_wr = 1;
-  qp_attr.cap.max_send_sge = 1;
-  qp_attr.cap.max_recv_sge = 1;
-
-  ibv_qp *qp = ibv_create_qp(pd, &qp_attr);
+  Pd pd = Pd::alloc(dev);
+  if (!pd) {
+    return 1;
+  }
+
+  // 3. Completion queue, owned by the waiter. In RC mode it is shared by
+  // every client's QP: one notification per ring slot at most, plus the
+  // credit writes.
+  int cq_depth = use_rc ? RC_RING_MAX_PEERS *
+                              (RC_RING_SLOTS + RC_RING_CREDIT_DEPTH)
+                        : RECV_SLOTS;
+  cq_waiter waiter;
+  ibv_cq *cq = cq_wait_create_cq(&waiter, dev, cq_depth, wait_mode);
+  if (!cq) {
+    return 1;
+  }
+  auto waiter_guard = on_scope_exit([&] { cq_wait_destroy(&waiter); });
+
+  if (use_rc) {
+    return serve_rc(dev, pd, &waiter, count, listen_addr);
+  }
+
+  // Optional shared receive queue the buffers are posted to instead
+  Srq srq;
+  if (use_srq) {
+    srq = Srq(recv_pool_create_srq(pd, RECV_SLOTS));
+    if (!srq) {
+      return 1;
+    }
+  }
+
+  // 4. Memory: one huge page backed region on the NIC's NUMA node,
+  // registered once and carved into GRH + MTU sized slots
   std::cout << "Add mem\n";
-  // 5. Memory
-  char buf[16 + 40] = {};
-  ibv_mr *mr = ibv_reg_mr(pd, buf, sizeof(buf),
-                          IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
-
-  // 6. Move QP to INIT
-  ibv_qp_attr attr{};
-  attr.qp_state = IBV_QPS_INIT;
-  attr.port_num = 1;
-  attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
-
-  attr.qkey = 0x11111111;
-  attr.pkey_index = 0;
-  // ibv_modify_qp(qp, &attr,
-  //              IBV_QP_STATE | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS |
-  //                IBV_QP_PKEY_INDEX);
-  //
-
-  if (ibv_modify_qp(qp, &attr,
-                    IBV_QP_STATE | IBV_QP_PORT | IBV_QP_QKEY |
-                        IBV_QP_PKEY_INDEX)) {
-    perror("ibv_modify_qp qp INIT");
+  buf_pool_config buf_cfg{};
+  buf_cfg.num_slots = RECV_SLOTS;
+  buf_cfg.slot_size = GRH_SIZE + MAX_MSG_SIZE;
+  buf_cfg.numa_node = -1;
+  buf_cfg.access = IBV_ACCESS_LOCAL_WRITE;
+
+  buf_pool bufs;
+  if (buf_pool_init(&bufs, pd, &buf_cfg)) {
+    return 1;
+  }
+  auto bufs_guard = on_scope_exit([&] { buf_pool_destroy(&bufs); });
+  buf_pool_report(&bufs, "Receive buffers");
+
+  // 5. Create UD QP and bring it up to RTS; UD needs no remote address
+  // until it sends
+  Qp qp = QpBuilder::ud(pd)
+              .cq(cq)
+              .srq(srq)
+              .depth(1, RECV_SLOTS)
+              .create();
+  if (!qp || qp.ready_ud(IB_PORT, QKEY)) {
+    return 1;
+  }
+  std::cout << "QP state: " << qp.state() << std::endl;
+
+  // 6. Post receives: every slot up front
+  recv_pool_config pool_cfg{};
+  pool_cfg.num_slots = RECV_SLOTS;
+  pool_cfg.slot_size = GRH_SIZE + MAX_MSG_SIZE;
+  pool_cfg.refill_batch = RECV_REFILL_BATCH;
+
+  recv_pool pool;
+  if (recv_pool_init(&pool, &bufs, qp, srq, &pool_cfg)) {
+    return 1;
+  }
+  auto pool_guard = on_scope_exit([&] { recv_pool_destroy(&pool); });
+
+  // 7. Hand our endpoint to every client that connects to the side
+  // channel, for as long as we run
+  QpEndpoint local{};
+  local.qpn = qp.qpn();
+  local.qkey = QKEY;
+  if (dev.port_address(IB_PORT, GID_INDEX, &local)) {
     return 1;
   }
 
-  // Print QP state after each transition
-  ibv_qp_attr query_attr;
-  ibv_qp_init_attr query_init_attr;
-  ibv_query_qp(qp, &query_attr, IBV_QP_STATE, &query_init_attr);
-  std::cout << "QP state: " << query_attr.qp_state << std::endl;
-  // 7. Post receive
-  ibv_sge sge{};
-  sge.addr = (uintptr_t)buf;
-  sge.length = sizeof(buf) + 40;
-  sge.lkey = mr->lkey;
-
-  ibv_recv_wr rr{};
-  rr.sg_list = &sge;
-  rr.num_sge = 1;
-  rr.next = nullptr;
-  ibv_recv_wr *bad_rr;
-  ibv_post_recv(qp, &rr, &bad_rr);
-
-  // 8. Print connection info for client
-  std::cout << "Server QP number: " << qp->qp_num << std::endl;
-  std::cout << "Send this to client" << std::endl;
-
-  uint32_t client_qpn;
-  std::cout << "Enter client QP number: ";
-  std::cin >> client_qpn;
-
-  // 9. Move QP to RTR
-  //
-  ibv_gid my_gid;
-  ibv_query_gid(ctx, 1, 1, &my_gid);
-
-  attr.qp_state = IBV_QPS_RTR;
-  attr.dest_qp_num = client_qpn;
-  attr.rq_psn = 0;
-  attr.path_mtu = IBV_MTU_256;
-  attr.ah_attr.is_global = 1;      // Enable global routing
-  attr.ah_attr.grh.dgid = my_gid;  // Destination GID
-  attr.ah_attr.grh.sgid_index = 1; // Source GID index (your -g 1)
-  attr.ah_attr.grh.hop_limit = 1;  // Or appropriate hop limit
-  attr.ah_attr.port_num = 1;
-  attr.ah_attr.sl = 0; // Service level
-
-  ibv_modify_qp(qp, &attr,
-                IBV_QP_STATE); //| IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
-                               // IBV_QP_PATH_MTU | IBV_QP_AV);
-
-  ibv_query_qp(qp, &query_attr, IBV_QP_STATE, &query_init_attr);
-  std::cout << "QP state: " << query_attr.qp_state << std::endl;
-  // 10. Move QP to RTS
-  attr.qp_state = IBV_QPS_RTS;
-  attr.sq_psn = 0;
-  ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
-
-  ibv_query_qp(qp, &query_attr, IBV_QP_STATE, &query_init_attr);
-  std::cout << "QP state: " << query_attr.qp_state << std::endl;
-  // 11. Poll completion queue
-  ibv_wc wc;
-  while (ibv_poll_cq(cq, 1, &wc) == 0) {
-  }
-
-  std::cout << "Server received: " << buf + 40 << std::endl;
-  std::cout << "Completion: status=" << wc.status << " opcode=" << wc.opcode
-            << " vendor_err=" << wc.vendor_err << std::endl;
-  // 12. Cleanup
-  ibv_dereg_mr(mr);
-  ibv_destroy_qp(qp);
-  ibv_destroy_cq(cq);
-  ibv_dealloc_pd(pd);
-  ibv_close_device(ctx);
-  ibv_free_device_list(dev_list);
+  oob_server oob;
+  if (oob_server_start(&oob, listen_addr, answer_client, &local)) {
+    return 1;
+  }
+  auto oob_guard = on_scope_exit([&] { oob_server_stop(&oob); });
+
+  char desc[128];
+  std::cout << "Server " << oob_endpoint_str(&local, desc, sizeof(desc))
+            << ", waiting for clients on " << listen_addr << std::endl;
+
+  // 8. Wait for completions, reposting buffers after each sweep
+  uint64_t received = 0;
+  uint64_t errors = 0;
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (received + errors < count) {
+    ibv_wc wcs[CQ_WAIT_BATCH];
+    int n = cq_wait_poll(&waiter, wcs);
+    if (n < 0) {
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      ibv_wc &wc = wcs[i];
+      if (wc.status != IBV_WC_SUCCESS) {
+        std::cout << "Completion: status=" << wc.status
+                  << " opcode=" << wc.opcode
+                  << " vendor_err=" << wc.vendor_err << std::endl;
+        errors++;
+      } else if (received++ == 0) {
+        // Payload follows the 40-byte GRH
+        char *buf = recv_pool_buf(&pool, wc.wr_id);
+        std::cout << "Server received: "
+                  << std::string(buf + GRH_SIZE,
+                                 strnlen(buf + GRH_SIZE,
+                                         wc.byte_len - GRH_SIZE))
+                  << std::endl;
+      }
+      recv_pool_release(&pool, wc.wr_id);
+    }
+
+    if (recv_pool_replenish(&pool, false) < 0) {
+      break;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  std::cout << "Server received " << received << " messages (" << errors
+            << " errors) after "
+            << __atomic_load_n(&oob.clients, __ATOMIC_RELAXED)
+            << " client(s) connected" << std::endl;
+  cq_wait_report(&waiter, (end.tv_sec - start.tv_sec) +
+                              (end.tv_nsec - start.tv_nsec) / 1e9);
+  // 9. Cleanup: the pool, QP, buffers, SRQ, CQ, PD and device go in
+  // reverse order as they leave scope
+  return 0;
 }
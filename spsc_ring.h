@@ -0,0 +1,116 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+
+// Lock-free single-producer/single-consumer ring.
+//
+// head is only written by the producer and tail only by the consumer; each
+// lives on its own cache line together with that side's cached copy of the
+// other index, so the two threads only share a line when the cached value
+// goes stale. Indices run freely and are masked on access, which is why the
+// capacity must be a power of two, and all N slots are usable.
+//
+// Slots are accessed in place: the producer fills claim() (or a batch from
+// claim_n()/claim_at()) and then calls publish(), the consumer reads front()
+// (or a batch from front_n()/front_at()) and then calls release(). A slot is
+// never handed back to the producer until the consumer has released it.
+template <typename T, size_t N> struct SpscRing {
+  static_assert(N != 0 && (N & (N - 1)) == 0,
+                "SpscRing capacity must be a power of two");
+  static const size_t MASK = N - 1;
+
+  // Producer side
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head{0};
+  size_t cached_tail = 0;
+
+  // Consumer side
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0};
+  size_t cached_head = 0;
+
+  alignas(CACHE_LINE_SIZE) T slots[N];
+
+  static constexpr size_t capacity() { return N; }
+
+  // Producer: next free slot, or NULL when the ring is full.
+  T *claim() {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - cached_tail == N) {
+      cached_tail = tail.load(std::memory_order_acquire);
+      if (h - cached_tail == N)
+        return NULL;
+    }
+    return &slots[h & MASK];
+  }
+
+  // Producer: number of free slots, up to max. The caller may fill
+  // claim_at(0) .. claim_at(n - 1) and then publish(n) them together.
+  size_t claim_n(size_t max) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t free_slots = N - (h - cached_tail);
+    if (free_slots < max) {
+      cached_tail = tail.load(std::memory_order_acquire);
+      free_slots = N - (h - cached_tail);
+    }
+    return free_slots < max ? free_slots : max;
+  }
+
+  // Producer: i-th slot past the head; only valid for i < claim_n().
+  T *claim_at(size_t i) {
+    return &slots[(head.load(std::memory_order_relaxed) + i) & MASK];
+  }
+
+  // Producer: make the next n claimed slots visible to the consumer.
+  void publish(size_t n = 1) {
+    head.store(head.load(std::memory_order_relaxed) + n,
+               std::memory_order_release);
+  }
+
+  // Consumer: oldest published slot, or NULL when the ring is empty.
+  T *front() {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == cached_head) {
+      cached_head = head.load(std::memory_order_acquire);
+      if (t == cached_head)
+        return NULL;
+    }
+    return &slots[t & MASK];
+  }
+
+  // Consumer: number of published slots, up to max. The caller may read
+  // front_at(0) .. front_at(n - 1) and then release(n) them together.
+  size_t front_n(size_t max) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t ready = cached_head - t;
+    if (ready < max) {
+      cached_head = head.load(std::memory_order_acquire);
+      ready = cached_head - t;
+    }
+    return ready < max ? ready : max;
+  }
+
+  // Consumer: i-th slot past the tail; only valid for i < front_n().
+  T *front_at(size_t i) {
+    return &slots[(tail.load(std::memory_order_relaxed) + i) & MASK];
+  }
+
+  // Consumer: hand the next n slots (front(), or a batch from front_n())
+  // back to the producer.
+  void release(size_t n = 1) {
+    tail.store(tail.load(std::memory_order_relaxed) + n,
+               std::memory_order_release);
+  }
+
+  // Approximate occupancy; safe to call from any thread.
+  size_t size() const {
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t h = head.load(std::memory_order_acquire);
+    return h - t;
+  }
+};
+
+#endif
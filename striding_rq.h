@@ -0,0 +1,345 @@
+#ifndef STRIDING_RQ_H
+#define STRIDING_RQ_H
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <infiniband/mlx5dv.h>
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buf_pool.h"
+
+// Multi-packet (striding) receive queue for raw Ethernet traffic.
+//
+// Each receive WQE covers one large buffer split into equal strides, and
+// the NIC packs consecutive packets into consecutive strides; a packet
+// longer than a stride takes several. A single WQE therefore receives
+// hundreds of packets. Receiving goes through an mlx5 striding WQ behind a
+// one-entry RSS indirection table, and the RSS QP on top of it is what
+// flow steering rules attach to.
+//
+// Completions are read straight from the CQ ring (mlx5dv owns the CQ's
+// consumer index), because a striding completion reports the stride index
+// and count that ibv_poll_cq() cannot return. striding_rq_poll() hands out
+// (pointer, length) views into the strides; they stay valid until the next
+// striding_rq_poll() call, which is when fully consumed WQEs are reposted.
+//
+// Only mlx5 devices that report striding RQ support for raw packet QPs can
+// use this; check striding_rq_supported() and fall back to a classic
+// receive queue otherwise.
+
+#define STRIDING_RQ_MAX_BATCH 64
+
+// byte_cnt of a striding completion: packet length, strides consumed and
+// whether it is a filler that only pads out the end of a WQE
+#define MPRQ_LEN_MASK 0xffff
+#define MPRQ_STRIDE_NUM_MASK 0x3fff0000
+#define MPRQ_STRIDE_NUM_SHIFT 16
+#define MPRQ_FILLER_MASK 0x80000000
+
+struct striding_rq_config {
+  uint32_t log_stride_size; // log2 bytes per stride
+  uint32_t log_num_strides; // log2 strides per WQE
+  uint32_t num_wqes;        // WQEs kept posted
+};
+
+struct striding_rq_pkt {
+  const char *data;
+  uint32_t len;
+};
+
+struct striding_rq {
+  struct ibv_cq *cq;
+  struct ibv_wq *wq;
+  struct ibv_rwq_ind_table *ind_tbl;
+  struct ibv_qp *qp; // RSS QP to attach flow rules to
+  struct ibv_mr *mr;
+  char *region;
+  size_t region_mapped; // huge page backed, on the device's NUMA node
+  struct striding_rq_config cfg;
+  uint32_t stride_size;
+  uint32_t strides_per_wqe;
+  size_t wqe_size;
+
+  struct mlx5dv_cq dv_cq;
+  uint32_t cq_ci; // CQ consumer index
+
+  uint32_t cur_wqe;      // WQE the NIC is filling, in posting order
+  uint32_t cur_strides;  // strides of cur_wqe consumed so far
+  uint32_t *done_wqes;   // fully consumed, reposted on the next poll
+  uint32_t num_done;
+
+  uint64_t packets;
+  uint64_t fillers;
+  uint64_t errors;
+  uint64_t reposts;
+};
+
+static inline char *striding_rq_wqe_buf(struct striding_rq *rq,
+                                        uint32_t wqe) {
+  return rq->region + (size_t)wqe * rq->wqe_size;
+}
+
+// Returns 1 if ctx can run a striding RQ with cfg on a raw packet QP
+static inline int striding_rq_supported(struct ibv_context *ctx,
+                                        const struct striding_rq_config *cfg) {
+  if (!mlx5dv_is_supported(ctx->device))
+    return 0;
+
+  struct mlx5dv_context attrs = {};
+  attrs.comp_mask = MLX5DV_CONTEXT_MASK_STRIDING_RQ;
+  if (mlx5dv_query_device(ctx, &attrs) ||
+      !(attrs.comp_mask & MLX5DV_CONTEXT_MASK_STRIDING_RQ))
+    return 0;
+
+  struct mlx5dv_striding_rq_caps *caps = &attrs.striding_rq_caps;
+  return (caps->supported_qpts & (1 << IBV_QPT_RAW_PACKET)) &&
+         cfg->log_stride_size >= caps->min_single_stride_log_num_of_bytes &&
+         cfg->log_stride_size <= caps->max_single_stride_log_num_of_bytes &&
+         cfg->log_num_strides >= caps->min_single_wqe_log_num_of_strides &&
+         cfg->log_num_strides <= caps->max_single_wqe_log_num_of_strides;
+}
+
+static inline int striding_rq_post_wqe(struct striding_rq *rq, uint32_t wqe) {
+  struct ibv_sge sge = {};
+  sge.addr = (uintptr_t)striding_rq_wqe_buf(rq, wqe);
+  sge.length = rq->wqe_size;
+  sge.lkey = rq->mr->lkey;
+
+  struct ibv_recv_wr wr = {};
+  wr.wr_id = wqe;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+
+  struct ibv_recv_wr *bad_wr;
+  int ret = ibv_post_wq_recv(rq->wq, &wr, &bad_wr);
+  if (ret)
+    fprintf(stderr, "striding_rq: failed to post WQE %u: %s\n", wqe,
+            strerror(ret));
+  return ret ? -1 : 0;
+}
+
+static inline void striding_rq_destroy(struct striding_rq *rq) {
+  if (rq->qp)
+    ibv_destroy_qp(rq->qp);
+  if (rq->ind_tbl)
+    ibv_destroy_rwq_ind_table(rq->ind_tbl);
+  if (rq->wq)
+    ibv_destroy_wq(rq->wq);
+  if (rq->cq)
+    ibv_destroy_cq(rq->cq);
+  if (rq->mr)
+    ibv_dereg_mr(rq->mr);
+  buf_pool_unmap(rq->region, rq->region_mapped);
+  free(rq->done_wqes);
+  memset(rq, 0, sizeof(*rq));
+}
+
+// Creates the CQ, striding WQ, indirection table and RSS QP, and posts
+// every WQE. Returns 0 on success, -1 on failure (with nothing left
+// allocated).
+static inline int striding_rq_init(struct striding_rq *rq,
+                                   struct ibv_context *ctx, struct ibv_pd *pd,
+                                   const struct striding_rq_config *cfg) {
+  memset(rq, 0, sizeof(*rq));
+  rq->cfg = *cfg;
+  rq->stride_size = 1u << cfg->log_stride_size;
+  rq->strides_per_wqe = 1u << cfg->log_num_strides;
+  rq->wqe_size = (size_t)rq->stride_size * rq->strides_per_wqe;
+
+  size_t region_size = rq->wqe_size * cfg->num_wqes;
+  size_t page_size;
+  rq->region = (char *)buf_pool_map(region_size, buf_pool_device_node(ctx),
+                                    &rq->region_mapped, &page_size);
+  rq->done_wqes = (uint32_t *)malloc(cfg->num_wqes * sizeof(uint32_t));
+  if (!rq->region || !rq->done_wqes) {
+    fprintf(stderr, "striding_rq: failed to allocate %zu bytes\n",
+            region_size);
+    striding_rq_destroy(rq);
+    return -1;
+  }
+
+  rq->mr = ibv_reg_mr(pd, rq->region, region_size, IBV_ACCESS_LOCAL_WRITE);
+  if (!rq->mr) {
+    perror("striding_rq: ibv_reg_mr");
+    striding_rq_destroy(rq);
+    return -1;
+  }
+
+  // Every stride, and every filler, can complete separately
+  rq->cq = ibv_create_cq(ctx, rq->strides_per_wqe * cfg->num_wqes, NULL,
+                         NULL, 0);
+  if (!rq->cq) {
+    perror("striding_rq: ibv_create_cq");
+    striding_rq_destroy(rq);
+    return -1;
+  }
+
+  struct mlx5dv_obj obj = {};
+  obj.cq.in = rq->cq;
+  obj.cq.out = &rq->dv_cq;
+  if (mlx5dv_init_obj(&obj, MLX5DV_OBJ_CQ)) {
+    fprintf(stderr, "striding_rq: mlx5dv_init_obj failed\n");
+    striding_rq_destroy(rq);
+    return -1;
+  }
+
+  struct ibv_wq_init_attr wq_attr = {};
+  wq_attr.wq_type = IBV_WQT_RQ;
+  wq_attr.max_wr = cfg->num_wqes;
+  wq_attr.max_sge = 1;
+  wq_attr.pd = pd;
+  wq_attr.cq = rq->cq;
+
+  struct mlx5dv_wq_init_attr dv_wq_attr = {};
+  dv_wq_attr.comp_mask = MLX5DV_WQ_INIT_ATTR_MASK_STRIDING_RQ;
+  dv_wq_attr.striding_rq_attrs.single_stride_log_num_of_bytes =
+      cfg->log_stride_size;
+  dv_wq_attr.striding_rq_attrs.single_wqe_log_num_of_strides =
+      cfg->log_num_strides;
+
+  rq->wq = mlx5dv_create_wq(ctx, &wq_attr, &dv_wq_attr);
+  if (!rq->wq) {
+    perror("striding_rq: mlx5dv_create_wq");
+    striding_rq_destroy(rq);
+    return -1;
+  }
+
+  struct ibv_wq_attr wq_mod = {};
+  wq_mod.attr_mask = IBV_WQ_ATTR_STATE;
+  wq_mod.wq_state = IBV_WQS_RDY;
+  if (ibv_modify_wq(rq->wq, &wq_mod)) {
+    perror("striding_rq: ibv_modify_wq RDY");
+    striding_rq_destroy(rq);
+    return -1;
+  }
+
+  // A one-entry indirection table: everything the RSS QP matches goes to
+  // our single WQ
+  struct ibv_rwq_ind_table_init_attr ind_attr = {};
+  ind_attr.log_ind_tbl_size = 0;
+  ind_attr.ind_tbl = &rq->wq;
+  rq->ind_tbl = ibv_create_rwq_ind_table(ctx, &ind_attr);
+  if (!rq->ind_tbl) {
+    perror("striding_rq: ibv_create_rwq_ind_table");
+    striding_rq_destroy(rq);
+    return -1;
+  }
+
+  static uint8_t rss_key[40] = {
+      0x2c, 0xc6, 0x81, 0xd1, 0x5b, 0xdb, 0xf4, 0xf7, 0xfc, 0xa2,
+      0x83, 0x19, 0xdb, 0x1a, 0x3e, 0x94, 0x6b, 0x9e, 0x38, 0xd9,
+      0x2c, 0x9c, 0x03, 0xd1, 0xad, 0x99, 0x44, 0xa7, 0xd9, 0x56,
+      0x3d, 0x59, 0x06, 0x3c, 0x25, 0xf3, 0xfc, 0x1f, 0xdc, 0x2a};
+
+  struct ibv_qp_init_attr_ex qp_attr = {};
+  qp_attr.qp_type = IBV_QPT_RAW_PACKET;
+  qp_attr.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_IND_TABLE |
+                      IBV_QP_INIT_ATTR_RX_HASH;
+  qp_attr.pd = pd;
+  qp_attr.rwq_ind_tbl = rq->ind_tbl;
+  qp_attr.rx_hash_conf.rx_hash_function = IBV_RX_HASH_FUNC_TOEPLITZ;
+  qp_attr.rx_hash_conf.rx_hash_key_len = sizeof(rss_key);
+  qp_attr.rx_hash_conf.rx_hash_key = rss_key;
+  qp_attr.rx_hash_conf.rx_hash_fields_mask =
+      IBV_RX_HASH_SRC_IPV4 | IBV_RX_HASH_DST_IPV4 |
+      IBV_RX_HASH_SRC_PORT_UDP | IBV_RX_HASH_DST_PORT_UDP;
+
+  rq->qp = ibv_create_qp_ex(ctx, &qp_attr);
+  if (!rq->qp) {
+    perror("striding_rq: ibv_create_qp_ex RSS");
+    striding_rq_destroy(rq);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < cfg->num_wqes; i++) {
+    if (striding_rq_post_wqe(rq, i)) {
+      striding_rq_destroy(rq);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Next valid CQE, or NULL if the NIC has not written one yet
+static inline struct mlx5_cqe64 *striding_rq_next_cqe(struct striding_rq *rq) {
+  uint32_t idx = rq->cq_ci & (rq->dv_cq.cqe_cnt - 1);
+  char *cqe = (char *)rq->dv_cq.buf + (size_t)idx * rq->dv_cq.cqe_size;
+
+  // With 128-byte CQEs the 64-byte completion sits in the second half
+  struct mlx5_cqe64 *cqe64 =
+      (struct mlx5_cqe64 *)(rq->dv_cq.cqe_size == 128 ? cqe + 64 : cqe);
+  uint8_t op_own = cqe64->op_own;
+
+  if ((op_own >> 4) == MLX5_CQE_INVALID ||
+      (op_own & MLX5_CQE_OWNER_MASK) != !!(rq->cq_ci & rq->dv_cq.cqe_cnt))
+    return NULL;
+
+  // Read the rest of the CQE only after seeing its owner bit flip
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return cqe64;
+}
+
+// Reposts the WQEs finished during the previous call, then returns up to
+// max packet views. Returns the number of packets, or -1 on error.
+static inline int striding_rq_poll(struct striding_rq *rq,
+                                   struct striding_rq_pkt *pkts, int max) {
+  for (uint32_t i = 0; i < rq->num_done; i++) {
+    if (striding_rq_post_wqe(rq, rq->done_wqes[i]))
+      return -1;
+    rq->reposts++;
+  }
+  rq->num_done = 0;
+
+  int n = 0;
+  uint32_t polled = 0;
+  struct mlx5_cqe64 *cqe;
+
+  while (n < max && (cqe = striding_rq_next_cqe(rq)) != NULL) {
+    uint8_t opcode = cqe->op_own >> 4;
+    uint32_t byte_cnt = be32toh(cqe->byte_cnt);
+    uint32_t strides =
+        (byte_cnt & MPRQ_STRIDE_NUM_MASK) >> MPRQ_STRIDE_NUM_SHIFT;
+    uint32_t stride_idx = be16toh(cqe->wqe_counter);
+
+    rq->cq_ci++;
+    polled++;
+
+    if (opcode != MLX5_CQE_RESP_SEND) {
+      // Error CQEs carry no stride count; nothing more will land in
+      // this WQE until it is reposted
+      rq->errors++;
+      strides = rq->strides_per_wqe - rq->cur_strides;
+    } else if (byte_cnt & MPRQ_FILLER_MASK) {
+      rq->fillers++;
+    } else {
+      pkts[n].data = striding_rq_wqe_buf(rq, rq->cur_wqe) +
+                     (size_t)stride_idx * rq->stride_size;
+      pkts[n].len = byte_cnt & MPRQ_LEN_MASK;
+      n++;
+      rq->packets++;
+    }
+
+    // WQEs are filled strictly in posting order
+    rq->cur_strides += strides;
+    if (rq->cur_strides >= rq->strides_per_wqe) {
+      rq->done_wqes[rq->num_done++] = rq->cur_wqe;
+      rq->cur_wqe = (rq->cur_wqe + 1) % rq->cfg.num_wqes;
+      rq->cur_strides = 0;
+    }
+  }
+
+  if (polled) {
+    // Publish the consumer index only after the CQEs have been read
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rq->dv_cq.dbrec[0] = htobe32(rq->cq_ci & 0xffffff);
+  }
+
+  return n;
+}
+
+#endif
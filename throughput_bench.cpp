@@ -0,0 +1,730 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <infiniband/verbs.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "buf_pool.h"
+#include "packet_parser.h"
+#include "recv_pool.h"
+#include "send_engine.h"
+#include "verbs.h"
+
+// Throughput benchmark: a matrix of runs over message size, send queue
+// depth, post batch, signal interval and number of QPs, on three paths:
+//   ud   UD QP pairs on one port; one thread per pair sends through the
+//        send engine and reposts the receiver's buffers between batches
+//   raw  raw packet QPs sending synthetic FPGA frames out of the port, to a
+//        locally administered MAC; send side only, as far as the NIC takes
+//        them
+//   udp  one socket pair per "QP" on 127.0.0.1, a sender thread calling
+//        sendmmsg() with batch datagrams and a receiver thread calling
+//        recvmmsg(); depth and signal interval do not apply
+// Each run moves --count messages per QP from worker threads pinned
+// round-robin to --cpus, and reports what arrived (what was sent, for raw)
+// in Mpps and Gbit/s of message bytes, the loss, and the CPU cycles spent
+// per message: the process's user and system CPU time at the TSC rate, so
+// every thread and the kernel's share are counted. Verbs rows name the
+// device's NUMA node, which the buffers are bound to; pin to its CPUs.
+
+#define IB_PORT 1
+#define GID_INDEX 1
+#define QKEY 0x11111111
+#define GRH_SIZE 40
+#define RECV_SLOTS 1024
+#define RECV_REFILL_BATCH 32
+#define POLL_BATCH 32
+#define MAX_QPS 64
+#define QUIET_NS 20000000 // receivers stop after this long with nothing
+#define UDP_RCVBUF (8 * 1024 * 1024)
+#define DEFAULT_COUNT 200000
+
+enum bench_path { PATH_UD, PATH_RAW, PATH_UDP, NUM_PATHS };
+static const char *const path_names[NUM_PATHS] = {"ud", "raw", "udp"};
+
+struct run_config {
+  uint32_t size;
+  uint32_t depth;
+  uint32_t batch;
+  uint32_t signal;
+  uint32_t qps;
+  uint64_t count; // per QP
+};
+
+struct run_result {
+  uint64_t sent;
+  uint64_t received;
+  double elapsed; // seconds
+  double cpu;     // seconds, all threads
+};
+
+// Starts n workers pinned round-robin to cpus and releases them together
+// once all are running, timing them from there until the last exits. Each
+// worker must wait on start once, before its timed work.
+static void run_workers(void *(*fn)(void *), void **args, uint32_t n,
+                       const uint32_t *cpus, int num_cpus,
+                       pthread_barrier_t *start, struct run_result *res) {
+  pthread_t tids[2 * MAX_QPS];
+  pthread_barrier_init(start, NULL, n + 1);
+
+  for (uint32_t i = 0; i < n; i++) {
+    int cpu = num_cpus ? (int)cpus[i % num_cpus] : -1;
+    if (bench_start_thread(&tids[i], fn, args[i], cpu)) {
+      // The barrier can never complete now
+      fprintf(stderr, "Failed to start worker %u\n", i);
+      exit(1);
+    }
+  }
+
+  pthread_barrier_wait(start);
+  uint64_t t0 = bench_now_ns();
+  double cpu0 = bench_cpu_seconds();
+  for (uint32_t i = 0; i < n; i++)
+    pthread_join(tids[i], NULL);
+  res->elapsed = (bench_now_ns() - t0) / 1e9;
+  res->cpu = bench_cpu_seconds() - cpu0;
+  pthread_barrier_destroy(start);
+}
+
+// UD: a sending and a receiving QP per pair, both driven by one thread
+
+struct ud_pair {
+  pthread_barrier_t *start;
+  uint64_t count;
+  uint32_t size;
+  Cq send_cq;
+  Cq recv_cq;
+  Qp tx;
+  Qp rx;
+  struct send_engine eng;
+  struct recv_pool pool;
+  uint64_t received;
+  int ret;
+};
+
+static uint32_t ud_reap(struct ud_pair *p) {
+  ibv_wc wcs[POLL_BATCH];
+  int n = p->recv_cq.poll(POLL_BATCH, wcs);
+  for (int i = 0; i < n; i++) {
+    if (wcs[i].status == IBV_WC_SUCCESS)
+      p->received++;
+    recv_pool_release(&p->pool, wcs[i].wr_id);
+  }
+  recv_pool_replenish(&p->pool, false);
+  return n > 0 ? (uint32_t)n : 0;
+}
+
+static void *ud_worker(void *arg) {
+  struct ud_pair *p = (struct ud_pair *)arg;
+  pthread_barrier_wait(p->start);
+
+  for (uint64_t sent = 0; sent < p->count; sent += p->eng.cfg.batch) {
+    uint64_t n = p->count - sent;
+    if (n > p->eng.cfg.batch)
+      n = p->eng.cfg.batch;
+    if (send_engine_post(&p->eng, n, p->size) < 0) {
+      p->ret = -1;
+      break;
+    }
+    ud_reap(p);
+  }
+  if (send_engine_drain(&p->eng) < 0)
+    p->ret = -1;
+
+  // Whatever is still on its way to the receiver
+  uint64_t last = bench_now_ns();
+  while (p->received < p->eng.completed &&
+         bench_now_ns() - last < QUIET_NS) {
+    if (ud_reap(p))
+      last = bench_now_ns();
+  }
+  return NULL;
+}
+
+static int run_ud(const Device &dev, ibv_pd *pd, const struct run_config *cfg,
+                  const uint32_t *cpus, int num_cpus,
+                  struct run_result *res) {
+  if (cfg->size > (128u << dev.active_mtu(IB_PORT))) {
+    return 1; // more than one MTU; UD cannot send it
+  }
+
+  buf_pool_config buf_cfg{};
+  buf_cfg.num_slots = cfg->qps * (cfg->depth + RECV_SLOTS);
+  buf_cfg.slot_size = GRH_SIZE + cfg->size;
+  buf_cfg.numa_node = -1;
+  buf_cfg.access = IBV_ACCESS_LOCAL_WRITE;
+
+  buf_pool bufs;
+  if (buf_pool_init(&bufs, pd, &buf_cfg))
+    return -1;
+  auto bufs_guard = on_scope_exit([&] { buf_pool_destroy(&bufs); });
+
+  QpEndpoint ep{};
+  if (dev.port_address(IB_PORT, GID_INDEX, &ep))
+    return -1;
+  Ah ah = Ah::to_endpoint(pd, IB_PORT, ep, GID_INDEX);
+  if (!ah)
+    return -1;
+
+  // Engines and pools are only destroyed once set up, so count them
+  struct ud_pair *pairs = new ud_pair[cfg->qps];
+  uint32_t ready = 0;
+  auto pairs_guard = on_scope_exit([&] {
+    for (uint32_t i = 0; i < ready; i++) {
+      recv_pool_destroy(&pairs[i].pool);
+      send_engine_destroy(&pairs[i].eng);
+    }
+    delete[] pairs;
+  });
+
+  pthread_barrier_t start;
+  void *args[MAX_QPS];
+  for (uint32_t i = 0; i < cfg->qps; i++) {
+    struct ud_pair *p = &pairs[i];
+    p->start = &start;
+    p->count = cfg->count;
+    p->size = cfg->size;
+    p->received = 0;
+    p->ret = 0;
+    args[i] = p;
+
+    p->send_cq = Cq::create(dev, cfg->depth);
+    p->recv_cq = Cq::create(dev, RECV_SLOTS);
+    if (!p->send_cq || !p->recv_cq)
+      return -1;
+    p->tx = QpBuilder::ud(pd)
+                .cq(p->send_cq)
+                .depth(cfg->depth, 1)
+                .sig_all(false)
+                .create();
+    p->rx = QpBuilder::ud(pd).cq(p->recv_cq).depth(1, RECV_SLOTS).create();
+    if (!p->tx || !p->rx || p->tx.ready_ud(IB_PORT, QKEY) ||
+        p->rx.ready_ud(IB_PORT, QKEY))
+      return -1;
+
+    send_engine_config eng_cfg{};
+    eng_cfg.sq_depth = cfg->depth;
+    eng_cfg.batch = cfg->batch;
+    eng_cfg.signal_interval = cfg->signal;
+    eng_cfg.buf_size = cfg->size;
+    if (send_engine_init(&p->eng, &bufs, p->tx, p->send_cq, &eng_cfg))
+      return -1;
+
+    recv_pool_config pool_cfg{};
+    pool_cfg.num_slots = RECV_SLOTS;
+    pool_cfg.slot_size = GRH_SIZE + cfg->size;
+    pool_cfg.refill_batch = RECV_REFILL_BATCH;
+    if (recv_pool_init(&p->pool, &bufs, p->rx, NULL, &pool_cfg)) {
+      send_engine_destroy(&p->eng);
+      return -1;
+    }
+    ready++;
+    send_engine_set_ud_dest(&p->eng, ah, p->rx.qpn(), QKEY);
+  }
+
+  run_workers(ud_worker, args, cfg->qps, cpus, num_cpus, &start, res);
+  int ret = 0;
+  for (uint32_t i = 0; i < cfg->qps; i++) {
+    res->sent += pairs[i].eng.completed;
+    res->received += pairs[i].received;
+    ret |= pairs[i].ret;
+  }
+  return ret;
+}
+
+// Raw packet: the send side alone, every WR sending a copy of one frame
+
+struct raw_sender {
+  pthread_barrier_t *start;
+  uint64_t count;
+  uint32_t size;
+  Cq cq;
+  Qp qp;
+  struct send_engine eng;
+  int ret;
+};
+
+static void *raw_worker(void *arg) {
+  struct raw_sender *s = (struct raw_sender *)arg;
+  pthread_barrier_wait(s->start);
+  if (send_engine_post(&s->eng, s->count, s->size) < 0 ||
+      send_engine_drain(&s->eng) < 0)
+    s->ret = -1;
+  return NULL;
+}
+
+// An FPGA packet of size bytes in all, headers included, from 10.0.0.1 to
+// 10.0.0.2 and from and to locally administered MACs
+static void build_frame(uint8_t *f, uint32_t size, uint32_t stream) {
+  static const uint8_t macs[12] = {0x02, 0, 0, 0, 0, 0x02,
+                                   0x02, 0, 0, 0, 0, 0x01};
+  memset(f, 0, size);
+  memcpy(f, macs, sizeof(macs));
+  f[PKT_ETH_TYPE_OFFSET] = 0x08;
+
+  uint8_t *ip = f + PKT_IP_OFFSET;
+  uint16_t ip_len = htons(size - PKT_IP_OFFSET);
+  uint16_t udp_len = htons(size - PKT_UDP_OFFSET);
+  uint16_t port = htons(12345);
+  ip[0] = 0x45;
+  memcpy(ip + 2, &ip_len, 2);
+  ip[6] = 0x40; // DF
+  ip[8] = 64;
+  ip[9] = IPPROTO_UDP;
+  ip[12] = 10, ip[15] = 1, ip[16] = 10, ip[19] = 2;
+  uint16_t csum = htons((uint16_t)~pkt_ip_sum_scalar(f));
+  memcpy(ip + 10, &csum, 2);
+  memcpy(f + PKT_UDP_OFFSET, &port, 2);
+  memcpy(f + PKT_UDP_OFFSET + 2, &port, 2);
+  memcpy(f + PKT_UDP_OFFSET + 4, &udp_len, 2);
+
+  uint32_t fpga_id = stream;
+  memcpy(f + PKT_CUSTOM_OFFSET + 8, &fpga_id, 4);
+}
+
+static int run_raw(const Device &dev, ibv_pd *pd, const struct run_config *cfg,
+                   const uint32_t *cpus, int num_cpus,
+                   struct run_result *res) {
+  if (cfg->size < PKT_PAYLOAD_OFFSET) {
+    return 1; // too small to hold the headers
+  }
+
+  buf_pool_config buf_cfg{};
+  buf_cfg.num_slots = cfg->qps * cfg->depth;
+  buf_cfg.slot_size = cfg->size;
+  buf_cfg.numa_node = -1;
+  buf_cfg.access = IBV_ACCESS_LOCAL_WRITE;
+
+  buf_pool bufs;
+  if (buf_pool_init(&bufs, pd, &buf_cfg))
+    return -1;
+  auto bufs_guard = on_scope_exit([&] { buf_pool_destroy(&bufs); });
+
+  struct raw_sender *senders = new raw_sender[cfg->qps];
+  uint32_t ready = 0;
+  auto senders_guard = on_scope_exit([&] {
+    for (uint32_t i = 0; i < ready; i++)
+      send_engine_destroy(&senders[i].eng);
+    delete[] senders;
+  });
+
+  pthread_barrier_t start;
+  void *args[MAX_QPS];
+  for (uint32_t i = 0; i < cfg->qps; i++) {
+    struct raw_sender *s = &senders[i];
+    s->start = &start;
+    s->count = cfg->count;
+    s->size = cfg->size;
+    s->ret = 0;
+    args[i] = s;
+
+    s->cq = Cq::create(dev, cfg->depth);
+    if (!s->cq)
+      return -1;
+    s->qp = QpBuilder::raw(pd)
+                .cq(s->cq)
+                .depth(cfg->depth, 1)
+                .sig_all(false)
+                .create();
+    if (!s->qp || s->qp.ready_raw(IB_PORT))
+      return -1;
+
+    send_engine_config eng_cfg{};
+    eng_cfg.sq_depth = cfg->depth;
+    eng_cfg.batch = cfg->batch;
+    eng_cfg.signal_interval = cfg->signal;
+    eng_cfg.buf_size = cfg->size;
+    if (send_engine_init(&s->eng, &bufs, s->qp, s->cq, &eng_cfg))
+      return -1;
+    ready++;
+    for (uint32_t j = 0; j < cfg->depth; j++)
+      build_frame((uint8_t *)send_engine_buffer(&s->eng, j), cfg->size, i);
+  }
+
+  run_workers(raw_worker, args, cfg->qps, cpus, num_cpus, &start, res);
+  int ret = 0;
+  for (uint32_t i = 0; i < cfg->qps; i++) {
+    res->sent += senders[i].eng.completed;
+    res->received += senders[i].eng.completed;
+    ret |= senders[i].ret;
+  }
+  return ret;
+}
+
+// UDP: a sender and a receiver thread per socket pair
+
+struct udp_pair {
+  pthread_barrier_t *start;
+  uint64_t count;
+  uint32_t size;
+  uint32_t batch;
+  int tx_fd;
+  int rx_fd;
+  uint64_t sent;     // written by the sender
+  bool done;         // set by the sender when it has finished
+  uint64_t received; // written by the receiver
+  int ret;
+};
+
+struct udp_worker_arg {
+  pthread_barrier_t *start;
+  struct udp_pair *pair;
+  bool receiver;
+};
+
+static void *udp_worker(void *arg) {
+  struct udp_worker_arg *a = (struct udp_worker_arg *)arg;
+  struct udp_pair *p = a->pair;
+  struct mmsghdr msgs[SEND_ENGINE_MAX_BATCH];
+  struct iovec iovs[SEND_ENGINE_MAX_BATCH];
+  char *buf = (char *)calloc(SEND_ENGINE_MAX_BATCH, p->size);
+  if (!buf) {
+    perror("calloc");
+    p->ret = -1;
+  }
+
+  memset(msgs, 0, sizeof(msgs));
+  for (uint32_t i = 0; buf && i < p->batch; i++) {
+    iovs[i].iov_base = buf + (size_t)i * p->size;
+    iovs[i].iov_len = p->size;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  pthread_barrier_wait(a->start);
+
+  if (!buf) {
+    if (!a->receiver)
+      __atomic_store_n(&p->done, true, __ATOMIC_RELEASE);
+  } else if (!a->receiver) {
+    uint64_t sent = 0;
+    while (sent < p->count) {
+      uint32_t n = p->count - sent < p->batch ? p->count - sent : p->batch;
+      int ret = sendmmsg(p->tx_fd, msgs, n, 0);
+      if (ret < 0) {
+        if (errno == EINTR || errno == ENOBUFS || errno == EAGAIN)
+          continue;
+        perror("sendmmsg");
+        p->ret = -1;
+        break;
+      }
+      sent += ret;
+    }
+    __atomic_store_n(&p->sent, sent, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->done, true, __ATOMIC_RELEASE);
+  } else {
+    uint64_t received = 0;
+    uint64_t last = bench_now_ns();
+    for (;;) {
+      int ret = recvmmsg(p->rx_fd, msgs, p->batch, MSG_DONTWAIT, NULL);
+      if (ret > 0) {
+        received += ret;
+        last = bench_now_ns();
+        continue;
+      }
+      if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+          errno != EINTR) {
+        perror("recvmmsg");
+        p->ret = -1;
+        break;
+      }
+      if (__atomic_load_n(&p->done, __ATOMIC_ACQUIRE) &&
+          (received >= __atomic_load_n(&p->sent, __ATOMIC_RELAXED) ||
+           bench_now_ns() - last > QUIET_NS))
+        break;
+      sched_yield();
+    }
+    p->received = received;
+  }
+
+  free(buf);
+  return NULL;
+}
+
+// A receiving socket on an ephemeral loopback port and a sender connected
+// to it. Returns 0, or -1 with nothing left open.
+static int udp_open_pair(struct udp_pair *p) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int rcvbuf = UDP_RCVBUF;
+
+  p->rx_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  p->tx_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (p->rx_fd < 0 || p->tx_fd < 0 ||
+      setsockopt(p->rx_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                 sizeof(rcvbuf)) ||
+      bind(p->rx_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      getsockname(p->rx_fd, (struct sockaddr *)&addr, &len) ||
+      connect(p->tx_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    perror("udp socket");
+    if (p->rx_fd >= 0)
+      close(p->rx_fd);
+    if (p->tx_fd >= 0)
+      close(p->tx_fd);
+    return -1;
+  }
+  return 0;
+}
+
+static int run_udp(const struct run_config *cfg, const uint32_t *cpus,
+                   int num_cpus, struct run_result *res) {
+  if (cfg->size > 65507) {
+    return 1; // largest UDP payload over IPv4
+  }
+
+  struct udp_pair pairs[MAX_QPS];
+  struct udp_worker_arg wargs[2 * MAX_QPS];
+  void *args[2 * MAX_QPS];
+  pthread_barrier_t start;
+  uint32_t opened = 0;
+  int ret = 0;
+
+  for (; opened < cfg->qps; opened++) {
+    struct udp_pair *p = &pairs[opened];
+    memset(p, 0, sizeof(*p));
+    p->count = cfg->count;
+    p->size = cfg->size;
+    p->batch = cfg->batch;
+    if (udp_open_pair(p)) {
+      ret = -1;
+      break;
+    }
+    // Receivers first, so they share out the CPUs before the senders
+    wargs[opened] = {&start, p, true};
+    wargs[cfg->qps + opened] = {&start, p, false};
+  }
+
+  if (ret == 0) {
+    for (uint32_t i = 0; i < 2 * cfg->qps; i++)
+      args[i] = &wargs[i];
+    run_workers(udp_worker, args, 2 * cfg->qps, cpus, num_cpus, &start,
+                res);
+  }
+
+  for (uint32_t i = 0; i < opened; i++) {
+    res->sent += pairs[i].sent;
+    res->received += pairs[i].received;
+    ret |= pairs[i].ret;
+    close(pairs[i].rx_fd);
+    close(pairs[i].tx_fd);
+  }
+  return ret;
+}
+
+struct sweep {
+  uint32_t sizes[BENCH_MAX_LIST];
+  uint32_t depths[BENCH_MAX_LIST];
+  uint32_t batches[BENCH_MAX_LIST];
+  uint32_t signals[BENCH_MAX_LIST];
+  uint32_t qps[BENCH_MAX_LIST];
+  int num_sizes, num_depths, num_batches, num_signals, num_qps;
+};
+
+static void report(struct bench_table *table, enum bench_path path,
+                   const struct run_config *cfg, const struct run_result *res,
+                   int numa_node) {
+  double tsc_hz = bench_tsc_hz();
+  char vals[11][32];
+  snprintf(vals[0], sizeof(vals[0]), "%s", path_names[path]);
+  snprintf(vals[1], sizeof(vals[1]), "%u", cfg->size);
+  if (path == PATH_UDP) {
+    snprintf(vals[2], sizeof(vals[2]), "-");
+    snprintf(vals[4], sizeof(vals[4]), "-");
+  } else {
+    snprintf(vals[2], sizeof(vals[2]), "%u", cfg->depth);
+    snprintf(vals[4], sizeof(vals[4]), "%u", cfg->signal);
+  }
+  snprintf(vals[3], sizeof(vals[3]), "%u", cfg->batch);
+  snprintf(vals[5], sizeof(vals[5]), "%u", cfg->qps);
+  snprintf(vals[6], sizeof(vals[6]), "%.3f",
+           res->received / res->elapsed / 1e6);
+  snprintf(vals[7], sizeof(vals[7]), "%.3f",
+           res->received * cfg->size * 8.0 / res->elapsed / 1e9);
+  if (tsc_hz > 0 && res->received)
+    snprintf(vals[8], sizeof(vals[8]), "%.0f",
+             res->cpu * tsc_hz / res->received);
+  else
+    snprintf(vals[8], sizeof(vals[8]), "-");
+  snprintf(vals[9], sizeof(vals[9]), "%.2f",
+           res->sent ? 100.0 * (res->sent - res->received) / res->sent : 0.0);
+  if (numa_node >= 0)
+    snprintf(vals[10], sizeof(vals[10]), "%d", numa_node);
+  else
+    snprintf(vals[10], sizeof(vals[10]), "-");
+
+  const char *row[11];
+  for (int i = 0; i < 11; i++)
+    row[i] = vals[i];
+  bench_table_row(table, row);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--paths=ud,raw,udp] [--sizes=B,...] [--depths=N,...] "
+          "[--batches=N,...] [--signals=N,...] [--qps=N,...] [--count=N] "
+          "[--cpus=C,...] [--format=text|csv|json]\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  static const char *const columns[] = {
+      "path", "size", "depth",      "batch",    "signal", "qps",
+      "mpps", "gbps", "cycles/msg", "loss_pct", "numa"};
+  const char *paths = "ud,raw,udp";
+  enum bench_format format = BENCH_TEXT;
+  uint64_t count = DEFAULT_COUNT;
+  uint32_t cpus[BENCH_MAX_LIST];
+  int num_cpus = 0;
+
+  // A small matrix by default; widen it from the command line
+  struct sweep sw;
+  sw.sizes[0] = 64, sw.sizes[1] = 1024, sw.num_sizes = 2;
+  sw.depths[0] = 256, sw.num_depths = 1;
+  sw.batches[0] = 1, sw.batches[1] = 32, sw.num_batches = 2;
+  sw.signals[0] = 1, sw.signals[1] = 32, sw.num_signals = 2;
+  sw.qps[0] = 1, sw.num_qps = 1;
+
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    int bad = 0;
+    if (strncmp(a, "--paths=", 8) == 0)
+      paths = a + 8;
+    else if (strncmp(a, "--sizes=", 8) == 0)
+      bad = (sw.num_sizes = bench_parse_list(a + 8, sw.sizes)) < 0;
+    else if (strncmp(a, "--depths=", 9) == 0)
+      bad = (sw.num_depths = bench_parse_list(a + 9, sw.depths)) < 0;
+    else if (strncmp(a, "--batches=", 10) == 0)
+      bad = (sw.num_batches = bench_parse_list(a + 10, sw.batches)) < 0;
+    else if (strncmp(a, "--signals=", 10) == 0)
+      bad = (sw.num_signals = bench_parse_list(a + 10, sw.signals)) < 0;
+    else if (strncmp(a, "--qps=", 6) == 0)
+      bad = (sw.num_qps = bench_parse_list(a + 6, sw.qps)) < 0;
+    else if (strncmp(a, "--cpus=", 7) == 0) {
+      // CPU 0 is a valid CPU, which bench_parse_list() rejects
+      num_cpus = 0;
+      for (const char *p = a + 7; *p && num_cpus < BENCH_MAX_LIST;) {
+        char *end;
+        cpus[num_cpus++] = strtoul(p, &end, 10);
+        bad |= end == p || (*end && *end != ',');
+        p = *end ? end + 1 : end;
+      }
+    } else if (strncmp(a, "--count=", 8) == 0)
+      bad = (count = strtoull(a + 8, NULL, 10)) == 0;
+    else if (strncmp(a, "--format=", 9) == 0)
+      bad = bench_parse_format(a + 9, &format);
+    else
+      bad = 1;
+    if (bad) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  for (int i = 0; i < sw.num_qps; i++) {
+    if (sw.qps[i] > MAX_QPS) {
+      fprintf(stderr, "At most %d QPs\n", MAX_QPS);
+      return 1;
+    }
+  }
+
+  bool want[NUM_PATHS];
+  for (int p = 0; p < NUM_PATHS; p++) {
+    size_t len = strlen(path_names[p]);
+    want[p] = false;
+    for (const char *s = paths; s; s = strchr(s, ',')) {
+      if (*s == ',')
+        s++;
+      if (strncmp(s, path_names[p], len) == 0 &&
+          (s[len] == ',' || s[len] == '\0'))
+        want[p] = true;
+    }
+  }
+
+  Device dev;
+  Pd pd;
+  int numa_node = -1;
+  if (want[PATH_UD] || want[PATH_RAW]) {
+    dev = Device::open();
+    if (dev)
+      pd = Pd::alloc(dev);
+    if (!dev || !pd) {
+      fprintf(stderr, "Skipping the verbs paths\n");
+      want[PATH_UD] = want[PATH_RAW] = false;
+    } else {
+      numa_node = buf_pool_device_node(dev);
+      fprintf(stderr, "Device %s on NUMA node %d\n", dev.name(), numa_node);
+    }
+  }
+  bench_tsc_hz(); // calibrate before any run
+
+  struct bench_table table;
+  bench_table_begin(&table, stdout, format, "throughput", columns, 11);
+  int ret = 0;
+  for (int path = 0; path < NUM_PATHS; path++) {
+    if (!want[path])
+      continue;
+
+    // Every combination, the last list varying fastest
+    int runs = sw.num_sizes * sw.num_depths * sw.num_batches *
+               sw.num_signals * sw.num_qps;
+    for (int run = 0; run < runs; run++) {
+      int rest = run;
+      int qi = rest % sw.num_qps;
+      rest /= sw.num_qps;
+      int gi = rest % sw.num_signals;
+      rest /= sw.num_signals;
+      int bi = rest % sw.num_batches;
+      rest /= sw.num_batches;
+      int di = rest % sw.num_depths;
+      int si = rest / sw.num_depths;
+      struct run_config cfg = {sw.sizes[si],   sw.depths[di],
+                               sw.batches[bi], sw.signals[gi],
+                               sw.qps[qi],     count};
+      // Depth and signal interval mean nothing to sockets
+      if (path == PATH_UDP && (di > 0 || gi > 0))
+        continue;
+      if (cfg.batch > SEND_ENGINE_MAX_BATCH ||
+          (path != PATH_UDP &&
+           cfg.batch + cfg.signal - 1 > cfg.depth)) {
+        fprintf(stderr, "Skipping %s depth %u batch %u signal %u: needs "
+                        "batch <= %d and batch + signal - 1 <= depth\n",
+                path_names[path], cfg.depth, cfg.batch, cfg.signal,
+                SEND_ENGINE_MAX_BATCH);
+        continue;
+      }
+
+      struct run_result res;
+      memset(&res, 0, sizeof(res));
+      int r;
+      if (path == PATH_UD)
+        r = run_ud(dev, pd, &cfg, cpus, num_cpus, &res);
+      else if (path == PATH_RAW)
+        r = run_raw(dev, pd, &cfg, cpus, num_cpus, &res);
+      else
+        r = run_udp(&cfg, cpus, num_cpus, &res);
+
+      if (r > 0) {
+        fprintf(stderr, "Skipping %s at %u bytes\n", path_names[path],
+                cfg.size);
+      } else if (r < 0) {
+        fprintf(stderr, "%s failed; skipping its other runs\n",
+                path_names[path]);
+        ret = 1;
+        break;
+      } else {
+        report(&table, (enum bench_path)path, &cfg, &res,
+               path == PATH_UDP ? -1 : numa_node);
+      }
+    }
+  }
+  bench_table_end(&table);
+  return ret;
+}
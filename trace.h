@@ -0,0 +1,289 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <new>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spsc_ring.h"
+
+// Binary packet trace that never blocks the data path.
+//
+// Each hot-path thread gets a trace_ring of its own and appends fixed-size
+// trace_records to it: no lock, no syscall, no formatting. When its ring
+// is full a record is not written but counted, and the count turns up in
+// the file as a TRACE_EV_LOST record. A drainer thread empties every ring
+// each TRACE_DRAIN_MS and writes what it took with as few write() calls
+// as its buffer allows, so the syscall rate depends on time, not on
+// events: a burst of drops costs a record each (or one record with count
+// set, for a batch dropped whole) and nothing more.
+//
+// The file is a trace_file_header followed by records in host byte order,
+// one drained chunk per ring at a time: records are in time order per
+// source, not across sources. trace_decode prints it.
+
+#define TRACE_MAGIC 0x54524331 // "TRC1"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE 16384 // records per thread, a power of two
+#define TRACE_MAX_RINGS 256
+#define TRACE_DRAIN_MS 50
+#define TRACE_WRITE_RECORDS 4096 // per write()
+
+enum trace_event {
+  TRACE_EV_TX,        // packet sent
+  TRACE_EV_RX,        // packet received and parsed
+  TRACE_EV_PROCESSED, // packet processed
+  TRACE_EV_DROP,      // packet(s) discarded, see reason
+  TRACE_EV_LOST,      // trace records the ring had no room for
+  TRACE_NUM_EVENTS
+};
+
+enum trace_reason {
+  TRACE_DROP_NONE,
+  TRACE_DROP_RING_FULL,  // receive ring full
+  TRACE_DROP_BAD_FRAME,  // failed parsing; detail is its pkt_status
+  TRACE_DROP_FILTERED,   // not for any flow
+  TRACE_DROP_SEND_ERROR, // refused by the receiving host (ICMP port
+                         // unreachable); already recorded as tx, as which
+                         // earlier datagram it was is not known
+  TRACE_NUM_REASONS
+};
+
+static const char *const trace_event_names[TRACE_NUM_EVENTS] = {
+    "tx", "rx", "processed", "drop", "lost"};
+static const char *const trace_reason_names[TRACE_NUM_REASONS] = {
+    "-", "ring_full", "bad_frame", "filtered", "send_error"};
+
+struct trace_record {
+  uint64_t ts_ns; // CLOCK_MONOTONIC
+  uint64_t sample_count;
+  uint32_t fpga_id;
+  uint16_t freq_channel;
+  uint8_t event;  // enum trace_event
+  uint8_t reason; // enum trace_reason
+  uint32_t count; // packets (or lost records) this stands for
+  uint16_t source; // ring that wrote it
+  uint16_t detail; // reason-specific
+};
+static_assert(sizeof(struct trace_record) == 32, "trace_record layout");
+
+struct trace_file_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+};
+
+struct trace_ring {
+  SpscRing<struct trace_record, TRACE_RING_SIZE> ring;
+  alignas(CACHE_LINE_SIZE) uint64_t lost; // written by the producer
+  uint64_t lost_reported;                 // drainer only
+  uint16_t source;
+};
+
+struct trace_log {
+  int fd;
+  pthread_mutex_t lock; // registering rings
+  struct trace_ring *rings[TRACE_MAX_RINGS];
+  int num_rings; // published with release ordering
+  struct trace_record *buf;
+  pthread_t thread;
+  int running;
+  int stop;
+  uint64_t written;
+  uint64_t write_errors;
+};
+
+static inline uint64_t trace_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Appends a record, or counts it as lost when the ring is full. A NULL
+// ring (tracing off) does nothing. Producer thread only.
+static inline void trace_emit(struct trace_ring *tr, uint64_t ts_ns,
+                              enum trace_event event,
+                              enum trace_reason reason, uint32_t fpga_id,
+                              uint16_t freq_channel, uint64_t sample_count,
+                              uint32_t count, uint16_t detail) {
+  if (!tr)
+    return;
+  struct trace_record *r = tr->ring.claim();
+  if (!r) {
+    __atomic_store_n(&tr->lost, tr->lost + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  r->ts_ns = ts_ns;
+  r->sample_count = sample_count;
+  r->fpga_id = fpga_id;
+  r->freq_channel = freq_channel;
+  r->event = event;
+  r->reason = reason;
+  r->count = count;
+  r->source = tr->source;
+  r->detail = detail;
+  tr->ring.publish();
+}
+
+// Writes n records from the buffer, retrying short writes. A failed write
+// is counted and its records dropped; the data path never waits on it.
+static inline void trace_write(struct trace_log *log, uint32_t n) {
+  const char *p = (const char *)log->buf;
+  size_t left = (size_t)n * sizeof(struct trace_record);
+  while (left > 0) {
+    ssize_t w = write(log->fd, p, left);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0) {
+      log->write_errors++;
+      return;
+    }
+    p += w;
+    left -= w;
+  }
+  log->written += n;
+}
+
+// Empties every ring into the file
+static inline void trace_drain(struct trace_log *log) {
+  int rings = __atomic_load_n(&log->num_rings, __ATOMIC_ACQUIRE);
+  uint32_t used = 0;
+
+  for (int i = 0; i < rings; i++) {
+    struct trace_ring *tr = log->rings[i];
+
+    uint64_t lost = __atomic_load_n(&tr->lost, __ATOMIC_RELAXED);
+    if (lost != tr->lost_reported) {
+      struct trace_record *r = &log->buf[used++];
+      memset(r, 0, sizeof(*r));
+      r->ts_ns = trace_now_ns();
+      r->event = TRACE_EV_LOST;
+      r->count = (uint32_t)(lost - tr->lost_reported);
+      r->source = tr->source;
+      tr->lost_reported = lost;
+    }
+
+    for (;;) {
+      if (used == TRACE_WRITE_RECORDS) {
+        trace_write(log, used);
+        used = 0;
+      }
+      size_t n = tr->ring.front_n(TRACE_WRITE_RECORDS - used);
+      if (n == 0)
+        break;
+      for (size_t j = 0; j < n; j++)
+        log->buf[used++] = *tr->ring.front_at(j);
+      tr->ring.release(n);
+    }
+  }
+  if (used)
+    trace_write(log, used);
+}
+
+static inline void *trace_drainer(void *arg) {
+  struct trace_log *log = (struct trace_log *)arg;
+  struct timespec period = {0, TRACE_DRAIN_MS * 1000000L};
+
+  while (!__atomic_load_n(&log->stop, __ATOMIC_RELAXED)) {
+    nanosleep(&period, NULL);
+    trace_drain(log);
+  }
+  return NULL;
+}
+
+// Creates path, writes the header and starts the drainer. Returns 0, or
+// -1 on failure (with nothing left open).
+static inline int trace_open(struct trace_log *log, const char *path) {
+  memset(log, 0, sizeof(*log));
+  pthread_mutex_init(&log->lock, NULL);
+  log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (log->fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  struct trace_file_header hdr = {TRACE_MAGIC, TRACE_VERSION,
+                                  sizeof(struct trace_record)};
+  log->buf = (struct trace_record *)malloc(TRACE_WRITE_RECORDS *
+                                           sizeof(struct trace_record));
+  if (!log->buf || write(log->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    perror(log->buf ? path : "trace: malloc");
+    free(log->buf);
+    close(log->fd);
+    return -1;
+  }
+
+  int ret = pthread_create(&log->thread, NULL, trace_drainer, log);
+  if (ret != 0) {
+    errno = ret;
+    perror("trace: pthread_create");
+    free(log->buf);
+    close(log->fd);
+    return -1;
+  }
+  log->running = 1;
+  return 0;
+}
+
+// A ring for one producer thread, or NULL if log is NULL (tracing off) or
+// out of rings. Freed by trace_close().
+static inline struct trace_ring *trace_ring_create(struct trace_log *log) {
+  if (!log || !log->running)
+    return NULL;
+
+  void *mem = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct trace_ring));
+  if (!mem) {
+    fprintf(stderr, "trace: no memory for a ring, not tracing a thread\n");
+    return NULL;
+  }
+  struct trace_ring *tr = new (mem) trace_ring();
+
+  pthread_mutex_lock(&log->lock);
+  int idx = log->num_rings;
+  if (idx < TRACE_MAX_RINGS) {
+    tr->source = idx;
+    log->rings[idx] = tr;
+    __atomic_store_n(&log->num_rings, idx + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&log->lock);
+
+  if (idx == TRACE_MAX_RINGS) {
+    fprintf(stderr, "trace: already %d rings, not tracing a thread\n",
+            TRACE_MAX_RINGS);
+    tr->~trace_ring();
+    free(mem);
+    return NULL;
+  }
+  return tr;
+}
+
+// Stops the drainer, writes what is left and closes the file. The
+// producers must have stopped. Safe on a log that failed to open.
+static inline void trace_close(struct trace_log *log) {
+  if (!log->running)
+    return;
+  __atomic_store_n(&log->stop, 1, __ATOMIC_RELAXED);
+  pthread_join(log->thread, NULL);
+  trace_drain(log);
+
+  if (log->write_errors)
+    fprintf(stderr, "trace: %llu writes failed\n",
+            (unsigned long long)log->write_errors);
+  close(log->fd);
+  for (int i = 0; i < log->num_rings; i++) {
+    log->rings[i]->~trace_ring();
+    free(log->rings[i]);
+  }
+  free(log->buf);
+  log->num_rings = 0;
+  log->running = 0;
+}
+
+#endif
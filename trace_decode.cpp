@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "packet_parser.h"
+#include "trace.h"
+
+// Prints a packet trace written by udp_server -t, udp_client -o or
+// raw_packet_receiver -t: one line per record, then the totals. Records
+// are in time order per source (the thread that wrote them), not across
+// sources; pipe through sort -n to merge them.
+//
+// A sender's send_error drops are datagrams the receiving host refused
+// after they were sent: they are counted in tx as well, and the totals
+// show tx less them as not refused.
+
+#define READ_RECORDS 4096
+
+struct totals {
+  unsigned long long records;
+  unsigned long long events[TRACE_NUM_EVENTS];  // packets, by count
+  unsigned long long drops[TRACE_NUM_REASONS];  // packets, by count
+  unsigned long long bad_frames[PKT_NUM_STATUS]; // by pkt_status
+  uint64_t first_ns, last_ns;
+};
+
+static void print_record(const struct trace_record *r, uint64_t base_ns) {
+  const char *event =
+      r->event < TRACE_NUM_EVENTS ? trace_event_names[r->event] : "?";
+
+  printf("%.9f src=%u %s", (int64_t)(r->ts_ns - base_ns) / 1e9, r->source,
+         event);
+  if (r->event == TRACE_EV_LOST) {
+    printf(" records=%u\n", r->count);
+    return;
+  }
+  if (r->event == TRACE_EV_DROP) {
+    printf(" reason=%s",
+           r->reason < TRACE_NUM_REASONS ? trace_reason_names[r->reason]
+                                         : "?");
+    if (r->reason == TRACE_DROP_BAD_FRAME && r->detail < PKT_NUM_STATUS)
+      printf(" status=%s", pkt_status_names[r->detail]);
+  }
+  printf(" fpga_id=%u freq_channel=%u sample_count=%llu", r->fpga_id,
+         r->freq_channel, (unsigned long long)r->sample_count);
+  if (r->count != 1)
+    printf(" count=%u", r->count);
+  printf("\n");
+}
+
+static void add_record(struct totals *t, const struct trace_record *r) {
+  if (t->records++ == 0 || r->ts_ns < t->first_ns)
+    t->first_ns = r->ts_ns;
+  if (r->ts_ns > t->last_ns)
+    t->last_ns = r->ts_ns;
+  if (r->event < TRACE_NUM_EVENTS)
+    t->events[r->event] += r->count;
+  if (r->event == TRACE_EV_DROP && r->reason < TRACE_NUM_REASONS)
+    t->drops[r->reason] += r->count;
+  if (r->event == TRACE_EV_DROP && r->reason == TRACE_DROP_BAD_FRAME &&
+      r->detail < PKT_NUM_STATUS)
+    t->bad_frames[r->detail] += r->count;
+}
+
+static void print_totals(const struct totals *t) {
+  printf("\n=== Totals ===\n");
+  printf("Records: %llu over %.3f s\n", t->records,
+         t->records ? (t->last_ns - t->first_ns) / 1e9 : 0.0);
+  for (int e = 0; e < TRACE_NUM_EVENTS; e++) {
+    if (e == TRACE_EV_LOST)
+      printf("Records lost (trace ring full): %llu\n", t->events[e]);
+    else
+      printf("Packets %s: %llu\n", trace_event_names[e], t->events[e]);
+  }
+  for (int r = TRACE_DROP_NONE + 1; r < TRACE_NUM_REASONS; r++) {
+    if (t->drops[r])
+      printf("  dropped, %s: %llu\n", trace_reason_names[r], t->drops[r]);
+  }
+  unsigned long long refused = t->drops[TRACE_DROP_SEND_ERROR];
+  if (refused) {
+    unsigned long long tx = t->events[TRACE_EV_TX];
+    printf("Packets tx and not refused: %llu\n",
+           tx > refused ? tx - refused : 0);
+  }
+  for (int s = PKT_OK + 1; s < PKT_NUM_STATUS; s++) {
+    if (t->bad_frames[s])
+      printf("    %s: %llu\n", pkt_status_names[s], t->bad_frames[s]);
+  }
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-s] [-a] <trace_file>\n"
+          "  -s  only print the totals\n"
+          "  -a  print absolute CLOCK_MONOTONIC times instead of times "
+          "since the\n"
+          "      first record\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  int summary_only = 0, absolute = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "sah")) != -1) {
+    switch (opt) {
+    case 's':
+      summary_only = 1;
+      break;
+    case 'a':
+      absolute = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char *path = argv[optind];
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+
+  struct trace_file_header hdr;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC) {
+    fprintf(stderr, "%s: not a packet trace\n", path);
+    fclose(f);
+    return 1;
+  }
+  if (hdr.version != TRACE_VERSION ||
+      hdr.record_size != sizeof(struct trace_record)) {
+    fprintf(stderr, "%s: trace version %u with %u byte records, expected "
+                    "version %d with %zu\n",
+            path, hdr.version, hdr.record_size, TRACE_VERSION,
+            sizeof(struct trace_record));
+    fclose(f);
+    return 1;
+  }
+
+  static struct trace_record recs[READ_RECORDS];
+  struct totals totals;
+  memset(&totals, 0, sizeof(totals));
+  uint64_t base_ns = 0;
+  int have_base = absolute;
+  size_t n;
+
+  while ((n = fread(recs, sizeof(recs[0]), READ_RECORDS, f)) > 0) {
+    if (!have_base) {
+      base_ns = recs[0].ts_ns;
+      have_base = 1;
+    }
+    // Other sources' records may predate the first one, so relative
+    // times can be negative
+    for (size_t i = 0; i < n; i++) {
+      if (!summary_only)
+        print_record(&recs[i], base_ns);
+      add_record(&totals, &recs[i]);
+    }
+  }
+
+  int ret = 0;
+  if (ferror(f)) {
+    perror(path);
+    ret = 1;
+  } else if ((ftell(f) - sizeof(hdr)) % sizeof(struct trace_record) != 0) {
+    fprintf(stderr, "%s: ends in a partial record\n", path);
+  }
+  fclose(f);
+
+  print_totals(&totals);
+  return ret;
+}
@@ -1,62 +1,51 @@
 #include <arpa/inet.h>
 #include <atomic>
 #include <errno.h>
+#include <new>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "corner_turn.h"
+#include "lat_hist.h"
+#include "metrics.h"
+#include "packet_parser.h"
+#include "reorder.h"
+#include "spsc_ring.h"
+#include "trace.h"
+
 #define PORT 12345
 #define BUFFER_SIZE 4096
-#define RING_BUFFER_SIZE 1000
-#define MIN_PCAP_HEADER_SIZE 58
-
-// Your custom headers (same as client)
-#pragma pack(push, 1)
-struct EthernetHeader {
-  uint8_t dst[6];
-  uint8_t src[6];
-  uint16_t ethertype;
-};
-
-struct IPHeader {
-  uint8_t version_ihl;
-  uint8_t dscp_ecn;
-  uint16_t total_length;
-  uint16_t identification;
-  uint16_t flags_fragment;
-  uint8_t ttl;
-  uint8_t protocol;
-  uint16_t header_checksum;
-  uint32_t src_ip;
-  uint32_t dst_ip;
-};
-
-struct UDPHeader {
-  uint16_t src_port;
-  uint16_t dst_port;
-  uint16_t length;
-  uint16_t checksum;
-};
-
-struct CustomHeader {
-  uint64_t sample_count;
-  uint32_t fpga_id;
-  uint16_t freq_channel;
-  uint8_t padding[8];
-};
-#pragma pack(pop)
+#define RING_BUFFER_SIZE 1024 // must be a power of two
+#define MAX_RECV_BATCH 64
+#define DEFAULT_RECV_BATCH 32
+#define MAX_QUEUES 16
+#define REORDER_POOL_SLOTS 1024 // held out-of-order packets per queue
+#define REORDER_IDLE_POLLS 100  // empty polls (~1 ms) before giving up on gaps
+#define MAX_WORKERS 64
+#define WORKER_SHARDS 64        // must be at least MAX_WORKERS
+#define SHARD_RING_SIZE 64      // packets queued per shard, a power of two
+#define WORKER_BATCH 16         // packets drained from a shard at a time
+#define WORKER_STEAL_BACKLOG 4  // queued packets before a shard is stolen
+#define DEFAULT_PROCESS_US 50000 // simulated processing time per packet
+#define STATS_INTERVAL_MS 5000
+#define OCCUPANCY_TICK_MS 10          // ring occupancy sampling period
+#define OCCUPANCY_MAX_SAMPLES 1048576 // kept for -R, about 3 hours' worth
 
 // Packet storage for ring buffer
 struct PacketEntry {
   uint8_t data[BUFFER_SIZE];
   int length;
   struct sockaddr_in sender_addr;
-  struct timeval timestamp;
+  struct timespec timestamp; // kernel receive time (SO_TIMESTAMPNS)
+  uint64_t ring_ns;          // CLOCK_MONOTONIC when it reached the ring
   int processed; // 0 = unprocessed, 1 = processed
 };
 
@@ -67,178 +56,532 @@ struct ProcessedPacket {
   uint16_t freq_channel;
   uint8_t *payload;
   int payload_size;
-  struct timeval timestamp;
+  struct timespec timestamp;
 };
 
-// Global ring buffer
-static struct PacketEntry ring_buffer[RING_BUFFER_SIZE];
-static int write_index = 0;
-static int read_index = 0;
-static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int running = 1;
+// Packet handed from a queue's processor thread to its workers, copied out
+// of the ring so the ring slot can be released straight away
+struct WorkItem {
+  uint64_t sample_count;
+  uint32_t fpga_id;
+  uint16_t freq_channel;
+  int payload_size;
+  struct timespec timestamp;
+  uint64_t ring_ns;
+  uint64_t dispatch_ns; // CLOCK_MONOTONIC when queued
+  uint8_t payload[BUFFER_SIZE - PKT_PAYLOAD_OFFSET];
+};
 
-// Statistics
-static std::atomic<unsigned long long> packets_received = 0;
-static std::atomic<unsigned long long> packets_processed = 0;
+// A slice of a queue's streams. Every packet of a stream maps to the same
+// shard, and a shard is drained by one worker at a time (whichever holds
+// busy), so streams stay in order even when a shard is stolen.
+struct Shard {
+  alignas(CACHE_LINE_SIZE) std::atomic<int> busy;
+  SpscRing<struct WorkItem, SHARD_RING_SIZE> ring;
+};
 
-int get_next_write_index() { return (write_index + 1) % RING_BUFFER_SIZE; }
+struct RxQueue;
 
-int get_next_read_index() { return (read_index + 1) % RING_BUFFER_SIZE; }
+// Processing worker. It drains its home shards (shard % workers == id)
+// and, when they are empty, steals any other shard with a backlog.
+struct Worker {
+  struct RxQueue *q;
+  int id;
+  pthread_t tid;
 
-int buffer_has_data() { return read_index != write_index; }
+  struct metrics_thread metrics; // queue wait, process, processed
+  // Packets from other shards
+  alignas(CACHE_LINE_SIZE) std::atomic<unsigned long long> stolen;
+  std::atomic<unsigned long long> busy_ns;
+  std::atomic<unsigned long long> latency_sum_ns; // dispatch to done
+  std::atomic<unsigned long long> latency_max_ns;
+  struct lat_hist send_latency; // sender's stamp to done, with -L
+  struct trace_ring *trace;     // processed packets, with -t
 
-int buffer_is_full() { return get_next_write_index() == read_index; }
+  // Previous print_stats() snapshot, only touched by the main thread
+  alignas(CACHE_LINE_SIZE) unsigned long long last_processed;
+  unsigned long long last_busy_ns;
+  unsigned long long last_latency_sum_ns;
+};
 
-void store_packet(uint8_t *data, int length, struct sockaddr_in *sender) {
-  pthread_mutex_lock(&buffer_mutex);
+// One receive queue: a SO_REUSEPORT socket, the ring its receiver thread
+// fills and the processor thread that drains it. The receiver's and the
+// processor's metrics sit on separate cache lines.
+struct RxQueue {
+  int id;
+  int sockfd;
+  int rx_cpu;   // CPU the receiver is pinned to, -1 if unpinned
+  int proc_cpu; // CPU the processor is pinned to, -1 if unpinned
+  pthread_t receiver_tid;
+  pthread_t processor_tid;
 
-  if (buffer_is_full()) {
-    printf("Warning: Ring buffer full, dropping packet\n");
-    pthread_mutex_unlock(&buffer_mutex);
-    return;
-  }
+  // Receiver side: recv, received, bytes, dropped, calls
+  struct metrics_thread rx_metrics;
+  struct trace_ring *rx_trace; // ring full drops, with -t
 
-  struct PacketEntry *entry = &ring_buffer[write_index];
-  memcpy(entry->data, data, length);
-  entry->length = length;
-  entry->sender_addr = *sender;
-  gettimeofday(&entry->timestamp, NULL);
-  entry->processed = 0;
+  // Processor side: parse, bad frames; with -T also queue wait, processed
+  struct metrics_thread proc_metrics;
+  struct trace_ring *proc_trace; // parsed and bad frames, with -t
+  uint64_t batch_ns; // when the current batch was parsed
+  struct pkt_stats parse_stats;
+  struct reorder_stage reorder;
+  struct corner_turn corner_turn; // only with -T
 
-  write_index = get_next_write_index();
-  packets_received.fetch_add(1, std::memory_order_relaxed);
+  // Worker pool the processor dispatches to, unless corner turning
+  struct Shard *shards;
+  struct Worker *workers;
+  int workers_started;
+  std::atomic<int> workers_stop;
 
-  pthread_mutex_unlock(&buffer_mutex);
-}
+  SpscRing<struct PacketEntry, RING_BUFFER_SIZE> ring;
+};
 
-struct PacketEntry *get_next_packet() {
-  pthread_mutex_lock(&buffer_mutex);
+// Queues are large (one ring each), so they live in static storage; only
+// the first num_queues are used
+static struct RxQueue queues[MAX_QUEUES];
+static int num_queues = 1;
+static volatile sig_atomic_t running = 1;
 
-  if (!buffer_has_data()) {
-    pthread_mutex_unlock(&buffer_mutex);
-    return NULL;
-  }
+// Every data path thread's metrics, served with -M
+static struct metrics_registry metrics;
+
+// Binary packet trace (-t); its rings stay NULL unless it is open
+static struct trace_log trace;
+
+// 1 (-D 1) prints every packet processed, which costs most of the
+// throughput
+#define DEBUG_PACKETS 1
+static int debug_level = 0;
+
+// What the receiver does when the ring is full
+enum FullPolicy {
+  FULL_POLICY_DROP,  // read and discard the newest packet (counted)
+  FULL_POLICY_BLOCK, // stop reading until the processor frees a slot
+};
+static enum FullPolicy full_policy = FULL_POLICY_DROP;
+
+// Datagrams requested per recvmmsg() call
+static int recv_batch = DEFAULT_RECV_BATCH;
 
-  struct PacketEntry *entry = &ring_buffer[read_index];
-  read_index = get_next_read_index();
+// sample_count advance between consecutive packets of a stream
+static uint64_t sample_step = 1;
 
-  pthread_mutex_unlock(&buffer_mutex);
-  return entry;
+// pkt_parse_batch() flags; -V adds PKT_VERIFY_CHECKSUM
+static int parse_flags = 0;
+
+// Corner turn into channel-major blocks (-T) instead of handing each
+// packet to process_packet_data()
+static int corner_turn_enabled = 0;
+static struct ct_config corner_turn_cfg = {0, 1024, 1, 4, 1, 0};
+
+// Processing workers per queue, and what packets are sharded by
+enum ShardKey { SHARD_BY_CHANNEL, SHARD_BY_FPGA };
+static int num_workers = 1;
+static enum ShardKey shard_key = SHARD_BY_CHANNEL;
+
+// Simulated processing time per packet (-P)
+static int process_us = DEFAULT_PROCESS_US;
+
+// Latency from the sender's stamp (udp_client -t) to processed (-L)
+static int send_latency_enabled = 0;
+
+// When print_stats() last ran, for per-interval rates
+static uint64_t last_stats_ns;
+
+// Packets waiting in every queue's ring, sampled every OCCUPANCY_TICK_MS
+// for the results file
+static uint32_t *occupancy;
+static size_t num_occupancy;
+static size_t max_occupancy;
+
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-struct ProcessedPacket parse_custom_packet(struct PacketEntry *entry) {
-  struct ProcessedPacket result = {0};
+static uint64_t timespec_ns(const struct timespec *ts) {
+  return (uint64_t)ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
 
-  if (entry->length < MIN_PCAP_HEADER_SIZE) {
-    printf("Packet too small for custom headers\n");
-    return result;
-  }
+// Returns how many ring slots (up to max) the receiver may recvmmsg() into.
+// When the ring is full this either waits for the processor
+// (FULL_POLICY_BLOCK) or returns 0 so the caller drops the packet
+// (FULL_POLICY_DROP).
+int claim_packet_slots(struct RxQueue *q, int max) {
+  int slots = q->ring.claim_n(max);
 
-  // Parse your custom packet structure
-  const EthernetHeader *eth = (const EthernetHeader *)entry->data;
-  if (ntohs(eth->ethertype) != 0x0800) {
-    printf("Not IPv4 packet\n");
-    return result;
+  while (slots == 0 && full_policy == FULL_POLICY_BLOCK && running) {
+    usleep(10);
+    slots = q->ring.claim_n(max);
   }
 
-  const CustomHeader *custom = (const CustomHeader *)(entry->data + 42);
-
-  result.sample_count = custom->sample_count;
-  result.fpga_id = custom->fpga_id;
-  result.freq_channel = custom->freq_channel;
-  result.timestamp = entry->timestamp;
+  return slots;
+}
 
-  // Point to payload (after headers)
-  result.payload = entry->data + MIN_PCAP_HEADER_SIZE;
-  result.payload_size = entry->length - MIN_PCAP_HEADER_SIZE;
+// Makes the first count claimed slots, filled in place by the receiver,
+// visible to the processor
+void publish_packets(struct RxQueue *q, int count) {
+  q->ring.publish(count);
+  metrics_add(&q->rx_metrics, METRIC_RECEIVED, count);
+}
 
-  return result;
+// Kernel receive timestamp from the SO_TIMESTAMPNS control message, or the
+// current time if the kernel did not attach one
+void get_rx_timestamp(struct msghdr *msg, struct timespec *ts) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+      return;
+    }
+  }
+  clock_gettime(CLOCK_REALTIME, ts);
 }
 
 void process_packet_data(struct ProcessedPacket *pkt) {
   // This is where you'd do your actual processing
   // For now, just print the info and simulate some work
 
-  printf("Processing packet: sample_count=%lu, freq_channel=%u, fpga_id=%u, "
-         "payload=%d bytes\n",
-         pkt->sample_count, pkt->freq_channel, pkt->fpga_id, pkt->payload_size);
+  if (debug_level >= DEBUG_PACKETS)
+    printf("Processing packet: sample_count=%lu, freq_channel=%u, "
+           "fpga_id=%u, payload=%d bytes\n",
+           pkt->sample_count, pkt->freq_channel, pkt->fpga_id,
+           pkt->payload_size);
 
   // Simulate processing time
-  usleep(50000); // 50ms processing time
+  if (process_us > 0)
+    usleep(process_us);
 
   // Here you could:
   // - Copy payload to your processing arrays
   // - Call your existing process_packet() function
   // - Pass to further processing stages
+}
 
-  packets_processed.fetch_add(1, std::memory_order_relaxed);
+// Traces count packets dropped because the ring was full, with the custom
+// header of the last one (read into buf) if it has one
+void trace_ring_full(struct RxQueue *q, const uint8_t *buf, uint32_t len,
+                     int count) {
+  uint64_t sample_count = 0;
+  uint32_t fpga_id = 0, payload_size;
+  uint16_t freq_channel = 0;
+
+  if (pkt_check(buf, len, 0, &payload_size) == PKT_OK) {
+    memcpy(&sample_count, buf + PKT_CUSTOM_OFFSET, sizeof(sample_count));
+    memcpy(&fpga_id, buf + PKT_CUSTOM_OFFSET + 8, sizeof(fpga_id));
+    memcpy(&freq_channel, buf + PKT_CUSTOM_OFFSET + 12, sizeof(freq_channel));
+  }
+  trace_emit(q->rx_trace, monotonic_ns(), TRACE_EV_DROP, TRACE_DROP_RING_FULL,
+             fpga_id, freq_channel, sample_count, count, 0);
 }
 
-// Receiver thread - continuously receives packets
+// Receiver thread - continuously receives batches of packets straight into
+// ring slots, one recvmmsg() call per batch
 void *receiver_thread(void *arg) {
-  int sockfd = *(int *)arg;
-  uint8_t buffer[BUFFER_SIZE];
-  struct sockaddr_in client_addr;
-  socklen_t client_len = sizeof(client_addr);
+  struct RxQueue *q = (struct RxQueue *)arg;
+  struct mmsghdr msgs[MAX_RECV_BATCH];
+  struct iovec iovecs[MAX_RECV_BATCH];
+  char control[MAX_RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+  // Landing area for packets dropped because the ring is full
+  uint8_t discard[BUFFER_SIZE];
+  struct sockaddr_in discard_addr;
 
-  printf("Receiver thread started\n");
+  printf("Receiver thread %d started\n", q->id);
 
   while (running) {
-    int received = recvfrom(sockfd, buffer, BUFFER_SIZE, 0,
-                            (struct sockaddr *)&client_addr, &client_len);
+    int slots = claim_packet_slots(q, recv_batch);
+    int vlen = slots > 0 ? slots : 1;
+
+    for (int i = 0; i < vlen; i++) {
+      struct PacketEntry *entry = slots > 0 ? q->ring.claim_at(i) : NULL;
+      struct msghdr *hdr = &msgs[i].msg_hdr;
+
+      iovecs[i].iov_base = entry ? entry->data : discard;
+      iovecs[i].iov_len = BUFFER_SIZE;
+      hdr->msg_name = entry ? &entry->sender_addr : &discard_addr;
+      hdr->msg_namelen = sizeof(struct sockaddr_in);
+      hdr->msg_iov = &iovecs[i];
+      hdr->msg_iovlen = 1;
+      hdr->msg_control = control[i];
+      hdr->msg_controllen = sizeof(control[i]);
+      hdr->msg_flags = 0;
+    }
+
+    // MSG_WAITFORONE: block for the first datagram only, then take
+    // whatever else is already queued
+    int received = recvmmsg(q->sockfd, msgs, vlen, MSG_WAITFORONE, NULL);
 
     if (received < 0) {
       if (errno == EINTR)
         continue;
-      perror("recvfrom");
+      perror("recvmmsg");
       break;
     }
+    metrics_add(&q->rx_metrics, METRIC_RECV_CALLS, 1);
+
+    if (slots == 0) {
+      metrics_add(&q->rx_metrics, METRIC_DROPPED, received);
+      if (q->rx_trace)
+        trace_ring_full(q, discard, msgs[0].msg_len, received);
+      continue;
+    }
+
+    // Kernel timestamps are CLOCK_REALTIME
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ns = timespec_ns(&now), ring_ns = monotonic_ns();
+    uint64_t bytes = 0;
+
+    for (int i = 0; i < received; i++) {
+      struct PacketEntry *entry = q->ring.claim_at(i);
+      entry->length = msgs[i].msg_len;
+      entry->processed = 0;
+      entry->ring_ns = ring_ns;
+      get_rx_timestamp(&msgs[i].msg_hdr, &entry->timestamp);
 
-    // Store in ring buffer
-    store_packet(buffer, received, &client_addr);
+      uint64_t rx_ns = timespec_ns(&entry->timestamp);
+      metrics_record(&q->rx_metrics, METRIC_RECV,
+                     now_ns > rx_ns ? now_ns - rx_ns : 0);
+      bytes += entry->length;
+    }
+
+    metrics_add(&q->rx_metrics, METRIC_RECEIVED_BYTES, bytes);
+    publish_packets(q, received);
   }
 
-  printf("Receiver thread exiting\n");
+  printf("Receiver thread %d exiting\n", q->id);
   return NULL;
 }
 
-// Processor thread - continuously processes packets
+// Corner turn output: one block of every channel's samples
+void process_block(void *arg, const struct ct_block *blk) {
+  struct RxQueue *q = (struct RxQueue *)arg;
+  uint64_t expected = (uint64_t)corner_turn_cfg.num_fpgas *
+                      corner_turn_cfg.num_channels *
+                      corner_turn_cfg.block_samples;
+
+  // Consumers of the block go here; it is reused once this returns
+  printf("Queue %d: block at sample %llu complete, %u packets, "
+         "%.1f%% filled\n",
+         q->id, (unsigned long long)blk->first_sample, blk->packets,
+         100.0 * blk->samples_filled / expected);
+}
+
+// Reorder stage output: packets of each stream in sample_count order, queued
+// to the shard of their stream (waiting while it is full) or corner turned
+void deliver_packet(void *arg, const struct reorder_pkt *pkt) {
+  struct RxQueue *q = (struct RxQueue *)arg;
+
+  if (corner_turn_enabled) {
+    metrics_record(&q->proc_metrics, METRIC_QUEUE_WAIT,
+                   q->batch_ns > pkt->ring_ns ? q->batch_ns - pkt->ring_ns
+                                              : 0);
+    ct_push(&q->corner_turn, pkt->sample_count, pkt->fpga_id,
+            pkt->freq_channel, pkt->payload, pkt->payload_size);
+    metrics_add(&q->proc_metrics, METRIC_PROCESSED, 1);
+    trace_emit(q->proc_trace, q->batch_ns, TRACE_EV_PROCESSED,
+               TRACE_DROP_NONE, pkt->fpga_id, pkt->freq_channel,
+               pkt->sample_count, 1, 0);
+    return;
+  }
+
+  uint32_t key =
+      shard_key == SHARD_BY_CHANNEL ? pkt->freq_channel : pkt->fpga_id;
+  struct Shard *shard = &q->shards[key % WORKER_SHARDS];
+  struct WorkItem *item = shard->ring.claim();
+
+  while (item == NULL) {
+    usleep(10);
+    item = shard->ring.claim();
+  }
+
+  item->sample_count = pkt->sample_count;
+  item->fpga_id = pkt->fpga_id;
+  item->freq_channel = pkt->freq_channel;
+  item->payload_size = pkt->payload_size;
+  item->timestamp = pkt->timestamp;
+  item->ring_ns = pkt->ring_ns;
+  memcpy(item->payload, pkt->payload, pkt->payload_size);
+  item->dispatch_ns = monotonic_ns();
+  shard->ring.publish();
+}
+
+// Processes up to WORKER_BATCH packets of shard s, unless another worker
+// holds it or fewer than min_backlog are queued. Returns the number
+// processed.
+int drain_shard(struct Worker *w, int s, size_t min_backlog) {
+  struct Shard *shard = &w->q->shards[s];
+
+  if (shard->ring.size() < min_backlog ||
+      shard->busy.exchange(1, std::memory_order_acquire))
+    return 0;
+
+  uint64_t start = monotonic_ns();
+  uint64_t latency_sum = 0, latency_max = 0;
+  uint64_t begin = start; // of the current packet
+  int n = 0;
+
+  for (; n < WORKER_BATCH; n++) {
+    struct WorkItem *item = shard->ring.front();
+    if (item == NULL)
+      break;
+
+    struct ProcessedPacket parsed;
+    parsed.sample_count = item->sample_count;
+    parsed.fpga_id = item->fpga_id;
+    parsed.freq_channel = item->freq_channel;
+    parsed.payload = item->payload;
+    parsed.payload_size = item->payload_size;
+    parsed.timestamp = item->timestamp;
+    metrics_record(&w->metrics, METRIC_QUEUE_WAIT,
+                   begin > item->ring_ns ? begin - item->ring_ns : 0);
+    process_packet_data(&parsed);
+
+    uint64_t done = monotonic_ns();
+    metrics_record(&w->metrics, METRIC_PROCESS, done - begin);
+    trace_emit(w->trace, done, TRACE_EV_PROCESSED, TRACE_DROP_NONE,
+               item->fpga_id, item->freq_channel, item->sample_count, 1, 0);
+    uint64_t latency = done - item->dispatch_ns;
+    latency_sum += latency;
+    if (latency > latency_max)
+      latency_max = latency;
+
+    // The stamp is the sender's CLOCK_MONOTONIC, the same clock on loopback
+    uint64_t sent;
+    if (send_latency_enabled && item->payload_size >= (int)sizeof(sent)) {
+      memcpy(&sent, item->payload + PKT_SEND_STAMP_OFFSET - PKT_PAYLOAD_OFFSET,
+             sizeof(sent));
+      lat_hist_record(&w->send_latency, done > sent ? done - sent : 0);
+    }
+    shard->ring.release();
+    begin = done;
+  }
+
+  shard->busy.store(0, std::memory_order_release);
+
+  metrics_add(&w->metrics, METRIC_PROCESSED, n);
+  if (s % num_workers != w->id)
+    w->stolen.fetch_add(n, std::memory_order_relaxed);
+  w->busy_ns.fetch_add(monotonic_ns() - start, std::memory_order_relaxed);
+  w->latency_sum_ns.fetch_add(latency_sum, std::memory_order_relaxed);
+  if (latency_max > w->latency_max_ns.load(std::memory_order_relaxed))
+    w->latency_max_ns.store(latency_max, std::memory_order_relaxed);
+  return n;
+}
+
+// Worker thread - drains its home shards, then steals from the others when
+// there is nothing at home. Whatever is still queued when the pool is
+// stopped is left unprocessed.
+void *worker_thread(void *arg) {
+  struct Worker *w = (struct Worker *)arg;
+  struct RxQueue *q = w->q;
+  int next_steal = w->id;
+
+  while (!q->workers_stop.load(std::memory_order_acquire)) {
+    int done = 0;
+
+    for (int s = w->id; s < WORKER_SHARDS; s += num_workers)
+      done += drain_shard(w, s, 1);
+
+    // Rotate where stealing starts so idle workers spread out. Shards whose
+    // owner is keeping up are left alone.
+    for (int k = 0; k < WORKER_SHARDS && done == 0 && num_workers > 1; k++) {
+      int s = (next_steal + k) % WORKER_SHARDS;
+      if (s % num_workers != w->id)
+        done += drain_shard(w, s, WORKER_STEAL_BACKLOG);
+    }
+    next_steal = (next_steal + 1) % WORKER_SHARDS;
+
+    if (done == 0)
+      usleep(10); // 10us sleep when no data
+  }
+
+  return NULL;
+}
+
+// Processor thread - continuously takes packets from one queue through the
+// reorder stage to the workers
 void *processor_thread(void *arg) {
-  printf("Processor thread started\n");
+  struct RxQueue *q = (struct RxQueue *)arg;
+  int idle_polls = 0;
+
+  printf("Processor thread %d started\n", q->id);
 
   while (running) {
-    struct PacketEntry *entry = get_next_packet();
+    size_t n = q->ring.front_n(PKT_MAX_BATCH);
 
-    if (entry == NULL) {
+    if (n == 0) {
+      // Missing packets that have not turned up by now are not coming
+      if (++idle_polls == REORDER_IDLE_POLLS)
+        reorder_flush_all(&q->reorder);
       usleep(10); // 10us sleep when no data
       continue;
     }
+    idle_polls = 0;
 
-    struct ProcessedPacket parsed = parse_custom_packet(entry);
+    const uint8_t *frames[PKT_MAX_BATCH];
+    uint32_t lens[PKT_MAX_BATCH];
+    struct pkt_batch batch;
 
-    if (parsed.payload_size > 0) {
-      process_packet_data(&parsed);
+    for (size_t i = 0; i < n; i++) {
+      struct PacketEntry *entry = q->ring.front_at(i);
+      frames[i] = entry->data;
+      lens[i] = entry->length;
     }
+    uint64_t start = monotonic_ns();
+    pkt_parse_batch(frames, lens, n, parse_flags, &batch, &q->parse_stats);
+    q->batch_ns = monotonic_ns();
+    metrics_record(&q->proc_metrics, METRIC_PARSE, (q->batch_ns - start) / n);
+
+    for (size_t i = 0; i < n; i++) {
+      if (batch.status[i] != PKT_OK) {
+        metrics_add(&q->proc_metrics, METRIC_BAD_FRAMES, 1);
+        trace_emit(q->proc_trace, q->batch_ns, TRACE_EV_DROP,
+                   TRACE_DROP_BAD_FRAME, 0, 0, 0, 1, batch.status[i]);
+        continue;
+      }
+      trace_emit(q->proc_trace, q->batch_ns, TRACE_EV_RX, TRACE_DROP_NONE,
+                 batch.fpga_id[i], batch.freq_channel[i],
+                 batch.sample_count[i], 1, 0);
+
+      struct reorder_pkt pkt;
+      pkt.sample_count = batch.sample_count[i];
+      pkt.fpga_id = batch.fpga_id[i];
+      pkt.freq_channel = batch.freq_channel[i];
+      pkt.payload = batch.payload[i];
+      pkt.payload_size = batch.payload_size[i];
+      pkt.timestamp = q->ring.front_at(i)->timestamp;
+      pkt.ring_ns = q->ring.front_at(i)->ring_ns;
+
+      // In-order packets are delivered from the ring entry right here, so
+      // the batch is only released afterwards
+      reorder_push(&q->reorder, &pkt);
+    }
+
+    q->ring.release(n);
+  }
+
+  // Hand over the partial blocks still held
+  if (corner_turn_enabled) {
+    reorder_flush_all(&q->reorder);
+    ct_flush(&q->corner_turn);
   }
 
-  printf("Processor thread exiting\n");
+  printf("Processor thread %d exiting\n", q->id);
   return NULL;
 }
 
-int main() {
-  int sockfd;
+// Creates a UDP socket bound to PORT with SO_REUSEPORT, so that every
+// queue's socket shares the port and the kernel hashes flows across them
+int open_rx_socket() {
   struct sockaddr_in server_addr;
-  pthread_t receiver_tid, processor_tid;
 
-  printf("UDP Server with concurrent processing starting on port %d...\n",
-         PORT);
-  printf("Ring buffer size: %d packets\n\n", RING_BUFFER_SIZE);
-
-  // Create UDP socket
-  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sockfd < 0) {
     perror("socket");
-    return 1;
+    return -1;
   }
 
   // Allow address reuse
@@ -246,6 +589,16 @@ int main() {
   if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
     perror("setsockopt");
   }
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+    perror("setsockopt SO_REUSEPORT");
+  }
+
+  // Have the kernel timestamp each datagram on arrival
+  int timestamp_on = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &timestamp_on,
+                 sizeof(timestamp_on)) < 0) {
+    perror("setsockopt SO_TIMESTAMPNS");
+  }
 
   // Setup server address
   memset(&server_addr, 0, sizeof(server_addr));
@@ -257,45 +610,578 @@ int main() {
   if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
     perror("bind");
     close(sockfd);
-    return 1;
+    return -1;
+  }
+
+  return sockfd;
+}
+
+// Starts a thread, pinned to cpu unless cpu is -1
+int start_thread(pthread_t *tid, void *(*fn)(void *), void *arg, int cpu) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+
+  if (cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  }
+
+  int ret = pthread_create(tid, &attr, fn, arg);
+  pthread_attr_destroy(&attr);
+  if (ret != 0)
+    errno = ret; // so callers can perror()
+  return ret;
+}
+
+// Allocates a queue's shards and workers; returns -1 on failure
+int init_pool(struct RxQueue *q) {
+  q->shards = (struct Shard *)aligned_alloc(
+      CACHE_LINE_SIZE, WORKER_SHARDS * sizeof(struct Shard));
+  q->workers = (struct Worker *)aligned_alloc(
+      CACHE_LINE_SIZE, num_workers * sizeof(struct Worker));
+  if (!q->shards || !q->workers) {
+    perror("aligned_alloc");
+    free(q->shards);
+    free(q->workers);
+    q->shards = NULL;
+    q->workers = NULL;
+    return -1;
+  }
+
+  for (int s = 0; s < WORKER_SHARDS; s++)
+    new (&q->shards[s]) Shard();
+  for (int i = 0; i < num_workers; i++) {
+    new (&q->workers[i]) Worker();
+    q->workers[i].q = q;
+    q->workers[i].id = i;
+    metrics_thread_reset(&q->workers[i].metrics);
+    lat_hist_reset(&q->workers[i].send_latency);
+    q->workers[i].trace = trace_ring_create(&trace);
+  }
+  return 0;
+}
+
+void stop_workers(struct RxQueue *q) {
+  q->workers_stop.store(1, std::memory_order_release);
+  for (int i = 0; i < q->workers_started; i++)
+    pthread_join(q->workers[i].tid, NULL);
+  q->workers_started = 0;
+}
+
+// Starts a queue's workers (unpinned); returns -1, with none left running,
+// on failure
+int start_workers(struct RxQueue *q) {
+  q->workers_stop.store(0);
+  for (; q->workers_started < num_workers; q->workers_started++) {
+    struct Worker *w = &q->workers[q->workers_started];
+    if (start_thread(&w->tid, worker_thread, w, -1) != 0) {
+      perror("pthread_create worker");
+      stop_workers(q);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Per-worker rate, latency and utilization over the last interval_ns
+void print_workers(struct RxQueue *q, uint64_t interval_ns,
+                   const char *prefix) {
+  for (int i = 0; i < q->workers_started; i++) {
+    struct Worker *w = &q->workers[i];
+    unsigned long long processed = metrics_get(&w->metrics, METRIC_PROCESSED);
+    unsigned long long busy = w->busy_ns.load(std::memory_order_relaxed);
+    unsigned long long latency_sum =
+        w->latency_sum_ns.load(std::memory_order_relaxed);
+    unsigned long long n = processed - w->last_processed;
+
+    printf("%s  Worker %d: Processed=%llu (%.0f pkt/s), Stolen=%llu, "
+           "Latency mean %.1f us max %.1f us, Busy %.0f%%\n",
+           prefix, i, processed, n * 1e9 / interval_ns,
+           w->stolen.load(std::memory_order_relaxed),
+           n ? (latency_sum - w->last_latency_sum_ns) / 1e3 / n : 0.0,
+           w->latency_max_ns.load(std::memory_order_relaxed) / 1e3,
+           100.0 * (busy - w->last_busy_ns) / interval_ns);
+
+    w->last_processed = processed;
+    w->last_busy_ns = busy;
+    w->last_latency_sum_ns = latency_sum;
+  }
+}
+
+void print_stats() {
+  unsigned long long total_received = 0, total_processed = 0;
+  unsigned long long total_dropped = 0, total_syscalls = 0;
+  uint64_t now = monotonic_ns();
+  uint64_t interval_ns = now - last_stats_ns;
+  last_stats_ns = now;
+
+  for (int i = 0; i < num_queues; i++) {
+    total_received += metrics_get(&queues[i].rx_metrics, METRIC_RECEIVED);
+  }
+
+  for (int i = 0; i < num_queues; i++) {
+    struct RxQueue *q = &queues[i];
+    unsigned long long received = metrics_get(&q->rx_metrics, METRIC_RECEIVED);
+    unsigned long long processed =
+        metrics_get(&q->proc_metrics, METRIC_PROCESSED);
+    unsigned long long dropped = metrics_get(&q->rx_metrics, METRIC_DROPPED);
+    unsigned long long syscalls =
+        metrics_get(&q->rx_metrics, METRIC_RECV_CALLS);
+
+    for (int w = 0; w < q->workers_started; w++)
+      processed += metrics_get(&q->workers[w].metrics, METRIC_PROCESSED);
+
+    if (num_queues > 1) {
+      printf("  Queue %d: Received=%llu (%.1f%%), Processed=%llu, "
+             "Dropped=%llu, Buffer usage=%zu/%d, Pkts/syscall=%.1f\n",
+             q->id, received,
+             total_received ? 100.0 * received / total_received : 0.0,
+             processed, dropped, q->ring.size(), RING_BUFFER_SIZE,
+             syscalls ? (double)(received + dropped) / syscalls : 0.0);
+    }
+    pkt_stats_report(&q->parse_stats, num_queues > 1 ? "    " : "");
+    reorder_report(&q->reorder, num_queues > 1 ? "    " : "");
+    if (corner_turn_enabled)
+      ct_report(&q->corner_turn, num_queues > 1 ? "    " : "");
+    else
+      print_workers(q, interval_ns, num_queues > 1 ? "    " : "");
+
+    total_processed += processed;
+    total_dropped += dropped;
+    total_syscalls += syscalls;
+  }
+
+  printf("Stats: Received=%llu, Processed=%llu, Dropped=%llu, "
+         "Pkts/syscall=%.1f\n",
+         total_received, total_processed, total_dropped,
+         total_syscalls
+             ? (double)(total_received + total_dropped) / total_syscalls
+             : 0.0);
+}
+
+// Adds a sample of the packets waiting in the rings, and returns it
+size_t sample_occupancy() {
+  size_t waiting = 0;
+  for (int i = 0; i < num_queues; i++)
+    waiting += queues[i].ring.size();
+
+  if (waiting > max_occupancy)
+    max_occupancy = waiting;
+  if (occupancy && num_occupancy < OCCUPANCY_MAX_SAMPLES)
+    occupancy[num_occupancy++] = (uint32_t)waiting;
+  return waiting;
+}
+
+// Writes the final counters, the -L latency percentiles and the occupancy
+// samples to path as name=value lines, for pipeline_bench. Call once the
+// threads are stopped. Returns 0, or -1 if the file cannot be written.
+int write_results(const char *path) {
+  unsigned long long received = 0, dropped = 0, processed = 0, bad = 0;
+  struct lat_hist latency;
+  lat_hist_reset(&latency);
+
+  for (int i = 0; i < num_queues; i++) {
+    struct RxQueue *q = &queues[i];
+    received += metrics_get(&q->rx_metrics, METRIC_RECEIVED);
+    dropped += metrics_get(&q->rx_metrics, METRIC_DROPPED);
+    processed += metrics_get(&q->proc_metrics, METRIC_PROCESSED);
+    bad += q->parse_stats.frames - q->parse_stats.counts[PKT_OK];
+    for (int w = 0; w < num_workers && q->workers; w++) {
+      processed += metrics_get(&q->workers[w].metrics, METRIC_PROCESSED);
+      lat_hist_merge(&latency, &q->workers[w].send_latency);
+    }
+  }
+
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+  fprintf(f, "received=%llu\ndropped=%llu\nprocessed=%llu\nbad=%llu\n",
+          received, dropped, processed, bad);
+  fprintf(f, "latency_count=%llu\n", (unsigned long long)latency.count);
+  fprintf(f, "latency_mean_ns=%.0f\n", lat_hist_mean(&latency));
+  const double pcts[] = {50, 90, 99, 99.9};
+  const char *names[] = {"p50", "p90", "p99", "p99.9"};
+  for (int i = 0; i < 4; i++)
+    fprintf(f, "latency_%s_ns=%llu\n", names[i],
+            (unsigned long long)lat_hist_percentile(&latency, pcts[i]));
+  fprintf(f, "latency_max_ns=%llu\n", (unsigned long long)latency.max);
+  fprintf(f, "ring_size=%d\noccupancy_max=%zu\noccupancy_tick_ms=%d\n",
+          RING_BUFFER_SIZE * num_queues, max_occupancy, OCCUPANCY_TICK_MS);
+  fprintf(f, "occupancy=");
+  for (size_t i = 0; i < num_occupancy; i++)
+    fprintf(f, "%s%u", i ? "," : "", occupancy[i]);
+  fprintf(f, "\n");
+
+  int ret = ferror(f) ? -1 : 0;
+  if (fclose(f) != 0 || ret < 0) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Scrape extras: how full each ring is right now
+void write_ring_gauges(void *arg, FILE *out, const char *prefix) {
+  (void)arg;
+  fprintf(out, "# HELP %s_ring_occupancy Packets waiting in the ring\n"
+               "# TYPE %s_ring_occupancy gauge\n",
+          prefix, prefix);
+  for (int i = 0; i < num_queues; i++)
+    fprintf(out, "%s_ring_occupancy{queue=\"%d\"} %zu\n", prefix, i,
+            queues[i].ring.size());
+  fprintf(out, "# HELP %s_ring_capacity Packets each ring holds\n"
+               "# TYPE %s_ring_capacity gauge\n%s_ring_capacity %d\n",
+          prefix, prefix, prefix, RING_BUFFER_SIZE);
+}
+
+// Registers a queue's receiver, processor and workers for -M
+int register_metrics(struct RxQueue *q) {
+  if (metrics_register(&metrics, &q->rx_metrics, q->id) < 0 ||
+      metrics_register(&metrics, &q->proc_metrics, q->id) < 0)
+    return -1;
+  for (int i = 0; i < num_workers && q->workers; i++) {
+    if (metrics_register(&metrics, &q->workers[i].metrics, q->id) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+void handle_signal(int sig) {
+  (void)sig;
+  running = 0;
+}
+
+// Frees a queue's processing stages; safe on stages never initialized
+void destroy_stages(struct RxQueue *q) {
+  reorder_destroy(&q->reorder);
+  ct_destroy(&q->corner_turn);
+  free(q->shards);
+  free(q->workers);
+  q->shards = NULL;
+  q->workers = NULL;
+}
+
+void usage(const char *prog) {
+  printf("Usage: %s [-f drop|block] [-b batch] [-q queues] [-c first_cpu] "
+         "[-k step] [-V]\n"
+         "          [-w workers] [-S channel|fpga] [-P usec] [-L] "
+         "[-R results_file]\n"
+         "          [-M unix:/path|[host]:port] [-t trace_file] [-D level]\n"
+         "          [-T channels[:block_samples[:chans_per_pkt[:bytes"
+         "[:fpgas]]]]]\n",
+         prog);
+  printf("  -f  policy when the ring is full: drop the newest packet "
+         "(default)\n");
+  printf("      or block the receiver until a slot is free\n");
+  printf("  -b  datagrams per recvmmsg() call, 1-%d (default %d)\n",
+         MAX_RECV_BATCH, DEFAULT_RECV_BATCH);
+  printf("  -q  receive queues (SO_REUSEPORT sockets), 1-%d (default 1)\n",
+         MAX_QUEUES);
+  printf("  -c  pin queue i's receiver to CPU first_cpu+2i and its processor\n"
+         "      to the CPU after it (default: no pinning)\n");
+  printf("  -k  sample_count advance between consecutive packets of a "
+         "stream\n"
+         "      (default 1), used to put streams back in order and spot "
+         "gaps\n");
+  printf("  -V  drop packets whose IPv4 header checksum is wrong\n");
+  printf("  -w  processing workers per queue, 1-%d (default 1)\n",
+         MAX_WORKERS);
+  printf("  -S  shard packets across workers by freq_channel (default) or\n"
+         "      fpga_id; each shard is processed in order, and idle workers\n"
+         "      steal whole shards from busy ones\n");
+  printf("  -T  corner turn packets into blocks of block_samples (default "
+         "1024)\n"
+         "      samples for freq_channel 0 to channels-1; each packet holds\n"
+         "      chans_per_pkt channels (default 1) of bytes-sized samples\n"
+         "      (default 4), time-major, from fpga_id 0 to fpgas-1 (default\n"
+         "      1), each FPGA's channels in rows of their own; the processor\n"
+         "      thread does this in place of the workers\n");
+  printf("  -P  simulated processing time per packet in microseconds "
+         "(default %d)\n",
+         DEFAULT_PROCESS_US);
+  printf("  -L  measure latency from the send time udp_client -t writes into\n"
+         "      each packet to the end of its processing (not with -T)\n");
+  printf("  -R  on exit, write the counters, latency percentiles and ring\n"
+         "      occupancy sampled every %d ms to this file\n",
+         OCCUPANCY_TICK_MS);
+  printf("  -M  serve per-stage latency histograms and counters in the\n"
+         "      Prometheus text format over HTTP on this Unix socket or TCP\n"
+         "      address\n");
+  printf("  -t  record every packet received, dropped and processed in a "
+         "binary\n"
+         "      trace file, written in the background (see trace_decode)\n");
+  printf("  -D  debug level: 1 prints every packet processed, at a large "
+         "cost\n"
+         "      in throughput (default 0)\n");
+}
+
+int main(int argc, char *argv[]) {
+  int first_cpu = -1;
+  const char *results_path = NULL;
+  const char *metrics_addr = NULL;
+  const char *trace_path = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:b:q:c:k:Vw:S:T:P:LR:M:t:D:h")) != -1) {
+    switch (opt) {
+    case 'f':
+      if (strcmp(optarg, "drop") == 0) {
+        full_policy = FULL_POLICY_DROP;
+      } else if (strcmp(optarg, "block") == 0) {
+        full_policy = FULL_POLICY_BLOCK;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'b':
+      recv_batch = atoi(optarg);
+      if (recv_batch < 1 || recv_batch > MAX_RECV_BATCH) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'q':
+      num_queues = atoi(optarg);
+      if (num_queues < 1 || num_queues > MAX_QUEUES) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'c':
+      first_cpu = atoi(optarg);
+      break;
+    case 'k':
+      sample_step = strtoull(optarg, NULL, 10);
+      if (sample_step == 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'V':
+      parse_flags |= PKT_VERIFY_CHECKSUM;
+      break;
+    case 'w':
+      num_workers = atoi(optarg);
+      if (num_workers < 1 || num_workers > MAX_WORKERS) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'S':
+      if (strcmp(optarg, "channel") == 0) {
+        shard_key = SHARD_BY_CHANNEL;
+      } else if (strcmp(optarg, "fpga") == 0) {
+        shard_key = SHARD_BY_FPGA;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'T':
+      if (sscanf(optarg, "%u:%u:%u:%u:%u", &corner_turn_cfg.num_channels,
+                 &corner_turn_cfg.block_samples,
+                 &corner_turn_cfg.channels_per_packet,
+                 &corner_turn_cfg.sample_bytes,
+                 &corner_turn_cfg.num_fpgas) < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      corner_turn_enabled = 1;
+      break;
+    case 'P':
+      process_us = atoi(optarg);
+      if (process_us < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'L':
+      send_latency_enabled = 1;
+      break;
+    case 'R':
+      results_path = optarg;
+      break;
+    case 'M':
+      metrics_addr = optarg;
+      break;
+    case 't':
+      trace_path = optarg;
+      break;
+    case 'D':
+      debug_level = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  printf("UDP Server with concurrent processing starting on port %d...\n",
+         PORT);
+  printf("Queues: %d, ring buffer size: %d packets, full policy: %s, "
+         "batch: %d\n\n",
+         num_queues, RING_BUFFER_SIZE,
+         full_policy == FULL_POLICY_DROP ? "drop" : "block", recv_batch);
+  if (!corner_turn_enabled) {
+    printf("Workers: %d per queue, sharded by %s\n\n", num_workers,
+           shard_key == SHARD_BY_CHANNEL ? "freq_channel" : "fpga_id");
+  } else {
+    printf("Corner turn: %u FPGA(s) x %u channels x %u samples of %u bytes "
+           "per block, %u channel(s) per packet\n\n",
+           corner_turn_cfg.num_fpgas, corner_turn_cfg.num_channels,
+           corner_turn_cfg.block_samples, corner_turn_cfg.sample_bytes,
+           corner_turn_cfg.channels_per_packet);
+  }
+
+  metrics_init(&metrics, "udp_server");
+  metrics.extra = write_ring_gauges;
+
+  // Open before the queues so that every data path thread gets a ring
+  if (trace_path) {
+    if (trace_open(&trace, trace_path) < 0)
+      return 1;
+    printf("Tracing packets to %s\n", trace_path);
+  }
+
+  // Create one socket per queue, all bound to the same port
+  for (int i = 0; i < num_queues; i++) {
+    struct RxQueue *q = &queues[i];
+    q->id = i;
+    metrics_thread_reset(&q->rx_metrics);
+    metrics_thread_reset(&q->proc_metrics);
+    q->rx_trace = trace_ring_create(&trace);
+    q->proc_trace = trace_ring_create(&trace);
+    q->rx_cpu = first_cpu >= 0 ? first_cpu + 2 * i : -1;
+    q->proc_cpu = first_cpu >= 0 ? first_cpu + 2 * i + 1 : -1;
+    if (reorder_init(&q->reorder, sample_step,
+                     BUFFER_SIZE - PKT_PAYLOAD_OFFSET, REORDER_POOL_SLOTS,
+                     deliver_packet, q) < 0 ||
+        (corner_turn_enabled &&
+         ct_init(&q->corner_turn, &corner_turn_cfg, process_block, q) < 0) ||
+        (!corner_turn_enabled && init_pool(q) < 0) ||
+        register_metrics(q) < 0) {
+      for (int j = 0; j < i; j++)
+        close(queues[j].sockfd);
+      for (int j = 0; j <= i; j++)
+        destroy_stages(&queues[j]);
+      trace_close(&trace);
+      return 1;
+    }
+    q->sockfd = open_rx_socket();
+    if (q->sockfd < 0) {
+      for (int j = 0; j < i; j++)
+        close(queues[j].sockfd);
+      for (int j = 0; j <= i; j++)
+        destroy_stages(&queues[j]);
+      trace_close(&trace);
+      return 1;
+    }
+  }
+
+  // Every thread's metrics are registered, so they can be served already
+  if (metrics_addr) {
+    if (metrics_start(&metrics, metrics_addr) < 0) {
+      for (int i = 0; i < num_queues; i++) {
+        close(queues[i].sockfd);
+        destroy_stages(&queues[i]);
+      }
+      trace_close(&trace);
+      return 1;
+    }
+    printf("Metrics served on %s\n", metrics_addr);
   }
 
   printf("Server listening on 0.0.0.0:%d\n", PORT);
   printf("Press Ctrl+C to stop\n\n");
 
-  // Start receiver thread
-  if (pthread_create(&receiver_tid, NULL, receiver_thread, &sockfd) != 0) {
-    perror("pthread_create receiver");
-    close(sockfd);
-    return 1;
+  // Start the workers, receiver and processor threads for each queue
+  int started = 0;
+  for (; started < num_queues; started++) {
+    struct RxQueue *q = &queues[started];
+
+    if (!corner_turn_enabled && start_workers(q) < 0)
+      break;
+
+    if (start_thread(&q->receiver_tid, receiver_thread, q, q->rx_cpu) != 0) {
+      perror("pthread_create receiver");
+      break;
+    }
+
+    if (start_thread(&q->processor_tid, processor_thread, q, q->proc_cpu) !=
+        0) {
+      perror("pthread_create processor");
+      running = 0;
+      shutdown(q->sockfd, SHUT_RD); // wake the receiver out of recvmmsg()
+      pthread_join(q->receiver_tid, NULL);
+      break;
+    }
+
+    if (q->rx_cpu >= 0) {
+      printf("Queue %d: receiver on CPU %d, processor on CPU %d\n", q->id,
+             q->rx_cpu, q->proc_cpu);
+    }
   }
 
-  // Start processor thread
-  if (pthread_create(&processor_tid, NULL, processor_thread, NULL) != 0) {
-    perror("pthread_create processor");
+  if (started < num_queues) {
     running = 0;
-    pthread_join(receiver_tid, NULL);
-    close(sockfd);
+    metrics_stop(&metrics);
+    for (int i = 0; i < started; i++) {
+      shutdown(queues[i].sockfd, SHUT_RD);
+      pthread_join(queues[i].receiver_tid, NULL);
+      pthread_join(queues[i].processor_tid, NULL);
+    }
+    for (int i = 0; i < num_queues; i++) {
+      stop_workers(&queues[i]);
+      close(queues[i].sockfd);
+      destroy_stages(&queues[i]);
+    }
+    trace_close(&trace);
     return 1;
   }
 
-  // Print statistics periodically
-  while (running) {
-    sleep(5);
-    printf(
-        "Stats: Received=%llu, Processed=%llu, Buffer usage=%d/%d\n",
-        (unsigned long long)packets_received.load(std::memory_order_relaxed),
-        (unsigned long long)packets_processed.load(std::memory_order_relaxed),
-        (write_index - read_index + RING_BUFFER_SIZE) % RING_BUFFER_SIZE,
-        RING_BUFFER_SIZE);
+  if (results_path) {
+    occupancy = (uint32_t *)malloc(OCCUPANCY_MAX_SAMPLES * sizeof(uint32_t));
+    if (!occupancy)
+      fprintf(stderr, "No memory for occupancy samples, keeping the max\n");
+  }
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+
+  // Sample the rings and print statistics periodically
+  last_stats_ns = monotonic_ns();
+  for (int tick = 1; running; tick++) {
+    usleep(OCCUPANCY_TICK_MS * 1000);
+    sample_occupancy();
+    if (tick % (STATS_INTERVAL_MS / OCCUPANCY_TICK_MS) == 0)
+      print_stats();
   }
 
   // Cleanup
   printf("\nShutting down...\n");
   running = 0;
-  pthread_join(receiver_tid, NULL);
-  pthread_join(processor_tid, NULL);
+  metrics_stop(&metrics);
+  for (int i = 0; i < num_queues; i++) {
+    shutdown(queues[i].sockfd, SHUT_RD);
+    pthread_join(queues[i].receiver_tid, NULL);
+    pthread_join(queues[i].processor_tid, NULL);
+    stop_workers(&queues[i]);
+  }
+  trace_close(&trace);
 
-  close(sockfd);
-  return 0;
+  int ret = 0;
+  if (results_path && write_results(results_path) < 0)
+    ret = 1;
+  for (int i = 0; i < num_queues; i++) {
+    close(queues[i].sockfd);
+    destroy_stages(&queues[i]);
+  }
+  free(occupancy);
+
+  return ret;
 }
@@ -1,5 +1,7 @@
 #include <arpa/inet.h>
-#include <pcap/pcap.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,37 +9,18 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "packet_parser.h"
+#include "pacer.h"
+#include "pcap_file.h"
+#include "trace.h"
+
 #define UDP_PORT 12345
-#define MIN_PCAP_HEADER_SIZE 58
+#define MAX_SEND_BATCH 64
+#define DEFAULT_SEND_BATCH 32
+#define SEND_BUFFER_SIZE (4 * 1024 * 1024)
 
-// Your custom headers
+// Custom header at PKT_CUSTOM_OFFSET, rewritten in synthesis mode
 #pragma pack(push, 1)
-struct EthernetHeader {
-  uint8_t dst[6];
-  uint8_t src[6];
-  uint16_t ethertype;
-};
-
-struct IPHeader {
-  uint8_t version_ihl;
-  uint8_t dscp_ecn;
-  uint16_t total_length;
-  uint16_t identification;
-  uint16_t flags_fragment;
-  uint8_t ttl;
-  uint8_t protocol;
-  uint16_t header_checksum;
-  uint32_t src_ip;
-  uint32_t dst_ip;
-};
-
-struct UDPHeader {
-  uint16_t src_port;
-  uint16_t dst_port;
-  uint16_t length;
-  uint16_t checksum;
-};
-
 struct CustomHeader {
   uint64_t sample_count;
   uint32_t fpga_id;
@@ -46,138 +29,541 @@ struct CustomHeader {
 };
 #pragma pack(pop)
 
-struct PacketInfo {
-  uint64_t sample_count;
-  uint16_t freq_channel;
-  uint32_t fpga_id;
-  int payload_size;
+// Frames of the capture that carry our custom header, in capture order.
+// Each one is sent whole (headers and all) as one datagram straight out of
+// the mapped file; msgs[i] is prebuilt to point at iovs[i], so a batch is
+// just a slice of msgs.
+//
+// In synthesis mode the frames come from a template arena instead: one
+// copy of a captured frame per emulated (fpga_id, freq_channel) stream,
+// with both fields already written, repeated often enough that a batch
+// never holds the same copy twice. Sending a frame then only costs storing
+// its stream's next sample_count.
+//
+// With send time stamps (-t) frames are written just before they go out,
+// so replayed frames are first copied out of the read-only mapping into
+// the arena too.
+struct Replay {
+  struct pcap_file pf;
+  struct iovec *iovs;
+  struct mmsghdr *msgs;
+  uint64_t *timestamps;
+  uint32_t num_frames;
+  uint32_t skipped; // frames without a custom header
+  struct pkt_stats parse_stats; // why they were skipped
+  uint64_t bytes;   // per pass over the capture
+
+  char *arena; // writable frames, when synthesizing or stamping
+
+  // Synthesis only
+  uint32_t num_fpgas;
+  uint32_t num_channels;
+  uint32_t num_streams;  // num_fpgas * num_channels
+  uint64_t *next_sample; // per stream
+  uint64_t sample_step;  // sample_count advance per packet
 };
 
-PacketInfo get_packet_info(const u_char *packet, const int size) {
-  PacketInfo info = {0};
+static volatile sig_atomic_t running = 1;
+
+// Maps the capture and indexes the frames worth sending. Returns 0 on
+// success, -1 on failure.
+int load_replay(struct Replay *r, const char *path) {
+  memset(r, 0, sizeof(*r));
+  if (pcap_file_open(&r->pf, path) < 0)
+    return -1;
+
+  uint32_t n = r->pf.num_frames;
+  r->iovs = (struct iovec *)calloc(n ? n : 1, sizeof(struct iovec));
+  r->msgs = (struct mmsghdr *)calloc(n ? n : 1, sizeof(struct mmsghdr));
+  r->timestamps = (uint64_t *)calloc(n ? n : 1, sizeof(uint64_t));
+  if (!r->iovs || !r->msgs || !r->timestamps) {
+    fprintf(stderr, "Failed to allocate index of %u frames\n", n);
+    return -1;
+  }
+
+  for (uint32_t base = 0; base < n; base += PKT_MAX_BATCH) {
+    uint32_t count = n - base < PKT_MAX_BATCH ? n - base : PKT_MAX_BATCH;
+    const uint8_t *frames[PKT_MAX_BATCH];
+    uint32_t lens[PKT_MAX_BATCH];
+    struct pkt_batch batch;
 
-  if (size < MIN_PCAP_HEADER_SIZE) {
-    printf("Packet too small (%d bytes)\n", size);
-    return info;
+    for (uint32_t i = 0; i < count; i++) {
+      frames[i] = pcap_frame_data(&r->pf, base + i);
+      lens[i] = r->pf.frames[base + i].len;
+    }
+    pkt_parse_batch(frames, lens, count, 0, &batch, &r->parse_stats);
+
+    for (uint32_t i = 0; i < count; i++) {
+      if (batch.status[i] != PKT_OK) {
+        r->skipped++;
+        continue;
+      }
+
+      uint32_t j = r->num_frames++;
+      r->iovs[j].iov_base = (void *)frames[i];
+      r->iovs[j].iov_len = lens[i];
+      r->msgs[j].msg_hdr.msg_iov = &r->iovs[j];
+      r->msgs[j].msg_hdr.msg_iovlen = 1;
+      r->timestamps[j] = r->pf.frames[base + i].ts_ns;
+      r->bytes += lens[i];
+    }
   }
 
-  // Parse headers
-  const EthernetHeader *eth = (const EthernetHeader *)packet;
-  if (ntohs(eth->ethertype) != 0x0800) {
-    printf("Not IPv4 packet\n");
-    return info;
+  if (r->num_frames == 0) {
+    fprintf(stderr, "No frames with custom headers in %s\n", path);
+    pkt_stats_report(&r->parse_stats, "  ");
+    return -1;
   }
+  return 0;
+}
 
-  const IPHeader *ip = (const IPHeader *)(packet + 14);
-  if ((ip->version_ihl >> 4) != 4) {
-    printf("Not IPv4\n");
-    return info;
+// Replaces the captured frames with a template arena emulating fpgas x
+// channels streams. Stream s is FPGA s % fpgas, channel s / fpgas, so
+// consecutive packets come from different FPGAs, and uses captured frame
+// s % num_frames as its template. Returns 0 on success, -1 on failure.
+int build_synthesis(struct Replay *r, uint32_t fpgas, uint32_t channels,
+                    uint64_t first_sample, uint64_t step) {
+  uint64_t streams = (uint64_t)fpgas * channels;
+  if (streams == 0 || streams > UINT32_MAX / MAX_SEND_BATCH) {
+    fprintf(stderr, "Cannot emulate %u FPGAs x %u channels\n", fpgas,
+            channels);
+    return -1;
   }
 
-  const UDPHeader *udp = (const UDPHeader *)(packet + 34);
-  const CustomHeader *custom = (const CustomHeader *)(packet + 42);
+  uint32_t copies = (MAX_SEND_BATCH + streams - 1) / streams;
+  uint32_t slots = streams * copies;
+
+  size_t arena_size = 0;
+  for (uint32_t i = 0; i < slots; i++)
+    arena_size += r->iovs[i % streams % r->num_frames].iov_len;
+
+  struct iovec *iovs = (struct iovec *)calloc(slots, sizeof(struct iovec));
+  struct mmsghdr *msgs =
+      (struct mmsghdr *)calloc(slots, sizeof(struct mmsghdr));
+  uint64_t *timestamps = (uint64_t *)calloc(slots, sizeof(uint64_t));
+  r->arena = (char *)malloc(arena_size);
+  r->next_sample = (uint64_t *)malloc(streams * sizeof(uint64_t));
+  if (!iovs || !msgs || !timestamps || !r->arena || !r->next_sample) {
+    fprintf(stderr, "Failed to allocate %zu byte template arena\n",
+            arena_size);
+    free(iovs);
+    free(msgs);
+    free(timestamps);
+    return -1;
+  }
 
-  info.sample_count = custom->sample_count;
-  info.freq_channel = custom->freq_channel;
-  info.fpga_id = custom->fpga_id;
-  info.payload_size = size - MIN_PCAP_HEADER_SIZE;
+  size_t offset = 0;
+  r->bytes = 0;
+  for (uint32_t i = 0; i < slots; i++) {
+    uint32_t stream = i % streams;
+    const struct iovec *tmpl = &r->iovs[stream % r->num_frames];
+    char *frame = r->arena + offset;
+    memcpy(frame, tmpl->iov_base, tmpl->iov_len);
+
+    CustomHeader custom;
+    memcpy(&custom, frame + PKT_CUSTOM_OFFSET, sizeof(custom));
+    custom.fpga_id = stream % fpgas;
+    custom.freq_channel = stream / fpgas;
+    memcpy(frame + PKT_CUSTOM_OFFSET, &custom, sizeof(custom));
+
+    iovs[i].iov_base = frame;
+    iovs[i].iov_len = tmpl->iov_len;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if (i < streams)
+      r->bytes += tmpl->iov_len;
+    offset += tmpl->iov_len;
+  }
 
-  return info;
+  free(r->iovs);
+  free(r->msgs);
+  free(r->timestamps);
+  r->iovs = iovs;
+  r->msgs = msgs;
+  r->timestamps = timestamps;
+  r->num_frames = slots;
+
+  r->num_fpgas = fpgas;
+  r->num_channels = channels;
+  r->num_streams = streams;
+  r->sample_step = step;
+  for (uint32_t s = 0; s < streams; s++)
+    r->next_sample[s] = first_sample;
+  return 0;
 }
 
-int send_custom_packet(int sockfd, struct sockaddr_in *server_addr,
-                       const u_char *packet_data, int packet_len) {
-
-  PacketInfo info = get_packet_info(packet_data, packet_len);
-  if (info.payload_size <= 0) {
-    printf("No payload or invalid packet\n");
+// Copies the indexed frames into an arena so they can be stamped. Returns
+// 0 on success, -1 on failure.
+int copy_frames(struct Replay *r) {
+  size_t arena_size = 0;
+  for (uint32_t i = 0; i < r->num_frames; i++)
+    arena_size += r->iovs[i].iov_len;
+
+  r->arena = (char *)malloc(arena_size ? arena_size : 1);
+  if (!r->arena) {
+    fprintf(stderr, "Failed to allocate %zu bytes for the frames\n",
+            arena_size);
     return -1;
   }
 
-  printf("Packet info: sample_count=%lu, freq_channel=%u, fpga_id=%u, "
-         "payload_size=%d\n",
-         info.sample_count, info.freq_channel, info.fpga_id, info.payload_size);
+  size_t offset = 0;
+  for (uint32_t i = 0; i < r->num_frames; i++) {
+    memcpy(r->arena + offset, r->iovs[i].iov_base, r->iovs[i].iov_len);
+    r->iovs[i].iov_base = r->arena + offset;
+    offset += r->iovs[i].iov_len;
+  }
+  return 0;
+}
+
+// Writes the next sample_count of their stream into the n arena frames
+// from first on, just before they are sent
+static inline void stamp_batch(struct Replay *r, uint32_t first, uint32_t n) {
+  for (uint32_t i = first; i < first + n; i++) {
+    uint64_t *next = &r->next_sample[i % r->num_streams];
+    memcpy((char *)r->iovs[i].iov_base + PKT_CUSTOM_OFFSET +
+               offsetof(CustomHeader, sample_count),
+           next, sizeof(*next));
+    *next += r->sample_step;
+  }
+}
+
+// Writes send time now into the n frames from first on that have room for
+// it in their payload
+static inline void stamp_send_time(struct Replay *r, uint32_t first,
+                                   uint32_t n, uint64_t now) {
+  for (uint32_t i = first; i < first + n; i++) {
+    if (r->iovs[i].iov_len >= PKT_SEND_STAMP_OFFSET + sizeof(now))
+      memcpy((char *)r->iovs[i].iov_base + PKT_SEND_STAMP_OFFSET, &now,
+             sizeof(now));
+  }
+}
+
+// Records the n frames from first on as sent at now, with -o. A refusal
+// reported later names no datagram, so refused frames are recorded here
+// too and the send_error drop only counts them.
+static inline void trace_sent(struct trace_ring *tr, struct Replay *r,
+                              uint32_t first, uint32_t n, uint64_t now) {
+  for (uint32_t i = first; i < first + n; i++) {
+    CustomHeader custom;
+    memcpy(&custom, (char *)r->iovs[i].iov_base + PKT_CUSTOM_OFFSET,
+           sizeof(custom));
+    trace_emit(tr, now, TRACE_EV_TX, TRACE_DROP_NONE, custom.fpga_id,
+               custom.freq_channel, custom.sample_count, 1, 0);
+  }
+}
 
-  // Send the entire packet (headers + payload)
-  ssize_t sent = sendto(sockfd, packet_data, packet_len, 0,
-                        (struct sockaddr *)server_addr, sizeof(*server_addr));
+void free_replay(struct Replay *r) {
+  free(r->iovs);
+  free(r->msgs);
+  free(r->timestamps);
+  free(r->arena);
+  free(r->next_sample);
+  pcap_file_close(&r->pf);
+}
 
-  if (sent < 0) {
-    perror("sendto");
+// Sends the n prebuilt messages in msgs, retrying the part sendmmsg() did
+// not take. An ICMP port unreachable for an earlier datagram (no receiver
+// listening yet) fails the next call once; it is counted in *errors and
+// the call retried. Returns 0, or -1 on a fatal error.
+int send_batch(int sockfd, struct mmsghdr *msgs, uint32_t n,
+               uint64_t *errors) {
+  uint32_t done = 0;
+  while (done < n) {
+    int ret = sendmmsg(sockfd, msgs + done, n - done, 0);
+    if (ret > 0) {
+      done += ret;
+      continue;
+    }
+    if (ret < 0 && (errno == EINTR || errno == ENOBUFS || errno == EAGAIN))
+      continue;
+    if (ret < 0 && errno == ECONNREFUSED) {
+      (*errors)++;
+      continue;
+    }
+    perror("sendmmsg");
     return -1;
   }
-
-  printf("Sent complete packet (%zd bytes)\n", sent);
   return 0;
 }
 
+void handle_signal(int sig) {
+  (void)sig;
+  running = 0;
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-d dst_ip] [-p port] [-m | -x speed | -r pps | "
+          "-g gbps] [-l loops] [-b batch] [-t]\n"
+          "          [-o trace_file]\n"
+          "          [-F fpgas -C channels [-s first_sample] [-k step]] "
+          "<pcap_file>\n"
+          "  -d  destination address (default 127.0.0.1)\n"
+          "  -p  destination UDP port (default %d)\n"
+          "  -m  send as fast as possible\n"
+          "  -x  keep the capture's timing, sped up by this factor "
+          "(default 1)\n"
+          "  -r  send at a fixed packet rate\n"
+          "  -g  send at a fixed bit rate, counting Ethernet framing\n"
+          "  -l  replay the capture this many times, 0 = until "
+          "interrupted (default 1)\n"
+          "  -b  datagrams per sendmmsg() (default %d, max %d)\n"
+          "  -F  emulate this many FPGAs (fpga_id 0..F-1) from the "
+          "capture\n"
+          "  -C  channels per FPGA (freq_channel 0..C-1); each loop sends "
+          "one\n"
+          "      packet per stream, paced with -m, -r or -g\n"
+          "  -s  sample_count of each stream's first packet (default 0)\n"
+          "  -k  sample_count advance per packet (default 1)\n"
+          "  -t  write the send time (CLOCK_MONOTONIC ns) over the first 8 "
+          "payload\n"
+          "      bytes of every packet, for udp_server -L\n"
+          "  -o  record every packet sent and refused in a binary trace "
+          "file,\n"
+          "      written in the background (see trace_decode); refused "
+          "packets\n"
+          "      are recorded as sent too\n",
+          prog, UDP_PORT, DEFAULT_SEND_BATCH, MAX_SEND_BATCH);
+}
+
 int main(int argc, char *argv[]) {
-  pcap_t *handle;
-  char errbuf[PCAP_ERRBUF_SIZE];
-  struct pcap_pkthdr *header;
-  const u_char *packet;
-  int sockfd;
+  struct Replay replay;
   struct sockaddr_in server_addr;
   const char *server_ip = "127.0.0.1";
-  int packet_count = 0;
-  int custom_packet_count = 0;
-  int res;
+  int port = UDP_PORT;
+  enum pace_mode mode = PACE_PCAP;
+  double rate = 1.0;
+  unsigned long loops = 1;
+  uint32_t batch = DEFAULT_SEND_BATCH;
+  uint32_t fpgas = 0, channels = 0;
+  uint64_t first_sample = 0, sample_step = 1;
+  int pace_set = 0;
+  int stamp = 0;
+  const char *trace_path = NULL;
+  int sockfd;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:p:mx:r:g:l:b:F:C:s:k:to:h")) != -1) {
+    if (opt == 'm' || opt == 'x' || opt == 'r' || opt == 'g')
+      pace_set = 1;
+    switch (opt) {
+    case 'd':
+      server_ip = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'm':
+      mode = PACE_MAX;
+      break;
+    case 'x':
+      mode = PACE_PCAP;
+      rate = atof(optarg);
+      break;
+    case 'r':
+      mode = PACE_PPS;
+      rate = atof(optarg);
+      break;
+    case 'g':
+      mode = PACE_BPS;
+      rate = atof(optarg) * 1e9;
+      break;
+    case 'l':
+      loops = strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      batch = atoi(optarg);
+      break;
+    case 'F':
+      fpgas = strtoul(optarg, NULL, 10);
+      break;
+    case 'C':
+      channels = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      first_sample = strtoull(optarg, NULL, 10);
+      break;
+    case 'k':
+      sample_step = strtoull(optarg, NULL, 10);
+      break;
+    case 't':
+      stamp = 1;
+      break;
+    case 'o':
+      trace_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  // Synthesized frames have no capture timing to keep
+  int synthesize = fpgas > 0 || channels > 0;
+  if (synthesize && !pace_set)
+    mode = PACE_MAX;
 
-  if (argc < 2) {
-    printf("Usage: %s <pcap_file>\n", argv[0]);
+  if (optind >= argc || batch == 0 || batch > MAX_SEND_BATCH ||
+      (mode != PACE_MAX && rate <= 0) ||
+      (synthesize && (fpgas == 0 || channels == 0 || mode == PACE_PCAP))) {
+    usage(argv[0]);
     return 1;
   }
 
-  // Open pcap file using libpcap
-  handle = pcap_open_offline(argv[1], errbuf);
-  if (!handle) {
-    fprintf(stderr, "pcap_open_offline failed: %s\n", errbuf);
+  if (load_replay(&replay, argv[optind]) < 0 ||
+      (synthesize && build_synthesis(&replay, fpgas, channels, first_sample,
+                                     sample_step) < 0) ||
+      (stamp && !synthesize && copy_frames(&replay) < 0)) {
+    free_replay(&replay);
     return 1;
   }
 
-  printf("Reading pcap file: %s\n", argv[1]);
-  printf("Sending packets to %s:%d\n\n", server_ip, UDP_PORT);
+  printf("Reading pcap file: %s (%u frames, %u without custom headers, "
+         "%u truncated)\n",
+         argv[optind], replay.num_frames, replay.skipped,
+         replay.pf.truncated);
+  if (replay.skipped)
+    pkt_stats_report(&replay.parse_stats, "  ");
+  if (synthesize)
+    printf("Synthesizing %u FPGAs x %u channels (%u streams), sample_count "
+           "from %llu in steps of %llu\n",
+           fpgas, channels, replay.num_streams,
+           (unsigned long long)first_sample,
+           (unsigned long long)sample_step);
+  printf("Sending packets to %s:%d\n\n", server_ip, port);
 
   // Create UDP socket for sending
   sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sockfd < 0) {
     perror("socket");
-    pcap_close(handle);
+    free_replay(&replay);
     return 1;
   }
 
-  // Setup server address
+  // Room for bursts of due frames
+  int sndbuf = SEND_BUFFER_SIZE;
+  setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  // Setup server address. Connecting lets every message leave out the
+  // destination.
   memset(&server_addr, 0, sizeof(server_addr));
   server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(UDP_PORT);
+  server_addr.sin_port = htons(port);
   server_addr.sin_addr.s_addr = inet_addr(server_ip);
+  if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
+      0) {
+    perror("connect");
+    close(sockfd);
+    free_replay(&replay);
+    return 1;
+  }
 
-  // Read packets using pcap_next_ex
-  while ((res = pcap_next_ex(handle, &header, &packet)) >= 0) {
-    if (res == 0)
-      continue; // Timeout (shouldn't happen with offline files)
-
-    packet_count++;
-    printf("\n--- Packet #%d (%d bytes) ---\n", packet_count, header->len);
-
-    // Process and send the packet
-    if (send_custom_packet(sockfd, &server_addr, packet, header->len) == 0) {
-      custom_packet_count++;
+  struct trace_log trace;
+  struct trace_ring *trace_ring = NULL;
+  if (trace_path) {
+    if (trace_open(&trace, trace_path) < 0) {
+      close(sockfd);
+      free_replay(&replay);
+      return 1;
     }
-
-    // Small delay between packets
-    usleep(100000); // 100ms
+    trace_ring = trace_ring_create(&trace);
+    printf("Tracing packets to %s\n\n", trace_path);
   }
 
-  if (res == -1) {
-    fprintf(stderr, "Error reading packets: %s\n", pcap_geterr(handle));
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+
+  struct pacer pacer;
+  pacer_init(&pacer, mode, rate);
+
+  // A loop is one pass over the capture, or one packet per stream
+  uint32_t per_loop = synthesize ? replay.num_streams : replay.num_frames;
+  uint64_t total = (uint64_t)per_loop * loops; // 0 = unbounded
+  uint64_t sent = 0, bytes = 0, errors = 0;
+  uint32_t idx = 0;
+  int failed = 0;
+
+  uint64_t start = pacer_now_ns();
+  uint64_t due = pacer_next(&pacer, replay.timestamps[0],
+                            replay.iovs[0].iov_len);
+
+  while (running && (loops == 0 || sent < total)) {
+    pacer_wait(&pacer, due);
+    uint64_t now = pacer_now_ns();
+
+    // Everything already due goes out in one sendmmsg(). Frames are
+    // contiguous in msgs until the capture wraps around.
+    uint32_t first = idx, n = 0;
+    do {
+      bytes += replay.iovs[idx].iov_len;
+      n++;
+      if (++idx == replay.num_frames)
+        idx = 0;
+      if (loops == 0 || sent + n < total)
+        due = pacer_next(&pacer, replay.timestamps[idx],
+                         replay.iovs[idx].iov_len);
+    } while (n < batch && (loops == 0 || sent + n < total) && idx != 0 &&
+             due <= now);
+
+    if (synthesize)
+      stamp_batch(&replay, first, n);
+    if (stamp)
+      stamp_send_time(&replay, first, n, pacer_now_ns());
+    uint64_t refused = errors;
+    if (send_batch(sockfd, &replay.msgs[first], n, &errors) < 0) {
+      failed = 1;
+      break;
+    }
+    sent += n;
+
+    if (trace_ring) {
+      uint64_t sent_ns = trace_now_ns();
+      if (errors != refused)
+        trace_emit(trace_ring, sent_ns, TRACE_EV_DROP, TRACE_DROP_SEND_ERROR,
+                   0, 0, 0, errors - refused, 0);
+      trace_sent(trace_ring, &replay, first, n, sent_ns);
+    }
   }
 
+  double elapsed = (pacer_now_ns() - start) / 1e9;
+
   printf("\n=== Summary ===\n");
-  printf("Total packets read: %d\n", packet_count);
-  printf("Custom packets sent: %d\n", custom_packet_count);
+  printf("Frames sent: %llu (%.2f loop(s) of %u %s)\n",
+         (unsigned long long)sent, (double)sent / per_loop, per_loop,
+         synthesize ? "streams" : "frames");
+  printf("Send errors: %llu\n", (unsigned long long)errors);
+
+  double pps = elapsed > 0 ? sent / elapsed : 0;
+  double bps = elapsed > 0 ? (bytes + sent * ETH_WIRE_OVERHEAD) * 8 / elapsed
+                           : 0;
+  printf("Elapsed: %.3f s, %.3f Mpps, %.3f Gbit/s on the wire\n", elapsed,
+         pps / 1e6, bps / 1e9);
+
+  // The capture's own rate is frames over the span of its timestamps
+  double target = 0;
+  const char *unit = "Mpps";
+  if (mode == PACE_PCAP && replay.num_frames > 1) {
+    uint64_t span = replay.timestamps[replay.num_frames - 1] -
+                    replay.timestamps[0];
+    if (span > 0)
+      target = (replay.num_frames - 1) * 1e9 / span * rate;
+  } else if (mode == PACE_PPS) {
+    target = rate;
+  } else if (mode == PACE_BPS) {
+    target = rate;
+    unit = "Gbit/s";
+  }
+  if (target > 0) {
+    double achieved = mode == PACE_BPS ? bps : pps;
+    printf("Target: %.3f %s, achieved %.1f%%\n",
+           target / (mode == PACE_BPS ? 1e9 : 1e6), unit,
+           achieved / target * 100);
+  }
+  pacer_report(&pacer);
 
+  if (trace_path)
+    trace_close(&trace);
   close(sockfd);
-  pcap_close(handle);
-  return 0;
+  free_replay(&replay);
+  return failed ? 1 : 0;
 }
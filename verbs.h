@@ -0,0 +1,459 @@
+#ifndef VERBS_H
+#define VERBS_H
+
+#include <errno.h>
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Move-only owners for libibverbs objects.
+//
+// Each type holds one handle and releases it in its destructor, so a setup
+// step that fails can just return and everything created before it is torn
+// down in reverse order. Nothing throws: a factory that fails prints why
+// and returns an empty object, which tests false. Every type converts to
+// its ibv_* pointer, so the C helpers (recv_pool, send_engine, cq_wait,
+// ...) take them as they are, without taking ownership.
+//
+// QPs are created with a QpBuilder for the three types used here, and
+// brought up with ready_ud(), ready_raw() or init_rc() + connect_rc(). The
+// post and poll calls are inline forwards, so the data path costs the same
+// as calling libibverbs directly. All of it is meant to be created once at
+// startup and reused.
+//
+// C-style resources with a destroy function (buf_pool, recv_pool, ...) are
+// covered by on_scope_exit().
+
+template <typename T, int (*Release)(T *)> class VerbsHandle {
+public:
+  VerbsHandle() : h(NULL) {}
+  explicit VerbsHandle(T *handle) : h(handle) {}
+  VerbsHandle(VerbsHandle &&o) : h(o.h) { o.h = NULL; }
+  VerbsHandle &operator=(VerbsHandle &&o) {
+    if (this != &o) {
+      reset();
+      h = o.h;
+      o.h = NULL;
+    }
+    return *this;
+  }
+  VerbsHandle(const VerbsHandle &) = delete;
+  VerbsHandle &operator=(const VerbsHandle &) = delete;
+  ~VerbsHandle() { reset(); }
+
+  T *get() const { return h; }
+  T *operator->() const { return h; }
+  operator T *() const { return h; }
+
+  // Gives up ownership without releasing
+  T *release() {
+    T *p = h;
+    h = NULL;
+    return p;
+  }
+
+  void reset() {
+    if (h && Release(h))
+      fprintf(stderr, "verbs: failed to release a handle: %s\n",
+              strerror(errno));
+    h = NULL;
+  }
+
+protected:
+  T *h;
+};
+
+// What one end of a connection needs to know about the other; swapped out
+// of band (see oob.h)
+struct QpEndpoint {
+  uint32_t qpn;
+  uint32_t psn; // first packet sequence number it sends (RC)
+  uint16_t lid; // 0 on RoCE
+  ibv_gid gid;
+  uint32_t qkey; // UD
+  uint32_t rkey; // buffer the peer may RDMA into, if any
+  uint64_t addr;
+  uint32_t length;
+  uint32_t slots; // the buffer is a ring of this many equal slots, or 0
+};
+
+// An open device, and the device list it was found in
+class Device {
+public:
+  Device() : list(NULL), count(0), ctx(NULL) {}
+  Device(Device &&o) : list(o.list), count(o.count), ctx(o.ctx) {
+    o.list = NULL;
+    o.count = 0;
+    o.ctx = NULL;
+  }
+  Device &operator=(Device &&o) {
+    if (this != &o) {
+      reset();
+      list = o.list;
+      count = o.count;
+      ctx = o.ctx;
+      o.list = NULL;
+      o.count = 0;
+      o.ctx = NULL;
+    }
+    return *this;
+  }
+  Device(const Device &) = delete;
+  Device &operator=(const Device &) = delete;
+  ~Device() { reset(); }
+
+  // Opens the device called name, or the first one if name is NULL
+  static Device open(const char *name = NULL) {
+    Device d;
+    d.list = ibv_get_device_list(&d.count);
+    if (!d.list || d.count == 0) {
+      fprintf(stderr, "No RDMA devices found\n");
+      return d;
+    }
+
+    int i = 0;
+    if (name) {
+      while (i < d.count && strcmp(ibv_get_device_name(d.list[i]), name))
+        i++;
+      if (i == d.count) {
+        fprintf(stderr, "No RDMA device called %s\n", name);
+        return d;
+      }
+    }
+
+    d.ctx = ibv_open_device(d.list[i]);
+    if (!d.ctx)
+      perror("ibv_open_device");
+    return d;
+  }
+
+  ibv_context *get() const { return ctx; }
+  ibv_context *operator->() const { return ctx; }
+  operator ibv_context *() const { return ctx; }
+  const char *name() const { return ibv_get_device_name(ctx->device); }
+
+  // Path MTU to use on port, or IBV_MTU_1024 if it cannot be queried
+  ibv_mtu active_mtu(uint8_t port) const {
+    ibv_port_attr attr;
+    if (ibv_query_port(ctx, port, &attr)) {
+      perror("ibv_query_port");
+      return IBV_MTU_1024;
+    }
+    return attr.active_mtu;
+  }
+
+  // Fills in ep's LID and GID for port and gid_index
+  int port_address(uint8_t port, int gid_index, QpEndpoint *ep) const {
+    ibv_port_attr attr;
+    if (ibv_query_port(ctx, port, &attr)) {
+      perror("ibv_query_port");
+      return -1;
+    }
+    ep->lid = attr.link_layer == IBV_LINK_LAYER_ETHERNET ? 0 : attr.lid;
+    if (ibv_query_gid(ctx, port, gid_index, &ep->gid)) {
+      perror("ibv_query_gid");
+      return -1;
+    }
+    return 0;
+  }
+
+  // Every device found, opened or not
+  int num_devices() const { return count; }
+  ibv_device *device_at(int i) const { return list[i]; }
+
+  void reset() {
+    if (ctx)
+      ibv_close_device(ctx);
+    if (list)
+      ibv_free_device_list(list);
+    list = NULL;
+    count = 0;
+    ctx = NULL;
+  }
+
+private:
+  ibv_device **list;
+  int count;
+  ibv_context *ctx;
+};
+
+class Pd : public VerbsHandle<ibv_pd, ibv_dealloc_pd> {
+public:
+  using VerbsHandle::VerbsHandle;
+
+  static Pd alloc(ibv_context *ctx) {
+    Pd pd(ibv_alloc_pd(ctx));
+    if (!pd)
+      perror("ibv_alloc_pd");
+    return pd;
+  }
+};
+
+class Cq : public VerbsHandle<ibv_cq, ibv_destroy_cq> {
+public:
+  using VerbsHandle::VerbsHandle;
+
+  static Cq create(ibv_context *ctx, int depth,
+                   ibv_comp_channel *channel = NULL) {
+    Cq cq(ibv_create_cq(ctx, depth, NULL, channel, 0));
+    if (!cq)
+      perror("ibv_create_cq");
+    return cq;
+  }
+
+  int poll(int n, ibv_wc *wcs) { return ibv_poll_cq(h, n, wcs); }
+};
+
+class Srq : public VerbsHandle<ibv_srq, ibv_destroy_srq> {
+public:
+  using VerbsHandle::VerbsHandle;
+};
+
+class Mr : public VerbsHandle<ibv_mr, ibv_dereg_mr> {
+public:
+  using VerbsHandle::VerbsHandle;
+
+  static Mr reg(ibv_pd *pd, void *addr, size_t length, int access) {
+    Mr mr(ibv_reg_mr(pd, addr, length, access));
+    if (!mr)
+      perror("ibv_reg_mr");
+    return mr;
+  }
+
+  uint32_t lkey() const { return h->lkey; }
+  uint32_t rkey() const { return h->rkey; }
+};
+
+class Ah : public VerbsHandle<ibv_ah, ibv_destroy_ah> {
+public:
+  using VerbsHandle::VerbsHandle;
+
+  static Ah create(ibv_pd *pd, ibv_ah_attr *attr) {
+    Ah ah(ibv_create_ah(pd, attr));
+    if (!ah)
+      perror("ibv_create_ah");
+    return ah;
+  }
+
+  // Global route to gid through port, from our GID at sgid_index
+  static Ah to_gid(ibv_pd *pd, uint8_t port, const ibv_gid &gid,
+                   uint8_t sgid_index) {
+    ibv_ah_attr attr{};
+    attr.is_global = 1;
+    attr.port_num = port;
+    attr.grh.dgid = gid;
+    attr.grh.sgid_index = sgid_index;
+    attr.grh.hop_limit = 64;
+    return create(pd, &attr);
+  }
+
+  // Route to the peer at ep: by LID on InfiniBand, by GID when it has none
+  static Ah to_endpoint(ibv_pd *pd, uint8_t port, const QpEndpoint &ep,
+                        uint8_t sgid_index) {
+    if (ep.lid == 0)
+      return to_gid(pd, port, ep.gid, sgid_index);
+
+    ibv_ah_attr attr{};
+    attr.dlid = ep.lid;
+    attr.port_num = port;
+    return create(pd, &attr);
+  }
+};
+
+class Qp : public VerbsHandle<ibv_qp, ibv_destroy_qp> {
+public:
+  using VerbsHandle::VerbsHandle;
+
+  uint32_t qpn() const { return h->qp_num; }
+
+  ibv_qp_state state() const {
+    ibv_qp_attr attr;
+    ibv_qp_init_attr init_attr;
+    if (ibv_query_qp(h, &attr, IBV_QP_STATE, &init_attr))
+      return IBV_QPS_UNKNOWN;
+    return attr.qp_state;
+  }
+
+  int modify(ibv_qp_attr *attr, int mask, const char *what) {
+    int ret = ibv_modify_qp(h, attr, mask);
+    if (ret)
+      fprintf(stderr, "ibv_modify_qp %s: %s\n", what, strerror(ret));
+    return ret ? -1 : 0;
+  }
+
+  // UD: INIT with qkey, then RTR and RTS. Returns 0, or -1 on error.
+  int ready_ud(uint8_t port, uint32_t qkey) {
+    ibv_qp_attr attr{};
+    attr.qp_state = IBV_QPS_INIT;
+    attr.port_num = port;
+    attr.pkey_index = 0;
+    attr.qkey = qkey;
+    if (modify(&attr,
+               IBV_QP_STATE | IBV_QP_PORT | IBV_QP_PKEY_INDEX | IBV_QP_QKEY,
+               "INIT"))
+      return -1;
+    return rtr_rts(true);
+  }
+
+  // Raw packet: INIT, RTR and RTS with nothing but the port
+  int ready_raw(uint8_t port) {
+    ibv_qp_attr attr{};
+    attr.qp_state = IBV_QPS_INIT;
+    attr.port_num = port;
+    if (modify(&attr, IBV_QP_STATE | IBV_QP_PORT, "INIT"))
+      return -1;
+    return rtr_rts(false);
+  }
+
+  // RC: INIT, allowing the given remote access to this QP's MRs
+  int init_rc(uint8_t port, int access) {
+    ibv_qp_attr attr{};
+    attr.qp_state = IBV_QPS_INIT;
+    attr.port_num = port;
+    attr.pkey_index = 0;
+    attr.qp_access_flags = access;
+    return modify(&attr,
+                  IBV_QP_STATE | IBV_QP_PORT | IBV_QP_PKEY_INDEX |
+                      IBV_QP_ACCESS_FLAGS,
+                  "INIT");
+  }
+
+  // RC: RTR towards remote, then RTS sending from local_psn. The route is
+  // global (RoCE) when remote has a LID of 0.
+  int connect_rc(const QpEndpoint &remote, uint32_t local_psn, uint8_t port,
+                 uint8_t sgid_index, ibv_mtu mtu) {
+    ibv_qp_attr attr{};
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = mtu;
+    attr.dest_qp_num = remote.qpn;
+    attr.rq_psn = remote.psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.port_num = port;
+    attr.ah_attr.dlid = remote.lid;
+    if (remote.lid == 0) {
+      attr.ah_attr.is_global = 1;
+      attr.ah_attr.grh.dgid = remote.gid;
+      attr.ah_attr.grh.sgid_index = sgid_index;
+      attr.ah_attr.grh.hop_limit = 64;
+    }
+    if (modify(&attr,
+               IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+                   IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC |
+                   IBV_QP_MIN_RNR_TIMER,
+               "RTR"))
+      return -1;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = local_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.max_rd_atomic = 1;
+    return modify(&attr,
+                  IBV_QP_STATE | IBV_QP_SQ_PSN | IBV_QP_TIMEOUT |
+                      IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+                      IBV_QP_MAX_QP_RD_ATOMIC,
+                  "RTS");
+  }
+
+  int post_send(ibv_send_wr *wr) {
+    ibv_send_wr *bad_wr;
+    return ibv_post_send(h, wr, &bad_wr);
+  }
+
+  int post_recv(ibv_recv_wr *wr) {
+    ibv_recv_wr *bad_wr;
+    return ibv_post_recv(h, wr, &bad_wr);
+  }
+
+private:
+  // Raw packet QPs take no send PSN
+  int rtr_rts(bool sq_psn) {
+    ibv_qp_attr attr{};
+    attr.qp_state = IBV_QPS_RTR;
+    if (modify(&attr, IBV_QP_STATE, "RTR"))
+      return -1;
+
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = 0;
+    return modify(&attr, IBV_QP_STATE | (sq_psn ? IBV_QP_SQ_PSN : 0), "RTS");
+  }
+};
+
+// Collects the ibv_qp_init_attr for one QP type; create() makes the QP
+class QpBuilder {
+public:
+  static QpBuilder ud(ibv_pd *pd) { return QpBuilder(pd, IBV_QPT_UD); }
+  static QpBuilder rc(ibv_pd *pd) { return QpBuilder(pd, IBV_QPT_RC); }
+  static QpBuilder raw(ibv_pd *pd) {
+    return QpBuilder(pd, IBV_QPT_RAW_PACKET);
+  }
+
+  // recv_cq defaults to send_cq
+  QpBuilder &cq(ibv_cq *send_cq, ibv_cq *recv_cq = NULL) {
+    attr.send_cq = send_cq;
+    attr.recv_cq = recv_cq ? recv_cq : send_cq;
+    return *this;
+  }
+  QpBuilder &depth(uint32_t max_send_wr, uint32_t max_recv_wr) {
+    attr.cap.max_send_wr = max_send_wr;
+    attr.cap.max_recv_wr = max_recv_wr;
+    return *this;
+  }
+  QpBuilder &srq(ibv_srq *srq) {
+    attr.srq = srq;
+    return *this;
+  }
+  QpBuilder &max_inline(uint32_t bytes) {
+    attr.cap.max_inline_data = bytes;
+    return *this;
+  }
+  // Complete every send WR, rather than only the ones asking to be
+  QpBuilder &sig_all(bool all) {
+    attr.sq_sig_all = all;
+    return *this;
+  }
+
+  const ibv_qp_init_attr &init_attr() const { return attr; }
+
+  Qp create() const {
+    ibv_qp_init_attr a = attr;
+    Qp qp(ibv_create_qp(pd, &a));
+    if (!qp)
+      perror("ibv_create_qp");
+    return qp;
+  }
+
+private:
+  QpBuilder(ibv_pd *pd, ibv_qp_type type) : pd(pd), attr() {
+    attr.qp_type = type;
+    attr.cap.max_send_wr = 1;
+    attr.cap.max_recv_wr = 1;
+    attr.cap.max_send_sge = 1;
+    attr.cap.max_recv_sge = 1;
+  }
+
+  ibv_pd *pd;
+  ibv_qp_init_attr attr;
+};
+
+// Calls f when it goes out of scope
+template <typename F> class ScopeExit {
+public:
+  explicit ScopeExit(F f) : f(f) {}
+  ScopeExit(const ScopeExit &) = delete;
+  ScopeExit &operator=(const ScopeExit &) = delete;
+  ~ScopeExit() { f(); }
+
+private:
+  F f;
+};
+
+template <typename F> ScopeExit<F> on_scope_exit(F f) {
+  return ScopeExit<F>(f);
+}
+
+#endif